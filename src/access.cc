@@ -0,0 +1,105 @@
+#include "access.h"
+
+#include <algorithm>
+
+namespace karu::access {
+// the counters are halved once there were this many samples per counter.
+constexpr std::uint64_t kAgingSamplesPerCounter = 8;
+
+namespace {
+std::size_t RoundUp(std::size_t width) {
+  std::size_t size = 1;
+  while (size < width) {
+    size <<= 1;
+  }
+  return size;
+}
+}  // namespace
+
+AccessTracker::AccessTracker(std::size_t width)
+    : mask_(RoundUp(std::max<std::size_t>(width, 64)) - 1),
+      counters_(new std::atomic<std::uint32_t>[kSketchDepth * (mask_ + 1)]),
+      anchors_(new std::atomic<std::uint64_t>[mask_ + 1]) {
+  for (std::size_t i = 0; i < kSketchDepth * (mask_ + 1); ++i) {
+    counters_[i].store(0, std::memory_order_relaxed);
+  }
+  for (std::size_t i = 0; i <= mask_; ++i) {
+    anchors_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+bool AccessTracker::Sample() noexcept {
+  // a random draw instead of every n-th read, which would always sample the
+  // same key of a loop over n keys.
+  static thread_local std::uint64_t state =
+      reinterpret_cast<std::uintptr_t>(&state) | 1;
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state % kSampleInterval == 0;
+}
+
+std::size_t AccessTracker::Slot(std::uint64_t key_hash,
+                                std::size_t row) const noexcept {
+  // the rows use different bits of a remixed hash, the keydir already uses
+  // the low bits of the key hash itself.
+  const std::uint64_t mixed =
+      (key_hash ^ (key_hash >> 29)) * 0xbf58476d1ce4e5b9ull;
+  const std::uint64_t hash = mixed + row * (mixed >> 32 | 1);
+  return row * (mask_ + 1) + ((hash >> 16) & mask_);
+}
+
+void AccessTracker::Add(std::uint64_t key_hash) noexcept {
+  for (std::size_t row = 0; row < kSketchDepth; ++row) {
+    counters_[Slot(key_hash, row)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // whoever crosses the limit halves the counters. Increments that race with
+  // it may be lost, which only makes the estimates a bit lower.
+  const std::uint64_t limit = kAgingSamplesPerCounter * (mask_ + 1);
+  if (samples_.fetch_add(1, std::memory_order_relaxed) + 1 == limit) {
+    for (std::size_t i = 0; i < kSketchDepth * (mask_ + 1); ++i) {
+      counters_[i].store(counters_[i].load(std::memory_order_relaxed) / 2,
+                         std::memory_order_relaxed);
+    }
+    samples_.store(0, std::memory_order_relaxed);
+  }
+}
+
+void AccessTracker::RecordGet(std::uint64_t key_hash) noexcept {
+  Add(key_hash);
+}
+
+void AccessTracker::RecordBatch(
+    absl::Span<const std::uint64_t> key_hashes) noexcept {
+  if (key_hashes.empty()) {
+    return;
+  }
+
+  const std::uint64_t anchor =
+      *std::min_element(key_hashes.begin(), key_hashes.end()) | 1;
+  for (const auto key_hash : key_hashes) {
+    Add(key_hash);
+    if (key_hashes.size() > 1) {
+      anchors_[(key_hash >> 16) & mask_].store(anchor,
+                                               std::memory_order_relaxed);
+    }
+  }
+}
+
+std::uint64_t AccessTracker::Estimate(std::uint64_t key_hash) const noexcept {
+  std::uint32_t estimate = UINT32_MAX;
+  for (std::size_t row = 0; row < kSketchDepth; ++row) {
+    estimate = std::min(
+        estimate,
+        counters_[Slot(key_hash, row)].load(std::memory_order_relaxed));
+  }
+  return static_cast<std::uint64_t>(estimate) * kSampleInterval;
+}
+
+std::uint64_t AccessTracker::Anchor(std::uint64_t key_hash) const noexcept {
+  const std::uint64_t anchor =
+      anchors_[(key_hash >> 16) & mask_].load(std::memory_order_relaxed);
+  return anchor != 0 ? anchor : key_hash;
+}
+}  // namespace karu::access
@@ -0,0 +1,60 @@
+#ifndef _KARU_ACCESS_H
+#define _KARU_ACCESS_H
+
+#include <absl/types/span.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// access samples which keys are read, such that CollectGarbage can move the
+// hot ones into datafiles of their own. The counts live in a count-min sketch
+// that only ever overestimates a key. Every now and then all counters are
+// halved, so keys that stopped being read cool down again.
+//
+// Keys that are read by the same MultiGet remember the smallest key hash of
+// the batch as their anchor. Sorting the hot keys by anchor places them next
+// to each other, such that MultiGet coalesces their reads. Both tables are
+// indexed by the key hash only and collisions just cost some accuracy.
+namespace karu::access {
+// about one in this many reads of a thread is counted.
+constexpr std::uint32_t kSampleInterval = 16;
+constexpr std::size_t kSketchDepth = 4;
+
+class AccessTracker {
+ public:
+  // width is the number of counters per row of the sketch and the number of
+  // anchors, it is rounded up to a power of two.
+  explicit AccessTracker(std::size_t width);
+  AccessTracker &operator=(const AccessTracker &) = delete;
+  AccessTracker(const AccessTracker &) = delete;
+
+  // whether this read of the calling thread is sampled. Callers check it
+  // before they record the read, such that the other reads cost nothing.
+  static bool Sample() noexcept;
+  // key_hash is the keydir hash of the key that was read.
+  void RecordGet(std::uint64_t key_hash) noexcept;
+  // records the keys of a MultiGet, which share an anchor.
+  void RecordBatch(absl::Span<const std::uint64_t> key_hashes) noexcept;
+  // the estimated number of reads of the key, already scaled by the sample
+  // interval.
+  [[nodiscard]] std::uint64_t Estimate(std::uint64_t key_hash) const noexcept;
+  // the anchor of the MultiGet that last read the key, or the key hash itself
+  // if there was none.
+  [[nodiscard]] std::uint64_t Anchor(std::uint64_t key_hash) const noexcept;
+
+ private:
+  void Add(std::uint64_t key_hash) noexcept;
+  std::size_t Slot(std::uint64_t key_hash, std::size_t row) const noexcept;
+
+  const std::size_t mask_;
+  std::unique_ptr<std::atomic<std::uint32_t>[]> counters_;
+  // 0 is an empty anchor, stored anchors have their lowest bit set.
+  std::unique_ptr<std::atomic<std::uint64_t>[]> anchors_;
+  // the number of samples since the counters were halved the last time.
+  std::atomic<std::uint64_t> samples_{0};
+};
+}  // namespace karu::access
+
+#endif
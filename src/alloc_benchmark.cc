@@ -0,0 +1,117 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "karu.h"
+#include "workload.h"
+
+// counts the heap allocations of steady state inserts, i.e. overwrites of
+// existing keys once the append and hint buffers have grown to their final
+// size, and of reads into a caller buffer. Every operator new of the process
+// is counted:
+//   karu_alloc_bench [operations] [value_size]
+static std::atomic<std::uint64_t> allocations{0};
+
+void *operator new(std::size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *ptr = std::malloc(size == 0 ? 1 : size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return std::malloc(size == 0 ? 1 : size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &tag) noexcept {
+  return operator new(size, tag);
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+static void print(const std::string &name, std::size_t operations,
+                  std::uint64_t counted,
+                  std::chrono::duration<double, std::nano> took) {
+  const auto count = static_cast<double>(operations);
+  std::cout << name << " allocations " << counted << " allocations/op "
+            << static_cast<double>(counted) / count << " ns/op "
+            << took.count() / count << '\n';
+}
+
+int main(int argc, char **argv) {
+  const std::size_t operations = argc > 1 ? std::stoul(argv[1]) : 100000;
+  const std::size_t value_size = argc > 2 ? std::stoul(argv[2]) : 100;
+  constexpr std::size_t key_count = 1000;
+  constexpr std::size_t key_size = 16;
+
+  const std::string directory = "./karu_alloc_bench";
+  std::filesystem::remove_all(directory);
+  std::filesystem::create_directories(directory);
+
+  std::vector<std::string> keys;
+  for (std::size_t i = 0; i < key_count; ++i) {
+    keys.push_back(karu::workload::build_key(i, key_size));
+  }
+  const std::string value(value_size, 'v');
+
+  int result = 0;
+  {
+    karu::DB db(karu::DBConfig{
+        .hint_files_ = true,
+        .database_directory_ = directory,
+    });
+
+    // warm up until the hint buffer has been flushed at least once.
+    const std::size_t warmup =
+        std::max(key_count, 2 * karu::hint::kHintBufferSize / key_size);
+    for (std::size_t i = 0; i < warmup; ++i) {
+      if (!db.Insert(keys[i % key_count], value).ok()) {
+        std::cerr << "insert failed\n";
+        return 1;
+      }
+    }
+
+    const std::uint64_t before = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < operations; ++i) {
+      if (!db.Insert(keys[i % key_count], value).ok()) {
+        std::cerr << "insert failed\n";
+        return 1;
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+    const std::uint64_t insert_allocations = allocations.load() - before;
+    print("insert", operations, insert_allocations, end - start);
+
+    std::vector<std::uint8_t> buffer(karu::kMaxValueSize);
+    const std::uint64_t before_gets = allocations.load();
+    start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < operations; ++i) {
+      if (!db.Get(keys[i % key_count], absl::MakeSpan(buffer)).ok()) {
+        std::cerr << "get failed\n";
+        return 1;
+      }
+    }
+    end = std::chrono::steady_clock::now();
+    const std::uint64_t get_allocations = allocations.load() - before_gets;
+    print("get", operations, get_allocations, end - start);
+
+    result = insert_allocations == 0 && get_allocations == 0 ? 0 : 1;
+  }
+
+  std::filesystem::remove_all(directory);
+  return result;
+}
@@ -1,74 +1,510 @@
+#include <atomic>
+#include <cctype>
 #include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <random>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "histogram.h"
 #include "karu.h"
+#include "trace.h"
+#include "workload.h"
 
-static std::string gen_random_str(size_t size) {
-  const std::string chars =
-      "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
-  std::random_device random_device;
-  std::mt19937 generator(random_device());
-  std::uniform_int_distribution<> distribution(0, chars.size() - 1);
-  std::string random_string;
+// karu_bench runs the YCSB core workloads against a DB:
+//   A: 50% reads, 50% updates
+//   B: 95% reads, 5% updates
+//   C: 100% reads
+//   D: 95% reads, 5% inserts, reading the latest keys
+//   E: 95% short scans, 5% inserts
+//   F: 50% reads, 50% read-modify-writes
+// The keydir isn't ordered, so a scan of n records is a MultiGet of n
+// consecutive key ids.
 
-  for (std::size_t i = 0; i < size; ++i) {
-    random_string += chars[distribution(generator)];
+namespace {
+using karu::workload::build_key;
+using karu::workload::scramble;
+using karu::workload::ZipfianGenerator;
+
+enum class Distribution { kUniform, kZipfian, kLatest };
+enum Operation { kRead, kUpdate, kInsert, kScan, kReadModifyWrite, kOpCount };
+constexpr const char *kOperationNames[kOpCount] = {"read", "update", "insert",
+                                                   "scan", "rmw"};
+constexpr std::uint64_t kMaxScanLength = 100;
+
+struct Options {
+  char workload_ = 'A';
+  std::string distribution_;  // empty means the workload's default.
+  std::uint64_t record_count_ = 100000;
+  std::uint64_t operation_count_ = 100000;
+  std::size_t threads_ = 1;
+  std::size_t key_size_ = 16;
+  std::size_t value_size_ = 100;
+  std::string directory_ = "./karu_bench_db";
+  std::string json_path_;
+  std::string trace_path_;
+  bool hint_files_ = true;
+};
+
+struct Workload {
+  double read_ = 0;
+  double update_ = 0;
+  double insert_ = 0;
+  double scan_ = 0;
+  double rmw_ = 0;
+  Distribution distribution_ = Distribution::kZipfian;
+};
+
+Workload workload_for(char name) {
+  switch (name) {
+    case 'A':
+      return {.read_ = 0.5, .update_ = 0.5};
+    case 'B':
+      return {.read_ = 0.95, .update_ = 0.05};
+    case 'C':
+      return {.read_ = 1.0};
+    case 'D':
+      return {.read_ = 0.95,
+              .insert_ = 0.05,
+              .distribution_ = Distribution::kLatest};
+    case 'E':
+      return {.insert_ = 0.05, .scan_ = 0.95};
+    case 'F':
+      return {.read_ = 0.5, .rmw_ = 0.5};
+    default:
+      std::cerr << "karu_bench: unknown workload " << name << '\n';
+      std::exit(1);
+  }
+}
+
+const char *distribution_name(Distribution distribution) {
+  switch (distribution) {
+    case Distribution::kUniform:
+      return "uniform";
+    case Distribution::kZipfian:
+      return "zipfian";
+    case Distribution::kLatest:
+      return "latest";
   }
-  return random_string;
+  return "";
 }
 
-static std::vector<std::string> generate_random_keys(size_t key_count = 10000,
-                                                     size_t key_size = 10) {
-  std::vector<std::string> keys;
-  keys.resize(key_count);
+// values start with their key so that reads can be checked.
+std::string build_value(const std::string &key, std::size_t value_size,
+                        std::mt19937_64 &generator) {
+  std::string value = key.substr(0, value_size);
+  value.reserve(value_size);
+  while (value.size() < value_size) {
+    value.push_back(static_cast<char>('a' + generator() % 26));
+  }
+  return value;
+}
 
-  for (std::string &v : keys) {
-    v = gen_random_str(key_size);
+bool check_value(const std::string &key, absl::string_view value,
+                 std::size_t value_size) {
+  if (value.size() != value_size) {
+    return false;
   }
-  return keys;
+  const std::size_t prefix = std::min(key.size(), value_size);
+  return value.substr(0, prefix) == absl::string_view(key).substr(0, prefix);
 }
 
-static std::vector<std::pair<std::string, std::string>> generate_random_pairs(
-    size_t pair_count = 10000, size_t str_size = 10) {
-  std::vector<std::pair<std::string, std::string>> keys(pair_count);
-  for (auto &[key, value] : keys) {
-    key = gen_random_str(str_size);
-    value = gen_random_str(str_size);
+struct ThreadResult {
+  karu::metrics::Histogram latencies_[kOpCount];
+  std::uint64_t errors_ = 0;
+};
+
+class Benchmark {
+ public:
+  Benchmark(const Options &options, karu::DB &db)
+      : options_(options),
+        workload_(workload_for(options.workload_)),
+        db_(db),
+        zipfian_(options.record_count_),
+        next_insert_(options.record_count_),
+        insert_count_(options.record_count_) {
+    if (options.distribution_ == "uniform") {
+      workload_.distribution_ = Distribution::kUniform;
+    } else if (options.distribution_ == "zipfian") {
+      workload_.distribution_ = Distribution::kZipfian;
+    } else if (options.distribution_ == "latest") {
+      workload_.distribution_ = Distribution::kLatest;
+    } else if (!options.distribution_.empty()) {
+      std::cerr << "karu_bench: unknown distribution "
+                << options.distribution_ << '\n';
+      std::exit(1);
+    }
+  }
+
+  Distribution distribution() const { return workload_.distribution_; }
+
+  void Load(std::size_t thread, ThreadResult &result) {
+    std::mt19937_64 generator(thread + 1);
+    for (std::uint64_t id = thread; id < options_.record_count_;
+         id += options_.threads_) {
+      auto key = build_key(id, options_.key_size_);
+      auto value = build_value(key, options_.value_size_, generator);
+
+      auto start = std::chrono::steady_clock::now();
+      auto status = db_.Insert(key, value);
+      record(result, kInsert, start);
+      if (!status.ok()) {
+        ++result.errors_;
+      }
+    }
   }
 
-  return keys;
+  void Run(std::size_t thread, ThreadResult &result) {
+    std::mt19937_64 generator(options_.threads_ + thread + 1);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::vector<std::string> scan_keys;
+    std::vector<std::uint8_t> scan_buffer(kMaxScanLength *
+                                          options_.value_size_);
+    std::vector<karu::MultiGetResult> scan_results(kMaxScanLength);
+
+    const std::uint64_t operations =
+        options_.operation_count_ / options_.threads_ +
+        (thread < options_.operation_count_ % options_.threads_ ? 1 : 0);
+    for (std::uint64_t i = 0; i < operations; ++i) {
+      const Operation op = choose_operation(uniform(generator));
+      auto start = std::chrono::steady_clock::now();
+      switch (op) {
+        case kRead: {
+          auto key = build_key(next_key(generator), options_.key_size_);
+          auto status = db_.Get(key);
+          if (!status.ok() ||
+              !check_value(key, *status, options_.value_size_)) {
+            ++result.errors_;
+          }
+          break;
+        }
+        case kUpdate: {
+          auto key = build_key(next_key(generator), options_.key_size_);
+          auto value = build_value(key, options_.value_size_, generator);
+          start = std::chrono::steady_clock::now();
+          if (!db_.Insert(key, value).ok()) {
+            ++result.errors_;
+          }
+          break;
+        }
+        case kInsert: {
+          const std::uint64_t id = next_insert_.fetch_add(1);
+          auto key = build_key(id, options_.key_size_);
+          auto value = build_value(key, options_.value_size_, generator);
+          start = std::chrono::steady_clock::now();
+          if (!db_.Insert(key, value).ok()) {
+            ++result.errors_;
+          }
+          record(result, op, start);
+
+          // keys are only readable once every key before them is inserted.
+          while (insert_count_.load() != id) {
+            std::this_thread::yield();
+          }
+          insert_count_.store(id + 1);
+          continue;
+        }
+        case kScan: {
+          const std::uint64_t first = next_key(generator);
+          const std::uint64_t length = 1 + generator() % kMaxScanLength;
+          const std::uint64_t last =
+              std::min(first + length, insert_count_.load());
+          scan_keys.clear();
+          for (std::uint64_t id = first; id < last; ++id) {
+            scan_keys.push_back(build_key(id, options_.key_size_));
+          }
+
+          start = std::chrono::steady_clock::now();
+          auto status = db_.MultiGet(scan_keys, absl::MakeSpan(scan_buffer),
+                                     absl::MakeSpan(scan_results));
+          if (!status.ok()) {
+            ++result.errors_;
+            break;
+          }
+          for (std::size_t k = 0; k < scan_keys.size(); ++k) {
+            const auto &r = scan_results[k];
+            absl::string_view value(
+                reinterpret_cast<const char *>(&scan_buffer[r.offset_]),
+                r.size_);
+            if (!r.status_.ok() ||
+                !check_value(scan_keys[k], value, options_.value_size_)) {
+              ++result.errors_;
+            }
+          }
+          break;
+        }
+        case kReadModifyWrite: {
+          auto key = build_key(next_key(generator), options_.key_size_);
+          auto value = build_value(key, options_.value_size_, generator);
+          start = std::chrono::steady_clock::now();
+          auto status = db_.Get(key);
+          if (!status.ok() || !db_.Insert(key, value).ok()) {
+            ++result.errors_;
+          }
+          break;
+        }
+        default:
+          break;
+      }
+      record(result, op, start);
+    }
+  }
+
+ private:
+  static void record(ThreadResult &result, Operation op,
+                     std::chrono::steady_clock::time_point start) {
+    auto took = std::chrono::steady_clock::now() - start;
+    result.latencies_[op].Record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(took).count());
+  }
+
+  Operation choose_operation(double u) const {
+    if ((u -= workload_.read_) < 0) return kRead;
+    if ((u -= workload_.update_) < 0) return kUpdate;
+    if ((u -= workload_.insert_) < 0) return kInsert;
+    if ((u -= workload_.scan_) < 0) return kScan;
+    if (workload_.rmw_ > 0) return kReadModifyWrite;
+    return kRead;
+  }
+
+  // returns the id of an existing key according to the distribution.
+  std::uint64_t next_key(std::mt19937_64 &generator) {
+    const std::uint64_t count = insert_count_.load();
+    const double u =
+        std::uniform_real_distribution<double>(0.0, 1.0)(generator);
+    switch (workload_.distribution_) {
+      case Distribution::kUniform:
+        return generator() % count;
+      case Distribution::kZipfian:
+        // scramble the ranks so that the popular keys are spread out.
+        return scramble(zipfian_.Next(u)) % count;
+      case Distribution::kLatest:
+        return count - 1 - std::min(zipfian_.Next(u), count - 1);
+    }
+    return 0;
+  }
+
+  const Options &options_;
+  Workload workload_;
+  karu::DB &db_;
+  ZipfianGenerator zipfian_;
+  std::atomic<std::uint64_t> next_insert_;   // next key id to insert
+  std::atomic<std::uint64_t> insert_count_;  // keys [0, count) are readable
+};
+
+void print_usage() {
+  std::cerr
+      << "usage: karu_bench [flags]\n"
+         "  --workload=A..F          YCSB core workload (default A)\n"
+         "  --distribution=NAME      uniform, zipfian or latest\n"
+         "  --records=N              keys preloaded before the run\n"
+         "  --operations=N           operations in the run phase\n"
+         "  --threads=N              client threads\n"
+         "  --key_size=N             key size in bytes\n"
+         "  --value_size=N           value size in bytes\n"
+         "  --directory=PATH         database directory, wiped on start\n"
+         "  --hint_files=0|1         write and read hint files\n"
+         "  --json=PATH              also write the results as json\n"
+         "  --trace=PATH             write a chrome trace of the hot path,\n"
+         "                           needs a build with -DKARU_TRACING=ON\n";
 }
 
-int main(int argc, char **argv) {
-  if (argc != 3) {
-    std::cerr << "need 3 arguments\n";
+Options parse_options(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto eq = arg.find('=');
+    if (arg.rfind("--", 0) != 0 || eq == std::string::npos) {
+      print_usage();
+      std::exit(1);
+    }
+
+    std::string name = arg.substr(2, eq - 2);
+    std::string value = arg.substr(eq + 1);
+    if (name == "workload" && value.size() == 1) {
+      options.workload_ = static_cast<char>(std::toupper(value[0]));
+    } else if (name == "distribution") {
+      options.distribution_ = value;
+    } else if (name == "records") {
+      options.record_count_ = std::stoull(value);
+    } else if (name == "operations") {
+      options.operation_count_ = std::stoull(value);
+    } else if (name == "threads") {
+      options.threads_ = std::max<std::size_t>(1, std::stoul(value));
+    } else if (name == "key_size") {
+      options.key_size_ = std::stoul(value);
+    } else if (name == "value_size") {
+      options.value_size_ = std::stoul(value);
+    } else if (name == "directory") {
+      options.directory_ = value;
+    } else if (name == "hint_files") {
+      options.hint_files_ = value != "0";
+    } else if (name == "json") {
+      options.json_path_ = value;
+    } else if (name == "trace") {
+      options.trace_path_ = value;
+    } else {
+      print_usage();
+      std::exit(1);
+    }
+  }
+
+  if (options.record_count_ == 0) {
+    std::cerr << "karu_bench: --records needs to be positive\n";
     std::exit(1);
   }
+  return options;
+}
+
+struct PhaseResult {
+  double seconds_ = 0;
+  std::uint64_t operations_ = 0;
+  std::uint64_t errors_ = 0;
+  karu::metrics::Histogram latencies_[kOpCount];
+};
+
+void run_phase(std::size_t threads, PhaseResult &phase,
+               const std::function<void(std::size_t, ThreadResult &)> &f) {
+  std::vector<std::unique_ptr<ThreadResult>> results;
+  std::vector<std::thread> workers;
+  for (std::size_t i = 0; i < threads; ++i) {
+    results.push_back(std::make_unique<ThreadResult>());
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < threads; ++i) {
+    workers.emplace_back(f, i, std::ref(*results[i]));
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+
+  phase.seconds_ = took.count();
+  for (const auto &result : results) {
+    phase.errors_ += result->errors_;
+    for (int op = 0; op < kOpCount; ++op) {
+      phase.latencies_[op].Merge(result->latencies_[op]);
+    }
+  }
+  for (const auto &histogram : phase.latencies_) {
+    phase.operations_ += histogram.Count();
+  }
+}
+
+double to_us(std::uint64_t ns) { return static_cast<double>(ns) / 1000.0; }
 
-  int str_lengths = std::stoi(argv[1]);
-  int iterations = std::stoi(argv[2]);
+void print_phase(const char *name, const PhaseResult &phase) {
+  std::cout << name << ": " << phase.operations_ << " ops in "
+            << phase.seconds_ << " s ("
+            << static_cast<double>(phase.operations_) / phase.seconds_
+            << " ops/s), " << phase.errors_ << " errors\n";
+  for (int op = 0; op < kOpCount; ++op) {
+    const auto &h = phase.latencies_[op];
+    if (h.Count() == 0) {
+      continue;
+    }
+    std::cout << "  " << kOperationNames[op] << ": count=" << h.Count()
+              << " p50=" << to_us(h.Percentile(50))
+              << "us p99=" << to_us(h.Percentile(99))
+              << "us p999=" << to_us(h.Percentile(99.9))
+              << "us max=" << to_us(h.Max()) << "us\n";
+  }
+}
 
-  auto keys = generate_random_pairs(iterations, str_lengths);
-  auto insert_time_start = std::chrono::high_resolution_clock::now();
-  karu::DB db("./test");
-  for (const auto &k : keys) {
-    db.Insert(k.first, k.second);
+void json_phase(std::ostream &out, const PhaseResult &phase) {
+  out << "{\"seconds\": " << phase.seconds_
+      << ", \"operations\": " << phase.operations_
+      << ", \"ops_per_sec\": "
+      << static_cast<double>(phase.operations_) / phase.seconds_
+      << ", \"errors\": " << phase.errors_ << ", \"latency_us\": {";
+  bool first = true;
+  for (int op = 0; op < kOpCount; ++op) {
+    const auto &h = phase.latencies_[op];
+    if (h.Count() == 0) {
+      continue;
+    }
+    out << (first ? "" : ", ") << '"' << kOperationNames[op]
+        << "\": {\"count\": " << h.Count() << ", \"mean\": " << h.Mean() / 1000
+        << ", \"p50\": " << to_us(h.Percentile(50))
+        << ", \"p99\": " << to_us(h.Percentile(99))
+        << ", \"p999\": " << to_us(h.Percentile(99.9))
+        << ", \"max\": " << to_us(h.Max()) << '}';
+    first = false;
   }
-  auto insert_time_end = std::chrono::high_resolution_clock::now();
+  out << "}}";
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options options = parse_options(argc, argv);
 
-  std::chrono::duration<double, std::milli> write_double =
-      insert_time_end - insert_time_start;
-  std::cout << "reads took: " << write_double.count() << '\n';
+  std::filesystem::remove_all(options.directory_);
+  std::filesystem::create_directories(options.directory_);
+
+  PhaseResult load;
+  PhaseResult run;
+  Distribution distribution;
+  karu::metrics::Stats db_stats;
+  {
+    karu::DB db(karu::DBConfig{
+        .hint_files_ = options.hint_files_,
+        .database_directory_ = options.directory_,
+    });
+    Benchmark benchmark(options, db);
+    distribution = benchmark.distribution();
+
+    run_phase(options.threads_, load, [&](std::size_t t, ThreadResult &r) {
+      benchmark.Load(t, r);
+    });
+    run_phase(options.threads_, run, [&](std::size_t t, ThreadResult &r) {
+      benchmark.Run(t, r);
+    });
+    db_stats = db.GetStats();
+  }
+  std::filesystem::remove_all(options.directory_);
+
+  std::cout << "workload " << options.workload_ << ", "
+            << distribution_name(distribution) << ", " << options.threads_
+            << " threads, " << options.key_size_ << " byte keys, "
+            << options.value_size_ << " byte values\n";
+  print_phase("load", load);
+  print_phase("run", run);
+
+  if (!options.json_path_.empty()) {
+    std::ofstream out(options.json_path_);
+    out << "{\"workload\": \"" << options.workload_
+        << "\", \"distribution\": \"" << distribution_name(distribution)
+        << "\", \"threads\": " << options.threads_
+        << ", \"records\": " << options.record_count_
+        << ", \"key_size\": " << options.key_size_
+        << ", \"value_size\": " << options.value_size_ << ", \"load\": ";
+    json_phase(out, load);
+    out << ", \"run\": ";
+    json_phase(out, run);
+    out << ", \"db\": " << db_stats.ToJson() << "}\n";
+    if (!out) {
+      std::cerr << "karu_bench: could not write " << options.json_path_
+                << '\n';
+      return 1;
+    }
+  }
 
-  auto read_time_start = std::chrono::high_resolution_clock::now();
-  for (const auto &k : keys) {
-    db.Get(k.first);
+  if (!options.trace_path_.empty()) {
+    if (auto status = karu::trace::DumpChromeTrace(options.trace_path_);
+        !status.ok()) {
+      std::cerr << "karu_bench: " << status.message() << '\n';
+      return 1;
+    }
   }
-  auto read_time_end = std::chrono::high_resolution_clock::now();
 
-  std::chrono::duration<double, std::milli> read_double =
-      insert_time_end - insert_time_start;
-  std::cout << "reads took: " << read_double.count() << '\n';
+  return run.errors_ == 0 && load.errors_ == 0 ? 0 : 1;
 }
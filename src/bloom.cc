@@ -1,37 +1,77 @@
 #include "bloom.h"
 
-#include "murmurhash3.h"
+#include <absl/base/internal/endian.h>
+
+#include "hash.h"
 
 namespace karu::bloom {
 BloomFilter::BloomFilter(std::uint64_t size, std::uint8_t hash_count)
-    : bits_(size), hash_count_(hash_count) {}
+    : hash_count_(hash_count), bits_(size) {}
 
 inline std::uint64_t nth_hash(uint8_t n, uint64_t hash_a, uint64_t hash_b,
                               uint64_t filter_size) {
   return (hash_a + n * hash_b) % filter_size;
 }
 
-std::array<std::uint64_t, 2> hash(const char *data, std::size_t len) noexcept {
-  std::array<std::uint64_t, 2> hash_value;
-  MurmurHash3_x64_128(data, len, 0, hash_value.data());
-  return hash_value;
+// the second hash for the double hashing is derived from the first one by
+// swapping its halves. It is made odd such that it never is zero.
+inline std::uint64_t second_hash(std::uint64_t hash) noexcept {
+  return ((hash >> 32) | (hash << 32)) | 1;
 }
 
 void BloomFilter::add(const char *data, std::size_t len) noexcept {
-  auto hashValues = hash(data, len);
+  add(hash::Hash64(data, len));
+}
+
+bool BloomFilter::contains(const char *data, std::size_t len) const noexcept {
+  return contains(hash::Hash64(data, len));
+}
+
+void BloomFilter::add(std::uint64_t hash) noexcept {
+  const std::uint64_t hash_b = second_hash(hash);
   for (int n = 0; n < hash_count_; n++) {
-    bits_[nth_hash(n, hashValues[0], hashValues[1], bits_.size())] = true;
+    bits_[nth_hash(n, hash, hash_b, bits_.size())] = true;
   }
 }
 
-bool BloomFilter::contains(const char *data, std::size_t len) const noexcept {
-  auto hashValues = hash(data, len);
+bool BloomFilter::contains(std::uint64_t hash) const noexcept {
+  const std::uint64_t hash_b = second_hash(hash);
   for (int n = 0; n < hash_count_; n++) {
-    if (!bits_[nth_hash(n, hashValues[0], hashValues[1], bits_.size())]) {
+    if (!bits_[nth_hash(n, hash, hash_b, bits_.size())]) {
       return false;
     }
   }
 
   return true;
 }
+
+std::string BloomFilter::Serialize() const {
+  std::string out(9 + (bits_.size() + 7) / 8, '\0');
+  out[0] = static_cast<char>(hash_count_);
+  absl::little_endian::Store64(&out[1], bits_.size());
+  for (std::size_t i = 0; i < bits_.size(); ++i) {
+    if (bits_[i]) {
+      out[9 + i / 8] |= static_cast<char>(1 << (i % 8));
+    }
+  }
+  return out;
+}
+
+std::unique_ptr<BloomFilter> BloomFilter::Deserialize(
+    const std::string &data) {
+  if (data.size() < 9) {
+    return nullptr;
+  }
+  const std::uint64_t size = absl::little_endian::Load64(&data[1]);
+  if (size == 0 || data.size() != 9 + (size + 7) / 8) {
+    return nullptr;
+  }
+
+  auto filter =
+      std::make_unique<BloomFilter>(size, static_cast<std::uint8_t>(data[0]));
+  for (std::size_t i = 0; i < size; ++i) {
+    filter->bits_[i] = (data[9 + i / 8] >> (i % 8)) & 1;
+  }
+  return filter;
+}
 }  // namespace karu
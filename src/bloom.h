@@ -3,6 +3,8 @@
 
 #include <cstdint>
 #include <functional>
+#include <memory>
+#include <string>
 #include <vector>
 
 namespace karu {
@@ -11,6 +13,15 @@ struct BloomFilter {
   BloomFilter(std::uint64_t size, uint8_t hash_count);
   void add(const char *data, std::size_t len) noexcept;
   bool contains(const char *data, std::size_t len) const noexcept;
+  // these take a hash::Hash64 of the key, such that callers which already
+  // hashed the key don't need to hash it again.
+  void add(std::uint64_t hash) noexcept;
+  bool contains(std::uint64_t hash) const noexcept;
+  // the filter as its hash count, its size in bits and the bits, such that
+  // it can be stored next to a datafile.
+  std::string Serialize() const;
+  // returns nullptr if data isn't a serialized filter.
+  static std::unique_ptr<BloomFilter> Deserialize(const std::string &data);
 
   BloomFilter &operator=(const BloomFilter &) = delete;
   BloomFilter(const BloomFilter &) = delete;
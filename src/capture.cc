@@ -0,0 +1,308 @@
+#include "capture.h"
+
+#include <absl/base/internal/endian.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include "../third_party/parallel_hashmap/phmap.h"
+#include "hash.h"
+#include "karu.h"
+
+namespace karu::capture {
+constexpr std::size_t kHeaderSize = 16;
+// op, two varints of at most 10 and 3 bytes, the key length and the key.
+constexpr std::size_t kMaxEventSize = 1 + 10 + 3 + 3 + 0xFFFF;
+
+static std::uint64_t now_ns() noexcept {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static void put_varint(std::string &out, std::uint64_t value) noexcept {
+  while (value >= 0x80) {
+    out.push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+// returns false if the varint is truncated or too long.
+static bool get_varint(absl::string_view in, std::size_t &pos,
+                       std::uint64_t &value) noexcept {
+  value = 0;
+  for (int shift = 0; shift < 64 && pos < in.size(); shift += 7) {
+    auto byte = static_cast<std::uint8_t>(in[pos++]);
+    value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Writer::Writer(std::ofstream file, bool hash_keys) noexcept
+    : file_(std::move(file)), hash_keys_(hash_keys), start_(now_ns()) {
+  buffer_.reserve(kCaptureBufferSize);
+}
+
+absl::StatusOr<std::unique_ptr<Writer>> Writer::Open(const std::string &path,
+                                                     bool hash_keys) noexcept {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    return absl::InternalError("could not open capture file: " + path);
+  }
+
+  std::uint8_t header[kHeaderSize] = {};
+  absl::little_endian::Store32(&header[0], kCaptureMagic);
+  absl::little_endian::Store32(&header[4], kCaptureVersion);
+  absl::little_endian::Store32(&header[8], hash_keys ? kHashedKeys : 0);
+  file.write(reinterpret_cast<const char *>(header), sizeof(header));
+  if (!file) {
+    return absl::InternalError("could not write capture header.");
+  }
+
+  return std::unique_ptr<Writer>(new Writer(std::move(file), hash_keys));
+}
+
+Writer::~Writer() {
+  if (auto status = Flush(); !status.ok()) {
+    std::cerr << status.message() << '\n';
+  }
+}
+
+void Writer::Record(Op op, absl::string_view key,
+                    std::uint16_t value_size) noexcept {
+  absl::MutexLock lock(&mutex_);
+  // the time is taken under the lock such that the deltas are never negative.
+  const std::uint64_t timestamp = now_ns() - start_;
+  buffer_.push_back(static_cast<char>(op));
+  put_varint(buffer_, timestamp - last_);
+  put_varint(buffer_, value_size);
+  last_ = timestamp;
+
+  if (hash_keys_) {
+    char hash[8];
+    absl::little_endian::Store64(hash, hash::HashKey(key));
+    buffer_.append(hash, sizeof(hash));
+  } else {
+    put_varint(buffer_, key.size());
+    buffer_.append(key.data(), key.size());
+  }
+
+  if (buffer_.size() >= kCaptureBufferSize) {
+    if (auto status = FlushLocked(); !status.ok()) {
+      std::cerr << status.message() << '\n';
+    }
+  }
+}
+
+absl::Status Writer::Flush() noexcept {
+  absl::MutexLock lock(&mutex_);
+  return FlushLocked();
+}
+
+absl::Status Writer::FlushLocked() noexcept {
+  file_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+  file_.flush();
+  buffer_.clear();
+  if (!file_) {
+    return absl::InternalError("could not write capture file.");
+  }
+  return absl::OkStatus();
+}
+
+Reader::Reader(std::ifstream file, bool hash_keys) noexcept
+    : file_(std::move(file)), hash_keys_(hash_keys) {}
+
+absl::StatusOr<std::unique_ptr<Reader>> Reader::Open(
+    const std::string &path) noexcept {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return absl::NotFoundError("could not open capture file: " + path);
+  }
+
+  std::uint8_t header[kHeaderSize];
+  if (!file.read(reinterpret_cast<char *>(header), sizeof(header))) {
+    return absl::DataLossError("capture header is truncated.");
+  }
+  if (absl::little_endian::Load32(&header[0]) != kCaptureMagic ||
+      absl::little_endian::Load32(&header[4]) != kCaptureVersion) {
+    return absl::DataLossError("invalid capture header.");
+  }
+
+  const bool hash_keys =
+      (absl::little_endian::Load32(&header[8]) & kHashedKeys) != 0;
+  return std::unique_ptr<Reader>(new Reader(std::move(file), hash_keys));
+}
+
+void Reader::Fill(std::size_t n) noexcept {
+  if (buffer_.size() - pos_ >= n || !file_) {
+    return;
+  }
+
+  buffer_.erase(0, pos_);
+  pos_ = 0;
+  const std::size_t old_size = buffer_.size();
+  const std::size_t read = std::max(n, kCaptureBufferSize);
+  buffer_.resize(old_size + read);
+  file_.read(buffer_.data() + old_size, static_cast<std::streamsize>(read));
+  buffer_.resize(old_size + file_.gcount());
+}
+
+absl::StatusOr<bool> Reader::Next(Event &event) noexcept {
+  Fill(kMaxEventSize);
+  absl::string_view in = buffer_;
+  std::size_t pos = pos_;
+  if (pos >= in.size()) {
+    return false;
+  }
+
+  const auto op = static_cast<std::uint8_t>(in[pos++]);
+  if (op < static_cast<std::uint8_t>(Op::kGet) ||
+      op > static_cast<std::uint8_t>(Op::kDelete)) {
+    return absl::DataLossError("invalid op in capture file.");
+  }
+
+  std::uint64_t delta = 0, value_size = 0, key_size = 8;
+  if (!get_varint(in, pos, delta) || !get_varint(in, pos, value_size) ||
+      (!hash_keys_ && !get_varint(in, pos, key_size))) {
+    return false;
+  }
+  if (value_size > 0xFFFF || key_size > 0xFFFF) {
+    return absl::DataLossError("invalid event in capture file.");
+  }
+  if (in.size() - pos < key_size) {
+    return false;
+  }
+
+  timestamp_ += delta;
+  event.op_ = static_cast<Op>(op);
+  event.timestamp_ = timestamp_;
+  event.value_size_ = static_cast<std::uint16_t>(value_size);
+  event.key_.assign(in.data() + pos, key_size);
+  pos_ = pos + key_size;
+  return true;
+}
+
+// returns the key that is used for the event in the replayed database.
+static absl::string_view replay_key(const Event &event, bool hashed,
+                                    std::string &buffer) noexcept {
+  if (!hashed) {
+    return event.key_;
+  }
+
+  // hashes are replayed as fixed length hex keys.
+  static constexpr char kHex[] = "0123456789abcdef";
+  const std::uint64_t hash = absl::little_endian::Load64(event.key_.data());
+  buffer.resize(16);
+  for (int i = 0; i < 16; ++i) {
+    buffer[i] = kHex[(hash >> (60 - 4 * i)) & 0xF];
+  }
+  return buffer;
+}
+
+static absl::Status prefill(const std::string &path, DB &db,
+                            ReplayStats &stats) noexcept {
+  auto reader = Reader::Open(path);
+  if (!reader.ok()) {
+    return reader.status();
+  }
+
+  phmap::flat_hash_set<std::string> seen;
+  Event event;
+  std::string key_buffer;
+  while (true) {
+    auto next = (*reader)->Next(event);
+    if (!next.ok()) {
+      return next.status();
+    }
+    if (!*next) {
+      return absl::OkStatus();
+    }
+
+    std::string key(replay_key(event, (*reader)->HashedKeys(), key_buffer));
+    if (!seen.insert(key).second || event.op_ != Op::kGet) {
+      continue;
+    }
+    if (!db.Insert(key, std::string(event.value_size_, 'p')).ok()) {
+      ++stats.errors_;
+    }
+    ++stats.prefilled_;
+  }
+}
+
+absl::Status Replay(const std::string &path, DB &db,
+                    const ReplayOptions &options,
+                    ReplayStats &stats) noexcept {
+  if (options.prefill_) {
+    if (auto status = prefill(path, db, stats); !status.ok()) {
+      return status;
+    }
+  }
+
+  auto reader = Reader::Open(path);
+  if (!reader.ok()) {
+    return reader.status();
+  }
+
+  Event event;
+  std::string key_buffer;
+  std::string value;
+  const std::uint64_t start = now_ns();
+  while (true) {
+    auto next = (*reader)->Next(event);
+    if (!next.ok()) {
+      return next.status();
+    }
+    if (!*next) {
+      break;
+    }
+
+    if (options.speed_ > 0) {
+      auto due = start + static_cast<std::uint64_t>(
+                             static_cast<double>(event.timestamp_) /
+                             options.speed_);
+      if (std::uint64_t now = now_ns(); due > now) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+      }
+    }
+
+    auto key = replay_key(event, (*reader)->HashedKeys(), key_buffer);
+    const std::uint64_t begin = now_ns();
+    switch (event.op_) {
+      case Op::kGet:
+      case Op::kGetMiss: {
+        auto status = db.Get(key);
+        if (absl::IsNotFound(status.status())) {
+          stats.misses_ += event.op_ == Op::kGet;
+        } else if (!status.ok()) {
+          ++stats.errors_;
+        }
+        break;
+      }
+      case Op::kInsert:
+        value.assign(event.value_size_, 'v');
+        if (!db.Insert(key, value).ok()) {
+          ++stats.errors_;
+        }
+        break;
+      case Op::kDelete: {
+        auto status = db.Delete(key);
+        if (!status.ok() && !absl::IsNotFound(status)) {
+          ++stats.errors_;
+        }
+        break;
+      }
+    }
+    stats.latencies_[static_cast<int>(event.op_)].Record(now_ns() - begin);
+    ++stats.events_;
+  }
+
+  stats.seconds_ = static_cast<double>(now_ns() - start) / 1e9;
+  return absl::OkStatus();
+}
+}  // namespace karu::capture
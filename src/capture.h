@@ -0,0 +1,123 @@
+#ifndef _KARU_CAPTURE_H
+#define _KARU_CAPTURE_H
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/string_view.h>
+#include <absl/synchronization/mutex.h>
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include "histogram.h"
+
+namespace karu {
+class DB;
+}
+
+// capture records the operations of a DB into a compact binary trace that can
+// later be replayed against another database, e.g. to benchmark a format
+// change with a production workload.
+namespace karu::capture {
+constexpr std::uint32_t kCaptureMagic = 0x5041434b;  // "KCAP"
+constexpr std::uint32_t kCaptureVersion = 1;
+constexpr std::uint32_t kHashedKeys = 1;  // header flag
+constexpr std::size_t kCaptureBufferSize = 64 * 1024;
+
+enum class Op : std::uint8_t {
+  kGet = 1,      // a read that found a value of value_size_ bytes
+  kGetMiss = 2,  // a read of a key that doesn't exist
+  kInsert = 3,
+  kDelete = 4,
+};
+constexpr int kOpCount = 5;
+
+struct Event {
+  Op op_;
+  std::uint64_t timestamp_;  // nanoseconds since the capture was started
+  std::uint16_t value_size_;
+  // the key, or the 8 byte little endian hash of it if the keys are hashed.
+  std::string key_;
+};
+
+// Writer appends events to a trace file. Every event is stored as the op, the
+// time since the previous event and the value size as varints followed by
+// either the key length and key or the 8 byte key hash. Record can be called
+// from multiple threads.
+class Writer {
+ public:
+  // with hash_keys only the hash of every key is stored, such that a trace
+  // doesn't contain user data.
+  static absl::StatusOr<std::unique_ptr<Writer>> Open(const std::string &path,
+                                                       bool hash_keys) noexcept;
+  ~Writer();
+  Writer &operator=(const Writer &) = delete;
+  Writer(const Writer &) = delete;
+
+  void Record(Op op, absl::string_view key, std::uint16_t value_size) noexcept;
+  absl::Status Flush() noexcept;
+
+ private:
+  Writer(std::ofstream file, bool hash_keys) noexcept;
+  absl::Status FlushLocked() noexcept;  // needs mutex_
+
+  // mutex_ protects everything except the constant fields.
+  absl::Mutex mutex_;
+  std::ofstream file_;
+  std::string buffer_;
+  const bool hash_keys_;
+  const std::uint64_t start_;
+  std::uint64_t last_ = 0;
+};
+
+// Reader reads the events of a trace file in order.
+class Reader {
+ public:
+  static absl::StatusOr<std::unique_ptr<Reader>> Open(
+      const std::string &path) noexcept;
+  Reader &operator=(const Reader &) = delete;
+  Reader(const Reader &) = delete;
+
+  // stores the next event into event. Returns false at the end of the trace,
+  // a truncated last event is ignored.
+  absl::StatusOr<bool> Next(Event &event) noexcept;
+  [[nodiscard]] bool HashedKeys() const noexcept { return hash_keys_; }
+
+ private:
+  Reader(std::ifstream file, bool hash_keys) noexcept;
+  // makes sure that at least n bytes are buffered if the file has them.
+  void Fill(std::size_t n) noexcept;
+
+  std::ifstream file_;
+  std::string buffer_;
+  std::size_t pos_ = 0;
+  const bool hash_keys_;
+  std::uint64_t timestamp_ = 0;
+};
+
+struct ReplayOptions {
+  // 1 replays at the captured speed, 2 twice as fast and 0 as fast as
+  // possible.
+  double speed_ = 1.0;
+  // insert every key that is read before it is written first, with a value
+  // of the size that was read, such that the reads of the trace hit.
+  bool prefill_ = false;
+};
+
+struct ReplayStats {
+  std::uint64_t events_ = 0;
+  std::uint64_t misses_ = 0;  // reads that hit in the capture but not here
+  std::uint64_t errors_ = 0;
+  std::uint64_t prefilled_ = 0;
+  double seconds_ = 0;
+  metrics::Histogram latencies_[kOpCount];
+};
+
+// Replay runs the trace at path against db on the calling thread.
+absl::Status Replay(const std::string &path, DB &db,
+                    const ReplayOptions &options, ReplayStats &stats) noexcept;
+}  // namespace karu::capture
+
+#endif
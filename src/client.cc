@@ -1,3 +1,4 @@
+#include <iostream>
 #include <sstream>
 #include <string>
 
@@ -11,7 +12,7 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  auto db = karu::DB(std::string(argv[2]));
+  auto db = karu::DB(std::string(argv[1]));
 
   std::string line;
   while (std::getline(std::cin, line)) {
@@ -28,7 +29,7 @@ int main(int argc, char **argv) {
       if (!status.ok()) {
         std::cerr << "karu: Error inserting key-value pair:\n"
                   << status.message() << '\n';
-        return 1;
+        continue;
       }
       std::cout << "set value\n";
     } else if (action == "get") {
@@ -39,13 +40,12 @@ int main(int argc, char **argv) {
       if (!status.ok()) {
         std::cerr << "karu: Error getting key-value pair:\n"
                   << status.status().message() << '\n';
-        return 1;
+        continue;
       }
       std::cout << status.value() << '\n';
 
     } else {
       std::cerr << "karu: Wrong type of action.\n";
-      return 1;
     }
   }
 
@@ -1,10 +1,21 @@
 #include "encoder.h"
 
+#include <cstring>
+
 #include "absl/base/internal/endian.h"
 
 namespace karu::encoder {
 std::uint16_t HintHeader::KeyLength() const noexcept {
-  return absl::little_endian::Load16(&data_[0]);
+  return absl::little_endian::Load16(&data_[0]) & ~kInlineValueFlag;
+}
+
+bool HintHeader::HasInlineValue() const noexcept {
+  return (absl::little_endian::Load16(&data_[0]) & kInlineValueFlag) != 0;
+}
+
+void HintHeader::SetInlineValue() noexcept {
+  absl::little_endian::Store16(
+      &data_[0], absl::little_endian::Load16(&data_[0]) | kInlineValueFlag);
 }
 
 std::uint16_t HintHeader::ValueLength() const noexcept {
@@ -68,11 +79,41 @@ void EntryHeader::SetValueLength(std::uint16_t vlen) noexcept {
 }
 
 void EntryHeader::MakeTombstone() noexcept { SetValueLength(kTombstone); }
-absl::Span<const std::uint8_t> FullEncoding::Key() {
-  return {};
+
+FullEncoding FullEncoding::Encode(std::uint8_t *dst, absl::string_view key,
+                                  absl::string_view value) noexcept {
+  EntryHeader header(dst);
+  header.SetKeyLength(static_cast<std::uint16_t>(key.size()));
+  header.SetValueLength(static_cast<std::uint16_t>(value.size()));
+  std::memcpy(&dst[kFullHeader], key.data(), key.size());
+  std::memcpy(&dst[kFullHeader + key.size()], value.data(), value.size());
+  return FullEncoding(dst);
+}
+
+FullEncoding FullEncoding::EncodeTombstone(std::uint8_t *dst,
+                                           absl::string_view key) noexcept {
+  EntryHeader header(dst);
+  header.SetKeyLength(static_cast<std::uint16_t>(key.size()));
+  header.MakeTombstone();
+  std::memcpy(&dst[kFullHeader], key.data(), key.size());
+  return FullEncoding(dst);
+}
+
+absl::string_view FullEncoding::Key() const noexcept {
+  return {reinterpret_cast<const char *>(&data_[kFullHeader]),
+          Header().KeyLength()};
+}
+
+absl::string_view FullEncoding::Value() const noexcept {
+  return {reinterpret_cast<const char *>(&data_[ValueOffset()]),
+          Header().ValueLength()};
+}
+
+std::uint32_t FullEncoding::ValueOffset() const noexcept {
+  return kFullHeader + Header().KeyLength();
 }
-absl::Span<const std::uint8_t> FullEncoding::Value() {
-  return {};
+
+std::uint32_t FullEncoding::Size() const noexcept {
+  return ValueOffset() + Header().ValueLength();
 }
-std::uint16_t FullEncoding::RawValueLength() noexcept { return 0; }
 }  // namespace karu
@@ -2,9 +2,10 @@
 #define _KARU_ENCODER_H
 
 #include <absl/status/status.h>
+#include <absl/strings/string_view.h>
 
+#include <cstddef>
 #include <cstdint>
-#include <memory>
 
 namespace karu::encoder {
 constexpr std::uint16_t kTombstone = 0xFFFF;
@@ -16,6 +17,9 @@ constexpr std::uint32_t kFullHeader =
     kKeyByteCount + kValueByteCount;  // 2 = key length + 2 = value length
 constexpr std::uint32_t kHintHeader =
     kKeyByteCount + kValueByteCount + kPosByteCount;
+// set on the key length of a hint or snapshot entry whose value follows the
+// key, see DatabaseEntry::inline_.
+constexpr std::uint16_t kInlineValueFlag = 0x8000;
 
 class HintHeader {
  public:
@@ -25,10 +29,13 @@ class HintHeader {
   [[nodiscard]] std::uint32_t ValuePos() const noexcept;
 
   [[nodiscard]] bool IsTombstoneValue() const noexcept;
+  // the value follows the key in the hint file.
+  [[nodiscard]] bool HasInlineValue() const noexcept;
   void MakeTombstone() noexcept;
   void SetKeyLength(std::uint16_t klen) noexcept;
   void SetValueLength(std::uint16_t vlen) noexcept;
   void SetPos(std::uint32_t pos) noexcept;
+  void SetInlineValue() noexcept;
 
  private:
   std::uint8_t* const data_;
@@ -50,21 +57,37 @@ class EntryHeader {
   [[nodiscard]] std::uint16_t RawValueLength() const noexcept;
 };
 
-// Full encoding contains encoding for full entries, meaning that it contains
+// FullEncoding is a view of a complete datafile record, the entry header
+// followed by the key and the value. It doesn't own the bytes, records are
+// encoded straight into an append buffer and decoded in place from a read
+// buffer.
 class FullEncoding {
-  explicit FullEncoding(std::uint32_t len)
-      : main_data_(new uint8_t[len]), key_size_(0), value_size_(0) {}
-  static absl::Span<const std::uint8_t> Key() ;
-  static absl::Span<const std::uint8_t> Value() ;
+ public:
+  explicit FullEncoding(std::uint8_t* const data) : data_(data){};
 
- private:
-  [[nodiscard]] const std::uint8_t* raw_ptr() const { return main_data_.get(); }
-  std::uint8_t* raw_ptr() { return main_data_.get(); }
+  // the number of bytes of a record with the given key and value lengths.
+  static constexpr std::uint32_t EncodedSize(std::size_t klen,
+                                             std::size_t vlen) noexcept {
+    return kFullHeader + static_cast<std::uint32_t>(klen + vlen);
+  }
+  // encodes the record into dst, which needs room for EncodedSize bytes.
+  static FullEncoding Encode(std::uint8_t* dst, absl::string_view key,
+                             absl::string_view value) noexcept;
+  static FullEncoding EncodeTombstone(std::uint8_t* dst,
+                                      absl::string_view key) noexcept;
+
+  [[nodiscard]] EntryHeader Header() const noexcept {
+    return EntryHeader(data_);
+  }
+  // only the header and the key have to be readable.
+  [[nodiscard]] absl::string_view Key() const noexcept;
+  [[nodiscard]] absl::string_view Value() const noexcept;
+  // the offset of the value from the start of the record.
+  [[nodiscard]] std::uint32_t ValueOffset() const noexcept;
+  [[nodiscard]] std::uint32_t Size() const noexcept;
 
-  std::uint8_t key_size_;
-  std::uint16_t value_size_;
-  std::unique_ptr<std::uint8_t[]> main_data_;
-  [[nodiscard]] static std::uint16_t RawValueLength() noexcept;
+ private:
+  std::uint8_t* const data_;
 };
 }  // namespace karu
 
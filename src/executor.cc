@@ -0,0 +1,213 @@
+#include "executor.h"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+namespace karu {
+namespace {
+// the worker the calling thread belongs to, used to keep the jobs a job
+// submits on the same thread.
+thread_local const Executor *current_executor = nullptr;
+thread_local std::size_t current_worker = 0;
+
+std::uint64_t CpuNanos(const rusage &usage) {
+  const auto nanos = [](const timeval &tv) {
+    return static_cast<std::uint64_t>(tv.tv_sec) * 1000000000ull +
+           static_cast<std::uint64_t>(tv.tv_usec) * 1000ull;
+  };
+  return nanos(usage.ru_utime) + nanos(usage.ru_stime);
+}
+}  // namespace
+
+Executor::Executor(std::size_t threads) {
+  threads = std::max<std::size_t>(threads, 1);
+  for (std::size_t i = 0; i < threads; ++i) {
+    workers_.push_back(std::make_unique<Worker>());
+  }
+  for (std::size_t i = 0; i < threads; ++i) {
+    threads_.emplace_back(&Executor::Run, this, i);
+  }
+}
+
+Executor::~Executor() { Shutdown(); }
+
+void Executor::Submit(absl::string_view name, Priority priority,
+                      std::function<void()> job) noexcept {
+  if (Cancelled()) {
+    return;
+  }
+  Push({.name_ = std::string(name),
+        .priority_ = priority,
+        .job_ = std::move(job)});
+}
+
+void Executor::SubmitAfter(absl::string_view name, Priority priority,
+                           absl::Duration delay,
+                           std::function<void()> job) noexcept {
+  if (Cancelled()) {
+    return;
+  }
+  absl::MutexLock lock(&mutex_);
+  delayed_.emplace(absl::Now() + delay, Task{.name_ = std::string(name),
+                                             .priority_ = priority,
+                                             .job_ = std::move(job)});
+  // an idle thread may sleep until a later job.
+  wake_.Signal();
+}
+
+void Executor::Push(Task task) noexcept {
+  const std::size_t index =
+      current_executor == this
+          ? current_worker
+          : next_worker_.fetch_add(1, std::memory_order_relaxed) %
+                workers_.size();
+  {
+    auto &worker = *workers_[index];
+    absl::MutexLock lock(&worker.mutex_);
+    worker.queues_[static_cast<std::size_t>(task.priority_)].push_back(
+        std::move(task));
+  }
+  absl::MutexLock lock(&mutex_);
+  ++queued_;
+  wake_.Signal();
+}
+
+bool Executor::Pop(std::size_t index, Task &task) noexcept {
+  for (std::size_t priority = 0; priority < kPriorityCount; ++priority) {
+    // the own queue first, oldest job first.
+    {
+      auto &worker = *workers_[index];
+      absl::MutexLock lock(&worker.mutex_);
+      auto &queue = worker.queues_[priority];
+      if (!queue.empty()) {
+        task = std::move(queue.front());
+        queue.pop_front();
+        return true;
+      }
+    }
+    // then steal the newest job of another thread, which is the one its owner
+    // would get to last.
+    for (std::size_t i = 1; i < workers_.size(); ++i) {
+      auto &victim = *workers_[(index + i) % workers_.size()];
+      absl::MutexLock lock(&victim.mutex_);
+      auto &queue = victim.queues_[priority];
+      if (!queue.empty()) {
+        task = std::move(queue.back());
+        queue.pop_back();
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void Executor::Run(std::size_t index) noexcept {
+  current_executor = this;
+  current_worker = index;
+
+  while (true) {
+    {
+      absl::MutexLock lock(&mutex_);
+      while (!Cancelled() && queued_ == 0) {
+        if (!delayed_.empty() && delayed_.begin()->first <= absl::Now()) {
+          break;
+        }
+        if (delayed_.empty()) {
+          wake_.Wait(&mutex_);
+        } else {
+          wake_.WaitWithDeadline(&mutex_, delayed_.begin()->first);
+        }
+      }
+      if (Cancelled()) {
+        return;
+      }
+
+      // due delayed jobs are queued on this thread, where they are taken
+      // first.
+      const absl::Time now = absl::Now();
+      while (!delayed_.empty() && delayed_.begin()->first <= now) {
+        Task task = std::move(delayed_.begin()->second);
+        delayed_.erase(delayed_.begin());
+        auto &worker = *workers_[index];
+        absl::MutexLock worker_lock(&worker.mutex_);
+        worker.queues_[static_cast<std::size_t>(task.priority_)].push_back(
+            std::move(task));
+        ++queued_;
+      }
+      // claims one of the queued jobs, the others are left for the threads
+      // that are still waiting.
+      --queued_;
+      if (queued_ > 0) {
+        wake_.Signal();
+      }
+    }
+
+    // jobs are queued before they are counted, so a claimed job is always
+    // found.
+    Task task;
+    if (Pop(index, task)) {
+      Execute(task);
+    }
+  }
+}
+
+void Executor::Execute(Task &task) noexcept {
+  rusage before{};
+  rusage after{};
+  getrusage(RUSAGE_THREAD, &before);
+  const auto start = std::chrono::steady_clock::now();
+
+  task.job_();
+
+  const auto wall = std::chrono::steady_clock::now() - start;
+  getrusage(RUSAGE_THREAD, &after);
+
+  absl::MutexLock lock(&accounting_mutex_);
+  auto &summary = accounting_[task.name_];
+  summary.name_ = task.name_;
+  summary.runs_ += 1;
+  summary.cpu_ns_ += CpuNanos(after) - CpuNanos(before);
+  summary.wall_ns_ += static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(wall).count());
+  summary.read_blocks_ +=
+      static_cast<std::uint64_t>(after.ru_inblock - before.ru_inblock);
+  summary.write_blocks_ +=
+      static_cast<std::uint64_t>(after.ru_oublock - before.ru_oublock);
+}
+
+void Executor::Shutdown() noexcept {
+  {
+    absl::MutexLock lock(&mutex_);
+    if (!cancelled_.HasBeenNotified()) {
+      cancelled_.Notify();
+    }
+    delayed_.clear();
+    wake_.SignalAll();
+  }
+  for (auto &thread : threads_) {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+  // the queued jobs are dropped once no thread can take them anymore.
+  for (auto &worker : workers_) {
+    absl::MutexLock lock(&worker->mutex_);
+    for (auto &queue : worker->queues_) {
+      queue.clear();
+    }
+  }
+}
+
+std::vector<metrics::JobSummary> Executor::Accounting() const {
+  absl::MutexLock lock(&accounting_mutex_);
+  std::vector<metrics::JobSummary> jobs;
+  jobs.reserve(accounting_.size());
+  for (const auto &[name, summary] : accounting_) {
+    jobs.push_back(summary);
+  }
+  return jobs;
+}
+}  // namespace karu
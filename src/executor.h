@@ -0,0 +1,101 @@
+#ifndef _KARU_EXECUTOR_H
+#define _KARU_EXECUTOR_H
+
+#include <absl/strings/string_view.h>
+#include <absl/synchronization/mutex.h>
+#include <absl/synchronization/notification.h>
+#include <absl/time/time.h>
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+
+namespace karu {
+// jobs of a higher priority are started first, the priorities don't preempt
+// jobs that are already running.
+enum class Priority : std::size_t {
+  kHigh,
+  kNormal,
+  kLow,
+};
+constexpr std::size_t kPriorityCount = 3;
+
+// Executor runs the background work of a DB on a fixed number of threads.
+// Every thread has a queue per priority. Jobs submitted from one of the
+// threads go into its own queue and the rest are spread over the threads.
+// An idle thread takes the oldest job of its own queues and otherwise steals
+// the newest one of another thread, always looking at the highest priority
+// first.
+//
+// Shutdown cancels the executor: queued and delayed jobs are dropped and the
+// running ones are expected to return soon, long jobs check Cancelled or wait
+// on Cancellation instead of sleeping. The CPU time, wall time and block I/O
+// of every job is accounted under its name with getrusage(RUSAGE_THREAD).
+class Executor {
+ public:
+  explicit Executor(std::size_t threads);
+  ~Executor();
+  Executor &operator=(const Executor &) = delete;
+  Executor(const Executor &) = delete;
+
+  // jobs submitted after Shutdown are dropped.
+  void Submit(absl::string_view name, Priority priority,
+              std::function<void()> job) noexcept;
+  // queues the job once delay has passed.
+  void SubmitAfter(absl::string_view name, Priority priority,
+                   absl::Duration delay, std::function<void()> job) noexcept;
+  [[nodiscard]] bool Cancelled() const noexcept {
+    return cancelled_.HasBeenNotified();
+  }
+  // notified by Shutdown.
+  [[nodiscard]] const absl::Notification &Cancellation() const noexcept {
+    return cancelled_;
+  }
+  // drops the queued jobs and waits for the running ones.
+  void Shutdown() noexcept;
+  // the accounting of every job name that ran so far.
+  [[nodiscard]] std::vector<metrics::JobSummary> Accounting() const;
+
+ private:
+  struct Task {
+    std::string name_;
+    Priority priority_;
+    std::function<void()> job_;
+  };
+  struct Worker {
+    absl::Mutex mutex_;
+    std::deque<Task> queues_[kPriorityCount];
+  };
+
+  void Push(Task task) noexcept;
+  // takes the next task for the worker at index, returns false if there is
+  // none.
+  bool Pop(std::size_t index, Task &task) noexcept;
+  void Run(std::size_t index) noexcept;
+  void Execute(Task &task) noexcept;
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+  absl::Notification cancelled_;
+  std::atomic<std::size_t> next_worker_{0};
+
+  // guards the wakeups of idle threads and the delayed jobs.
+  absl::Mutex mutex_;
+  absl::CondVar wake_;
+  std::size_t queued_ = 0;
+  std::multimap<absl::Time, Task> delayed_;
+
+  mutable absl::Mutex accounting_mutex_;
+  std::map<std::string, metrics::JobSummary> accounting_;
+};
+}  // namespace karu
+
+#endif
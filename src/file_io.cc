@@ -19,6 +19,9 @@ absl::StatusOr<std::uint32_t> FileWriter::Append(
 
   std::uint64_t offset = offset_;  // where it starts.
   offset_ += src.size();
+  if (metrics_ != nullptr) {
+    metrics_->Add(metrics::kBytesWritten, src.size());
+  }
 
   return offset;
 }
@@ -26,6 +29,9 @@ absl::StatusOr<std::uint32_t> FileWriter::Append(
 void FileWriter::Sync() noexcept {
   // flush the writed buffer onto the disk
   file_.flush();
+  if (metrics_ != nullptr) {
+    metrics_->Add(metrics::kWriteSyscalls);
+  }
 }
 
 absl::StatusOr<std::unique_ptr<FileWriter>> OpenFileWriter(
@@ -66,6 +72,27 @@ absl::StatusOr<std::uint64_t> FileReader::ReadAt(
     return absl::InternalError("pread failed");
   }
 
+  if (metrics_ != nullptr) {
+    metrics_->Add(metrics::kReadSyscalls);
+    metrics_->Add(metrics::kBytesRead, size);
+  }
+
+  return size;
+}
+
+absl::StatusOr<std::uint64_t> FileReader::ReadVAt(
+    std::uint64_t offset, absl::Span<const ::iovec> dst) const noexcept {
+  ssize_t size = ::preadv(fd_, dst.data(), static_cast<int>(dst.size()),
+                          static_cast<off_t>(offset));
+  if (size < 0) {
+    return absl::InternalError("preadv failed");
+  }
+
+  if (metrics_ != nullptr) {
+    metrics_->Add(metrics::kReadSyscalls);
+    metrics_->Add(metrics::kBytesRead, size);
+  }
+
   return size;
 }
 }  // namespace karu
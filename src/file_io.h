@@ -1,11 +1,15 @@
 #ifndef _KARU_FILE_WRITER_H
 #define _KARU_FILE_WRITER_H
 
+#include <sys/uio.h>
+
 #include <cstdint>
 #include <fstream>
+#include <functional>
 #include <utility>
 
 #include "absl/status/statusor.h"
+#include "metrics.h"
 
 namespace karu::io {
 class FileWriter {
@@ -13,7 +17,7 @@ class FileWriter {
   ~FileWriter() { file_.close(); }
   FileWriter(std::string fname, std::ofstream &&file,
              std::uint32_t offset)
-      : file_(std::move(file)), filename_(std::move(fname)), offset_(offset) {}
+      : file_(std::move(file)), offset_(offset), filename_(std::move(fname)) {}
   [[nodiscard]] absl::StatusOr<std::uint32_t> Append(
       absl::Span<const std::uint8_t> src) noexcept;
   void Sync() noexcept;
@@ -23,8 +27,10 @@ class FileWriter {
   FileWriter(const FileWriter &) = delete;
   FileWriter &operator=(const FileWriter &) = delete;
   std::uint64_t LastWritten() const noexcept { return last_written_; };
+  void SetMetrics(metrics::Registry *metrics) noexcept { metrics_ = metrics; }
 
  private:
+  metrics::Registry *metrics_ = nullptr;
   std::uint64_t last_written_ = 0;  // so we can easily append sizes
   std::ofstream file_;
   uint32_t offset_{};
@@ -40,11 +46,22 @@ class FileReader {
 
   [[nodiscard]] absl::StatusOr<std::uint64_t> ReadAt(
       std::uint64_t offset, absl::Span<std::uint8_t> dst) const noexcept;
+  // reads a contiguous range of the file starting at offset and scatters it
+  // into the given buffers using a single preadv call.
+  [[nodiscard]] absl::StatusOr<std::uint64_t> ReadVAt(
+      std::uint64_t offset, absl::Span<const ::iovec> dst) const noexcept;
+  void SetMetrics(metrics::Registry *metrics) noexcept { metrics_ = metrics; }
 
  private:
   const int fd_;
+  metrics::Registry *metrics_ = nullptr;
 };
 
+// called with the number of bytes before background work reads or writes
+// them, see RateLimiter. Returns false once the work should stop because the
+// database is closing. An empty one doesn't limit anything.
+using Throttle = std::function<bool(std::uint64_t)>;
+
 absl::StatusOr<std::unique_ptr<FileWriter>> OpenFileWriter(
     const std::string &fname) noexcept;
 absl::StatusOr<std::unique_ptr<FileReader>> OpenFileReader(
@@ -0,0 +1,48 @@
+#include "file_slots.h"
+
+namespace karu {
+std::uint16_t FileSlots::Acquire(file_id_t id) noexcept {
+  absl::MutexLock lock(&mutex_);
+  if (auto it = slots_.find(id); it != slots_.end()) {
+    return it->second;
+  }
+
+  std::uint16_t slot = kNoFileSlot;
+  if (!free_.empty()) {
+    slot = free_.back();
+    free_.pop_back();
+    ids_[slot] = id;
+  } else if (ids_.size() < kNoFileSlot) {
+    slot = static_cast<std::uint16_t>(ids_.size());
+    ids_.push_back(id);
+  } else {
+    return kNoFileSlot;
+  }
+  slots_[id] = slot;
+  return slot;
+}
+
+void FileSlots::Release(file_id_t id) noexcept {
+  absl::MutexLock lock(&mutex_);
+  if (auto it = slots_.find(id); it != slots_.end()) {
+    free_.push_back(it->second);
+    slots_.erase(it);
+  }
+}
+
+file_id_t FileSlots::FileOf(const DatabaseEntry &entry) const noexcept {
+  if (!entry.Inline()) {
+    return entry.file_id_;
+  }
+  absl::MutexLock lock(&mutex_);
+  return ids_[entry.FileSlot()];
+}
+
+DatabaseEntry FileSlots::Location(const DatabaseEntry &entry) const noexcept {
+  return DatabaseEntry{
+      .file_id_ = FileOf(entry),
+      .pos_ = entry.pos_,
+      .value_size_ = entry.value_size_,
+  };
+}
+}  // namespace karu
@@ -0,0 +1,37 @@
+#ifndef _KARU_FILE_SLOTS_H
+#define _KARU_FILE_SLOTS_H
+
+#include <absl/synchronization/mutex.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "types.h"
+
+namespace karu {
+// FileSlots numbers the datafiles of a DB with slots of 15 bits. An inline
+// keydir entry keeps its value where the datafile id would be and only has
+// room for the slot, see DatabaseEntry. A datafile takes a slot when it is
+// opened and gives it back once garbage collection removed it, at which
+// point no entry refers to it anymore.
+class FileSlots {
+ public:
+  // returns the slot of id, taking a free one if it has none yet, or
+  // kNoFileSlot once every slot is taken.
+  std::uint16_t Acquire(file_id_t id) noexcept;
+  void Release(file_id_t id) noexcept;
+  // the id of the datafile that entry points into.
+  [[nodiscard]] file_id_t FileOf(const DatabaseEntry &entry) const noexcept;
+  // entry without its inline value, i.e. only the location.
+  [[nodiscard]] DatabaseEntry Location(
+      const DatabaseEntry &entry) const noexcept;
+
+ private:
+  mutable absl::Mutex mutex_;
+  std::vector<file_id_t> ids_;  // by slot
+  std::vector<std::uint16_t> free_;
+  phmap::flat_hash_map<file_id_t, std::uint16_t> slots_;
+};
+}  // namespace karu
+
+#endif
@@ -0,0 +1,391 @@
+#include "frozen.h"
+
+#include <absl/base/internal/endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+
+#include "hash.h"
+
+namespace karu::frozen {
+// magic (4), version (4), key count (8), datafile count (4), level count (4),
+// fallback count (8) and the number of 64-bit words of the levels (8). It is
+// followed by the datafile ids, the level offsets, the level bits, the rank
+// table, the fallback table and the slots.
+constexpr std::size_t kHeaderSize = 40;
+// fingerprint (4), position (4), index into the datafile ids (2) and value
+// size (2).
+constexpr std::size_t kSlotSize = 12;
+// the hash and the slot of every fallback key.
+constexpr std::size_t kFallbackSize = 16;
+// the rank table stores the number of set bits before every block of this
+// many words.
+constexpr std::uint64_t kRankBlockWords = 8;
+constexpr std::uint64_t kFingerprintSeed = kMaxLevels + 1;
+
+// position of a key hash within a level of size bits.
+static std::uint64_t level_position(std::uint64_t key_hash, std::uint32_t level,
+                                    std::uint64_t size) noexcept {
+  const std::uint64_t h = hash::Hash64(&key_hash, sizeof(key_hash), level + 1);
+  return static_cast<std::uint64_t>((static_cast<__uint128_t>(h) * size) >>
+                                    64);
+}
+
+static std::uint32_t fingerprint(std::uint64_t key_hash) noexcept {
+  return static_cast<std::uint32_t>(
+      hash::Hash64(&key_hash, sizeof(key_hash), kFingerprintSeed));
+}
+
+static bool test_bit(const std::vector<std::uint64_t> &words,
+                     std::uint64_t bit) noexcept {
+  return (words[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void set_bit(std::vector<std::uint64_t> &words,
+                    std::uint64_t bit) noexcept {
+  words[bit / 64] |= std::uint64_t{1} << (bit % 64);
+}
+
+// counts the set bits before bit, word(i) returns the i-th word of the levels
+// and block(i) the i-th entry of the rank table.
+template <typename Word, typename Block>
+static std::uint64_t rank(std::uint64_t bit, Word word,
+                          Block block) noexcept {
+  const std::uint64_t index = bit / 64;
+  std::uint64_t result = block(index / kRankBlockWords);
+  for (std::uint64_t i = index - index % kRankBlockWords; i < index; ++i) {
+    result += __builtin_popcountll(word(i));
+  }
+  const std::uint64_t mask = (std::uint64_t{1} << (bit % 64)) - 1;
+  return result + __builtin_popcountll(word(index) & mask);
+}
+
+static void put64(std::string &out, std::uint64_t value) noexcept {
+  char buffer[8];
+  absl::little_endian::Store64(buffer, value);
+  out.append(buffer, sizeof(buffer));
+}
+
+absl::Status Build(const std::string &path,
+                   absl::Span<const file_id_t> datafiles, const keydir_t &index,
+                   const FileSlots &file_slots) noexcept {
+  if (datafiles.size() > 0xFFFF) {
+    return absl::InvalidArgumentError("too many datafiles to freeze.");
+  }
+  phmap::flat_hash_map<file_id_t, std::uint16_t> file_index;
+  for (std::size_t i = 0; i < datafiles.size(); ++i) {
+    file_index[datafiles[i]] = static_cast<std::uint16_t>(i);
+  }
+
+  struct Key {
+    std::uint64_t hash_;
+    const DatabaseEntry *entry_;
+    file_id_t file_id_;
+  };
+  std::vector<Key> keys;
+  keys.reserve(index.size());
+  for (const auto &[key, entry] : index) {
+    keys.push_back({hash::HashKey(key), &entry, file_slots.FileOf(entry)});
+  }
+
+  // every level gets gamma bits per remaining key. Keys that are the only
+  // one at their position set its bit, the others move on to the next level.
+  constexpr std::uint64_t kUnplaced = ~std::uint64_t{0};
+  std::vector<std::uint64_t> placed(keys.size(), kUnplaced);
+  std::vector<std::uint64_t> words;
+  std::vector<std::uint64_t> offsets{0};
+  std::vector<std::size_t> remaining(keys.size());
+  std::iota(remaining.begin(), remaining.end(), 0);
+  std::vector<std::size_t> next;
+  std::vector<std::uint64_t> seen, collided;
+  for (std::uint32_t level = 0; level < kMaxLevels && !remaining.empty();
+       ++level) {
+    auto size = static_cast<std::uint64_t>(
+        std::ceil(kGamma * static_cast<double>(remaining.size())));
+    size = (size + 63) / 64 * 64;
+    seen.assign(size / 64, 0);
+    collided.assign(size / 64, 0);
+    for (auto k : remaining) {
+      const auto pos = level_position(keys[k].hash_, level, size);
+      if (test_bit(seen, pos)) {
+        set_bit(collided, pos);
+      } else {
+        set_bit(seen, pos);
+      }
+    }
+
+    next.clear();
+    for (auto k : remaining) {
+      const auto pos = level_position(keys[k].hash_, level, size);
+      if (test_bit(collided, pos)) {
+        next.push_back(k);
+      } else {
+        placed[k] = offsets.back() + pos;
+      }
+    }
+    for (std::size_t i = 0; i < seen.size(); ++i) {
+      words.push_back(seen[i] & ~collided[i]);
+    }
+    offsets.push_back(offsets.back() + size);
+    remaining.swap(next);
+  }
+
+  std::vector<std::uint64_t> ranks(words.size() / kRankBlockWords + 1);
+  std::uint64_t set_bits = 0;
+  for (std::size_t i = 0; i < words.size(); ++i) {
+    if (i % kRankBlockWords == 0) {
+      ranks[i / kRankBlockWords] = set_bits;
+    }
+    set_bits += __builtin_popcountll(words[i]);
+  }
+  if (words.size() % kRankBlockWords == 0) {
+    ranks.back() = set_bits;
+  }
+
+  // keys that are still left have the same position on every level, which
+  // is only likely for keys with the same hash. Those can't be told apart.
+  std::sort(remaining.begin(), remaining.end(),
+            [&](std::size_t a, std::size_t b) {
+              return keys[a].hash_ < keys[b].hash_;
+            });
+  for (std::size_t i = 1; i < remaining.size(); ++i) {
+    if (keys[remaining[i]].hash_ == keys[remaining[i - 1]].hash_) {
+      return absl::FailedPreconditionError(
+          "keys with the same hash cannot be frozen.");
+    }
+  }
+
+  std::string slots(keys.size() * kSlotSize, '\0');
+  std::string fallback;
+  auto store_slot = [&](std::uint64_t slot, const Key &key) {
+    auto *p = reinterpret_cast<std::uint8_t *>(&slots[slot * kSlotSize]);
+    absl::little_endian::Store32(&p[0], fingerprint(key.hash_));
+    absl::little_endian::Store32(&p[4], key.entry_->pos_);
+    absl::little_endian::Store16(&p[8], file_index[key.file_id_]);
+    absl::little_endian::Store16(&p[10], key.entry_->value_size_);
+  };
+  for (std::size_t k = 0; k < keys.size(); ++k) {
+    if (!file_index.contains(keys[k].file_id_)) {
+      return absl::InternalError("entry points into an unknown datafile.");
+    }
+    if (placed[k] != kUnplaced) {
+      store_slot(rank(
+                     placed[k], [&](std::uint64_t i) { return words[i]; },
+                     [&](std::uint64_t i) { return ranks[i]; }),
+                 keys[k]);
+    }
+  }
+  for (std::size_t i = 0; i < remaining.size(); ++i) {
+    const auto &key = keys[remaining[i]];
+    put64(fallback, key.hash_);
+    put64(fallback, set_bits + i);
+    store_slot(set_bits + i, key);
+  }
+
+  std::string out(kHeaderSize, '\0');
+  auto *header = reinterpret_cast<std::uint8_t *>(out.data());
+  absl::little_endian::Store32(&header[0], kFrozenMagic);
+  absl::little_endian::Store32(&header[4], kFrozenVersion);
+  absl::little_endian::Store64(&header[8], keys.size());
+  absl::little_endian::Store32(&header[16], datafiles.size());
+  absl::little_endian::Store32(&header[20], offsets.size() - 1);
+  absl::little_endian::Store64(&header[24], remaining.size());
+  absl::little_endian::Store64(&header[32], words.size());
+  for (const auto id : datafiles) {
+    put64(out, id);
+  }
+  for (const auto offset : offsets) {
+    put64(out, offset);
+  }
+  for (const auto word : words) {
+    put64(out, word);
+  }
+  for (const auto block : ranks) {
+    put64(out, block);
+  }
+  out += fallback;
+  out += slots;
+  char trailer[4];
+  absl::little_endian::Store32(trailer, kFrozenMagic);
+  out.append(trailer, sizeof(trailer));
+
+  const std::string tmp_path = path + ".tmp";
+  std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    return absl::InternalError("could not open frozen keydir: " + tmp_path);
+  }
+  file.write(out.data(), static_cast<std::streamsize>(out.size()));
+  file.close();
+  if (file.fail()) {
+    return absl::InternalError("could not write frozen keydir.");
+  }
+
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, path, ec);
+  if (ec) {
+    return absl::InternalError("could not rename frozen keydir: " +
+                               ec.message());
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::unique_ptr<FrozenKeydir>> FrozenKeydir::Open(
+    const std::string &path) noexcept {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return absl::NotFoundError("could not open frozen keydir: " + path);
+  }
+
+  struct ::stat st {};
+  if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+    ::close(fd);
+    return absl::DataLossError("frozen keydir is empty.");
+  }
+
+  // the mapping stays valid after the descriptor is closed.
+  const auto size = static_cast<std::size_t>(st.st_size);
+  void *data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    return absl::InternalError("could not map frozen keydir.");
+  }
+
+  std::unique_ptr<FrozenKeydir> keydir(
+      new FrozenKeydir(static_cast<const std::uint8_t *>(data), size));
+  if (auto status = keydir->Parse(); !status.ok()) {
+    return status;
+  }
+  return keydir;
+}
+
+FrozenKeydir::~FrozenKeydir() {
+  ::munmap(const_cast<std::uint8_t *>(data_), size_);
+}
+
+absl::Status FrozenKeydir::Parse() noexcept {
+  if (size_ < kHeaderSize + 4 ||
+      absl::little_endian::Load32(&data_[0]) != kFrozenMagic ||
+      absl::little_endian::Load32(&data_[4]) != kFrozenVersion ||
+      absl::little_endian::Load32(&data_[size_ - 4]) != kFrozenMagic) {
+    return absl::DataLossError("invalid frozen keydir.");
+  }
+
+  key_count_ = absl::little_endian::Load64(&data_[8]);
+  const std::uint32_t datafile_count = absl::little_endian::Load32(&data_[16]);
+  const std::uint32_t level_count = absl::little_endian::Load32(&data_[20]);
+  fallback_count_ = absl::little_endian::Load64(&data_[24]);
+  word_count_ = absl::little_endian::Load64(&data_[32]);
+  if (level_count > kMaxLevels || fallback_count_ > key_count_ ||
+      key_count_ > size_ || word_count_ > size_) {
+    return absl::DataLossError("invalid frozen keydir header.");
+  }
+
+  const std::uint64_t expected =
+      kHeaderSize + 8 * (datafile_count + level_count + 1) + 8 * word_count_ +
+      8 * (word_count_ / kRankBlockWords + 1) +
+      kFallbackSize * fallback_count_ + kSlotSize * key_count_ + 4;
+  if (expected != size_) {
+    return absl::DataLossError("frozen keydir is truncated.");
+  }
+
+  const std::uint8_t *p = data_ + kHeaderSize;
+  for (std::uint32_t i = 0; i < datafile_count; ++i, p += 8) {
+    datafiles_.push_back(
+        static_cast<file_id_t>(absl::little_endian::Load64(p)));
+  }
+  for (std::uint32_t i = 0; i <= level_count; ++i, p += 8) {
+    level_offsets_.push_back(absl::little_endian::Load64(p));
+  }
+  if (level_offsets_.back() != 64 * word_count_) {
+    return absl::DataLossError("invalid frozen keydir levels.");
+  }
+
+  bits_ = p;
+  ranks_ = bits_ + 8 * word_count_;
+  fallback_ = ranks_ + 8 * (word_count_ / kRankBlockWords + 1);
+  slots_ = fallback_ + kFallbackSize * fallback_count_;
+  return absl::OkStatus();
+}
+
+std::uint64_t FrozenKeydir::Rank(std::uint64_t bit) const noexcept {
+  return rank(
+      bit,
+      [this](std::uint64_t i) {
+        return absl::little_endian::Load64(&bits_[8 * i]);
+      },
+      [this](std::uint64_t i) {
+        return absl::little_endian::Load64(&ranks_[8 * i]);
+      });
+}
+
+bool FrozenKeydir::Find(absl::string_view key,
+                        DatabaseEntry &entry) const noexcept {
+  const std::uint64_t key_hash = hash::HashKey(key);
+  std::uint64_t slot = key_count_;
+  for (std::size_t level = 0; level + 1 < level_offsets_.size(); ++level) {
+    const std::uint64_t offset = level_offsets_[level];
+    const std::uint64_t bit =
+        offset + level_position(key_hash, static_cast<std::uint32_t>(level),
+                                level_offsets_[level + 1] - offset);
+    if ((bits_[bit / 8] >> (bit % 8)) & 1) {
+      slot = Rank(bit);
+      break;
+    }
+  }
+
+  if (slot == key_count_) {
+    // binary search of the fallback table, which is sorted by hash.
+    std::uint64_t low = 0, high = fallback_count_;
+    while (low < high) {
+      const std::uint64_t mid = low + (high - low) / 2;
+      const std::uint64_t h =
+          absl::little_endian::Load64(&fallback_[kFallbackSize * mid]);
+      if (h < key_hash) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    if (low == fallback_count_ ||
+        absl::little_endian::Load64(&fallback_[kFallbackSize * low]) !=
+            key_hash) {
+      return false;
+    }
+    slot = absl::little_endian::Load64(&fallback_[kFallbackSize * low + 8]);
+  }
+
+  if (slot >= key_count_) {
+    return false;
+  }
+  const std::uint8_t *p = slots_ + kSlotSize * slot;
+  if (absl::little_endian::Load32(&p[0]) != fingerprint(key_hash)) {
+    return false;
+  }
+
+  const std::uint16_t file = absl::little_endian::Load16(&p[8]);
+  if (file >= datafiles_.size()) {
+    return false;
+  }
+  entry = DatabaseEntry{
+      .file_id_ = datafiles_[file],
+      .pos_ = absl::little_endian::Load32(&p[4]),
+      .value_size_ = absl::little_endian::Load16(&p[10]),
+  };
+  return true;
+}
+
+double FrozenKeydir::BitsPerKey() const noexcept {
+  if (key_count_ == 0) {
+    return 0;
+  }
+  const std::uint64_t words = word_count_ + word_count_ / kRankBlockWords + 1;
+  return static_cast<double>(64 * words) / static_cast<double>(key_count_);
+}
+}  // namespace karu::frozen
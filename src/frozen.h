@@ -0,0 +1,85 @@
+#ifndef _KARU_FROZEN_H
+#define _KARU_FROZEN_H
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/string_view.h>
+#include <absl/types/span.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "file_slots.h"
+#include "types.h"
+
+// frozen is a read-only keydir for datasets that are never written again. It
+// stores a minimal perfect hash function over the keys in the style of BBHash
+// instead of the keys themselves: every key maps to its own slot that holds a
+// fingerprint of the key and the location of the value. A lookup hashes the
+// key once and checks the fingerprint, a key that isn't in the dataset is
+// only found with a chance of 2^-32.
+namespace karu::frozen {
+constexpr std::uint32_t kFrozenMagic = 0x4e5a5246;  // "FRZN"
+constexpr std::uint32_t kFrozenVersion = 1;
+// bits per key of every level. Larger values have less collisions and thus
+// less levels to probe, at the cost of more bits per key.
+constexpr double kGamma = 2.0;
+// keys that still collide after this many levels are stored in a sorted
+// fallback table.
+constexpr std::uint32_t kMaxLevels = 32;
+
+// Build writes a frozen keydir of index to path. datafiles are the ids of the
+// datafiles the entries point into, file_slots resolves the datafiles of
+// inline entries. Like snapshots it is written into a temporary file first
+// which is then renamed over path.
+absl::Status Build(const std::string &path,
+                   absl::Span<const file_id_t> datafiles, const keydir_t &index,
+                   const FileSlots &file_slots) noexcept;
+
+// FrozenKeydir maps a file written by Build. Find can be called from any
+// number of threads.
+class FrozenKeydir {
+ public:
+  static absl::StatusOr<std::unique_ptr<FrozenKeydir>> Open(
+      const std::string &path) noexcept;
+  ~FrozenKeydir();
+  FrozenKeydir &operator=(const FrozenKeydir &) = delete;
+  FrozenKeydir(const FrozenKeydir &) = delete;
+
+  // stores the location of key into entry, returns false if it isn't there.
+  bool Find(absl::string_view key, DatabaseEntry &entry) const noexcept;
+  [[nodiscard]] std::uint64_t Size() const noexcept { return key_count_; }
+  [[nodiscard]] const std::vector<file_id_t> &Datafiles() const noexcept {
+    return datafiles_;
+  }
+  // bits per key of the hash function itself, i.e. the levels and their rank
+  // table without the slots.
+  [[nodiscard]] double BitsPerKey() const noexcept;
+
+ private:
+  FrozenKeydir(const std::uint8_t *data, std::size_t size) noexcept
+      : data_(data), size_(size) {}
+  // validates the header and sets up the pointers into the mapping.
+  absl::Status Parse() noexcept;
+  // number of set bits of the levels before bit.
+  std::uint64_t Rank(std::uint64_t bit) const noexcept;
+
+  const std::uint8_t *data_;
+  std::size_t size_;
+  std::uint64_t key_count_ = 0;
+  std::uint64_t fallback_count_ = 0;
+  std::uint64_t word_count_ = 0;
+  std::vector<file_id_t> datafiles_;
+  // bit offset and size of every level in bits_.
+  std::vector<std::uint64_t> level_offsets_;
+  const std::uint8_t *bits_ = nullptr;
+  const std::uint8_t *ranks_ = nullptr;
+  const std::uint8_t *fallback_ = nullptr;
+  const std::uint8_t *slots_ = nullptr;
+};
+}  // namespace karu::frozen
+
+#endif
@@ -0,0 +1,206 @@
+#include "gc.h"
+
+#include <absl/base/internal/endian.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <filesystem>
+#include <fstream>
+
+namespace karu::gc {
+std::string DeadPath(const std::string &path) noexcept {
+  return std::filesystem::path(path).replace_extension(kDeadFileSuffix);
+}
+
+std::vector<Extent> DeadExtents(std::vector<Extent> live,
+                                std::uint64_t file_size) noexcept {
+  std::sort(live.begin(), live.end(), [](const auto &a, const auto &b) {
+    return a.start_ < b.start_;
+  });
+
+  std::vector<Extent> dead;
+  std::uint64_t offset = 0;
+  for (const auto &extent : live) {
+    if (extent.start_ > offset) {
+      dead.push_back({static_cast<std::uint32_t>(offset), extent.start_});
+    }
+    offset = std::max<std::uint64_t>(offset, extent.end_);
+  }
+  if (offset < file_size) {
+    dead.push_back({static_cast<std::uint32_t>(offset),
+                    static_cast<std::uint32_t>(file_size)});
+  }
+  return dead;
+}
+
+bool Contains(absl::Span<const Extent> extents,
+              std::uint64_t offset) noexcept {
+  auto it = std::upper_bound(
+      extents.begin(), extents.end(), offset,
+      [](std::uint64_t value, const Extent &e) { return value < e.start_; });
+  return it != extents.begin() && offset < std::prev(it)->end_;
+}
+
+absl::StatusOr<std::vector<Extent>> ReadExtents(
+    const std::string &path) noexcept {
+  std::ifstream file(path, std::ios::binary | std::ios::in);
+  if (!file) {
+    return std::vector<Extent>{};
+  }
+
+  std::uint8_t header[12];
+  if (!file.read(reinterpret_cast<char *>(header), sizeof(header)) ||
+      absl::little_endian::Load32(&header[0]) != kDeadMagic ||
+      absl::little_endian::Load32(&header[4]) != kDeadVersion) {
+    return absl::DataLossError("invalid dead extents header: " + path);
+  }
+
+  std::vector<Extent> extents(absl::little_endian::Load32(&header[8]));
+  for (auto &extent : extents) {
+    std::uint8_t buffer[8];
+    if (!file.read(reinterpret_cast<char *>(buffer), sizeof(buffer))) {
+      return absl::DataLossError("dead extents are truncated: " + path);
+    }
+    extent.start_ = absl::little_endian::Load32(&buffer[0]);
+    extent.end_ = absl::little_endian::Load32(&buffer[4]);
+  }
+  return extents;
+}
+
+absl::Status WriteExtents(const std::string &path,
+                          absl::Span<const Extent> extents) noexcept {
+  const std::string tmp_path = path + ".tmp";
+  std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    return absl::InternalError("could not open dead extents: " + tmp_path);
+  }
+
+  std::uint8_t header[12];
+  absl::little_endian::Store32(&header[0], kDeadMagic);
+  absl::little_endian::Store32(&header[4], kDeadVersion);
+  absl::little_endian::Store32(&header[8],
+                               static_cast<std::uint32_t>(extents.size()));
+  file.write(reinterpret_cast<const char *>(header), sizeof(header));
+  for (const auto &extent : extents) {
+    std::uint8_t buffer[8];
+    absl::little_endian::Store32(&buffer[0], extent.start_);
+    absl::little_endian::Store32(&buffer[4], extent.end_);
+    file.write(reinterpret_cast<const char *>(buffer), sizeof(buffer));
+  }
+  file.close();
+  if (file.fail()) {
+    return absl::InternalError("could not write dead extents.");
+  }
+
+  // the extents have to be on disk before the holes are punched.
+  int fd = ::open(tmp_path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    ::fsync(fd);
+    ::close(fd);
+  }
+
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, path, ec);
+  if (ec) {
+    return absl::InternalError("could not rename dead extents: " +
+                               ec.message());
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::uint64_t> PunchHoles(
+    const std::string &path, absl::Span<const Extent> extents) noexcept {
+  int fd = ::open(path.c_str(), O_WRONLY);
+  if (fd < 0) {
+    return absl::InternalError("could not open datafile: " + path);
+  }
+
+  struct ::stat before{};
+  if (::fstat(fd, &before) == -1) {
+    ::close(fd);
+    return absl::InternalError("could not stat datafile: " + path);
+  }
+
+  // only whole blocks can be released, the partial blocks at the ends of an
+  // extent stay allocated.
+  const auto block = static_cast<std::uint64_t>(before.st_blksize);
+  for (const auto &extent : extents) {
+    const std::uint64_t start = (extent.start_ + block - 1) / block * block;
+    const std::uint64_t end = extent.end_ / block * block;
+    if (start >= end) {
+      continue;
+    }
+    if (::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    static_cast<off_t>(start),
+                    static_cast<off_t>(end - start)) == -1) {
+      if (errno == EOPNOTSUPP) {
+        break;
+      }
+      ::close(fd);
+      return absl::InternalError("could not punch hole into: " + path);
+    }
+  }
+
+  struct ::stat after{};
+  ::fstat(fd, &after);
+  ::close(fd);
+  // st_blocks is in 512 byte units.
+  return before.st_blocks > after.st_blocks
+             ? static_cast<std::uint64_t>(before.st_blocks - after.st_blocks) *
+                   512
+             : 0;
+}
+
+absl::StatusOr<Action> CollectDatafile(const std::string &path,
+                                       std::vector<Extent> &live,
+                                       double rewrite_threshold,
+                                       std::uint64_t &punched) noexcept {
+  punched = 0;
+  std::error_code ec;
+  const std::uint64_t size = std::filesystem::file_size(path, ec);
+  if (ec) {
+    return absl::InternalError("could not get the size of " + path);
+  }
+
+  std::sort(live.begin(), live.end(), [](const auto &a, const auto &b) {
+    return a.start_ < b.start_;
+  });
+  auto dead = DeadExtents(live, size);
+  std::uint64_t dead_bytes = 0;
+  for (const auto &extent : dead) {
+    dead_bytes += extent.end_ - extent.start_;
+  }
+  if (dead_bytes == 0) {
+    return Action::kKeep;
+  }
+  if (dead_bytes == size) {
+    return Action::kRemove;
+  }
+
+  const double dead_ratio =
+      static_cast<double>(dead_bytes) / static_cast<double>(size);
+  if (dead_ratio > rewrite_threshold) {
+    return Action::kRewrite;
+  }
+
+  auto previous = ReadExtents(DeadPath(path));
+  if (!previous.ok()) {
+    return previous.status();
+  }
+  if (*previous == dead) {
+    return Action::kKeep;
+  }
+  if (auto status = WriteExtents(DeadPath(path), dead); !status.ok()) {
+    return status;
+  }
+  auto bytes = PunchHoles(path, dead);
+  if (!bytes.ok()) {
+    return bytes.status();
+  }
+  punched = *bytes;
+  return Action::kKeep;
+}
+}  // namespace karu::gc
@@ -0,0 +1,83 @@
+#ifndef _KARU_GC_H
+#define _KARU_GC_H
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/types/span.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// gc reclaims the space of dead records, i.e. values that were overwritten or
+// deleted, in immutable datafiles without rewriting them. The dead ranges of
+// a datafile are stored next to it in <id>.dead and the file system blocks
+// that lie completely inside of them are released with
+// fallocate(FALLOC_FL_PUNCH_HOLE). The live records keep their offsets, so the
+// keydir doesn't change.
+//
+// A punched range reads back as zeros, so recovery skips the dead ranges of a
+// datafile and the hints that point into them. A record is only ever dead
+// once its key has a newer record or tombstone, and the datafiles are
+// collected oldest first, such that a dropped tombstone never brings back an
+// older value.
+namespace karu::gc {
+constexpr std::uint32_t kDeadMagic = 0x44414544;  // "DEAD"
+constexpr std::uint32_t kDeadVersion = 1;
+constexpr const char *kDeadFileSuffix = ".dead";
+
+// the records in [start_, end_) of a datafile. Both ends are record
+// boundaries.
+struct Extent {
+  std::uint32_t start_;
+  std::uint32_t end_;
+
+  bool operator==(const Extent &other) const noexcept {
+    return start_ == other.start_ && end_ == other.end_;
+  }
+};
+
+// the path of the dead ranges of the datafile or hint file at path.
+std::string DeadPath(const std::string &path) noexcept;
+
+// returns the gaps between the live records of a file of file_size bytes.
+// live doesn't need to be sorted.
+std::vector<Extent> DeadExtents(std::vector<Extent> live,
+                                std::uint64_t file_size) noexcept;
+
+// whether offset lies in one of the sorted extents.
+bool Contains(absl::Span<const Extent> extents, std::uint64_t offset) noexcept;
+
+// reads the extents written by WriteExtents. A missing file has none.
+absl::StatusOr<std::vector<Extent>> ReadExtents(
+    const std::string &path) noexcept;
+
+// like snapshots the extents are written into a temporary file first which is
+// then renamed over path.
+absl::Status WriteExtents(const std::string &path,
+                          absl::Span<const Extent> extents) noexcept;
+
+// punches a hole for every block inside of the extents of the datafile at
+// path. Returns the number of bytes the file system released, which is 0 if
+// it doesn't support holes.
+absl::StatusOr<std::uint64_t> PunchHoles(
+    const std::string &path, absl::Span<const Extent> extents) noexcept;
+
+// what CollectDatafile left for the caller to do with a datafile.
+enum class Action {
+  kKeep,     // nothing more, its dead records were punched if there were any
+  kRewrite,  // move the live records to the active datafile, then remove it
+  kRemove,   // it has no live records, remove it
+};
+
+// decides how to collect the immutable datafile at path with the given live
+// records, and punches its dead ones if it is at most rewrite_threshold dead.
+// live is sorted by offset on return. punched is set to the number of bytes
+// the file system released.
+absl::StatusOr<Action> CollectDatafile(const std::string &path,
+                                       std::vector<Extent> &live,
+                                       double rewrite_threshold,
+                                       std::uint64_t &punched) noexcept;
+}  // namespace karu::gc
+
+#endif
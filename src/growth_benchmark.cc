@@ -0,0 +1,103 @@
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+#include "karu.h"
+#include "types.h"
+#include "workload.h"
+
+// measures the latency of every insert while the keydir grows from empty to
+// keys entries, such that the inserts which resize the keydir show up in the
+// maximum. The keydir is measured on its own as well and compared with
+// phmap's default of 16 submaps, whose resizes rehash 16 times more entries:
+//   karu_growth_bench [keys]
+using Clock = std::chrono::steady_clock;
+
+using default_keydir_t =
+    phmap::parallel_flat_hash_map<std::string, karu::DatabaseEntry,
+                                  karu::hash::KeyHash, karu::hash::KeyEqual>;
+
+static void print(const std::string &name,
+                  const karu::metrics::Histogram &histogram,
+                  std::chrono::duration<double> took) {
+  std::cout << name << " inserts " << histogram.Count() << " seconds "
+            << took.count() << " mean_ns " << histogram.Mean() << " p99.9_ns "
+            << histogram.Percentile(99.9) << " max_ns " << histogram.Max()
+            << '\n';
+}
+
+template <typename Keydir>
+static void insert_keydir(const std::string &name,
+                          const std::vector<std::string> &keys) {
+  Keydir keydir;
+  karu::metrics::Histogram histogram;
+  karu::DatabaseEntry entry{};
+  const auto start = Clock::now();
+  for (const auto &key : keys) {
+    const auto before = Clock::now();
+    keydir.insert_or_assign(key, entry);
+    histogram.Record(static_cast<std::uint64_t>(
+        std::chrono::nanoseconds(Clock::now() - before).count()));
+  }
+  print(name, histogram, Clock::now() - start);
+}
+
+int main(int argc, char **argv) {
+  const std::size_t key_count = argc > 1 ? std::stoul(argv[1]) : 1000000;
+  constexpr std::size_t key_size = 16;
+  const std::string value(100, 'v');
+
+  std::vector<std::string> keys;
+  keys.reserve(key_count);
+  for (std::size_t i = 0; i < key_count; ++i) {
+    keys.push_back(karu::workload::build_key(i, key_size));
+  }
+
+  // the freed memory of the first keydir makes the allocator stall the
+  // second one, so the keydir actually in use is measured first.
+  insert_keydir<karu::keydir_t>(
+      "keydir_" + std::to_string(1 << karu::kKeydirSubmapBits) + "_submaps",
+      keys);
+  insert_keydir<default_keydir_t>("keydir_16_submaps", keys);
+
+  const std::string directory = "./karu_growth_bench";
+  std::filesystem::remove_all(directory);
+  std::filesystem::create_directories(directory);
+  const karu::DBConfig config{
+      .hint_files_ = true,
+      .database_directory_ = directory,
+  };
+
+  {
+    karu::DB db(config);
+    karu::metrics::Histogram histogram;
+    const auto start = Clock::now();
+    for (const auto &key : keys) {
+      const auto before = Clock::now();
+      if (!db.Insert(key, value).ok()) {
+        std::cerr << "insert failed\n";
+        return 1;
+      }
+      histogram.Record(static_cast<std::uint64_t>(
+          std::chrono::nanoseconds(Clock::now() - before).count()));
+    }
+    print("db", histogram, Clock::now() - start);
+  }
+
+  // recovery presizes the keydir from the hint files, so it shouldn't rehash
+  // while they are replayed.
+  {
+    const auto start = Clock::now();
+    karu::DB db(config);
+    const std::chrono::duration<double> took = Clock::now() - start;
+    std::cout << "recovery keys " << db.GetStats().index_size_ << " seconds "
+              << took.count() << '\n';
+  }
+
+  std::filesystem::remove_all(directory);
+  return 0;
+}
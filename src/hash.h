@@ -0,0 +1,113 @@
+#ifndef _KARU_HASH_H
+#define _KARU_HASH_H
+
+#include <absl/base/internal/endian.h>
+#include <absl/strings/string_view.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace karu::hash {
+// Hash64 is a 64-bit hash in the style of wyhash (public domain). It is used
+// for both the keydir and the bloom filters, such that a key only needs to be
+// hashed once per operation. It is much faster than MurmurHash3_x64_128 for
+// short keys, which is what we mostly store.
+namespace internal {
+constexpr std::uint64_t kSecret[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull,
+    0x4d5a2da51de1aa47ull};
+
+inline void Multiply(std::uint64_t &a, std::uint64_t &b) noexcept {
+  __uint128_t r = a;
+  r *= b;
+  a = static_cast<std::uint64_t>(r);
+  b = static_cast<std::uint64_t>(r >> 64);
+}
+
+inline std::uint64_t Mix(std::uint64_t a, std::uint64_t b) noexcept {
+  Multiply(a, b);
+  return a ^ b;
+}
+
+inline std::uint64_t Read8(const std::uint8_t *p) noexcept {
+  return absl::little_endian::Load64(p);
+}
+
+inline std::uint64_t Read4(const std::uint8_t *p) noexcept {
+  return absl::little_endian::Load32(p);
+}
+
+inline std::uint64_t Read3(const std::uint8_t *p, std::size_t k) noexcept {
+  return (static_cast<std::uint64_t>(p[0]) << 16) |
+         (static_cast<std::uint64_t>(p[k >> 1]) << 8) | p[k - 1];
+}
+}  // namespace internal
+
+inline std::uint64_t Hash64(const void *data, std::size_t len,
+                            std::uint64_t seed = 0) noexcept {
+  using namespace internal;
+  const auto *p = static_cast<const std::uint8_t *>(data);
+  seed ^= Mix(seed ^ kSecret[0], kSecret[1]);
+
+  std::uint64_t a = 0;
+  std::uint64_t b = 0;
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (Read4(p) << 32) | Read4(p + ((len >> 3) << 2));
+      b = (Read4(p + len - 4) << 32) | Read4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = Read3(p, len);
+    }
+  } else {
+    std::size_t i = len;
+    if (i > 48) {
+      std::uint64_t see1 = seed;
+      std::uint64_t see2 = seed;
+      do {
+        seed = Mix(Read8(p) ^ kSecret[1], Read8(p + 8) ^ seed);
+        see1 = Mix(Read8(p + 16) ^ kSecret[2], Read8(p + 24) ^ see1);
+        see2 = Mix(Read8(p + 32) ^ kSecret[3], Read8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+
+    while (i > 16) {
+      seed = Mix(Read8(p) ^ kSecret[1], Read8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = Read8(p + i - 16);
+    b = Read8(p + i - 8);
+  }
+
+  a ^= kSecret[1];
+  b ^= seed;
+  Multiply(a, b);
+  return Mix(a ^ kSecret[0] ^ len, b ^ kSecret[1]);
+}
+
+inline std::uint64_t HashKey(absl::string_view key) noexcept {
+  return Hash64(key.data(), key.size());
+}
+
+// hasher and key equality for the keydir. Both are transparent, such that
+// the keydir can be searched with a string_view without building a
+// std::string first.
+struct KeyHash {
+  using is_transparent = void;
+  std::size_t operator()(absl::string_view key) const noexcept {
+    return HashKey(key);
+  }
+};
+
+struct KeyEqual {
+  using is_transparent = void;
+  bool operator()(absl::string_view a, absl::string_view b) const noexcept {
+    return a == b;
+  }
+};
+}  // namespace karu::hash
+
+#endif
@@ -0,0 +1,83 @@
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "hash.h"
+#include "murmurhash3.h"
+
+// compares the in-tree hash with the MurmurHash3 + std::hash combination that
+// the bloom filters and the keydir used before, on typical key sizes.
+static std::vector<std::string> generate_keys(std::size_t count,
+                                              std::size_t size) {
+  const std::string chars =
+      "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+  std::mt19937 generator(42);
+  std::uniform_int_distribution<> distribution(0, chars.size() - 1);
+
+  std::vector<std::string> keys(count);
+  for (auto &key : keys) {
+    key.resize(size);
+    for (auto &c : key) {
+      c = chars[distribution(generator)];
+    }
+  }
+  return keys;
+}
+
+template <typename F>
+static double measure_ns(const std::vector<std::string> &keys, int rounds,
+                         F &&f) {
+  std::uint64_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; ++r) {
+    for (const auto &key : keys) {
+      sink += f(key);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  // make sure the compiler doesn't optimize the hashing away.
+  if (sink == 42) {
+    std::cerr << "";
+  }
+
+  std::chrono::duration<double, std::nano> took = end - start;
+  return took.count() / static_cast<double>(keys.size() * rounds);
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? std::stoi(argv[1]) : 100;
+  constexpr std::size_t key_count = 100000;
+
+  std::cout << "key_size murmur3_128 murmur3_128+std::hash hash64 (ns/key)\n";
+  for (std::size_t size : {5, 10, 16, 32, 64, 128}) {
+    auto keys = generate_keys(key_count, size);
+
+    double murmur = measure_ns(keys, rounds, [](const std::string &key) {
+      std::uint64_t out[2];
+      MurmurHash3_x64_128(key.data(), static_cast<int>(key.size()), 0, out);
+      return out[0];
+    });
+
+    double murmur_and_std =
+        measure_ns(keys, rounds, [](const std::string &key) {
+          std::uint64_t out[2];
+          MurmurHash3_x64_128(key.data(), static_cast<int>(key.size()), 0,
+                              out);
+          return out[0] + std::hash<std::string>{}(key);
+        });
+
+    double hash64 = measure_ns(keys, rounds, [](const std::string &key) {
+      return karu::hash::HashKey(key);
+    });
+
+    std::cout << size << ' ' << murmur << ' ' << murmur_and_std << ' '
+              << hash64 << '\n';
+  }
+
+  return 0;
+}
@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include <algorithm>
 #include <cstring>
 #include <fstream>
 #include <iostream>
@@ -12,17 +13,16 @@
 
 #include "encoder.h"
 #include "file_io.h"
+#include "gc.h"
 #include "karu.h"
 #include "sstable.h"
 
 namespace karu::hint {
 
-#define STRING_TO_SPAN(str)       \
-  absl::Span<const std::uint8_t>{ \
-      reinterpret_cast<const std::uint8_t *>((str).data()), (str).size()};
-
 HintFile::HintFile(const std::string& path) {
-  std::ofstream file{path};
+  // open in append mode so that reopening an existing table doesn't truncate
+  // its hint file.
+  std::ofstream file{path, std::ios::app};
   file.close();
 
   auto status = io::OpenFileWriter(path);
@@ -31,39 +31,67 @@ HintFile::HintFile(const std::string& path) {
   }
   file_writer_ = std::move(*status);
   path_ = path;
+  buffer_.reserve(kHintBufferSize);
+}
+
+HintFile::~HintFile() {
+  if (auto status = Flush(); !status.ok()) {
+    std::cerr << status.message() << '\n';
+  }
 }
 
-absl::Status HintFile::WriteHint(const std::string &key,
-                                 std::uint16_t value_size,
-                                 std::uint32_t pos) noexcept {
+void HintFile::SetMetrics(metrics::Registry *metrics) noexcept {
+  if (file_writer_ != nullptr) {
+    file_writer_->SetMetrics(metrics);
+  }
+}
+
+absl::Status HintFile::WriteHint(absl::string_view key,
+                                 std::uint16_t value_size, std::uint32_t pos,
+                                 absl::string_view value) noexcept {
   if (file_writer_ == nullptr) {
     return absl::InternalError("hint file writer is a nullptr.");
   }
 
-  auto key_span = STRING_TO_SPAN(key);
-
   // we have already made sure that they key is not too long.
-  auto klen = static_cast<std::uint16_t>(key_span.size());
-  std::uint32_t buffer_size = encoder::kHintHeader + klen;
-  std::unique_ptr<std::uint8_t[]> buffer(new std::uint8_t[buffer_size]);
+  auto klen = static_cast<std::uint16_t>(key.size());
+  const std::size_t offset = buffer_.size();
+  buffer_.resize(offset + encoder::kHintHeader);
 
   // set header information
-  encoder::HintHeader header(buffer.get());
+  encoder::HintHeader header(
+      reinterpret_cast<std::uint8_t *>(&buffer_[offset]));
   header.SetPos(pos);
   header.SetKeyLength(klen);
   header.SetValueLength(value_size);
+  buffer_.append(key.data(), klen);
+
+  // small values are stored in the hint as well, such that they can be
+  // inlined into the keydir on startup.
+  if (value_size != encoder::kTombstone && value.size() == value_size &&
+      value_size <= kMaxInlineValueSize) {
+    header.SetInlineValue();
+    buffer_.append(value.data(), value.size());
+  }
 
-  std::cerr << key_span.data() << '\n';
+  if (buffer_.size() >= kHintBufferSize) {
+    return Flush();
+  }
+  return absl::OkStatus();
+}
 
-  // copy the key data into the buffer
-  std::memcpy(&buffer[encoder::kHintHeader], key_span.data(), klen);
+absl::Status HintFile::Flush() noexcept {
+  if (buffer_.empty() || file_writer_ == nullptr) {
+    return absl::OkStatus();
+  }
 
-  // write to the hint file
-  if (auto status = file_writer_->Append({buffer.get(), buffer_size});
-      !status.ok()) {
+  auto status = file_writer_->Append(
+      {reinterpret_cast<const std::uint8_t *>(buffer_.data()), buffer_.size()});
+  buffer_.clear();
+  if (!status.ok()) {
     return status.status();
   }
-  file_writer_->Sync();  // write changes to disk
+  file_writer_->Sync();  // one sync for the whole block of hints
 
   return absl::OkStatus();
 }
@@ -112,16 +140,34 @@ HintFile::BuildSSTableHintFile() noexcept {
 }
 #endif
 
-absl::Status ParseHintFile(
-    const std::string &path, karu::file_id_t file_id,
-    phmap::parallel_flat_hash_map<std::string, DatabaseEntry> &index) noexcept {
+absl::StatusOr<std::uint64_t> ParseHintFile(
+    const std::string &path, karu::file_id_t file_id, keydir_t &index,
+    std::size_t inline_limit, std::uint16_t file_slot, bool keep_tombstones,
+    const io::Throttle &throttle) noexcept {
   std::ifstream file(path, std::ios::binary | std::ios::in);
   if (!file) {
     return absl::InternalError(
         "could not open file stream to hint file: " + path + ".\n");
   }
 
+  // hints of records that garbage collection found dead are skipped, their
+  // values may be holes by now.
+  auto dead = gc::ReadExtents(gc::DeadPath(path));
+  if (!dead.ok()) {
+    return dead.status();
+  }
+
+  std::uint64_t covered = 0;
+  std::uint64_t unthrottled = 0;
+  std::string buffer;
   while (true) {
+    if (throttle && unthrottled >= kHintBufferSize) {
+      if (!throttle(unthrottled)) {
+        return absl::CancelledError("parsing the hint file was cancelled.");
+      }
+      unthrottled = 0;
+    }
+
     // read header and parse hint entry data
     std::uint8_t hint_header[encoder::kHintHeader]{};
     file.read(reinterpret_cast<char *>(hint_header), encoder::kHintHeader);
@@ -135,10 +181,12 @@ absl::Status ParseHintFile(
 
     encoder::HintHeader encoded_header(hint_header);
     auto key_len = encoded_header.KeyLength();
+    const std::size_t value_len =
+        encoded_header.HasInlineValue() ? encoded_header.ValueLength() : 0;
 
-    // parse key
-    std::unique_ptr<std::uint8_t[]> key_buffer(new std::uint8_t[key_len]);
-    file.read(reinterpret_cast<char *>(key_buffer.get()), key_len);
+    // parse the key and the inline value if there is one.
+    buffer.resize(key_len + value_len);
+    file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
     if (file.eof()) {
       break;
     }
@@ -147,20 +195,69 @@ absl::Status ParseHintFile(
       return absl::InternalError("error reading hint file stream.");
     }
 
-    std::string hint_key = reinterpret_cast<char *>(key_buffer.get());
-    std::cerr << "hint key: " << hint_key << ' ' << encoded_header.ValuePos()
-              << ' ' << encoded_header.ValueLength() << '\n';
+    unthrottled += encoder::kHintHeader + buffer.size();
 
-    // sometimes this contains some extra keys. This ensures that
-    // the key is the same length as described.
-    hint_key.resize(key_len);
+    // the keydir is searched with a view of the key, such that a string is
+    // only built for keys that are new.
+    absl::string_view hint_key(buffer.data(), key_len);
+
+    // the position of a tombstone hint is the end of the tombstone record.
+    covered = std::max<std::uint64_t>(
+        covered, encoded_header.ValuePos() + encoded_header.ValueLength());
+    if (!dead->empty() &&
+        gc::Contains(*dead, encoded_header.ValuePos() - encoder::kFullHeader -
+                                key_len)) {
+      continue;
+    }
+    if (encoded_header.IsTombstoneValue() && !keep_tombstones) {
+      index.erase(hint_key);
+      continue;
+    }
 
-    index[hint_key] = DatabaseEntry{
+    auto &entry = index.try_emplace(hint_key).first->second;
+    entry = DatabaseEntry{
         .file_id_ = file_id,
         .pos_ = encoded_header.ValuePos(),
-        .value_size_ = encoded_header.ValueLength(),
+        .value_size_ = encoded_header.IsTombstoneValue()
+                           ? encoder::kTombstone
+                           : encoded_header.ValueLength(),
     };
+    if (encoded_header.HasInlineValue()) {
+      entry.MaybeInline(absl::string_view(buffer).substr(key_len),
+                        inline_limit, file_slot);
+    }
   }
-  return absl::OkStatus();
+  return covered;
+}
+
+std::uint64_t EstimateHintCount(const std::string &path) noexcept {
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file) {
+    return 0;
+  }
+  const auto file_size = static_cast<std::uint64_t>(file.tellg());
+  file.seekg(0);
+
+  std::string sample(std::min<std::uint64_t>(file_size, kHintBufferSize),
+                     '\0');
+  file.read(sample.data(), static_cast<std::streamsize>(sample.size()));
+  std::uint64_t count = 0;
+  std::size_t pos = 0;
+  while (pos + encoder::kHintHeader <= sample.size()) {
+    encoder::HintHeader header(
+        reinterpret_cast<std::uint8_t *>(&sample[pos]));
+    std::size_t size = encoder::kHintHeader + header.KeyLength() +
+                       (header.HasInlineValue() ? header.ValueLength() : 0);
+    if (pos + size > sample.size()) {
+      break;
+    }
+    pos += size;
+    ++count;
+  }
+
+  if (count == 0) {
+    return file_size > 0 ? 1 : 0;
+  }
+  return file_size * count / pos;
 }
 }  // namespace karu
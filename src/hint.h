@@ -2,31 +2,63 @@
 #define _KARU_HINT_H
 
 #include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/string_view.h>
 
 #include <string>
 
 #include "../third_party/parallel_hashmap/phmap.h"
 #include "file_io.h"
+#include "metrics.h"
 #include "types.h"
 
 namespace karu::hint {
+// hints are collected in memory and appended to the file once this many bytes
+// are buffered, when the datafile is rotated or when it is closed.
+constexpr std::size_t kHintBufferSize = 64 * 1024;
+
+// HintFile writes the hints of the active datafile. The hints aren't on the
+// write path of an insert, so the hint file can lag behind its datafile after
+// a crash. ParseHintFile reports how much of the datafile the hints cover and
+// the rest has to be scanned.
 class HintFile {
  public:
   explicit HintFile(const std::string& path);
-  absl::Status WriteHint(const std::string &key, std::uint16_t value_size,
-                         std::uint32_t pos) noexcept;
+  ~HintFile();
+  // value_size can be encoder::kTombstone to mark the key as deleted. value
+  // is stored in the hint if it's at most kMaxInlineValueSize bytes.
+  absl::Status WriteHint(absl::string_view key, std::uint16_t value_size,
+                         std::uint32_t pos,
+                         absl::string_view value = {}) noexcept;
+  // writes the buffered hints into the file.
+  absl::Status Flush() noexcept;
   HintFile &operator=(const HintFile &) = delete;
   HintFile(const HintFile &) = delete;
+  void SetMetrics(metrics::Registry *metrics) noexcept;
 
  private:
   std::string path_;
+  std::string buffer_;
   std::unique_ptr<io::FileWriter> file_writer_ = nullptr;
   std::unique_ptr<io::FileReader> file_reader_ = nullptr;
 };
 
-absl::Status ParseHintFile(
-    const std::string &path, file_id_t sstable_id,
-    phmap::parallel_flat_hash_map<std::string, DatabaseEntry> &index) noexcept;
+// adds the hints at path into index. Values of at most inline_limit bytes that
+// are stored in the hints are inlined into the index, file_slot is the slot of
+// the datafile, see FileSlots. With keep_tombstones a deleted key stays in the
+// index as a tombstone entry. Returns the offset in the datafile up to which
+// the hints cover its records. throttle is called for about every
+// kHintBufferSize bytes that are read, the parse is cancelled once it returns
+// false.
+absl::StatusOr<std::uint64_t> ParseHintFile(
+    const std::string &path, file_id_t sstable_id, keydir_t &index,
+    std::size_t inline_limit = 0, std::uint16_t file_slot = kNoFileSlot,
+    bool keep_tombstones = false,
+    const io::Throttle &throttle = nullptr) noexcept;
+
+// extrapolates the number of hints in the file at path from the ones in its
+// first kHintBufferSize bytes. Returns 0 if the file can't be read.
+std::uint64_t EstimateHintCount(const std::string &path) noexcept;
 }  // namespace karu
 
 #endif
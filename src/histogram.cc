@@ -0,0 +1,118 @@
+#include "histogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace karu::metrics {
+// there is only one writer, so the counters are updated with a plain load and
+// store instead of a locked read-modify-write.
+static inline void add_relaxed(std::atomic<std::uint64_t> &counter,
+                               std::uint64_t value) noexcept {
+  counter.store(counter.load(std::memory_order_relaxed) + value,
+                std::memory_order_relaxed);
+}
+
+std::size_t Histogram::BucketIndex(std::uint64_t value) noexcept {
+  if (value < kSubBucketCount) {
+    return value;
+  }
+
+  const int msb = 63 - __builtin_clzll(value);
+  const int shift = msb - kSubBucketBits;
+  return (shift + 1) * kSubBucketCount + ((value >> shift) - kSubBucketCount);
+}
+
+std::uint64_t Histogram::BucketLowerBound(std::size_t index) noexcept {
+  if (index < kSubBucketCount) {
+    return index;
+  }
+
+  const std::size_t shift = index / kSubBucketCount - 1;
+  return (index % kSubBucketCount + kSubBucketCount) << shift;
+}
+
+void Histogram::Record(std::uint64_t value) noexcept {
+  add_relaxed(counts_[BucketIndex(value)], 1);
+  add_relaxed(count_, 1);
+  add_relaxed(sum_, value);
+  if (value < min_.load(std::memory_order_relaxed)) {
+    min_.store(value, std::memory_order_relaxed);
+  }
+  if (value > max_.load(std::memory_order_relaxed)) {
+    max_.store(value, std::memory_order_relaxed);
+  }
+}
+
+void Histogram::Merge(const Histogram &other) noexcept {
+  for (std::size_t i = 0; i < kBucketCount; ++i) {
+    add_relaxed(counts_[i], other.counts_[i].load(std::memory_order_relaxed));
+  }
+  add_relaxed(count_, other.Count());
+  add_relaxed(sum_, other.sum_.load(std::memory_order_relaxed));
+  // the raw minimum of an empty histogram is UINT64_MAX, unlike Min().
+  min_.store(std::min(min_.load(std::memory_order_relaxed),
+                      other.min_.load(std::memory_order_relaxed)),
+             std::memory_order_relaxed);
+  max_.store(std::max(Max(), other.Max()), std::memory_order_relaxed);
+}
+
+void Histogram::Reset() noexcept {
+  for (auto &count : counts_) {
+    count.store(0, std::memory_order_relaxed);
+  }
+  count_.store(0, std::memory_order_relaxed);
+  sum_.store(0, std::memory_order_relaxed);
+  min_.store(UINT64_MAX, std::memory_order_relaxed);
+  max_.store(0, std::memory_order_relaxed);
+}
+
+std::uint64_t Histogram::Count() const noexcept {
+  return count_.load(std::memory_order_relaxed);
+}
+
+std::uint64_t Histogram::Min() const noexcept {
+  return Count() == 0 ? 0 : min_.load(std::memory_order_relaxed);
+}
+
+std::uint64_t Histogram::Max() const noexcept {
+  return max_.load(std::memory_order_relaxed);
+}
+
+std::uint64_t Histogram::Sum() const noexcept {
+  return sum_.load(std::memory_order_relaxed);
+}
+
+double Histogram::Mean() const noexcept {
+  const std::uint64_t count = Count();
+  if (count == 0) {
+    return 0;
+  }
+  return static_cast<double>(sum_.load(std::memory_order_relaxed)) /
+         static_cast<double>(count);
+}
+
+std::uint64_t Histogram::Percentile(double percentile) const noexcept {
+  const std::uint64_t count = Count();
+  if (count == 0) {
+    return 0;
+  }
+
+  percentile = std::clamp(percentile, 0.0, 100.0);
+  auto target = static_cast<std::uint64_t>(
+      std::ceil(percentile / 100.0 * static_cast<double>(count)));
+  target = std::max<std::uint64_t>(target, 1);
+
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < kBucketCount; ++i) {
+    seen += counts_[i].load(std::memory_order_relaxed);
+    if (seen >= target) {
+      // report the highest value that falls into the bucket.
+      std::uint64_t value = i + 1 < kBucketCount ? BucketLowerBound(i + 1) - 1
+                                                 : UINT64_MAX;
+      return std::clamp(value, Min(), Max());
+    }
+  }
+
+  return Max();
+}
+}  // namespace karu::metrics
@@ -0,0 +1,53 @@
+#ifndef _KARU_HISTOGRAM_H
+#define _KARU_HISTOGRAM_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace karu::metrics {
+// values below 2^kSubBucketBits are stored exactly, larger values are stored
+// in 2^kSubBucketBits linear buckets per power of two. This bounds the
+// relative error of any recorded value to about 1.6%.
+constexpr int kSubBucketBits = 6;
+constexpr std::size_t kSubBucketCount = std::size_t{1} << kSubBucketBits;
+constexpr std::size_t kBucketCount =
+    (64 - kSubBucketBits + 1) * kSubBucketCount;
+
+// Histogram is a log-linear (HDR-style) histogram for latencies. Record is not
+// synchronized with other calls to Record, so every writer thread should have
+// its own histogram. Reading from other threads while recording is safe and
+// the histograms can be combined with Merge.
+class Histogram {
+ public:
+  Histogram() = default;
+  Histogram &operator=(const Histogram &) = delete;
+  Histogram(const Histogram &) = delete;
+
+  void Record(std::uint64_t value) noexcept;
+  void Merge(const Histogram &other) noexcept;
+  void Reset() noexcept;
+
+  [[nodiscard]] std::uint64_t Count() const noexcept;
+  [[nodiscard]] std::uint64_t Min() const noexcept;
+  [[nodiscard]] std::uint64_t Max() const noexcept;
+  [[nodiscard]] double Mean() const noexcept;
+  // the sum of all recorded values.
+  [[nodiscard]] std::uint64_t Sum() const noexcept;
+  // returns the value at the given percentile in the range [0, 100].
+  [[nodiscard]] std::uint64_t Percentile(double percentile) const noexcept;
+
+ private:
+  static std::size_t BucketIndex(std::uint64_t value) noexcept;
+  static std::uint64_t BucketLowerBound(std::size_t index) noexcept;
+
+  std::array<std::atomic<std::uint64_t>, kBucketCount> counts_{};
+  std::atomic<std::uint64_t> count_{0};
+  std::atomic<std::uint64_t> sum_{0};
+  std::atomic<std::uint64_t> min_{UINT64_MAX};
+  std::atomic<std::uint64_t> max_{0};
+};
+}  // namespace karu::metrics
+
+#endif
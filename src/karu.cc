@@ -4,38 +4,85 @@
 #include <absl/synchronization/mutex.h>
 
 #include <algorithm>
+#include <climits>
 #include <cstdio>
+#include <cstring>
 #include <filesystem>
+#include <fstream>
+#include <limits>
 #include <memory>
-#include <thread>
+#include <vector>
 
+#include "encoder.h"
+#include "hash.h"
 #include "hint.h"
+#include "record_scanner.h"
+#include "snapshot.h"
 #include "sstable.h"
+#include "trace.h"
 #include "types.h"
 #include "utils.h"
 
 namespace karu {
-DB::DB(absl::string_view directory) {
-  database_directory_ = directory;
+DB::DB(absl::string_view directory)
+    : DB(DBConfig{
+          .hint_files_ = false,
+          .database_directory_ = std::string(directory),
+      }) {}
 
-  auto status = InitializeSSTables();
-  if (!status.ok()) {
-    std::cerr << "error parsing sstables\n";
+DB::DB(const DBConfig &conf) : config_(conf) {
+  database_directory_ = conf.database_directory_;
+  if (conf.background_io_rate_ > 0) {
+    limiter_ = std::make_unique<io::RateLimiter>(
+        conf.background_io_rate_,
+        std::chrono::microseconds(conf.background_io_target_latency_us_),
+        &metrics_);
   }
+  executor_ = std::make_unique<Executor>(conf.background_threads_);
 
-  auto id = utils::generate_file_id();
-  std::string sstable_string =
-      database_directory_ + "/" + std::to_string(id) + sstable_file_suffix;
-  current_sstable_ = std::make_unique<sstable::SSTable>(sstable_string, id);
-  if (status = current_sstable_->InitWriterAndReader(); !status.ok()) {
-    std::cerr << "could not initialize writer and reader\n";
+  bool loaded = false;
+  if (conf.read_only_) {
+    if (auto status = LoadFrozen(); status.ok()) {
+      loaded = true;
+    } else if (!absl::IsNotFound(status)) {
+      std::cerr << "not using the frozen keydir: " << status.message()
+                << '\n';
+      datafiles_.clear();
+    }
   }
-}
 
-DB::DB(const DBConfig &conf) {
-  database_directory_ = conf.database_directory_;
+  const bool use_mapped = conf.mapped_keydir_ && !conf.read_only_;
+  if (!loaded && use_mapped) {
+    if (auto status = LoadMapped(); status.ok()) {
+      loaded = true;
+    } else {
+      if (!absl::IsNotFound(status)) {
+        std::cerr << "rebuilding the mapped keydir: " << status.message()
+                  << '\n';
+      }
+      datafiles_.clear();
+    }
+  }
 
-  if (conf.hint_files_) {
+  if (!loaded && conf.keydir_snapshot_) {
+    if (auto status = LoadSnapshot(); status.ok()) {
+      loaded = true;
+    } else if (!absl::IsNotFound(status)) {
+      std::cerr << "error loading keydir snapshot: " << status.message()
+                << '\n';
+      index_.clear();
+      datafiles_.clear();
+    }
+  }
+
+  if (loaded) {
+    // the snapshot already contains everything we need.
+  } else if (conf.background_load_ && !use_mapped) {
+    if (auto status = StartBackgroundLoad(); !status.ok()) {
+      std::cerr << "error starting the background load: " << status.message()
+                << '\n';
+    }
+  } else if (conf.hint_files_) {
     if (auto status = ParseHintFiles(); !status.ok()) {
       std::cerr << "error parsing hint files: " << status.message() << '\n';
     }
@@ -45,18 +92,90 @@ DB::DB(const DBConfig &conf) {
     }
   }
 
-  auto id = utils::generate_file_id();
-  std::string sstable_string =
-      database_directory_ + "/" + std::to_string(id) + sstable_file_suffix;
-  current_sstable_ = std::make_unique<sstable::SSTable>(sstable_string, id);
-  if (auto status = current_sstable_->InitWriterAndReader(); !status.ok()) {
-    std::cerr << "could not initialize writer and reader\n";
+  if (use_mapped && mapped_ == nullptr) {
+    if (auto status = BuildMapped(); !status.ok()) {
+      std::cerr << "error building the mapped keydir: " << status.message()
+                << '\n';
+    }
+  }
+
+  if (!conf.read_only_) {
+    auto id = NextFileId();
+    std::string sstable_string =
+        database_directory_ + "/" + std::to_string(id) + sstable_file_suffix;
+    current_sstable_ = MakeTable(sstable_string, id);
+    if (auto status = current_sstable_->InitWriterAndReader(); !status.ok()) {
+      std::cerr << "could not initialize writer and reader\n";
+    }
+  }
+
+  if (conf.track_access_ && !conf.read_only_) {
+    access_ = std::make_unique<access::AccessTracker>(kAccessSketchWidth);
+  }
+
+  if (!conf.capture_path_.empty()) {
+    if (auto writer = capture::Writer::Open(conf.capture_path_,
+                                            conf.capture_hash_keys_);
+        writer.ok()) {
+      capture_ = *std::move(writer);
+    } else {
+      std::cerr << "error opening capture: " << writer.status().message()
+                << '\n';
+    }
+  }
+
+  // the active table exists by now, so live writes are newer than every file
+  // that is loaded.
+  if (!Ready()) {
+    ScheduleLoad();
+  }
+
+  if (conf.checkpoint_interval_ > 0 && !conf.read_only_ &&
+      mapped_ == nullptr) {
+    ScheduleCheckpoint();
+  }
+}
+
+DB::~DB() {
+  // drops the jobs that haven't started and waits for the running ones.
+  executor_->Shutdown();
+
+  // nothing is written into the active table anymore, so the snapshot can
+  // cover it as well.
+  if (mapped_ != nullptr) {
+    if (auto status = mapped_->Close(DatafileCoverage()); !status.ok()) {
+      std::cerr << "error closing the mapped keydir: " << status.message()
+                << '\n';
+    }
+  } else if (config_.keydir_snapshot_ && !config_.read_only_ && Ready()) {
+    if (auto status = WriteSnapshot(true); !status.ok()) {
+      std::cerr << "error writing keydir snapshot: " << status.message()
+                << '\n';
+    }
   }
 }
 
 absl::Status DB::InitializeSSTables() noexcept {
-  for (const auto &entry :
-       std::filesystem::directory_iterator(database_directory_)) {
+  // the files have to be replayed oldest first, such that newer values and
+  // tombstones win.
+  std::vector<std::filesystem::directory_entry> entries(
+      std::filesystem::directory_iterator(database_directory_), {});
+  std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b) {
+    return *utils::parse_file_id(a.path().string()) <
+           *utils::parse_file_id(b.path().string());
+  });
+
+  // the keydir is sized for all entries up front, such that it doesn't have
+  // to rehash while the files are replayed.
+  std::uint64_t estimate = 0;
+  for (const auto &entry : entries) {
+    if (entry.path().extension() == ".data") {
+      estimate += EstimateEntries(entry.path());
+    }
+  }
+  index_.reserve(estimate);
+
+  for (const auto &entry : entries) {
     // parse sstable id from filename
     std::string filename = entry.path().filename();
     if (entry.path().extension() != ".data") {
@@ -69,50 +188,194 @@ absl::Status DB::InitializeSSTables() noexcept {
       continue;
     }
 
-    auto sstable = std::make_unique<sstable::SSTable>(entry.path(), *id);
+    auto sstable = MakeTable(entry.path(), *id);
 
     auto status = sstable->InitOnlyReader();
     if (!status.ok()) {
       return status;
     }
 
-    status = sstable->AddEntriesToIndex(index_);
+    status = sstable->AddEntriesToIndex(index_, 0,
+                                        config_.inline_value_size_);
     datafiles_[*id] = std::move(sstable);
   }
 
   return absl::OkStatus();
 }
 
-absl::StatusOr<std::string> DB::Get(const std::string &key) noexcept {
-  if (!index_.contains(key)) {
+absl::Status DB::Lookup(absl::string_view key,
+                        DatabaseEntry &entry) noexcept {
+  // the key is hashed only once and the hash is reused for the lookup.
+  KARU_TRACE_SCOPE("DB::Get/index");
+  if (frozen_ != nullptr) {
+    if (!frozen_->Find(key, entry)) {
+      if (capture_ != nullptr) {
+        capture_->Record(capture::Op::kGetMiss, key, 0);
+      }
+      return absl::NotFoundError("coult not find key in index");
+    }
+    if (capture_ != nullptr) {
+      capture_->Record(capture::Op::kGet, key, entry.value_size_);
+    }
+    return absl::OkStatus();
+  }
+
+  const std::uint64_t raw_hash = hash::HashKey(key);
+  const std::size_t key_hash = KeydirHash(raw_hash);
+  if (!Ready()) {
+    LoadKey(key, raw_hash);
+  }
+  if (access_ != nullptr && access::AccessTracker::Sample()) {
+    access_->RecordGet(key_hash);
+  }
+
+  index_mutex_.ReaderLock();
+  bool found = false;
+  if (mapped_ != nullptr) {
+    found = mapped_->Find(key, key_hash, entry);
+  } else if (auto it = index_.find(key, key_hash);
+             it != index_.end() && !it->second.Tombstone()) {
+    entry = it->second;
+    found = true;
+  }
+  index_mutex_.ReaderUnlock();
+  if (!found) {
+    if (capture_ != nullptr) {
+      capture_->Record(capture::Op::kGetMiss, key, 0);
+    }
     return absl::NotFoundError("coult not find key in index");
   }
+  if (capture_ != nullptr) {
+    capture_->Record(capture::Op::kGet, key, entry.value_size_);
+  }
+  return absl::OkStatus();
+}
 
-  const auto &value = index_[key];
-  sstable_mutex_.ReaderLock();
-  if (value.file_id_ == current_sstable_->ID()) {
-    auto status = current_sstable_->Find(value.value_size_, value.pos_);
-    if (!status.ok()) {
-      sstable_mutex_.ReaderUnlock();
+absl::Status DB::ReadValue(const DatabaseEntry &entry,
+                           absl::Span<std::uint8_t> out) noexcept {
+  if (entry.Inline()) {
+    std::memcpy(out.data(), entry.inline_value_, entry.value_size_);
+    return absl::OkStatus();
+  }
+
+  io::ForegroundScope foreground(limiter_.get());
+  absl::ReaderMutexLock guard(&sstable_mutex_);
+  auto *table = FindTable(entry.file_id_);
+  if (table == nullptr) {
+    return absl::UnavailableError("datafile was removed.");
+  }
+
+  return table->Read(entry.pos_, out);
+}
+
+template <typename Read>
+absl::Status DB::LookupAndRead(absl::string_view key, Read &&read) noexcept {
+  // garbage collection points the keydir at the moved records before it
+  // removes a datafile, so a fresh lookup finds the value again. An entry
+  // that still points at the missing datafile is broken, not moved.
+  DatabaseEntry previous{};
+  for (bool retry = false;; retry = true) {
+    DatabaseEntry entry{};
+    if (auto status = Lookup(key, entry); !status.ok()) {
+      return status;
+    }
+    if (retry && entry.file_id_ == previous.file_id_ &&
+        entry.pos_ == previous.pos_) {
+      return absl::InternalError("invalid file id.");
+    }
+    if (auto status = read(entry); !absl::IsUnavailable(status)) {
       return status;
     }
+    previous = entry;
   }
-  sstable_mutex_.ReaderUnlock();
+}
 
-  if (!datafiles_.contains(value.file_id_)) {
-    std::cerr << "could not find datafile: " << value.file_id_ << '\n';
-    for (const auto &entry : datafiles_) {
-      std::cerr << "found datafile: " << entry.first << '\n';
+absl::StatusOr<std::string> DB::Get(absl::string_view key) noexcept {
+  metrics::ScopedLatency latency(&metrics_, metrics::kGetLatency);
+  KARU_TRACE_SCOPE("DB::Get");
+  std::string value;
+  auto status = LookupAndRead(key, [&](const DatabaseEntry &entry) {
+    value.assign(entry.value_size_, '\0');
+    auto *data = reinterpret_cast<std::uint8_t *>(value.data());
+    return ReadValue(entry, {data, value.size()});
+  });
+  if (!status.ok()) {
+    return status;
+  }
+  return value;
+}
+
+absl::StatusOr<std::uint16_t> DB::Get(absl::string_view key,
+                                      absl::Span<std::uint8_t> out) noexcept {
+  metrics::ScopedLatency latency(&metrics_, metrics::kGetLatency);
+  KARU_TRACE_SCOPE("DB::Get");
+  std::uint16_t size = 0;
+  auto status = LookupAndRead(key, [&](const DatabaseEntry &entry) {
+    if (entry.value_size_ > out.size()) {
+      return absl::ResourceExhaustedError("value does not fit into buffer.");
     }
-    return absl::InternalError("invalid file id.");
+    size = entry.value_size_;
+    return ReadValue(entry, out.first(size));
+  });
+  if (!status.ok()) {
+    return status;
   }
+  return size;
+}
 
-  return datafiles_[value.file_id_]->Find(value.value_size_, value.pos_);
+absl::StatusOr<absl::string_view> DB::Get(
+    absl::string_view key, std::pmr::memory_resource &arena) noexcept {
+  metrics::ScopedLatency latency(&metrics_, metrics::kGetLatency);
+  KARU_TRACE_SCOPE("DB::Get");
+  absl::string_view value;
+  auto status = LookupAndRead(key, [&](const DatabaseEntry &entry) {
+    // values are plain bytes, so they don't need any alignment.
+    auto *data =
+        static_cast<std::uint8_t *>(arena.allocate(entry.value_size_, 1));
+    value = {reinterpret_cast<const char *>(data), entry.value_size_};
+    return ReadValue(entry, {data, entry.value_size_});
+  });
+  if (!status.ok()) {
+    return status;
+  }
+  return value;
+}
+
+absl::Status DB::Insert(absl::string_view key,
+                        absl::string_view value) noexcept {
+  return InsertKey(key, value);
 }
 
-absl::Status DB::Insert(const std::string &key,
-                        const std::string &value) noexcept {
+absl::Status DB::Insert(std::string &&key, absl::string_view value) noexcept {
+  return InsertKey(std::move(key), value);
+}
+
+template <typename Key>
+absl::Status DB::InsertKey(Key &&key, absl::string_view value) noexcept {
+  if (config_.read_only_) {
+    return absl::FailedPreconditionError("database is read-only.");
+  }
+  if (key.size() > kMaxKeySize) {
+    return absl::InvalidArgumentError("key is too large.");
+  }
+  metrics::ScopedLatency latency(&metrics_, metrics::kInsertLatency);
+  KARU_TRACE_SCOPE("DB::Insert");
+  const std::size_t key_hash = index_.hash(key);
+
+  KARU_TRACE_BEGIN(lock_span, "DB::Insert/lock");
   sstable_mutex_.WriterLock();
+  KARU_TRACE_END(lock_span);
+  // every Put of the mapped keydir happens under sstable_mutex_, so the
+  // reserved room is still there once the record is written.
+  if (mapped_ != nullptr) {
+    index_mutex_.WriterLock();
+    auto reserved = mapped_->Reserve(1, key.size());
+    index_mutex_.WriterUnlock();
+    if (!reserved.ok()) {
+      sstable_mutex_.WriterUnlock();
+      return reserved;
+    }
+  }
   auto status = current_sstable_->Insert(key, value);
   if (!status.ok()) {
     sstable_mutex_.WriterUnlock();
@@ -121,49 +384,1392 @@ absl::Status DB::Insert(const std::string &key,
 
   std::uint32_t file_pos = *status;
   file_id_t id = current_sstable_->ID();
-  sstable_mutex_.WriterUnlock();
+  // recorded before the key may be moved into the index.
+  if (capture_ != nullptr) {
+    capture_->Record(capture::Op::kInsert, key,
+                     static_cast<std::uint16_t>(value.size()));
+  }
 
-  index_mutex_.WriterLock();
-  index_[key] = {
-      .file_id_ = current_sstable_->ID(),
+  // the index is updated before releasing the table such that the entry is in
+  // the index once the table is rotated. Checkpoints rely on this. The key is
+  // only copied or moved into the index if it is new.
+  KARU_TRACE_BEGIN(index_span, "DB::Insert/index");
+  const DatabaseEntry location{
+      .file_id_ = id,
       .pos_ = file_pos,
       .value_size_ = static_cast<std::uint16_t>(value.size()),
   };
+  absl::Status result;
+  index_mutex_.WriterLock();
+  if (mapped_ != nullptr) {
+    result = mapped_->Put(key, key_hash, location);
+  } else {
+    auto &entry =
+        index_.try_emplace_with_hash(key_hash, std::forward<Key>(key))
+            .first->second;
+    entry = location;
+    entry.MaybeInline(value, config_.inline_value_size_,
+                      current_sstable_->FileSlot());
+  }
   index_mutex_.WriterUnlock();
+  KARU_TRACE_END(index_span);
+  sstable_mutex_.WriterUnlock();
+  return result;
+}
+
+absl::Status DB::InsertBatch(
+    absl::Span<const std::pair<absl::string_view, absl::string_view>>
+        pairs) noexcept {
+  if (config_.read_only_) {
+    return absl::FailedPreconditionError("database is read-only.");
+  }
+  if (pairs.empty()) {
+    return absl::OkStatus();
+  }
+  for (const auto &[key, value] : pairs) {
+    if (key.size() > kMaxKeySize) {
+      return absl::InvalidArgumentError("key is too large.");
+    }
+  }
+  metrics::ScopedLatency latency(&metrics_, metrics::kInsertLatency);
+  KARU_TRACE_SCOPE("DB::InsertBatch");
+
+  absl::WriterMutexLock table_lock(&sstable_mutex_);
+  // see InsertKey, none of the records are written unless all of their keys
+  // fit into the mapped keydir.
+  if (mapped_ != nullptr) {
+    std::uint64_t key_bytes = 0;
+    for (const auto &[key, value] : pairs) {
+      key_bytes += key.size();
+    }
+    absl::WriterMutexLock index_lock(&index_mutex_);
+    if (auto status = mapped_->Reserve(pairs.size(), key_bytes);
+        !status.ok()) {
+      return status;
+    }
+  }
+  auto status = current_sstable_->InsertBatch(pairs);
+  if (!status.ok()) {
+    return status.status();
+  }
+
+  file_id_t id = current_sstable_->ID();
+  absl::Status result;
+  absl::WriterMutexLock index_lock(&index_mutex_);
+  for (std::size_t i = 0; i < pairs.size(); ++i) {
+    const DatabaseEntry location{
+        .file_id_ = id,
+        .pos_ = (*status)[i],
+        .value_size_ = static_cast<std::uint16_t>(pairs[i].second.size()),
+    };
+    if (mapped_ != nullptr) {
+      // the records are written, so the rest of them is still indexed.
+      auto put = mapped_->Put(pairs[i].first, index_.hash(pairs[i].first),
+                              location);
+      if (result.ok()) {
+        result = put;
+      }
+      continue;
+    }
+    auto &entry = index_.try_emplace(pairs[i].first).first->second;
+    entry = location;
+    entry.MaybeInline(pairs[i].second, config_.inline_value_size_,
+                      current_sstable_->FileSlot());
+  }
+
+  if (capture_ != nullptr) {
+    for (const auto &[key, value] : pairs) {
+      capture_->Record(capture::Op::kInsert, key,
+                       static_cast<std::uint16_t>(value.size()));
+    }
+  }
+
+  return result;
+}
+
+absl::Status DB::Delete(absl::string_view key) noexcept {
+  if (config_.read_only_) {
+    return absl::FailedPreconditionError("database is read-only.");
+  }
+  const std::uint64_t raw_hash = hash::HashKey(key);
+  const std::size_t key_hash = KeydirHash(raw_hash);
+  if (!Ready()) {
+    LoadKey(key, raw_hash);
+  }
+  if (capture_ != nullptr) {
+    capture_->Record(capture::Op::kDelete, key, 0);
+  }
+
+  absl::WriterMutexLock table_lock(&sstable_mutex_);
+  {
+    absl::ReaderMutexLock index_lock(&index_mutex_);
+    DatabaseEntry entry;
+    bool found = false;
+    if (mapped_ != nullptr) {
+      found = mapped_->Find(key, key_hash, entry);
+    } else if (auto it = index_.find(key, key_hash); it != index_.end()) {
+      found = !it->second.Tombstone();
+    }
+    if (!found) {
+      return absl::NotFoundError("key not found");
+    }
+  }
 
+  if (auto status = current_sstable_->Delete(key); !status.ok()) {
+    return status;
+  }
+
+  absl::WriterMutexLock index_lock(&index_mutex_);
+  if (mapped_ != nullptr) {
+    mapped_->Erase(key, key_hash);
+  } else if (!Ready()) {
+    // a file that is still loading must not bring the key back.
+    index_.try_emplace_with_hash(key_hash, key).first->second = DatabaseEntry{
+        .file_id_ = current_sstable_->ID(),
+        .pos_ = 0,
+        .value_size_ = encoder::kTombstone,
+    };
+  } else if (auto it = index_.find(key, key_hash); it != index_.end()) {
+    index_.erase(it);
+  }
   return absl::OkStatus();
 }
 
+std::uint64_t DB::Scan(std::uint64_t cursor, std::size_t count,
+                       std::vector<std::string> &keys) noexcept {
+  absl::ReaderMutexLock lock(&index_mutex_);
+  if (mapped_ != nullptr) {
+    return mapped_->Scan(cursor, count, keys);
+  }
+
+  // the cursor is the submap in the high bits and the slot in it in the low
+  // ones, so every call resumes where the last one stopped. phmap can't do
+  // that on its own, see third_party/parallel_hashmap/patches.
+  std::size_t submap = cursor >> kScanSlotBits;
+  std::size_t slot = cursor & kScanSlotMask;
+  std::size_t added = 0;
+  while (submap < index_.subcnt() && added < count) {
+    bool more = false;
+    index_.with_submap(submap, [&](const auto &set) {
+      auto it = set.iterator_from(slot);
+      for (; it != set.end() && added < count; ++it) {
+        if (!it->second.Tombstone()) {
+          keys.push_back(it->first);
+          ++added;
+        }
+      }
+      if (it != set.end()) {
+        more = true;
+        slot = set.slot_index(it);
+      }
+    });
+    if (more) {
+      return (std::uint64_t{submap} << kScanSlotBits) | slot;
+    }
+    ++submap;
+    slot = 0;
+  }
+  return submap < index_.subcnt() ? std::uint64_t{submap} << kScanSlotBits
+                                  : 0;
+}
+
 absl::Status DB::ParseHintFiles() noexcept {
   // find all hint files
   auto hint_files = utils::files_with_extension(".hnt", database_directory_);
 
   // we want to sort the file paths such that oldest tables first.
   std::sort(hint_files.begin(), hint_files.end());
+  std::uint64_t estimate = 0;
   for (const auto &path : hint_files) {
-    auto status = utils::parse_file_id(path);
-    if (!status.ok()) {
+    estimate += hint::EstimateHintCount(path);
+  }
+  index_.reserve(estimate);
+
+  for (const auto &path : hint_files) {
+    auto id = utils::parse_file_id(path);
+    if (!id.ok()) {
+      continue;
+    }
+
+    auto covered =
+        hint::ParseHintFile(path, *id, index_, config_.inline_value_size_,
+                            InlineSlot(*id));
+    if (!covered.ok()) {
+      continue;
+    }
+
+    // the hint file only contains the positions, we still need a reader for
+    // the datafile itself.
+    std::string sstable_path = path.substr(0, path.size() - 3) + "data";
+    auto sstable = MakeTable(sstable_path, *id);
+    if (auto status = sstable->InitOnlyReader(); !status.ok()) {
+      return status;
+    }
+
+    // the hints are written lazily, so the end of the datafile may not have
+    // made it into the hint file before a crash.
+    if (auto status = sstable->AddEntriesToIndex(index_, *covered,
+                                                 config_.inline_value_size_);
+        !status.ok()) {
+      return status;
+    }
+    datafiles_[*id] = std::move(sstable);
+  }
+
+  return absl::OkStatus();
+}
+
+std::unique_ptr<sstable::SSTable> DB::MakeTable(const std::string &path,
+                                                file_id_t id) noexcept {
+  auto sstable = std::make_unique<sstable::SSTable>(path, id);
+  sstable->SetMetrics(&metrics_);
+  sstable->SetFileSlot(InlineSlot(id));
+  return sstable;
+}
+
+std::uint16_t DB::InlineSlot(file_id_t id) noexcept {
+  return config_.inline_value_size_ > 0 ? file_slots_.Acquire(id)
+                                        : kNoFileSlot;
+}
+
+metrics::Stats DB::GetStats() noexcept {
+  metrics::Stats stats = metrics_.Collect();
+
+  index_mutex_.ReaderLock();
+  if (frozen_ != nullptr) {
+    stats.index_size_ = frozen_->Size();
+  } else if (mapped_ != nullptr) {
+    stats.index_size_ = mapped_->Size();
+  } else {
+    stats.index_size_ = index_.size();
+  }
+  index_mutex_.ReaderUnlock();
+
+  load_mutex_.Lock();
+  stats.pending_files_ = pending_.size();
+  load_mutex_.Unlock();
+  stats.background_io_rate_ = limiter_ != nullptr ? limiter_->Rate() : 0;
+  stats.jobs_ = executor_->Accounting();
+
+  absl::ReaderMutexLock guard(&sstable_mutex_);
+  stats.datafile_count_ =
+      datafiles_.size() + (current_sstable_ != nullptr ? 1 : 0);
+  return stats;
+}
+
+sstable::SSTable *DB::FindTable(file_id_t id) noexcept {
+  if (current_sstable_ != nullptr && current_sstable_->ID() == id) {
+    return current_sstable_.get();
+  }
+
+  auto it = datafiles_.find(id);
+  if (it == datafiles_.end()) {
+    return nullptr;
+  }
+  return it->second.get();
+}
+
+absl::Status DB::MultiGet(absl::Span<const std::string> keys,
+                          absl::Span<std::uint8_t> buffer,
+                          absl::Span<MultiGetResult> results) noexcept {
+  if (results.size() < keys.size()) {
+    return absl::InvalidArgumentError("results span is smaller than keys.");
+  }
+
+  struct PendingRead {
+    DatabaseEntry entry_;
+    std::size_t index_;  // index of the key in keys and results.
+  };
+
+  // resolve all of the index entries first such that we can order the reads.
+  // the values are placed into the buffer in the same order as the keys.
+  std::vector<PendingRead> reads;
+  reads.reserve(keys.size());
+  std::uint64_t buffer_size = 0;
+
+  // every key is hashed once, the loads, the access sketch, the prefetches
+  // and the lookups all share it.
+  std::vector<std::uint64_t> hashes(keys.size());
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    const std::uint64_t raw_hash = hash::HashKey(keys[i]);
+    if (!Ready()) {
+      LoadKey(keys[i], raw_hash);
+    }
+    hashes[i] = KeydirHash(raw_hash);
+  }
+  if (access_ != nullptr && access::AccessTracker::Sample()) {
+    access_->RecordBatch(hashes);
+  }
+
+  index_mutex_.ReaderLock();
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    if (i + kMultiGetPrefetchDistance < keys.size()) {
+      index_.prefetch_hash(hashes[i + kMultiGetPrefetchDistance]);
+    }
+
+    // the entry is copied, frozen entries only exist on the stack.
+    DatabaseEntry entry{};
+    bool found = false;
+    if (frozen_ != nullptr) {
+      found = frozen_->Find(keys[i], entry);
+    } else if (mapped_ != nullptr) {
+      found = mapped_->Find(keys[i], hashes[i], entry);
+    } else if (auto it = index_.find(keys[i], hashes[i]);
+               it != index_.end() && !it->second.Tombstone()) {
+      entry = it->second;
+      found = true;
+    }
+    if (!found) {
+      results[i] = {
+          .status_ = absl::NotFoundError("could not find key in index"),
+          .offset_ = static_cast<std::uint32_t>(buffer_size),
+          .size_ = 0,
+      };
       continue;
     }
 
-    status = hint::ParseHintFile(path, *status, index_);
+    results[i] = {
+        .status_ = absl::OkStatus(),
+        .offset_ = static_cast<std::uint32_t>(buffer_size),
+        .size_ = entry.value_size_,
+    };
+    reads.push_back({.entry_ = entry, .index_ = i});
+    buffer_size += entry.value_size_;
+  }
+  index_mutex_.ReaderUnlock();
+
+  if (capture_ != nullptr) {
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+      if (results[i].status_.ok()) {
+        capture_->Record(capture::Op::kGet, keys[i], results[i].size_);
+      } else {
+        capture_->Record(capture::Op::kGetMiss, keys[i], 0);
+      }
+    }
+  }
+
+  if (buffer_size > buffer.size()) {
+    return absl::ResourceExhaustedError("buffer is too small for the values.");
+  }
+
+  // inlined values are copied from the index, the rest is read from disk.
+  reads.erase(std::remove_if(reads.begin(), reads.end(),
+                             [&](const PendingRead &read) {
+                               if (!read.entry_.Inline()) {
+                                 return false;
+                               }
+                               const auto &result = results[read.index_];
+                               std::memcpy(&buffer[result.offset_],
+                                           read.entry_.inline_value_,
+                                           result.size_);
+                               return true;
+                             }),
+              reads.end());
+
+  std::sort(reads.begin(), reads.end(),
+            [](const PendingRead &a, const PendingRead &b) {
+              if (a.entry_.file_id_ != b.entry_.file_id_) {
+                return a.entry_.file_id_ < b.entry_.file_id_;
+              }
+              return a.entry_.pos_ < b.entry_.pos_;
+            });
+
+  // the bytes between two values are read into this and then discarded.
+  static thread_local std::uint8_t gap_buffer[kMultiGetMaxGap];
+  std::vector<::iovec> iov;
+
+  io::ForegroundScope foreground(limiter_.get());
+  sstable_mutex_.ReaderLock();
+  std::vector<std::size_t> removed;
+  std::size_t i = 0;
+  while (i < reads.size()) {
+    const file_id_t id = reads[i].entry_.file_id_;
+    auto *table = FindTable(id);
+
+    // merge neighbouring values into a single range. Overlapping entries, i.e.
+    // the same key being requested twice, start a new range.
+    iov.clear();
+    const std::uint32_t start = reads[i].entry_.pos_;
+    std::uint32_t end = start;
+    std::size_t j = i;
+    for (; j < reads.size() && iov.size() + 2 <= IOV_MAX; ++j) {
+      const auto &entry = reads[j].entry_;
+      if (entry.file_id_ != id) {
+        break;
+      }
+
+      if (j != i) {
+        if (entry.pos_ < end || entry.pos_ - end > kMultiGetMaxGap) {
+          break;
+        }
+        if (entry.pos_ > end) {
+          iov.push_back({gap_buffer, entry.pos_ - end});
+        }
+      }
+
+      iov.push_back({buffer.data() + results[reads[j].index_].offset_,
+                     entry.value_size_});
+      end = entry.pos_ + entry.value_size_;
+    }
+
+    absl::Status status;
+    if (table == nullptr) {
+      for (std::size_t k = i; k < j; ++k) {
+        removed.push_back(reads[k].index_);
+      }
+    } else if (auto read = table->FindRange(start, iov); !read.ok()) {
+      status = read.status();
+    } else if (*read != end - start) {
+      status = absl::InternalError("read wrong amount of bytes from file.");
+    }
+
     if (!status.ok()) {
+      for (std::size_t k = i; k < j; ++k) {
+        results[reads[k].index_].status_ = status;
+      }
+    }
+    i = j;
+  }
+  sstable_mutex_.ReaderUnlock();
+
+  // garbage collection removed the datafile after the lookup, the values are
+  // looked up again. The space of each value was set aside by the first
+  // lookup, so a value that was overwritten with another size in between
+  // fails.
+  for (const std::size_t index : removed) {
+    auto &result = results[index];
+    result.status_ =
+        LookupAndRead(keys[index], [&](const DatabaseEntry &entry) {
+          if (entry.value_size_ != result.size_) {
+            return absl::AbortedError("value changed during the read.");
+          }
+          return ReadValue(entry, buffer.subspan(result.offset_, result.size_));
+        });
+  }
+
+  return absl::OkStatus();
+}
+
+absl::Status DB::LoadSnapshot() noexcept {
+  std::vector<file_id_t> covered;
+  auto status = snapshot::ReadSnapshot(
+      database_directory_ + "/" + snapshot_file_name, covered, index_,
+      file_slots_);
+  if (!status.ok()) {
+    return status;
+  }
+  std::sort(covered.begin(), covered.end());
+
+  // replay the files not covered by the snapshot oldest first, such that newer
+  // entries replace older ones.
+  const auto files =
+      utils::datafiles(sstable_file_suffix, database_directory_);
+  std::uint64_t estimate = index_.size();
+  for (const auto &[id, path] : files) {
+    if (!std::binary_search(covered.begin(), covered.end(), id)) {
+      estimate += EstimateEntries(path);
+    }
+  }
+  index_.reserve(estimate);
+
+  for (const auto &[id, path] : files) {
+    auto sstable = MakeTable(path, id);
+    if (status = sstable->InitOnlyReader(); !status.ok()) {
+      return status;
+    }
+
+    if (!std::binary_search(covered.begin(), covered.end(), id)) {
+      std::string hint_path = path.substr(0, path.size() - 4) + "hnt";
+      std::uint64_t covered = 0;
+      if (config_.hint_files_ && std::filesystem::exists(hint_path)) {
+        auto parsed =
+            hint::ParseHintFile(hint_path, id, index_,
+                                config_.inline_value_size_,
+                                sstable->FileSlot());
+        if (!parsed.ok()) {
+          return parsed.status();
+        }
+        covered = *parsed;
+      }
+      status = sstable->AddEntriesToIndex(index_, covered,
+                                          config_.inline_value_size_);
+
+      if (!status.ok()) {
+        return status;
+      }
+    }
+    datafiles_[id] = std::move(sstable);
+  }
+
+  return absl::OkStatus();
+}
+
+std::uint64_t DB::EstimateEntries(const std::string &datafile_path) noexcept {
+  // keys that are overwritten in later files are counted more than once, so
+  // the estimate errs on the side of reserving too much.
+  std::string hint_path =
+      datafile_path.substr(0, datafile_path.size() - 4) + "hnt";
+  if (config_.hint_files_ && std::filesystem::exists(hint_path)) {
+    return hint::EstimateHintCount(hint_path);
+  }
+
+  std::error_code ec;
+  auto size = std::filesystem::file_size(datafile_path, ec);
+  if (ec || size == 0) {
+    return 0;
+  }
+  auto reader = io::OpenFileReader(datafile_path);
+  if (!reader.ok()) {
+    return 0;
+  }
+  return scanner::EstimateRecords(**reader, size);
+}
+
+absl::Status DB::WriteSnapshot(bool include_active,
+                               const io::Throttle &throttle) noexcept {
+  // the keydir of a frozen database is empty, it must not replace a snapshot.
+  if (config_.read_only_) {
+    return absl::FailedPreconditionError("database is read-only.");
+  }
+  if (mapped_ != nullptr) {
+    return absl::FailedPreconditionError("the keydir is mapped.");
+  }
+  if (!Ready()) {
+    return absl::UnavailableError("the keydir is still loading.");
+  }
+  // inserts update the index before releasing the table lock, so every entry
+  // of the tables captured here is in the index by the time we dump it. Later
+  // changes only point entries at datafiles that aren't covered, which are
+  // replayed on startup, so the submaps may be dumped one after another.
+  std::vector<file_id_t> covered;
+  sstable_mutex_.ReaderLock();
+  for (const auto &[id, _] : datafiles_) {
+    covered.push_back(id);
+  }
+  if (include_active && current_sstable_ != nullptr) {
+    covered.push_back(current_sstable_->ID());
+  }
+  sstable_mutex_.ReaderUnlock();
+
+  return snapshot::WriteSnapshot(database_directory_ + "/" + snapshot_file_name,
+                                 covered, index_, file_slots_, &index_mutex_,
+                                 throttle);
+}
+
+absl::Status DB::Checkpoint() noexcept {
+  return WriteSnapshot(false, BackgroundThrottle());
+}
+
+absl::Status DB::CollectGarbage() noexcept {
+  if (config_.read_only_) {
+    return absl::FailedPreconditionError("database is read-only.");
+  }
+  // the background load reads the pending datafiles without holding
+  // sstable_mutex_, see LoadFile, so none of them may be removed before it is
+  // done.
+  if (!Ready()) {
+    return absl::UnavailableError("the keydir is still loading.");
+  }
+  absl::MutexLock gc_guard(&gc_mutex_);
+
+  // the hot keys are moved first, such that their old records are collected
+  // in the same run.
+  if (access_ != nullptr) {
+    if (auto status = MoveHotKeys(); !status.ok()) {
+      return status;
+    }
+  }
+
+  // the live records of every immutable datafile. Records of these files only
+  // ever die, so whatever is dead now stays dead while they are collected.
+  std::map<file_id_t, std::vector<gc::Extent>> live;
+  {
+    absl::ReaderMutexLock table_guard(&sstable_mutex_);
+    for (const auto &[id, _] : datafiles_) {
+      live[id];
+    }
+  }
+  {
+    absl::ReaderMutexLock index_guard(&index_mutex_);
+    auto add = [&](absl::string_view key, const DatabaseEntry &entry) {
+      if (auto it = live.find(file_slots_.FileOf(entry)); it != live.end()) {
+        it->second.push_back({
+            .start_ = static_cast<std::uint32_t>(
+                entry.pos_ - encoder::kFullHeader - key.size()),
+            .end_ = entry.pos_ + entry.value_size_,
+        });
+      }
+    };
+    if (mapped_ != nullptr) {
+      mapped_->ForEach(add);
+    } else {
+      for (const auto &[key, entry] : index_) {
+        add(key, entry);
+      }
+    }
+  }
+
+  // oldest first, such that the values a tombstone deleted are dead before
+  // the tombstone itself is dropped.
+  for (auto &[id, extents] : live) {
+    const std::string path =
+        database_directory_ + "/" + std::to_string(id) + sstable_file_suffix;
+    std::uint64_t punched = 0;
+    auto action = gc::CollectDatafile(
+        path, extents, config_.gc_rewrite_threshold_, punched);
+    if (!action.ok()) {
+      return action.status();
+    }
+    if (punched > 0) {
+      metrics_.Add(metrics::kGcBytesPunched, punched);
+    }
+    if (*action == gc::Action::kKeep) {
+      continue;
+    }
+
+    if (*action == gc::Action::kRewrite) {
+      if (auto status = RewriteDatafile(id, extents); !status.ok()) {
+        return status;
+      }
+    }
+    if (auto status = RemoveDatafile(id); !status.ok()) {
+      return status;
+    }
+  }
+
+  return absl::OkStatus();
+}
+
+absl::Status DB::RewriteDatafile(
+    file_id_t id, absl::Span<const gc::Extent> extents) noexcept {
+  sstable::SSTable *table = nullptr;
+  {
+    // only CollectGarbage removes immutable tables, so the table stays valid
+    // after the lock is released.
+    absl::ReaderMutexLock guard(&sstable_mutex_);
+    table = FindTable(id);
+  }
+  if (table == nullptr) {
+    return absl::InternalError("invalid file id.");
+  }
+
+  struct Moved {
+    absl::string_view key_;
+    absl::string_view value_;
+    std::uint32_t pos_;  // of the value in the old datafile
+  };
+  std::vector<std::uint8_t> buffer;
+  std::vector<Moved> moved;
+  std::vector<std::pair<absl::string_view, absl::string_view>> pairs;
+  // the records are read without holding a lock and moved in chunks, such
+  // that reads and writes go on in between.
+  for (std::size_t next = 0; next < extents.size();) {
+    buffer.clear();
+    std::size_t last = next;
+    for (; last < extents.size() &&
+           (last == next || buffer.size() < scanner::kScanBufferSize);
+         ++last) {
+      buffer.resize(buffer.size() + extents[last].end_ - extents[last].start_);
+    }
+
+    if (!Throttle(buffer.size())) {
+      return absl::CancelledError("database is closing.");
+    }
+    std::size_t offset = 0;
+    for (std::size_t i = next; i < last; ++i) {
+      const std::uint32_t length = extents[i].end_ - extents[i].start_;
+      if (auto status =
+              table->Read(extents[i].start_, {&buffer[offset], length});
+          !status.ok()) {
+        return status;
+      }
+      offset += length;
+    }
+
+    // a record that was overwritten since the extents were collected must
+    // not be moved, as it would replace the newer value on recovery. The
+    // write is throttled before the lock is taken.
+    if (!Throttle(buffer.size())) {
+      return absl::CancelledError("database is closing.");
+    }
+    absl::WriterMutexLock table_guard(&sstable_mutex_);
+    moved.clear();
+    pairs.clear();
+    offset = 0;
+    {
+      absl::ReaderMutexLock index_guard(&index_mutex_);
+      for (std::size_t i = next; i < last; ++i) {
+        encoder::FullEncoding record(&buffer[offset]);
+        const Moved entry{
+            .key_ = record.Key(),
+            .value_ = record.Value(),
+            .pos_ = extents[i].start_ + record.ValueOffset(),
+        };
+        offset += extents[i].end_ - extents[i].start_;
+
+        DatabaseEntry current{};
+        if (mapped_ != nullptr) {
+          if (!mapped_->Find(entry.key_, index_.hash(entry.key_), current)) {
+            continue;
+          }
+        } else if (auto it = index_.find(entry.key_); it != index_.end()) {
+          current = it->second;
+        } else {
+          continue;
+        }
+        if (file_slots_.FileOf(current) == id && current.pos_ == entry.pos_) {
+          moved.push_back(entry);
+          pairs.emplace_back(entry.key_, entry.value_);
+        }
+      }
+    }
+    next = last;
+    if (pairs.empty()) {
+      continue;
+    }
+
+    auto positions = current_sstable_->InsertBatch(pairs);
+    if (!positions.ok()) {
+      return positions.status();
+    }
+    absl::WriterMutexLock index_guard(&index_mutex_);
+    for (std::size_t i = 0; i < moved.size(); ++i) {
+      const DatabaseEntry location{
+          .file_id_ = current_sstable_->ID(),
+          .pos_ = (*positions)[i],
+          .value_size_ = static_cast<std::uint16_t>(moved[i].value_.size()),
+      };
+      if (mapped_ != nullptr) {
+        auto status =
+            mapped_->Put(moved[i].key_, index_.hash(moved[i].key_), location);
+        if (!status.ok()) {
+          return status;
+        }
+        continue;
+      }
+      auto &entry = index_.find(moved[i].key_)->second;
+      entry = location;
+      entry.MaybeInline(moved[i].value_, config_.inline_value_size_,
+                        current_sstable_->FileSlot());
+    }
+  }
+
+  metrics_.Add(metrics::kGcFilesRewritten);
+  return absl::OkStatus();
+}
+
+absl::Status DB::RemoveDatafile(file_id_t id) noexcept {
+  std::unique_ptr<sstable::SSTable> table;
+  {
+    absl::WriterMutexLock guard(&sstable_mutex_);
+    auto it = datafiles_.find(id);
+    if (it == datafiles_.end()) {
+      return absl::OkStatus();
+    }
+    table = std::move(it->second);
+    datafiles_.erase(it);
+  }
+
+  const std::string base = database_directory_ + "/" + std::to_string(id);
+  for (const char *suffix : {hint_file_suffix, sstable_file_suffix,
+                             filter_file_suffix, dead_file_suffix}) {
+    std::error_code ec;
+    std::filesystem::remove(base + suffix, ec);
+    if (ec) {
+      return absl::InternalError("could not remove " + base + suffix + ": " +
+                                 ec.message());
+    }
+  }
+
+  // the moved entries don't refer to the datafile anymore.
+  file_slots_.Release(id);
+  hot_files_.erase(id);
+  metrics_.Add(metrics::kGcFilesRemoved);
+  return absl::OkStatus();
+}
+
+absl::Status DB::MoveHotKeys() noexcept {
+  struct HotKey {
+    std::string key_;
+    DatabaseEntry entry_;
+    std::uint64_t reads_;
+    std::uint64_t anchor_;
+    std::string value_;
+  };
+  std::vector<HotKey> hot;
+  phmap::flat_hash_set<file_id_t> candidates;
+  {
+    absl::ReaderMutexLock table_guard(&sstable_mutex_);
+    for (const auto &[id, _] : datafiles_) {
+      if (!hot_files_.contains(id)) {
+        candidates.insert(id);
+      }
+    }
+  }
+  {
+    // inlined values are served from the keydir, moving them doesn't help.
+    absl::ReaderMutexLock index_guard(&index_mutex_);
+    auto add = [&](absl::string_view key, const DatabaseEntry &entry) {
+      if (entry.Inline() || !candidates.contains(entry.file_id_)) {
+        return;
+      }
+      const std::uint64_t key_hash = index_.hash(key);
+      const std::uint64_t reads = access_->Estimate(key_hash);
+      if (reads >= config_.hot_key_reads_) {
+        hot.push_back({
+            .key_ = std::string(key),
+            .entry_ = entry,
+            .reads_ = reads,
+            .anchor_ = access_->Anchor(key_hash),
+            .value_ = {},
+        });
+      }
+    };
+    if (mapped_ != nullptr) {
+      mapped_->ForEach(add);
+    } else {
+      for (const auto &[key, entry] : index_) {
+        add(key, entry);
+      }
+    }
+  }
+  if (hot.empty()) {
+    return absl::OkStatus();
+  }
+
+  // the hottest keys that fit into a hot datafile, ordered such that the
+  // keys of a MultiGet end up next to each other.
+  std::sort(hot.begin(), hot.end(), [](const auto &a, const auto &b) {
+    return a.reads_ > b.reads_;
+  });
+  std::uint64_t size = 0;
+  std::size_t count = 0;
+  for (; count < hot.size(); ++count) {
+    size += encoder::FullEncoding::EncodedSize(hot[count].key_.size(),
+                                               hot[count].entry_.value_size_);
+    if (size > config_.hot_file_size_) {
+      break;
+    }
+  }
+  hot.resize(count);
+  std::sort(hot.begin(), hot.end(), [](const auto &a, const auto &b) {
+    if (a.anchor_ != b.anchor_) {
+      return a.anchor_ < b.anchor_;
+    }
+    return a.key_ < b.key_;
+  });
+
+  // only CollectGarbage removes immutable tables, so they can be read
+  // without holding a lock.
+  for (auto &key : hot) {
+    sstable::SSTable *table = nullptr;
+    {
+      absl::ReaderMutexLock guard(&sstable_mutex_);
+      table = FindTable(key.entry_.file_id_);
+    }
+    if (table == nullptr) {
+      return absl::InternalError("invalid file id.");
+    }
+    if (!Throttle(key.entry_.value_size_)) {
+      return absl::CancelledError("database is closing.");
+    }
+    key.value_.resize(key.entry_.value_size_);
+    auto *data = reinterpret_cast<std::uint8_t *>(key.value_.data());
+    if (auto status = table->Read(key.entry_.pos_, {data, key.value_.size()});
+        !status.ok()) {
+      return status;
+    }
+  }
+
+  // the hot keys get a datafile of their own, which is newer than the one
+  // they come from and older than any later write of them. It is written in
+  // chunks, such that writes go on in between, which land in the hot datafile
+  // as well.
+  {
+    absl::WriterMutexLock table_guard(&sstable_mutex_);
+    if (current_sstable_->Size() > 0) {
+      if (auto status = RotateTable(); !status.ok()) {
+        return status;
+      }
+    }
+  }
+
+  std::vector<const HotKey *> moved;
+  std::vector<std::pair<absl::string_view, absl::string_view>> pairs;
+  for (std::size_t next = 0; next < hot.size();) {
+    std::size_t last = next;
+    std::uint64_t chunk = 0;
+    for (; last < hot.size() &&
+           (last == next || chunk < scanner::kScanBufferSize);
+         ++last) {
+      chunk += encoder::FullEncoding::EncodedSize(hot[last].key_.size(),
+                                                  hot[last].entry_.value_size_);
+    }
+    if (!Throttle(chunk)) {
+      return absl::CancelledError("database is closing.");
+    }
+
+    // keys that were written since they were collected stay where they are.
+    absl::WriterMutexLock table_guard(&sstable_mutex_);
+    moved.clear();
+    pairs.clear();
+    {
+      absl::ReaderMutexLock index_guard(&index_mutex_);
+      for (std::size_t i = next; i < last; ++i) {
+        const auto &key = hot[i];
+        DatabaseEntry current{};
+        if (mapped_ != nullptr) {
+          if (!mapped_->Find(key.key_, index_.hash(key.key_), current)) {
+            continue;
+          }
+        } else if (auto it = index_.find(key.key_); it != index_.end()) {
+          current = it->second;
+        } else {
+          continue;
+        }
+        if (file_slots_.FileOf(current) == key.entry_.file_id_ &&
+            current.pos_ == key.entry_.pos_) {
+          moved.push_back(&key);
+          pairs.emplace_back(key.key_, key.value_);
+        }
+      }
+    }
+    next = last;
+    if (pairs.empty()) {
+      continue;
+    }
+
+    auto positions = current_sstable_->InsertBatch(pairs);
+    if (!positions.ok()) {
+      return positions.status();
+    }
+    const file_id_t hot_id = current_sstable_->ID();
+    {
+      absl::WriterMutexLock index_guard(&index_mutex_);
+      for (std::size_t i = 0; i < moved.size(); ++i) {
+        const DatabaseEntry location{
+            .file_id_ = hot_id,
+            .pos_ = (*positions)[i],
+            .value_size_ = moved[i]->entry_.value_size_,
+        };
+        if (mapped_ != nullptr) {
+          auto status = mapped_->Put(moved[i]->key_,
+                                     index_.hash(moved[i]->key_), location);
+          if (!status.ok()) {
+            return status;
+          }
+          continue;
+        }
+        index_.find(moved[i]->key_)->second = location;
+      }
+    }
+    hot_files_.insert(hot_id);
+    metrics_.Add(metrics::kGcHotKeysMoved, moved.size());
+  }
+
+  absl::WriterMutexLock table_guard(&sstable_mutex_);
+  if (current_sstable_->Size() == 0) {
+    return absl::OkStatus();
+  }
+  return RotateTable();
+}
+
+absl::Status DB::Freeze() noexcept {
+  if (frozen_ != nullptr) {
+    return absl::FailedPreconditionError("database is already frozen.");
+  }
+  if (!Ready()) {
+    return absl::UnavailableError("the keydir is still loading.");
+  }
+
+  std::vector<file_id_t> datafiles;
+  absl::ReaderMutexLock table_guard(&sstable_mutex_);
+  for (const auto &[id, _] : datafiles_) {
+    datafiles.push_back(id);
+  }
+  if (current_sstable_ != nullptr) {
+    datafiles.push_back(current_sstable_->ID());
+  }
+
+  absl::ReaderMutexLock index_guard(&index_mutex_);
+  const std::string path = database_directory_ + "/" + frozen_file_name;
+  if (mapped_ == nullptr) {
+    return frozen::Build(path, datafiles, index_, file_slots_);
+  }
+
+  keydir_t index;
+  index.reserve(mapped_->Size());
+  mapped_->ForEach([&index](absl::string_view key, const DatabaseEntry &entry) {
+    index.try_emplace(key, entry);
+  });
+  return frozen::Build(path, datafiles, index, file_slots_);
+}
+
+absl::Status DB::LoadFrozen() noexcept {
+  auto frozen =
+      frozen::FrozenKeydir::Open(database_directory_ + "/" + frozen_file_name);
+  if (!frozen.ok()) {
+    return frozen.status();
+  }
+  std::vector<file_id_t> covered = (*frozen)->Datafiles();
+  std::sort(covered.begin(), covered.end());
+
+  for (const auto &path :
+       utils::files_with_extension(sstable_file_suffix, database_directory_)) {
+    auto id = utils::parse_file_id(path);
+    if (!id.ok()) {
+      continue;
+    }
+
+    // a database that was opened for writing after the freeze leaves an
+    // empty datafile behind, that one doesn't change anything.
+    const bool is_covered =
+        std::binary_search(covered.begin(), covered.end(), *id);
+    std::error_code ec;
+    if (!is_covered && std::filesystem::file_size(path, ec) == 0 && !ec) {
+      continue;
+    }
+    if (!is_covered) {
+      return absl::FailedPreconditionError(
+          "datafile was written after the keydir was frozen: " + path);
+    }
+
+    auto sstable = MakeTable(path, *id);
+    if (auto status = sstable->InitOnlyReader(); !status.ok()) {
+      return status;
+    }
+    datafiles_[*id] = std::move(sstable);
+  }
+
+  frozen_ = *std::move(frozen);
+  return absl::OkStatus();
+}
+
+void DB::ScheduleCheckpoint() noexcept {
+  executor_->SubmitAfter(
+      "checkpoint", Priority::kNormal,
+      absl::Seconds(config_.checkpoint_interval_), [this] {
+        if (auto status = Checkpoint();
+            !status.ok() && !absl::IsCancelled(status)) {
+          std::cerr << "error writing checkpoint: " << status.message()
+                    << '\n';
+        }
+        ScheduleCheckpoint();
+      });
+}
+
+absl::Status DB::LoadMapped() noexcept {
+  auto keydir = mapped::MappedKeydir::Open(
+      database_directory_ + "/" + mapped_file_name,
+      database_directory_ + "/" + mapped_keys_file_name, DatafileCoverage());
+  if (!keydir.ok()) {
+    return keydir.status();
+  }
+
+  // only the readers are opened, the datafiles aren't read.
+  for (const auto &path :
+       utils::files_with_extension(sstable_file_suffix, database_directory_)) {
+    auto id = utils::parse_file_id(path);
+    if (!id.ok()) {
+      continue;
+    }
+    auto sstable = MakeTable(path, *id);
+    if (auto status = sstable->InitOnlyReader(); !status.ok()) {
+      return status;
+    }
+    datafiles_[*id] = std::move(sstable);
+  }
+
+  mapped_ = *std::move(keydir);
+  return absl::OkStatus();
+}
+
+absl::Status DB::BuildMapped() noexcept {
+  auto keydir = mapped::MappedKeydir::Create(
+      database_directory_ + "/" + mapped_file_name,
+      database_directory_ + "/" + mapped_keys_file_name, index_.size());
+  if (!keydir.ok()) {
+    return keydir.status();
+  }
+
+  for (const auto &[key, entry] : index_) {
+    // the mapped keydir doesn't inline values.
+    if (auto status =
+            (*keydir)->Put(key, index_.hash(key), file_slots_.Location(entry));
+        !status.ok()) {
+      return status;
+    }
+  }
+  mapped_ = *std::move(keydir);
+  keydir_t().swap(index_);
+  return absl::OkStatus();
+}
+
+mapped::Coverage DB::DatafileCoverage() const noexcept {
+  mapped::Coverage coverage;
+  std::string newest;
+  for (auto &path :
+       utils::files_with_extension(sstable_file_suffix, database_directory_)) {
+    auto id = utils::parse_file_id(path);
+    if (!id.ok()) {
+      continue;
+    }
+    if (++coverage.file_count_ == 1 || *id > coverage.newest_) {
+      coverage.newest_ = *id;
+      newest = std::move(path);
+    }
+  }
+
+  std::error_code ec;
+  if (!newest.empty()) {
+    coverage.newest_size_ = std::filesystem::file_size(newest, ec);
+  }
+  return coverage;
+}
+
+// writes a Bloom filter of the keys of a datafile next to it, such that the
+// next background load can skip the file for keys it doesn't have.
+static absl::Status write_filter(const std::string &path,
+                                 const keydir_t &keys) noexcept {
+  bloom::BloomFilter filter(
+      std::max<std::uint64_t>(64, keys.size() * kFilterBitsPerKey),
+      kFilterHashCount);
+  for (const auto &[key, _] : keys) {
+    filter.add(hash::HashKey(key));
+  }
+
+  const std::string tmp_path = path + ".tmp";
+  std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+  const std::string data = filter.Serialize();
+  file.write(data.data(), static_cast<std::streamsize>(data.size()));
+  file.close();
+  if (file.fail()) {
+    return absl::InternalError("could not write filter: " + tmp_path);
+  }
+
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, path, ec);
+  if (ec) {
+    return absl::InternalError("could not rename filter: " + ec.message());
+  }
+  return absl::OkStatus();
+}
+
+absl::Status DB::StartBackgroundLoad() noexcept {
+  absl::MutexLock lock(&load_mutex_);
+  std::uint64_t estimate = 0;
+  for (const auto &path :
+       utils::files_with_extension(sstable_file_suffix, database_directory_)) {
+    auto id = utils::parse_file_id(path);
+    if (!id.ok()) {
       continue;
     }
+    estimate += EstimateEntries(path);
+
+    auto sstable = MakeTable(path, *id);
+    if (auto status = sstable->InitOnlyReader(); !status.ok()) {
+      return status;
+    }
+    datafiles_[*id] = std::move(sstable);
+
+    PendingFile file;
+    std::ifstream filter(database_directory_ + "/" + std::to_string(*id) +
+                             filter_file_suffix,
+                         std::ios::binary);
+    if (filter) {
+      std::string data((std::istreambuf_iterator<char>(filter)), {});
+      file.filter_ = bloom::BloomFilter::Deserialize(data);
+    }
+    pending_[*id] = std::move(file);
   }
+  // the load jobs merge into the keydir while it is being written, so it is
+  // presized before they start.
+  index_.reserve(estimate);
 
+  ready_.store(pending_.empty(), std::memory_order_release);
   return absl::OkStatus();
 }
 
+void DB::ScheduleLoad() noexcept {
+  std::vector<file_id_t> ids;
+  load_mutex_.Lock();
+  for (auto it = pending_.rbegin(); it != pending_.rend(); ++it) {
+    ids.push_back(it->first);
+  }
+  load_mutex_.Unlock();
+
+  // the files are loaded in parallel, merging them into the keydir doesn't
+  // depend on the order.
+  for (const file_id_t id : ids) {
+    executor_->Submit("load", Priority::kHigh, [this, id] {
+      if (executor_->Cancelled()) {
+        return;
+      }
+      // lookups load files on demand without being throttled.
+      if (auto status = LoadFile(id, BackgroundThrottle());
+          !status.ok() && !absl::IsCancelled(status)) {
+        std::cerr << "error loading datafile " << id << ": "
+                  << status.message() << '\n';
+      }
+    });
+  }
+}
+
+absl::Status DB::LoadFile(file_id_t id,
+                          const io::Throttle &throttle) noexcept {
+  bool has_filter = false;
+  {
+    absl::MutexLock lock(&load_mutex_);
+    auto it = pending_.find(id);
+    if (it == pending_.end()) {
+      return absl::OkStatus();
+    }
+    if (it->second.loading_) {
+      while ((it = pending_.find(id)) != pending_.end() &&
+             it->second.loading_) {
+        load_done_.Wait(&load_mutex_);
+      }
+      // a load that was cancelled leaves the file pending.
+      return it == pending_.end()
+                 ? absl::OkStatus()
+                 : absl::CancelledError("loading the datafile was cancelled.");
+    }
+    it->second.loading_ = true;
+    has_filter = it->second.filter_ != nullptr;
+  }
+
+  // only CollectGarbage removes immutable tables and it refuses to run until
+  // Ready(), which is set once the last pending file is erased below. The
+  // file stays in pending_ until then, so the table can be used without
+  // holding the lock.
+  sstable::SSTable *table = nullptr;
+  {
+    absl::ReaderMutexLock guard(&sstable_mutex_);
+    table = FindTable(id);
+  }
+
+  // the entries of the file are collected on their own first, such that its
+  // tombstones still hide the key in older files.
+  keydir_t loaded;
+  absl::Status status;
+  std::uint64_t covered = 0;
+  const std::string base = database_directory_ + "/" + std::to_string(id);
+  if (table == nullptr) {
+    status = absl::InternalError("invalid file id.");
+  } else if (config_.hint_files_ &&
+             std::filesystem::exists(base + hint_file_suffix)) {
+    auto parsed = hint::ParseHintFile(base + hint_file_suffix, id, loaded,
+                                      config_.inline_value_size_,
+                                      table->FileSlot(), true, throttle);
+    if (parsed.ok()) {
+      covered = *parsed;
+    } else {
+      status = parsed.status();
+    }
+  }
+  if (status.ok()) {
+    status = table->AddEntriesToIndex(loaded, covered,
+                                      config_.inline_value_size_, true,
+                                      throttle);
+  }
+
+  if (status.ok()) {
+    absl::WriterMutexLock guard(&index_mutex_);
+    for (const auto &[key, entry] : loaded) {
+      // entries of newer files and live writes win over this file.
+      auto [it, inserted] = index_.try_emplace(key, entry);
+      if (!inserted && file_slots_.FileOf(it->second) < id) {
+        it->second = entry;
+      }
+    }
+  }
+  if (status.ok() && !has_filter) {
+    if (auto written = write_filter(base + filter_file_suffix, loaded);
+        !written.ok()) {
+      std::cerr << written.message() << '\n';
+    }
+  }
+
+  absl::MutexLock lock(&load_mutex_);
+  if (absl::IsCancelled(status)) {
+    // the database is closing, the keydir must not count as complete.
+    pending_[id].loading_ = false;
+    load_done_.SignalAll();
+    return status;
+  }
+  pending_.erase(id);
+  if (pending_.empty()) {
+    // every file is in, the tombstones aren't needed anymore.
+    absl::WriterMutexLock guard(&index_mutex_);
+    for (auto it = index_.begin(); it != index_.end();) {
+      if (it->second.Tombstone()) {
+        index_.erase(it++);
+      } else {
+        ++it;
+      }
+    }
+    ready_.store(true, std::memory_order_release);
+  }
+  load_done_.SignalAll();
+  return status;
+}
+
+void DB::LoadKey(absl::string_view key, std::uint64_t key_hash) noexcept {
+  file_id_t newest = std::numeric_limits<file_id_t>::min();
+  index_mutex_.ReaderLock();
+  if (auto it = index_.find(key, KeydirHash(key_hash)); it != index_.end()) {
+    newest = file_slots_.FileOf(it->second);
+  }
+  index_mutex_.ReaderUnlock();
+
+  // newest first, like the load jobs.
+  std::vector<file_id_t> candidates;
+  load_mutex_.Lock();
+  for (auto it = pending_.rbegin(); it != pending_.rend() && it->first > newest;
+       ++it) {
+    if (it->second.filter_ == nullptr ||
+        it->second.filter_->contains(key_hash)) {
+      candidates.push_back(it->first);
+    }
+  }
+  load_mutex_.Unlock();
+
+  for (const auto id : candidates) {
+    if (auto status = LoadFile(id); !status.ok()) {
+      std::cerr << "error loading datafile " << id << ": " << status.message()
+                << '\n';
+    }
+  }
+}
+
+void DB::WaitUntilReady() noexcept {
+  absl::MutexLock lock(&load_mutex_);
+  while (!pending_.empty()) {
+    load_done_.Wait(&load_mutex_);
+  }
+}
+
 absl::Status DB::FlushMemoryTable() noexcept {
+  if (config_.read_only_) {
+    return absl::FailedPreconditionError("database is read-only.");
+  }
+  metrics::ScopedLatency latency(&metrics_, metrics::kRotationLatency);
   absl::WriterMutexLock guard(&sstable_mutex_);
+  return RotateTable();
+}
+
+absl::Status DB::RotateTable() noexcept {
+  // the hints of the old table are complete now, write them out in one go.
+  if (auto status = current_sstable_->FlushHints(); !status.ok()) {
+    return status;
+  }
   file_id_t id = current_sstable_->ID();
   datafiles_[id] = std::move(current_sstable_);
 
-  auto new_id = utils::generate_file_id();
+  auto new_id = NextFileId();
   std::string sstable_string =
       database_directory_ + "/" + std::to_string(new_id) + sstable_file_suffix;
-  current_sstable_ = std::make_unique<sstable::SSTable>(sstable_string, new_id);
+  current_sstable_ = MakeTable(sstable_string, new_id);
   auto status = current_sstable_->InitWriterAndReader();
   if (!status.ok()) {
     return status;
@@ -172,4 +1778,12 @@ absl::Status DB::FlushMemoryTable() noexcept {
   return absl::OkStatus();
 }
 absl::Status DB::InitializeHints() noexcept { return {}; }
+
+file_id_t DB::NextFileId() const noexcept {
+  file_id_t newest = 0;
+  for (const auto &[existing, table] : datafiles_) {
+    newest = std::max(newest, existing);
+  }
+  return utils::next_file_id(newest);
+}
 }  // namespace karu
@@ -1,13 +1,31 @@
 #ifndef _KARU_H
 #define _KARU_H
 
+#include <atomic>
 #include <cstdint>
+#include <map>
+#include <memory_resource>
 #include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "../third_party/parallel_hashmap/phmap.h"
 #include "absl/container/btree_map.h"
+#include "absl/status/status.h"
 #include "absl/strings/string_view.h"
+#include "absl/types/span.h"
+#include "access.h"
+#include "bloom.h"
+#include "capture.h"
+#include "encoder.h"
+#include "executor.h"
+#include "file_slots.h"
+#include "frozen.h"
+#include "gc.h"
+#include "mapped_keydir.h"
+#include "metrics.h"
+#include "rate_limiter.h"
 #include "sstable.h"
 #include "types.h"
 
@@ -16,6 +34,44 @@ namespace karu {
 constexpr const char *sstable_file_suffix = ".data";
 constexpr const char *hint_file_suffix = ".hnt";
 constexpr const char *log_file_suffix = ".log";
+constexpr const char *filter_file_suffix = ".blm";
+constexpr const char *dead_file_suffix = gc::kDeadFileSuffix;
+constexpr const char *snapshot_file_name = "keydir.snap";
+constexpr const char *frozen_file_name = "keydir.frozen";
+constexpr const char *mapped_file_name = "keydir.map";
+constexpr const char *mapped_keys_file_name = "keydir.keys";
+
+// the largest value length, 0xFFFF marks tombstones. A Get buffer of this
+// size always fits the value.
+constexpr std::size_t kMaxValueSize = 0xFFFE;
+// the largest key length, the top bit of the length marks inline values in
+// hint files and snapshots, see encoder::kInlineValueFlag.
+constexpr std::size_t kMaxKeySize = encoder::kInlineValueFlag - 1;
+
+// the Bloom filters written by the background load have about 1% false
+// positives.
+constexpr std::uint64_t kFilterBitsPerKey = 10;
+constexpr std::uint8_t kFilterHashCount = 7;
+
+// values that are at most this many bytes apart in the same datafile are read
+// with a single preadv call in MultiGet. The bytes in between are discarded.
+constexpr std::uint32_t kMultiGetMaxGap = 4096;
+// how many keys ahead of the current lookup we prefetch the index buckets of.
+constexpr std::size_t kMultiGetPrefetchDistance = 8;
+// a Scan cursor is the keydir submap in the bits above kScanSlotBits and the
+// slot in that submap below them. Cursors stay below 2^48.
+constexpr int kScanSlotBits = 40;
+constexpr std::uint64_t kScanSlotMask = (std::uint64_t{1} << kScanSlotBits) - 1;
+// counters per row of the access sketch, see DBConfig::track_access_.
+constexpr std::size_t kAccessSketchWidth = 1 << 16;
+
+// result of a single key in a MultiGet call. On success the value is stored in
+// the caller supplied buffer at [offset_, offset_ + size_).
+struct MultiGetResult {
+  absl::Status status_;
+  std::uint32_t offset_;
+  std::uint16_t size_;
+};
 
 struct DBConfig {
   bool hint_files_;  // the option to write into hint files. This basically
@@ -25,35 +81,258 @@ struct DBConfig {
                      // which will take a lot more time compared to just parsing
                      // hint files.
   std::string database_directory_;
+  // write a snapshot of the keydir when the database is closed and load it on
+  // startup. Then only the datafiles written after the snapshot need to be
+  // replayed.
+  bool keydir_snapshot_ = false;
+  // if non-zero, a snapshot is also written every this many seconds while the
+  // database is open.
+  std::uint32_t checkpoint_interval_ = 0;
+  // if set, every operation is recorded into a trace at this path which can
+  // be replayed with karu_replay. capture_hash_keys_ stores the hash of every
+  // key instead of the key itself.
+  std::string capture_path_ = "";
+  bool capture_hash_keys_ = false;
+  // values of at most this many bytes, up to kMaxInlineValueSize, are kept in
+  // the keydir as well and Get serves them without reading the datafile. 0
+  // turns it off.
+  std::uint16_t inline_value_size_ = 0;
+  // opens the database without an active datafile, every write returns
+  // FailedPrecondition. If the directory has a keydir written by Freeze that
+  // covers all of the datafiles it is mapped instead of building the keydir.
+  bool read_only_ = false;
+  // keep the keydir in memory mapped files in the database directory, see
+  // mapped_keydir.h. After a clean shutdown it is opened as is instead of
+  // being rebuilt. Snapshots are not written and values are not inlined with
+  // it.
+  bool mapped_keydir_ = false;
+  // return from the constructor right away and rebuild the keydir from the
+  // hint files or datafiles in background jobs, newest file first. A
+  // lookup that the keydir can't answer yet loads the files that may have
+  // the key first, skipping the ones whose Bloom filter rules it out. The
+  // filters are written next to the datafiles by the first background load.
+  // Not used when the keydir comes from a snapshot or mapped keydir.
+  bool background_load_ = false;
+  // CollectGarbage moves the live records of a datafile into the active one
+  // and removes it once more than this fraction of it is dead, instead of
+  // punching holes into it.
+  double gc_rewrite_threshold_ = 0.5;
+  // sample the keys that Get and MultiGet read, see access.h. CollectGarbage
+  // then first moves the keys that were read at least hot_key_reads_ times,
+  // up to hot_file_size_ bytes of them, into a datafile of their own. Keys
+  // that MultiGet reads together are placed next to each other.
+  bool track_access_ = false;
+  std::uint64_t hot_key_reads_ = 64;
+  std::uint32_t hot_file_size_ = 16 << 20;
+  // caps the disk bandwidth of background work, i.e. CollectGarbage, the
+  // background load and checkpoints, at this many bytes per second. 0 doesn't
+  // limit it. Background I/O also briefly waits for in-flight Gets, see
+  // rate_limiter.h.
+  std::uint64_t background_io_rate_ = 0;
+  // if non-zero, the background rate is lowered while the mean Get latency
+  // is above this many microseconds and raised again while it's below.
+  std::uint32_t background_io_target_latency_us_ = 0;
+  // the number of threads that run background work, i.e. the background
+  // load and checkpoints, see executor.h. 0 is treated as 1.
+  std::uint32_t background_threads_ = 2;
 };
 
 class DB {
  public:
   explicit DB(absl::string_view directory);
   explicit DB(const DBConfig &conf);
+  ~DB();
   DB &operator=(const DB &) = delete;
   DB(const DB &) = delete;
 
   absl::Status InitializeSSTables() noexcept;
   absl::Status InitializeHints() noexcept;
   absl::Status FlushMemoryTable() noexcept;
-  absl::Status Insert(const std::string &key,
-                      const std::string &value) noexcept;  // string_view?
-  absl::StatusOr<std::string> Get(
-      const std::string &key) noexcept;  // string_view?
+  absl::Status Insert(absl::string_view key, absl::string_view value) noexcept;
+  // moves the key into the keydir instead of copying it if it is new.
+  absl::Status Insert(std::string &&key, absl::string_view value) noexcept;
+  // string literals would be ambiguous between the two overloads above.
+  absl::Status Insert(const char *key, absl::string_view value) noexcept {
+    return Insert(absl::string_view(key), value);
+  }
+  absl::StatusOr<std::string> Get(absl::string_view key) noexcept;
+  // reads the value straight into out and returns its size. Returns
+  // ResourceExhausted if out is too small for the value.
+  absl::StatusOr<std::uint16_t> Get(absl::string_view key,
+                                    absl::Span<std::uint8_t> out) noexcept;
+  // allocates the value from arena, e.g. a std::pmr::monotonic_buffer_resource
+  // that lives as long as a request. The view is valid as long as the arena.
+  absl::StatusOr<absl::string_view> Get(
+      absl::string_view key, std::pmr::memory_resource &arena) noexcept;
+  // inserts all of the pairs with a single write and sync. If the same key is
+  // in the batch multiple times the last one wins.
+  absl::Status InsertBatch(
+      absl::Span<const std::pair<absl::string_view, absl::string_view>>
+          pairs) noexcept;
+  // writes a tombstone for the key and removes it from the index. Returns
+  // NotFound if the key doesn't exist.
+  absl::Status Delete(absl::string_view key) noexcept;
+  // appends at most count keys to keys starting from cursor. The returned
+  // cursor is passed to the next call and is 0 once all keys have been
+  // visited. Keys inserted or deleted during the iteration may be missed or
+  // returned twice.
+  std::uint64_t Scan(std::uint64_t cursor, std::size_t count,
+                     std::vector<std::string> &keys) noexcept;
   absl::Status ParseHintFiles() noexcept;
+  // writes a snapshot of the keydir that covers all of the immutable
+  // datafiles.
+  absl::Status Checkpoint() noexcept;
+  // writes a frozen keydir of all datafiles, see frozen.h, which a read-only
+  // DB maps on startup. It only stays in use as long as the database isn't
+  // written to again. A frozen keydir doesn't store the keys, so Scan doesn't
+  // return any.
+  absl::Status Freeze() noexcept;
+  // reclaims the space of overwritten and deleted values in the immutable
+  // datafiles, oldest first. Datafiles that are mostly dead, see
+  // DBConfig::gc_rewrite_threshold_, are rewritten and every other dead range
+  // becomes a hole, see gc.h. A Get that races the removal of a datafile
+  // looks its key up again.
+  absl::Status CollectGarbage() noexcept;
+  // returns a copy of the metrics of the database. Use ToText or ToJson on the
+  // result to export them.
+  metrics::Stats GetStats() noexcept;
+  // whether the keydir is complete, see DBConfig::background_load_. Until
+  // then snapshots can't be written and Scan only returns loaded keys.
+  [[nodiscard]] bool Ready() const noexcept {
+    return ready_.load(std::memory_order_acquire);
+  }
+  void WaitUntilReady() noexcept;
+
+  // MultiGet looks up all of the keys and stores their values one after
+  // another into buffer. results has to be at least as long as keys and will
+  // contain the status and location of each key's value. The returned status
+  // is only an error if the whole batch failed, e.g. the buffer being too
+  // small to hold all of the values.
+  absl::Status MultiGet(absl::Span<const std::string> keys,
+                        absl::Span<std::uint8_t> buffer,
+                        absl::Span<MultiGetResult> results) noexcept;
 
  private:
+  // returns the table with the given id or nullptr if it doesn't exist. The
+  // caller needs to hold sstable_mutex_.
+  sstable::SSTable *FindTable(file_id_t id) noexcept;
+  // finds the entry of key in the index. The common part of every Get.
+  absl::Status Lookup(absl::string_view key, DatabaseEntry &entry) noexcept;
+  // reads the value of entry into out, which has to be value_size_ bytes.
+  // Fails with Unavailable if garbage collection removed the datafile since
+  // entry was looked up.
+  absl::Status ReadValue(const DatabaseEntry &entry,
+                         absl::Span<std::uint8_t> out) noexcept;
+  // looks up key and calls read with its entry, again with a fresh entry if
+  // read failed because garbage collection removed the datafile. Fails if
+  // the fresh entry still points at the removed datafile.
+  template <typename Read>
+  absl::Status LookupAndRead(absl::string_view key, Read &&read) noexcept;
+  // Key is either a string_view or a std::string that is moved into the
+  // keydir.
+  template <typename Key>
+  absl::Status InsertKey(Key &&key, absl::string_view value) noexcept;
+  std::unique_ptr<sstable::SSTable> MakeTable(const std::string &path,
+                                              file_id_t id) noexcept;
+  // the file slot of datafile id, kNoFileSlot if values aren't inlined.
+  std::uint16_t InlineSlot(file_id_t id) noexcept;
+  // returns an id that is newer than the id of every datafile. The caller
+  // needs to hold sstable_mutex_ or be the constructor.
+  file_id_t NextFileId() const noexcept;
+  absl::Status LoadSnapshot() noexcept;
+  // estimates the number of entries in a datafile from its hint file, or
+  // from the datafile itself if it has none, to presize the keydir.
+  std::uint64_t EstimateEntries(const std::string &datafile_path) noexcept;
+  absl::Status LoadFrozen() noexcept;
+  absl::Status LoadMapped() noexcept;
+  // moves the entries of index_ into a new mapped keydir.
+  absl::Status BuildMapped() noexcept;
+  mapped::Coverage DatafileCoverage() const noexcept;
+  absl::Status WriteSnapshot(bool include_active,
+                             const io::Throttle &throttle = nullptr) noexcept;
+  // appends the live records of the datafile in extents to the active table
+  // and points the keydir at them.
+  absl::Status RewriteDatafile(file_id_t id,
+                               absl::Span<const gc::Extent> extents) noexcept;
+  // deletes a datafile that has no live records left.
+  absl::Status RemoveDatafile(file_id_t id) noexcept;
+  // waits until background work may read or write bytes. Returns false once
+  // the database is closing.
+  bool Throttle(std::uint64_t bytes) noexcept {
+    return limiter_ == nullptr ||
+           limiter_->Request(bytes, &executor_->Cancellation());
+  }
+  // Throttle for the readers and writers of background work, empty if
+  // background I/O isn't limited.
+  io::Throttle BackgroundThrottle() noexcept {
+    if (limiter_ == nullptr) {
+      return nullptr;
+    }
+    return [this](std::uint64_t bytes) { return Throttle(bytes); };
+  }
+  // writes the hot keys of the immutable datafiles into a new datafile.
+  absl::Status MoveHotKeys() noexcept;
+  // makes the active table immutable and opens a new one. The caller needs to
+  // hold sstable_mutex_.
+  absl::Status RotateTable() noexcept;
+  // writes a checkpoint after checkpoint_interval_ seconds and schedules the
+  // next one.
+  void ScheduleCheckpoint() noexcept;
+
+  // lists the datafiles for the background load and opens their readers.
+  absl::Status StartBackgroundLoad() noexcept;
+  // submits a job per pending file, newest file first.
+  void ScheduleLoad() noexcept;
+  // adds the entries of the datafile to the keydir unless that already
+  // happened. Waits if another thread is loading it.
+  absl::Status LoadFile(file_id_t id,
+                        const io::Throttle &throttle = nullptr) noexcept;
+  // loads every pending file that may have a newer entry for key than the
+  // keydir. key_hash is hash::HashKey(key).
+  void LoadKey(absl::string_view key, std::uint64_t key_hash) noexcept;
+
+  DBConfig config_;
+  metrics::Registry metrics_;
+
   // we hold memtables which we have not yet written to disk in the
   // memtable_list
   std::string database_directory_;
   std::unique_ptr<sstable::SSTable> current_sstable_ = nullptr;
 
-  phmap::parallel_flat_hash_map<std::string, DatabaseEntry> index_;
+  keydir_t index_;
+  // the datafiles of inline entries, see DatabaseEntry.
+  FileSlots file_slots_;
+  // replaces index_ if a read-only database was opened from a frozen keydir.
+  std::unique_ptr<frozen::FrozenKeydir> frozen_;
+  // replaces index_ with DBConfig::mapped_keydir_, guarded by index_mutex_.
+  std::unique_ptr<mapped::MappedKeydir> mapped_;
   phmap::node_hash_map<file_id_t, std::unique_ptr<sstable::SSTable>> datafiles_;
 
   absl::Mutex sstable_mutex_;
   absl::Mutex index_mutex_;
+
+  std::unique_ptr<capture::Writer> capture_;
+
+  // the datafiles that still need to be loaded, see background_load_.
+  struct PendingFile {
+    bool loading_ = false;
+    std::unique_ptr<bloom::BloomFilter> filter_;  // nullptr if there is none
+  };
+  absl::Mutex load_mutex_;
+  absl::CondVar load_done_;
+  std::map<file_id_t, PendingFile> pending_;
+  std::atomic<bool> ready_{true};
+
+  // only one CollectGarbage runs at a time.
+  absl::Mutex gc_mutex_;
+  // the datafiles written by MoveHotKeys, guarded by gc_mutex_.
+  phmap::flat_hash_set<file_id_t> hot_files_;
+  // nullptr unless DBConfig::track_access_.
+  std::unique_ptr<access::AccessTracker> access_;
+  // nullptr unless DBConfig::background_io_rate_.
+  std::unique_ptr<io::RateLimiter> limiter_;
+  // runs the background jobs, it is shut down first thing in the destructor.
+  std::unique_ptr<Executor> executor_;
 };
 }  // namespace karu
 
@@ -0,0 +1,605 @@
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "histogram.h"
+#include "resp.h"
+#include "workload.h"
+
+// karu_loadgen drives a server speaking the Redis protocol, like memtier. Every
+// thread runs its own epoll loop over its connections and keeps up to
+// --pipeline requests in flight on each of them.
+//
+// With --rate the requests of a connection are scheduled at fixed intervals.
+// When the server falls behind the schedule, requests are sent late, and
+// measuring from the actual send time would hide that wait (coordinated
+// omission). The corrected latency is measured from the scheduled time
+// instead.
+
+namespace {
+using karu::workload::build_key;
+using karu::workload::scramble;
+using karu::workload::ZipfianGenerator;
+
+enum Operation { kGet, kSet, kOpCount };
+constexpr const char *kOperationNames[kOpCount] = {"get", "set"};
+constexpr std::size_t kReadSize = 64 * 1024;
+constexpr int kMaxEvents = 256;
+
+struct Options {
+  std::string host_ = "127.0.0.1";
+  std::uint16_t port_ = 6380;
+  std::size_t threads_ = 4;
+  std::size_t connections_ = 10;  // per thread
+  std::size_t pipeline_ = 1;
+  std::uint64_t requests_ = 10000;  // per connection
+  double duration_ = 0;             // seconds, overrides requests_
+  double rate_ = 0;                 // requests per second over all connections
+  std::uint64_t set_ratio_ = 1;
+  std::uint64_t get_ratio_ = 10;
+  std::string distribution_ = "uniform";
+  std::uint64_t keys_ = 100000;
+  std::size_t key_size_ = 16;
+  std::size_t value_size_ = 100;
+  bool prefill_ = false;
+  std::string json_path_;
+};
+
+std::uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+struct ThreadResult {
+  karu::metrics::Histogram latencies_[kOpCount];
+  karu::metrics::Histogram corrected_[kOpCount];
+  std::uint64_t hits_ = 0;
+  std::uint64_t misses_ = 0;
+  std::uint64_t errors_ = 0;
+};
+
+struct Request {
+  Operation op_;
+  std::uint64_t scheduled_;  // when the request should have been sent
+  std::uint64_t sent_;
+};
+
+struct Connection {
+  int fd_ = -1;
+  std::string output_;
+  std::size_t output_offset_ = 0;
+  std::string input_;
+  std::deque<Request> in_flight_;
+  std::uint64_t issued_ = 0;
+  std::uint64_t next_send_ = 0;  // scheduled time of the next request
+  bool writable_ = false;
+};
+
+int connect_to(const Options &options) {
+  int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(options.port_);
+  if (fd == -1 ||
+      ::inet_pton(AF_INET, options.host_.c_str(), &addr.sin_addr) != 1 ||
+      ::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+    std::cerr << "karu_loadgen: could not connect to " << options.host_ << ':'
+              << options.port_ << ": " << std::strerror(errno) << '\n';
+    std::exit(1);
+  }
+
+  int one = 1;
+  ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+void append_command(std::string &out,
+                    std::initializer_list<absl::string_view> args) {
+  karu::resp::AppendArrayHeader(out, args.size());
+  for (auto arg : args) {
+    karu::resp::AppendBulkString(out, arg);
+  }
+}
+
+class Worker {
+ public:
+  Worker(const Options &options, std::size_t index,
+         const ZipfianGenerator &zipfian, std::atomic<std::uint64_t> &sequence)
+      : options_(options),
+        zipfian_(zipfian),
+        sequence_(sequence),
+        generator_(index + 1),
+        value_(options.value_size_, 'x') {
+    for (auto &c : value_) {
+      c = static_cast<char>('a' + generator_() % 26);
+    }
+  }
+
+  // sets keys [first, last) with the full pipeline depth.
+  void Prefill(std::uint64_t first, std::uint64_t last) {
+    int fd = connect_to(options_);
+    std::string out, in;
+    std::uint64_t next = first;
+    while (next < last) {
+      out.clear();
+      std::uint64_t batch = std::min<std::uint64_t>(last - next, 256);
+      for (std::uint64_t i = 0; i < batch; ++i) {
+        append_command(out, {"SET", build_key(next + i, options_.key_size_),
+                             value_});
+      }
+      next += batch;
+      write_all(fd, out);
+      for (std::uint64_t replies = 0; replies < batch;) {
+        replies += read_replies(fd, in);
+      }
+    }
+    ::close(fd);
+  }
+
+  void Run(std::uint64_t start, std::uint64_t end, ThreadResult &result) {
+    result_ = &result;
+    end_ = end;
+    epoll_fd_ = ::epoll_create1(0);
+    const std::size_t total_connections =
+        options_.threads_ * options_.connections_;
+    interval_ = options_.rate_ > 0
+                    ? static_cast<std::uint64_t>(
+                          1e9 * static_cast<double>(total_connections) /
+                          options_.rate_)
+                    : 0;
+
+    connections_.resize(options_.connections_);
+    for (std::size_t i = 0; i < connections_.size(); ++i) {
+      auto &conn = connections_[i];
+      conn.fd_ = connect_to(options_);
+      // spread the schedules of the connections over one interval.
+      conn.next_send_ = start + interval_ * i / connections_.size();
+      epoll_event event{};
+      event.events = EPOLLIN;
+      event.data.u64 = i;
+      ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, conn.fd_, &event);
+    }
+
+    epoll_event events[kMaxEvents];
+    while (true) {
+      std::uint64_t now = now_ns();
+      std::uint64_t wake_at = UINT64_MAX;
+      bool active = false;
+      for (auto &conn : connections_) {
+        Fill(conn, now);
+        Flush(conn);
+        active |= !Done(conn, now);
+        if (interval_ > 0 && !Done(conn, now) &&
+            conn.in_flight_.size() < options_.pipeline_) {
+          wake_at = std::min(wake_at, conn.next_send_);
+        }
+      }
+      if (!active) {
+        break;
+      }
+
+      int timeout = -1;
+      if (wake_at != UINT64_MAX) {
+        timeout = wake_at > now ? static_cast<int>((wake_at - now) / 1000000)
+                                : 0;
+      }
+      if (end_ != 0) {
+        timeout = std::min<int>(
+            timeout == -1 ? INT32_MAX : timeout,
+            end_ > now ? static_cast<int>((end_ - now) / 1000000) + 1 : 0);
+      }
+
+      int count = ::epoll_wait(epoll_fd_, events, kMaxEvents, timeout);
+      for (int i = 0; i < count; ++i) {
+        auto &conn = connections_[events[i].data.u64];
+        if (events[i].events & EPOLLIN) {
+          Receive(conn);
+        }
+      }
+    }
+
+    for (auto &conn : connections_) {
+      ::close(conn.fd_);
+    }
+    ::close(epoll_fd_);
+  }
+
+ private:
+  // a connection is done once it issued all of its requests, or the run time
+  // is over, and all of the replies have arrived.
+  bool Done(const Connection &conn, std::uint64_t now) const {
+    bool issuing = end_ != 0 ? now < end_ : conn.issued_ < options_.requests_;
+    return !issuing && conn.in_flight_.empty();
+  }
+
+  void Fill(Connection &conn, std::uint64_t now) {
+    while (conn.in_flight_.size() < options_.pipeline_) {
+      if (end_ != 0 ? now >= end_ : conn.issued_ >= options_.requests_) {
+        return;
+      }
+      if (interval_ > 0 && conn.next_send_ > now) {
+        return;
+      }
+
+      Request request{};
+      request.scheduled_ = interval_ > 0 ? conn.next_send_ : now;
+      request.sent_ = now;
+      conn.next_send_ += interval_;
+
+      const std::uint64_t ratio = options_.set_ratio_ + options_.get_ratio_;
+      request.op_ = generator_() % ratio < options_.set_ratio_ ? kSet : kGet;
+      std::string key = build_key(NextKey(), options_.key_size_);
+      if (request.op_ == kSet) {
+        append_command(conn.output_, {"SET", key, value_});
+      } else {
+        append_command(conn.output_, {"GET", key});
+      }
+      conn.in_flight_.push_back(request);
+      ++conn.issued_;
+    }
+  }
+
+  std::uint64_t NextKey() {
+    if (options_.distribution_ == "zipfian") {
+      double u = std::uniform_real_distribution<double>(0.0, 1.0)(generator_);
+      return scramble(zipfian_.Next(u)) % options_.keys_;
+    }
+    if (options_.distribution_ == "sequential") {
+      return sequence_.fetch_add(1, std::memory_order_relaxed) %
+             options_.keys_;
+    }
+    return generator_() % options_.keys_;
+  }
+
+  void Flush(Connection &conn) {
+    while (conn.output_offset_ < conn.output_.size()) {
+      ssize_t n = ::send(conn.fd_, conn.output_.data() + conn.output_offset_,
+                         conn.output_.size() - conn.output_offset_,
+                         MSG_DONTWAIT);
+      if (n <= 0) {
+        break;
+      }
+      conn.output_offset_ += n;
+    }
+    if (conn.output_offset_ == conn.output_.size()) {
+      conn.output_.clear();
+      conn.output_offset_ = 0;
+    }
+
+    // wait for the socket to drain when the server doesn't keep up.
+    bool want_write = !conn.output_.empty();
+    if (want_write != conn.writable_) {
+      epoll_event event{};
+      event.events = EPOLLIN;
+      if (want_write) {
+        event.events |= EPOLLOUT;
+      }
+      event.data.u64 = &conn - connections_.data();
+      ::epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, conn.fd_, &event);
+      conn.writable_ = want_write;
+    }
+  }
+
+  void Receive(Connection &conn) {
+    char buf[kReadSize];
+    ssize_t n = ::recv(conn.fd_, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n <= 0) {
+      if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        std::cerr << "karu_loadgen: server closed the connection\n";
+        std::exit(1);
+      }
+      return;
+    }
+    conn.input_.append(buf, n);
+
+    const std::uint64_t now = now_ns();
+    std::size_t pos = 0;
+    karu::resp::Reply reply{};
+    std::size_t consumed = 0;
+    while (!conn.in_flight_.empty() &&
+           karu::resp::ParseReply(absl::string_view(conn.input_).substr(pos),
+                                  reply, consumed) ==
+               karu::resp::ParseResult::kCommand) {
+      pos += consumed;
+      const Request request = conn.in_flight_.front();
+      conn.in_flight_.pop_front();
+
+      if (reply.type_ == karu::resp::ReplyType::kError) {
+        ++result_->errors_;
+      } else if (request.op_ == kGet) {
+        ++(reply.type_ == karu::resp::ReplyType::kNull ? result_->misses_
+                                                        : result_->hits_);
+      }
+      result_->latencies_[request.op_].Record(now - request.sent_);
+      result_->corrected_[request.op_].Record(now - request.scheduled_);
+    }
+    conn.input_.erase(0, pos);
+  }
+
+  static void write_all(int fd, const std::string &out) {
+    std::size_t sent = 0;
+    while (sent < out.size()) {
+      ssize_t n = ::write(fd, out.data() + sent, out.size() - sent);
+      if (n <= 0) {
+        std::cerr << "karu_loadgen: write failed\n";
+        std::exit(1);
+      }
+      sent += n;
+    }
+  }
+
+  // reads from the blocking fd and returns how many replies were completed.
+  static std::uint64_t read_replies(int fd, std::string &in) {
+    char buf[kReadSize];
+    ssize_t n = ::read(fd, buf, sizeof(buf));
+    if (n <= 0) {
+      std::cerr << "karu_loadgen: server closed the connection\n";
+      std::exit(1);
+    }
+    in.append(buf, n);
+
+    std::uint64_t replies = 0;
+    std::size_t pos = 0, consumed = 0;
+    karu::resp::Reply reply{};
+    while (karu::resp::ParseReply(absl::string_view(in).substr(pos), reply,
+                                  consumed) ==
+           karu::resp::ParseResult::kCommand) {
+      pos += consumed;
+      ++replies;
+    }
+    in.erase(0, pos);
+    return replies;
+  }
+
+  const Options &options_;
+  const ZipfianGenerator &zipfian_;
+  std::atomic<std::uint64_t> &sequence_;
+  std::mt19937_64 generator_;
+  std::string value_;
+
+  ThreadResult *result_ = nullptr;
+  std::vector<Connection> connections_;
+  int epoll_fd_ = -1;
+  std::uint64_t interval_ = 0;
+  std::uint64_t end_ = 0;
+};
+
+void print_usage() {
+  std::cerr
+      << "usage: karu_loadgen [flags]\n"
+         "  --host=IP              server address (default 127.0.0.1)\n"
+         "  --port=N               server port (default 6380)\n"
+         "  --threads=N            client threads\n"
+         "  --connections=N        connections per thread\n"
+         "  --pipeline=N           requests in flight per connection\n"
+         "  --requests=N           requests per connection\n"
+         "  --duration=SECONDS     run for a fixed time instead\n"
+         "  --rate=N               requests per second over all connections,\n"
+         "                         0 sends as fast as possible\n"
+         "  --ratio=SET:GET        mix of sets and gets (default 1:10)\n"
+         "  --distribution=NAME    uniform, zipfian or sequential\n"
+         "  --keys=N               size of the key space\n"
+         "  --key_size=N           key size in bytes\n"
+         "  --value_size=N         value size in bytes\n"
+         "  --prefill=0|1          set every key before the run\n"
+         "  --json=PATH            also write the results as json\n";
+}
+
+Options parse_options(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto eq = arg.find('=');
+    if (arg.rfind("--", 0) != 0 || eq == std::string::npos) {
+      print_usage();
+      std::exit(1);
+    }
+
+    std::string name = arg.substr(2, eq - 2);
+    std::string value = arg.substr(eq + 1);
+    if (name == "host") {
+      options.host_ = value;
+    } else if (name == "port") {
+      options.port_ = static_cast<std::uint16_t>(std::stoul(value));
+    } else if (name == "threads") {
+      options.threads_ = std::max<std::size_t>(1, std::stoul(value));
+    } else if (name == "connections") {
+      options.connections_ = std::max<std::size_t>(1, std::stoul(value));
+    } else if (name == "pipeline") {
+      options.pipeline_ = std::max<std::size_t>(1, std::stoul(value));
+    } else if (name == "requests") {
+      options.requests_ = std::stoull(value);
+    } else if (name == "duration") {
+      options.duration_ = std::stod(value);
+    } else if (name == "rate") {
+      options.rate_ = std::stod(value);
+    } else if (name == "ratio") {
+      std::vector<std::string> parts = absl::StrSplit(value, ':');
+      if (parts.size() != 2 ||
+          !absl::SimpleAtoi(parts[0], &options.set_ratio_) ||
+          !absl::SimpleAtoi(parts[1], &options.get_ratio_) ||
+          options.set_ratio_ + options.get_ratio_ == 0) {
+        print_usage();
+        std::exit(1);
+      }
+    } else if (name == "distribution") {
+      options.distribution_ = value;
+    } else if (name == "keys") {
+      options.keys_ = std::max<std::uint64_t>(1, std::stoull(value));
+    } else if (name == "key_size") {
+      options.key_size_ = std::stoul(value);
+    } else if (name == "value_size") {
+      options.value_size_ = std::stoul(value);
+    } else if (name == "prefill") {
+      options.prefill_ = value != "0";
+    } else if (name == "json") {
+      options.json_path_ = value;
+    } else {
+      print_usage();
+      std::exit(1);
+    }
+  }
+
+  if (options.distribution_ != "uniform" &&
+      options.distribution_ != "zipfian" &&
+      options.distribution_ != "sequential") {
+    std::cerr << "karu_loadgen: unknown distribution " << options.distribution_
+              << '\n';
+    std::exit(1);
+  }
+  return options;
+}
+
+double to_us(std::uint64_t ns) { return static_cast<double>(ns) / 1000.0; }
+
+void print_latency(const char *name, const karu::metrics::Histogram &h) {
+  std::cout << "    " << name << ": p50=" << to_us(h.Percentile(50))
+            << "us p99=" << to_us(h.Percentile(99))
+            << "us p999=" << to_us(h.Percentile(99.9))
+            << "us max=" << to_us(h.Max()) << "us\n";
+}
+
+void json_latency(std::ostream &out, const karu::metrics::Histogram &h) {
+  out << "{\"mean\": " << h.Mean() / 1000
+      << ", \"p50\": " << to_us(h.Percentile(50))
+      << ", \"p99\": " << to_us(h.Percentile(99))
+      << ", \"p999\": " << to_us(h.Percentile(99.9))
+      << ", \"max\": " << to_us(h.Max()) << '}';
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options options = parse_options(argc, argv);
+  ZipfianGenerator zipfian(options.keys_);
+  std::atomic<std::uint64_t> sequence = 0;
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  for (std::size_t i = 0; i < options.threads_; ++i) {
+    workers.push_back(
+        std::make_unique<Worker>(options, i, zipfian, sequence));
+  }
+
+  auto run_threads = [&](const std::function<void(std::size_t)> &f) {
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < options.threads_; ++i) {
+      threads.emplace_back(f, i);
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  };
+
+  if (options.prefill_) {
+    const std::uint64_t per_thread =
+        (options.keys_ + options.threads_ - 1) / options.threads_;
+    run_threads([&](std::size_t i) {
+      std::uint64_t first = std::min(options.keys_, i * per_thread);
+      workers[i]->Prefill(first, std::min(options.keys_, first + per_thread));
+    });
+  }
+
+  std::vector<std::unique_ptr<ThreadResult>> results;
+  for (std::size_t i = 0; i < options.threads_; ++i) {
+    results.push_back(std::make_unique<ThreadResult>());
+  }
+
+  const std::uint64_t start = now_ns();
+  const std::uint64_t end =
+      options.duration_ > 0
+          ? start + static_cast<std::uint64_t>(options.duration_ * 1e9)
+          : 0;
+  run_threads([&](std::size_t i) { workers[i]->Run(start, end, *results[i]); });
+  const double seconds = static_cast<double>(now_ns() - start) / 1e9;
+
+  ThreadResult total;
+  for (const auto &result : results) {
+    for (int op = 0; op < kOpCount; ++op) {
+      total.latencies_[op].Merge(result->latencies_[op]);
+      total.corrected_[op].Merge(result->corrected_[op]);
+    }
+    total.hits_ += result->hits_;
+    total.misses_ += result->misses_;
+    total.errors_ += result->errors_;
+  }
+
+  std::uint64_t requests = 0;
+  for (const auto &h : total.latencies_) {
+    requests += h.Count();
+  }
+  const double throughput = static_cast<double>(requests) / seconds;
+
+  std::cout << options.threads_ << " threads, " << options.connections_
+            << " connections per thread, pipeline " << options.pipeline_
+            << ", " << options.distribution_ << " keys\n"
+            << requests << " requests in " << seconds << " s (" << throughput
+            << " ops/s), " << total.hits_ << " hits, " << total.misses_
+            << " misses, " << total.errors_ << " errors\n";
+  for (int op = 0; op < kOpCount; ++op) {
+    if (total.latencies_[op].Count() == 0) {
+      continue;
+    }
+    std::cout << "  " << kOperationNames[op]
+              << ": count=" << total.latencies_[op].Count() << '\n';
+    print_latency("latency", total.latencies_[op]);
+    if (options.rate_ > 0) {
+      print_latency("corrected", total.corrected_[op]);
+    }
+  }
+
+  if (!options.json_path_.empty()) {
+    std::ofstream out(options.json_path_);
+    out << "{\"threads\": " << options.threads_
+        << ", \"connections\": " << options.connections_
+        << ", \"pipeline\": " << options.pipeline_
+        << ", \"rate\": " << options.rate_ << ", \"distribution\": \""
+        << options.distribution_ << "\", \"seconds\": " << seconds
+        << ", \"requests\": " << requests
+        << ", \"ops_per_sec\": " << throughput
+        << ", \"hits\": " << total.hits_ << ", \"misses\": " << total.misses_
+        << ", \"errors\": " << total.errors_ << ", \"latency_us\": {";
+    bool first = true;
+    for (int op = 0; op < kOpCount; ++op) {
+      if (total.latencies_[op].Count() == 0) {
+        continue;
+      }
+      out << (first ? "" : ", ") << '"' << kOperationNames[op]
+          << "\": {\"count\": " << total.latencies_[op].Count()
+          << ", \"latency\": ";
+      json_latency(out, total.latencies_[op]);
+      out << ", \"corrected\": ";
+      json_latency(out, total.corrected_[op]);
+      out << '}';
+      first = false;
+    }
+    out << "}}\n";
+    if (!out) {
+      std::cerr << "karu_loadgen: could not write " << options.json_path_
+                << '\n';
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,476 @@
+#include "mapped_keydir.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <filesystem>
+
+#include "hash.h"
+
+namespace karu::mapped {
+// the header takes a whole page, such that the slots are page aligned.
+constexpr std::size_t kHeaderSize = 4096;
+constexpr std::size_t kKeysHeaderSize = 64;
+constexpr std::size_t kInitialKeysSize = 64 * 1024;
+
+struct MappedKeydir::Header {
+  std::uint32_t magic_;
+  std::uint32_t version_;
+  // incremented every time the table is opened. The keys file has to be of
+  // the same generation.
+  std::uint64_t generation_;
+  std::uint64_t clean_;
+  std::uint64_t capacity_;  // a power of two
+  std::uint64_t size_;
+  std::uint64_t keys_used_;  // bytes of the keys file in use
+  std::uint64_t file_count_;
+  std::int64_t newest_;
+  std::uint64_t newest_size_;
+  std::uint64_t checksum_;  // of the fields above
+};
+
+struct MappedKeydir::KeysHeader {
+  std::uint32_t magic_;
+  std::uint32_t version_;
+  std::uint64_t generation_;
+};
+
+// an empty slot has a hash of 0, which is why stored hashes always have their
+// lowest bit set.
+struct MappedKeydir::Slot {
+  std::uint64_t hash_;
+  std::int64_t file_id_;
+  std::uint64_t key_offset_;
+  std::uint32_t pos_;
+  std::uint16_t value_size_;
+  std::uint16_t key_size_;
+};
+static_assert(sizeof(MappedKeydir::Slot) == 32);
+
+static std::uint64_t stored_hash(std::uint64_t key_hash) noexcept {
+  return key_hash | 1;
+}
+
+static std::uint64_t header_checksum(const void *header) noexcept {
+  return hash::Hash64(header, offsetof(MappedKeydir::Header, checksum_));
+}
+
+static void *map_file(int fd, std::size_t size) noexcept {
+  void *data =
+      ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  return data == MAP_FAILED ? nullptr : data;
+}
+
+// creates or truncates the file at path to size bytes. The file is sparse,
+// untouched slots don't take any space.
+static absl::Status create_file(const std::string &path, std::uint64_t size,
+                                int &fd) noexcept {
+  fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return absl::InternalError("could not create mapped keydir: " + path);
+  }
+  if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+    ::close(fd);
+    fd = -1;
+    return absl::InternalError("could not size mapped keydir: " + path);
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::unique_ptr<MappedKeydir>> MappedKeydir::Create(
+    const std::string &path, const std::string &keys_path,
+    std::uint64_t capacity) noexcept {
+  std::uint64_t slots = kMinCapacity;
+  while (static_cast<double>(slots) * kMaxLoadFactor <
+         static_cast<double>(capacity)) {
+    slots *= 2;
+  }
+
+  int fd = -1, keys_fd = -1;
+  if (auto status = create_file(path, kHeaderSize + slots * sizeof(Slot), fd);
+      !status.ok()) {
+    return status;
+  }
+  if (auto status = create_file(keys_path, kInitialKeysSize, keys_fd);
+      !status.ok()) {
+    ::close(fd);
+    return status;
+  }
+
+  std::unique_ptr<MappedKeydir> keydir(new MappedKeydir(fd, keys_fd));
+  keydir->path_ = path;
+  if (auto status = keydir->Map(); !status.ok()) {
+    return status;
+  }
+
+  auto *header = keydir->GetHeader();
+  *header = Header{
+      .magic_ = kMappedMagic,
+      .version_ = kMappedVersion,
+      .generation_ = 1,
+      .clean_ = 0,
+      .capacity_ = slots,
+      .size_ = 0,
+      .keys_used_ = kKeysHeaderSize,
+      .file_count_ = 0,
+      .newest_ = 0,
+      .newest_size_ = 0,
+      .checksum_ = 0,
+  };
+  header->checksum_ = header_checksum(header);
+  *reinterpret_cast<KeysHeader *>(keydir->keys_) = KeysHeader{
+      .magic_ = kMappedMagic,
+      .version_ = kMappedVersion,
+      .generation_ = 1,
+  };
+  return keydir;
+}
+
+absl::StatusOr<std::unique_ptr<MappedKeydir>> MappedKeydir::Open(
+    const std::string &path, const std::string &keys_path,
+    const Coverage &coverage) noexcept {
+  int fd = ::open(path.c_str(), O_RDWR);
+  if (fd < 0) {
+    return absl::NotFoundError("could not open mapped keydir: " + path);
+  }
+  int keys_fd = ::open(keys_path.c_str(), O_RDWR);
+  if (keys_fd < 0) {
+    ::close(fd);
+    return absl::NotFoundError("could not open mapped keys: " + keys_path);
+  }
+
+  std::unique_ptr<MappedKeydir> keydir(new MappedKeydir(fd, keys_fd));
+  keydir->path_ = path;
+  if (auto status = keydir->Map(); !status.ok()) {
+    return status;
+  }
+  if (keydir->map_size_ < kHeaderSize ||
+      keydir->keys_size_ < kKeysHeaderSize) {
+    return absl::DataLossError("mapped keydir is truncated.");
+  }
+
+  auto *header = keydir->GetHeader();
+  const auto *keys_header = reinterpret_cast<KeysHeader *>(keydir->keys_);
+  // the checksum is only kept up to date when the table is closed.
+  if (header->magic_ != kMappedMagic || header->version_ != kMappedVersion) {
+    return absl::DataLossError("invalid mapped keydir header.");
+  }
+  if (header->clean_ == 0) {
+    return absl::DataLossError("mapped keydir was not closed.");
+  }
+  if (header->checksum_ != header_checksum(header)) {
+    return absl::DataLossError("mapped keydir header checksum mismatch.");
+  }
+  if (keys_header->magic_ != kMappedMagic ||
+      keys_header->generation_ != header->generation_) {
+    return absl::DataLossError("mapped keys are of another generation.");
+  }
+  if (keydir->map_size_ != kHeaderSize + header->capacity_ * sizeof(Slot) ||
+      keydir->keys_size_ < header->keys_used_) {
+    return absl::DataLossError("mapped keydir is truncated.");
+  }
+  if (header->file_count_ != coverage.file_count_ ||
+      header->newest_ != coverage.newest_ ||
+      header->newest_size_ != coverage.newest_size_) {
+    return absl::DataLossError(
+        "datafiles changed since the keydir was closed.");
+  }
+
+  // the table is dirty until Close, a crash in between rebuilds it.
+  header->clean_ = 0;
+  ++header->generation_;
+  header->checksum_ = header_checksum(header);
+  reinterpret_cast<KeysHeader *>(keydir->keys_)->generation_ =
+      header->generation_;
+  if (::msync(keydir->map_, kHeaderSize, MS_SYNC) != 0) {
+    return absl::InternalError("could not mark mapped keydir as dirty.");
+  }
+  return keydir;
+}
+
+MappedKeydir::~MappedKeydir() {
+  if (map_ != nullptr) {
+    ::munmap(map_, map_size_);
+  }
+  if (keys_ != nullptr) {
+    ::munmap(keys_, keys_size_);
+  }
+  ::close(fd_);
+  ::close(keys_fd_);
+}
+
+absl::Status MappedKeydir::Map() noexcept {
+  struct ::stat st {};
+  struct ::stat keys_st {};
+  if (::fstat(fd_, &st) != 0 || ::fstat(keys_fd_, &keys_st) != 0) {
+    return absl::InternalError("could not stat mapped keydir.");
+  }
+
+  map_size_ = static_cast<std::size_t>(st.st_size);
+  keys_size_ = static_cast<std::size_t>(keys_st.st_size);
+  if (map_size_ == 0 || keys_size_ == 0) {
+    return absl::DataLossError("mapped keydir is empty.");
+  }
+  map_ = static_cast<std::uint8_t *>(map_file(fd_, map_size_));
+  keys_ = static_cast<std::uint8_t *>(map_file(keys_fd_, keys_size_));
+  if (map_ == nullptr || keys_ == nullptr) {
+    return absl::InternalError("could not map keydir.");
+  }
+  return absl::OkStatus();
+}
+
+MappedKeydir::Header *MappedKeydir::GetHeader() const noexcept {
+  return reinterpret_cast<Header *>(map_);
+}
+
+MappedKeydir::Slot *MappedKeydir::Slots() const noexcept {
+  return reinterpret_cast<Slot *>(map_ + kHeaderSize);
+}
+
+std::uint64_t MappedKeydir::Home(std::uint64_t hash) const noexcept {
+  // the lowest bit is always set, so the slot is taken from the top bits.
+  const int bits = __builtin_ctzll(GetHeader()->capacity_);
+  return bits == 0 ? 0 : hash >> (64 - bits);
+}
+
+MappedKeydir::Slot *MappedKeydir::Probe(absl::string_view key,
+                                        std::uint64_t hash) const noexcept {
+  const std::uint64_t mask = GetHeader()->capacity_ - 1;
+  Slot *slots = Slots();
+  for (std::uint64_t i = Home(hash);; i = (i + 1) & mask) {
+    Slot &slot = slots[i];
+    if (slot.hash_ == 0) {
+      return &slot;
+    }
+    if (slot.hash_ == hash && slot.key_size_ == key.size() &&
+        std::memcmp(keys_ + slot.key_offset_, key.data(), key.size()) == 0) {
+      return &slot;
+    }
+  }
+}
+
+bool MappedKeydir::Find(absl::string_view key, std::uint64_t key_hash,
+                        DatabaseEntry &entry) const noexcept {
+  const Slot *slot = Probe(key, stored_hash(key_hash));
+  if (slot->hash_ == 0) {
+    return false;
+  }
+  entry = DatabaseEntry{
+      .file_id_ = slot->file_id_,
+      .pos_ = slot->pos_,
+      .value_size_ = slot->value_size_,
+  };
+  return true;
+}
+
+absl::Status MappedKeydir::Put(absl::string_view key, std::uint64_t key_hash,
+                               const DatabaseEntry &entry) noexcept {
+  const std::uint64_t hash = stored_hash(key_hash);
+  Slot *slot = Probe(key, hash);
+  if (slot->hash_ == 0) {
+    auto *header = GetHeader();
+    if (static_cast<double>(header->size_ + 1) >
+        kMaxLoadFactor * static_cast<double>(header->capacity_)) {
+      if (auto status = Grow(); !status.ok()) {
+        return status;
+      }
+      slot = Probe(key, hash);
+    }
+    if (auto status = ReserveKeys(key.size()); !status.ok()) {
+      return status;
+    }
+
+    header = GetHeader();
+    std::memcpy(keys_ + header->keys_used_, key.data(), key.size());
+    slot->hash_ = hash;
+    slot->key_offset_ = header->keys_used_;
+    slot->key_size_ = static_cast<std::uint16_t>(key.size());
+    header->keys_used_ += key.size();
+    ++header->size_;
+  }
+
+  slot->file_id_ = entry.file_id_;
+  slot->pos_ = entry.pos_;
+  slot->value_size_ = entry.value_size_;
+  return absl::OkStatus();
+}
+
+bool MappedKeydir::Erase(absl::string_view key,
+                         std::uint64_t key_hash) noexcept {
+  Slot *slots = Slots();
+  Slot *slot = Probe(key, stored_hash(key_hash));
+  if (slot->hash_ == 0) {
+    return false;
+  }
+
+  // backward shift deletion: later slots of the same probe sequence move
+  // into the hole, such that lookups never need tombstones. The key bytes
+  // stay behind in the keys file.
+  const std::uint64_t mask = GetHeader()->capacity_ - 1;
+  std::uint64_t hole = slot - slots;
+  for (std::uint64_t i = (hole + 1) & mask; slots[i].hash_ != 0;
+       i = (i + 1) & mask) {
+    const std::uint64_t home = Home(slots[i].hash_);
+    // the slot can move if its home isn't cyclically within (hole, i].
+    const bool stays = hole <= i ? (hole < home && home <= i)
+                                 : (hole < home || home <= i);
+    if (!stays) {
+      slots[hole] = slots[i];
+      hole = i;
+    }
+  }
+  slots[hole] = Slot{};
+  --GetHeader()->size_;
+  return true;
+}
+
+std::uint64_t MappedKeydir::Size() const noexcept {
+  return GetHeader()->size_;
+}
+
+std::uint64_t MappedKeydir::Scan(
+    std::uint64_t cursor, std::size_t count,
+    std::vector<std::string> &keys) const noexcept {
+  const std::uint64_t capacity = GetHeader()->capacity_;
+  const Slot *slots = Slots();
+  std::size_t added = 0;
+  for (; cursor < capacity && added < count; ++cursor) {
+    if (slots[cursor].hash_ != 0) {
+      keys.emplace_back(
+          reinterpret_cast<const char *>(keys_ + slots[cursor].key_offset_),
+          slots[cursor].key_size_);
+      ++added;
+    }
+  }
+  return cursor >= capacity ? 0 : cursor;
+}
+
+void MappedKeydir::ForEach(
+    const std::function<void(absl::string_view, const DatabaseEntry &)> &f)
+    const {
+  const std::uint64_t capacity = GetHeader()->capacity_;
+  const Slot *slots = Slots();
+  for (std::uint64_t i = 0; i < capacity; ++i) {
+    if (slots[i].hash_ == 0) {
+      continue;
+    }
+    f(absl::string_view(
+          reinterpret_cast<const char *>(keys_ + slots[i].key_offset_),
+          slots[i].key_size_),
+      DatabaseEntry{
+          .file_id_ = slots[i].file_id_,
+          .pos_ = slots[i].pos_,
+          .value_size_ = slots[i].value_size_,
+      });
+  }
+}
+
+absl::Status MappedKeydir::Grow() noexcept {
+  const Header old = *GetHeader();
+  const std::uint64_t capacity = old.capacity_ * 2;
+  const std::string tmp_path = path_ + ".tmp";
+  const std::size_t size = kHeaderSize + capacity * sizeof(Slot);
+  int fd = -1;
+  if (auto status = create_file(tmp_path, size, fd); !status.ok()) {
+    return status;
+  }
+
+  auto *map = static_cast<std::uint8_t *>(map_file(fd, size));
+  if (map == nullptr) {
+    ::close(fd);
+    return absl::InternalError("could not map grown keydir.");
+  }
+
+  const Slot *old_slots = Slots();
+  auto *header = reinterpret_cast<Header *>(map);
+  *header = old;
+  header->capacity_ = capacity;
+  header->checksum_ = header_checksum(header);
+
+  std::swap(map, map_);
+  std::swap(fd, fd_);
+  const std::size_t old_size = map_size_;
+  map_size_ = size;
+  Slot *slots = Slots();
+  for (std::uint64_t i = 0; i < old.capacity_; ++i) {
+    if (old_slots[i].hash_ == 0) {
+      continue;
+    }
+    for (std::uint64_t j = Home(old_slots[i].hash_);;
+         j = (j + 1) & (capacity - 1)) {
+      if (slots[j].hash_ == 0) {
+        slots[j] = old_slots[i];
+        break;
+      }
+    }
+  }
+  ::munmap(map, old_size);
+  ::close(fd);
+
+  // the table is dirty while it is open, so a crash before or after the
+  // rename rebuilds it either way.
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, path_, ec);
+  if (ec) {
+    return absl::InternalError("could not rename grown keydir: " +
+                               ec.message());
+  }
+  return absl::OkStatus();
+}
+
+absl::Status MappedKeydir::Reserve(std::uint64_t keys,
+                                   std::uint64_t key_bytes) noexcept {
+  while (static_cast<double>(GetHeader()->size_ + keys) >
+         kMaxLoadFactor * static_cast<double>(GetHeader()->capacity_)) {
+    if (auto status = Grow(); !status.ok()) {
+      return status;
+    }
+  }
+  return ReserveKeys(key_bytes);
+}
+
+absl::Status MappedKeydir::ReserveKeys(std::uint64_t size) noexcept {
+  const std::uint64_t used = GetHeader()->keys_used_;
+  if (used + size <= keys_size_) {
+    return absl::OkStatus();
+  }
+
+  std::size_t new_size = keys_size_ * 2;
+  while (new_size < used + size) {
+    new_size *= 2;
+  }
+  if (::ftruncate(keys_fd_, static_cast<off_t>(new_size)) != 0) {
+    return absl::InternalError("could not grow mapped keys.");
+  }
+  void *keys = ::mremap(keys_, keys_size_, new_size, MREMAP_MAYMOVE);
+  if (keys == MAP_FAILED) {
+    return absl::InternalError("could not remap mapped keys.");
+  }
+  keys_ = static_cast<std::uint8_t *>(keys);
+  keys_size_ = new_size;
+  return absl::OkStatus();
+}
+
+absl::Status MappedKeydir::Close(const Coverage &coverage) noexcept {
+  // the slots and keys have to be on disk before the header says that they
+  // are complete.
+  if (::msync(map_, map_size_, MS_SYNC) != 0 ||
+      ::msync(keys_, keys_size_, MS_SYNC) != 0) {
+    return absl::InternalError("could not sync mapped keydir.");
+  }
+
+  auto *header = GetHeader();
+  header->file_count_ = coverage.file_count_;
+  header->newest_ = coverage.newest_;
+  header->newest_size_ = coverage.newest_size_;
+  header->clean_ = 1;
+  header->checksum_ = header_checksum(header);
+  if (::msync(map_, kHeaderSize, MS_SYNC) != 0) {
+    return absl::InternalError("could not sync mapped keydir header.");
+  }
+  return absl::OkStatus();
+}
+}  // namespace karu::mapped
@@ -0,0 +1,109 @@
+#ifndef _KARU_MAPPED_KEYDIR_H
+#define _KARU_MAPPED_KEYDIR_H
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/string_view.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "types.h"
+
+// mapped is a keydir that lives in memory mapped files, such that opening a
+// database doesn't have to rebuild it. It is an open addressing hash table
+// with linear probing in one file and the keys, appended one after another,
+// in a second one. Writers update both in place and the page cache decides
+// how much of it stays in memory.
+//
+// The table is marked dirty when it is opened and clean again when it is
+// closed. A table that wasn't closed, e.g. after a crash, or whose header
+// checksum, generation or datafiles don't match can't be trusted and has to
+// be rebuilt from the datafiles. The files are in host byte order.
+namespace karu::mapped {
+constexpr std::uint32_t kMappedMagic = 0x4b444d50;  // "PMDK"
+constexpr std::uint32_t kMappedVersion = 1;
+constexpr std::uint64_t kMinCapacity = 1024;
+// the table doubles in size once it is this full.
+constexpr double kMaxLoadFactor = 0.75;
+
+// the state of the datafiles when the table was closed. Every datafile but
+// the newest one is immutable, so this is enough to notice datafiles that
+// were written without updating the table.
+struct Coverage {
+  std::uint64_t file_count_ = 0;
+  file_id_t newest_ = 0;
+  std::uint64_t newest_size_ = 0;
+};
+
+class MappedKeydir {
+ public:
+  // opens the table at path with its keys at keys_path. Returns DataLoss if
+  // it can't be used with the datafiles described by coverage and has to be
+  // rebuilt.
+  static absl::StatusOr<std::unique_ptr<MappedKeydir>> Open(
+      const std::string &path, const std::string &keys_path,
+      const Coverage &coverage) noexcept;
+  // creates an empty table with room for at least capacity keys, replacing
+  // the files if they exist.
+  static absl::StatusOr<std::unique_ptr<MappedKeydir>> Create(
+      const std::string &path, const std::string &keys_path,
+      std::uint64_t capacity) noexcept;
+  ~MappedKeydir();
+  MappedKeydir &operator=(const MappedKeydir &) = delete;
+  MappedKeydir(const MappedKeydir &) = delete;
+
+  // key_hash is hash::HashKey of the key. Find can be called concurrently,
+  // but not together with Put or Erase.
+  bool Find(absl::string_view key, std::uint64_t key_hash,
+            DatabaseEntry &entry) const noexcept;
+  absl::Status Put(absl::string_view key, std::uint64_t key_hash,
+                   const DatabaseEntry &entry) noexcept;
+  // makes room for keys new keys of key_bytes bytes in total, such that the
+  // Puts that add them can't fail. Records are only written once their keys
+  // fit, otherwise they'd be durable without being in the keydir.
+  absl::Status Reserve(std::uint64_t keys, std::uint64_t key_bytes) noexcept;
+  // returns false if the key doesn't exist.
+  bool Erase(absl::string_view key, std::uint64_t key_hash) noexcept;
+  [[nodiscard]] std::uint64_t Size() const noexcept;
+  // same contract as DB::Scan, the cursor is the next slot.
+  std::uint64_t Scan(std::uint64_t cursor, std::size_t count,
+                     std::vector<std::string> &keys) const noexcept;
+  void ForEach(const std::function<void(absl::string_view,
+                                        const DatabaseEntry &)> &f) const;
+  // writes everything to disk and marks the table as clean for coverage.
+  absl::Status Close(const Coverage &coverage) noexcept;
+
+  // the layout of the files, see mapped_keydir.cc.
+  struct Header;
+  struct KeysHeader;
+  struct Slot;
+
+ private:
+  MappedKeydir(int fd, int keys_fd) noexcept : fd_(fd), keys_fd_(keys_fd) {}
+  absl::Status Map() noexcept;
+  Header *GetHeader() const noexcept;
+  Slot *Slots() const noexcept;
+  // the slot of key or the empty slot where it would be inserted.
+  Slot *Probe(absl::string_view key, std::uint64_t stored_hash) const noexcept;
+  std::uint64_t Home(std::uint64_t stored_hash) const noexcept;
+  // doubles the table into a new file which replaces the old one.
+  absl::Status Grow() noexcept;
+  // makes sure that size more bytes fit into the keys file.
+  absl::Status ReserveKeys(std::uint64_t size) noexcept;
+
+  std::string path_;
+  int fd_;
+  int keys_fd_;
+  std::uint8_t *map_ = nullptr;
+  std::size_t map_size_ = 0;
+  std::uint8_t *keys_ = nullptr;
+  std::size_t keys_size_ = 0;
+};
+}  // namespace karu::mapped
+
+#endif
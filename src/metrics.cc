@@ -0,0 +1,142 @@
+#include "metrics.h"
+
+#include <sstream>
+
+namespace karu::metrics {
+// registry ids are never reused, so a thread local cache entry can't point to
+// the metrics of a registry that has been destroyed.
+static std::atomic<std::uint64_t> next_registry_id{1};
+
+Registry::Registry() : id_(next_registry_id.fetch_add(1)) {}
+
+// the number of registries a thread keeps cached. Ids are handed out in
+// order, so a thread that alternates between a few DBs hits a different entry
+// for each of them.
+constexpr std::size_t kLocalCacheSize = 8;
+
+ThreadMetrics &Registry::Local() noexcept {
+  struct Cache {
+    std::uint64_t registry_id_ = 0;
+    ThreadMetrics *metrics_ = nullptr;
+  };
+  thread_local std::array<Cache, kLocalCacheSize> cache;
+  auto &entry = cache[id_ % kLocalCacheSize];
+  if (entry.registry_id_ == id_) {
+    return *entry.metrics_;
+  }
+
+  // first time this thread touches the registry, or another one took its
+  // entry.
+  absl::MutexLock guard(&mutex_);
+  auto &metrics = threads_[std::this_thread::get_id()];
+  if (metrics == nullptr) {
+    metrics = std::make_unique<ThreadMetrics>();
+  }
+  entry = {.registry_id_ = id_, .metrics_ = metrics.get()};
+  return *metrics;
+}
+
+void Registry::Add(Counter counter, std::uint64_t value) noexcept {
+  auto &slot = Local().counters_[counter];
+  slot.store(slot.load(std::memory_order_relaxed) + value,
+             std::memory_order_relaxed);
+}
+
+void Registry::Record(Latency latency, std::uint64_t nanos) noexcept {
+  Local().latencies_[latency].Record(nanos);
+}
+
+Stats Registry::Collect() const noexcept {
+  Stats stats;
+  auto merged = std::make_unique<Histogram[]>(kLatencyCount);
+
+  absl::MutexLock guard(&mutex_);
+  for (const auto &[_, metrics] : threads_) {
+    for (std::size_t i = 0; i < kCounterCount; ++i) {
+      stats.counters_[i] +=
+          metrics->counters_[i].load(std::memory_order_relaxed);
+    }
+    for (std::size_t i = 0; i < kLatencyCount; ++i) {
+      merged[i].Merge(metrics->latencies_[i]);
+    }
+  }
+
+  for (std::size_t i = 0; i < kLatencyCount; ++i) {
+    stats.latencies_[i] = {
+        .count_ = merged[i].Count(),
+        .mean_ = merged[i].Mean(),
+        .p50_ = merged[i].Percentile(50),
+        .p99_ = merged[i].Percentile(99),
+        .p999_ = merged[i].Percentile(99.9),
+        .max_ = merged[i].Max(),
+    };
+  }
+  return stats;
+}
+
+std::pair<std::uint64_t, std::uint64_t> Registry::LatencyTotals(
+    Latency latency) const noexcept {
+  std::uint64_t count = 0;
+  std::uint64_t sum = 0;
+  absl::MutexLock guard(&mutex_);
+  for (const auto &[_, metrics] : threads_) {
+    count += metrics->latencies_[latency].Count();
+    sum += metrics->latencies_[latency].Sum();
+  }
+  return {count, sum};
+}
+
+std::string Stats::ToText() const {
+  std::ostringstream out;
+  out << "index_size " << index_size_ << '\n';
+  out << "datafile_count " << datafile_count_ << '\n';
+  out << "pending_files " << pending_files_ << '\n';
+  out << "background_io_rate " << background_io_rate_ << '\n';
+  for (std::size_t i = 0; i < kCounterCount; ++i) {
+    out << kCounterNames[i] << ' ' << counters_[i] << '\n';
+  }
+  for (std::size_t i = 0; i < kLatencyCount; ++i) {
+    const auto &l = latencies_[i];
+    out << kLatencyNames[i] << "_latency_ns count=" << l.count_
+        << " mean=" << l.mean_ << " p50=" << l.p50_ << " p99=" << l.p99_
+        << " p999=" << l.p999_ << " max=" << l.max_ << '\n';
+  }
+  for (const auto &job : jobs_) {
+    out << "job " << job.name_ << " runs=" << job.runs_
+        << " cpu_ns=" << job.cpu_ns_ << " wall_ns=" << job.wall_ns_
+        << " read_blocks=" << job.read_blocks_
+        << " write_blocks=" << job.write_blocks_ << '\n';
+  }
+  return out.str();
+}
+
+std::string Stats::ToJson() const {
+  std::ostringstream out;
+  out << "{\"index_size\": " << index_size_
+      << ", \"datafile_count\": " << datafile_count_
+      << ", \"pending_files\": " << pending_files_
+      << ", \"background_io_rate\": " << background_io_rate_;
+  for (std::size_t i = 0; i < kCounterCount; ++i) {
+    out << ", \"" << kCounterNames[i] << "\": " << counters_[i];
+  }
+  out << ", \"latency_ns\": {";
+  for (std::size_t i = 0; i < kLatencyCount; ++i) {
+    const auto &l = latencies_[i];
+    out << (i == 0 ? "" : ", ") << '"' << kLatencyNames[i]
+        << "\": {\"count\": " << l.count_ << ", \"mean\": " << l.mean_
+        << ", \"p50\": " << l.p50_ << ", \"p99\": " << l.p99_
+        << ", \"p999\": " << l.p999_ << ", \"max\": " << l.max_ << '}';
+  }
+  out << "}, \"jobs\": {";
+  for (std::size_t i = 0; i < jobs_.size(); ++i) {
+    const auto &job = jobs_[i];
+    out << (i == 0 ? "" : ", ") << '"' << job.name_
+        << "\": {\"runs\": " << job.runs_ << ", \"cpu_ns\": " << job.cpu_ns_
+        << ", \"wall_ns\": " << job.wall_ns_
+        << ", \"read_blocks\": " << job.read_blocks_
+        << ", \"write_blocks\": " << job.write_blocks_ << '}';
+  }
+  out << "}}";
+  return out.str();
+}
+}  // namespace karu::metrics
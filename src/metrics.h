@@ -0,0 +1,158 @@
+#ifndef _KARU_METRICS_H
+#define _KARU_METRICS_H
+
+#include <absl/synchronization/mutex.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../third_party/parallel_hashmap/phmap.h"
+#include "histogram.h"
+
+namespace karu::metrics {
+enum Counter : std::size_t {
+  kBytesRead,
+  kBytesWritten,
+  kReadSyscalls,
+  kWriteSyscalls,
+  kBloomNegatives,       // lookups the bloom filter answered on its own
+  kBloomFalsePositives,  // bloom filter said yes, but the key was missing
+  kGcBytesPunched,       // bytes released by punching holes into datafiles
+  kGcFilesRemoved,       // datafiles without any live records
+  kGcFilesRewritten,     // datafiles whose live records were moved
+  kGcHotKeysMoved,       // keys moved into hot datafiles
+  kIoPreempted,          // background requests that waited for foreground
+  kIoThrottled,          // background requests the rate limiter delayed
+  kIoThrottledNanos,     // total time background requests were delayed
+  kIoRateDecreases,      // rate limiter tuned down for foreground latency
+  kIoRateIncreases,      // and back up again
+  kCounterCount,
+};
+
+enum Latency : std::size_t {
+  kGetLatency,
+  kInsertLatency,
+  kFlushLatency,
+  kRotationLatency,
+  kLatencyCount,
+};
+
+constexpr const char *kCounterNames[kCounterCount] = {
+    "bytes_read",         "bytes_written",
+    "read_syscalls",      "write_syscalls",
+    "bloom_negatives",    "bloom_false_positives",
+    "gc_bytes_punched",   "gc_files_removed",
+    "gc_files_rewritten", "gc_hot_keys_moved",
+    "io_preempted",       "io_throttled",
+    "io_throttled_ns",    "io_rate_decreases",
+    "io_rate_increases"};
+constexpr const char *kLatencyNames[kLatencyCount] = {"get", "insert", "flush",
+                                                      "rotation"};
+
+struct LatencySummary {
+  std::uint64_t count_ = 0;
+  double mean_ = 0;
+  std::uint64_t p50_ = 0;
+  std::uint64_t p99_ = 0;
+  std::uint64_t p999_ = 0;
+  std::uint64_t max_ = 0;
+};
+
+// the resources used by all runs of one kind of background job. The I/O is
+// counted in 512 byte blocks that actually hit the disk.
+struct JobSummary {
+  std::string name_;
+  std::uint64_t runs_ = 0;
+  std::uint64_t cpu_ns_ = 0;
+  std::uint64_t wall_ns_ = 0;
+  std::uint64_t read_blocks_ = 0;
+  std::uint64_t write_blocks_ = 0;
+};
+
+// Stats is a point in time copy of the metrics of a DB. The latencies are in
+// nanoseconds.
+struct Stats {
+  std::array<std::uint64_t, kCounterCount> counters_{};
+  std::array<LatencySummary, kLatencyCount> latencies_{};
+  std::uint64_t index_size_ = 0;
+  std::uint64_t datafile_count_ = 0;
+  // datafiles that the background load hasn't added to the keydir yet.
+  std::uint64_t pending_files_ = 0;
+  // bytes per second background work may currently use, 0 if it's not
+  // limited.
+  std::uint64_t background_io_rate_ = 0;
+  std::vector<JobSummary> jobs_;
+
+  [[nodiscard]] std::string ToText() const;
+  [[nodiscard]] std::string ToJson() const;
+};
+
+// the metrics written by a single thread. Only the owning thread writes into
+// it, so updating a counter is a plain load and store without a lock prefix.
+struct ThreadMetrics {
+  std::array<std::atomic<std::uint64_t>, kCounterCount> counters_{};
+  Histogram latencies_[kLatencyCount];
+};
+
+// Registry holds the metrics of a single DB. Each thread writes into its own
+// ThreadMetrics, which is found through a thread local cache, such that the
+// hot path never takes a lock. Collect merges all of the threads.
+class Registry {
+ public:
+  Registry();
+  Registry &operator=(const Registry &) = delete;
+  Registry(const Registry &) = delete;
+
+  void Add(Counter counter, std::uint64_t value = 1) noexcept;
+  void Record(Latency latency, std::uint64_t nanos) noexcept;
+  [[nodiscard]] Stats Collect() const noexcept;
+  // the number and the sum of the recorded latencies, without merging the
+  // histograms like Collect does.
+  [[nodiscard]] std::pair<std::uint64_t, std::uint64_t> LatencyTotals(
+      Latency latency) const noexcept;
+
+ private:
+  ThreadMetrics &Local() noexcept;
+
+  const std::uint64_t id_;
+  mutable absl::Mutex mutex_;
+  phmap::flat_hash_map<std::thread::id, std::unique_ptr<ThreadMetrics>>
+      threads_;
+};
+
+// records the time from construction until destruction into the registry.
+// Does nothing if the registry is nullptr.
+class ScopedLatency {
+ public:
+  ScopedLatency(Registry *registry, Latency latency)
+      : registry_(registry),
+        latency_(latency),
+        start_(registry != nullptr ? std::chrono::steady_clock::now()
+                                   : std::chrono::steady_clock::time_point{}) {
+  }
+  ~ScopedLatency() {
+    if (registry_ != nullptr) {
+      registry_->Record(latency_,
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start_)
+                            .count());
+    }
+  }
+  ScopedLatency &operator=(const ScopedLatency &) = delete;
+  ScopedLatency(const ScopedLatency &) = delete;
+
+ private:
+  Registry *registry_;
+  Latency latency_;
+  std::chrono::steady_clock::time_point start_;
+};
+}  // namespace karu::metrics
+
+#endif
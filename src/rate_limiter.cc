@@ -0,0 +1,121 @@
+#include "rate_limiter.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace karu::io {
+using Clock = std::chrono::steady_clock;
+
+RateLimiter::RateLimiter(std::uint64_t bytes_per_second,
+                         std::chrono::nanoseconds target_latency,
+                         metrics::Registry *metrics)
+    : max_rate_(std::max<std::uint64_t>(bytes_per_second, 1)),
+      target_latency_(target_latency),
+      metrics_(metrics),
+      rate_(max_rate_),
+      tokens_(0),
+      last_refill_(Clock::now()),
+      last_tune_(last_refill_) {}
+
+void RateLimiter::Refill(Clock::time_point now) noexcept {
+  const std::chrono::duration<double> elapsed = now - last_refill_;
+  const auto rate = static_cast<double>(Rate());
+  const std::chrono::duration<double> burst = kRateLimiterBurst;
+  tokens_ = std::min(tokens_ + elapsed.count() * rate, burst.count() * rate);
+  last_refill_ = now;
+}
+
+void RateLimiter::Tune() noexcept {
+  if (target_latency_.count() == 0 || metrics_ == nullptr) {
+    return;
+  }
+  {
+    absl::MutexLock lock(&mutex_);
+    const auto now = Clock::now();
+    if (now - last_tune_ < kRateLimiterTuneInterval) {
+      return;
+    }
+    last_tune_ = now;
+  }
+
+  const auto [gets, sum] = metrics_->LatencyTotals(metrics::kGetLatency);
+  absl::MutexLock lock(&mutex_);
+  // another request may have tuned in between with newer totals.
+  if (gets < last_get_count_) {
+    return;
+  }
+  const std::uint64_t count = gets - last_get_count_;
+  const double mean = count == 0 ? 0
+                                 : static_cast<double>(sum - last_get_sum_) /
+                                       static_cast<double>(count);
+  last_get_count_ = gets;
+  last_get_sum_ = sum;
+
+  const std::uint64_t rate = Rate();
+  const std::uint64_t min_rate = std::max<std::uint64_t>(max_rate_ / 64, 1);
+  const std::uint64_t step = std::max<std::uint64_t>(max_rate_ / 16, 1);
+  std::uint64_t tuned = rate;
+  if (mean > static_cast<double>(target_latency_.count())) {
+    tuned = std::max(rate / 2, min_rate);
+  } else {
+    tuned = std::min(rate + step, max_rate_);
+  }
+  if (tuned != rate) {
+    rate_.store(tuned, std::memory_order_relaxed);
+    metrics_->Add(tuned < rate ? metrics::kIoRateDecreases
+                               : metrics::kIoRateIncreases);
+  }
+}
+
+bool RateLimiter::Request(std::uint64_t bytes,
+                          const absl::Notification *cancel) noexcept {
+  const auto cancelled = [cancel] {
+    return cancel != nullptr && cancel->HasBeenNotified();
+  };
+  // foreground reads go first, but background work isn't starved by them.
+  const auto start = Clock::now();
+  bool preempted = false;
+  while (foreground_.load(std::memory_order_relaxed) > 0 &&
+         Clock::now() - start < kMaxPreemption && !cancelled()) {
+    preempted = true;
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  if (cancelled()) {
+    return false;
+  }
+
+  Tune();
+  std::chrono::nanoseconds wait{0};
+  {
+    absl::MutexLock lock(&mutex_);
+    const auto now = Clock::now();
+    Refill(now);
+    tokens_ -= static_cast<double>(bytes);
+    if (tokens_ < 0) {
+      wait = std::chrono::nanoseconds(static_cast<std::int64_t>(
+          -tokens_ * 1e9 / static_cast<double>(Rate())));
+    }
+  }
+
+  if (metrics_ != nullptr) {
+    if (preempted) {
+      metrics_->Add(metrics::kIoPreempted);
+    }
+    if (wait.count() > 0) {
+      metrics_->Add(metrics::kIoThrottled);
+      metrics_->Add(metrics::kIoThrottledNanos,
+                    static_cast<std::uint64_t>(wait.count()));
+    }
+  }
+  // the debt of a large request can take seconds to pay, a shutdown must not
+  // wait for it.
+  if (wait.count() > 0) {
+    if (cancel == nullptr) {
+      std::this_thread::sleep_for(wait);
+    } else if (cancel->WaitForNotificationWithTimeout(absl::FromChrono(wait))) {
+      return false;
+    }
+  }
+  return true;
+}
+}  // namespace karu::io
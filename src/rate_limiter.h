@@ -0,0 +1,102 @@
+#ifndef _KARU_RATE_LIMITER_H
+#define _KARU_RATE_LIMITER_H
+
+#include <absl/synchronization/mutex.h>
+#include <absl/synchronization/notification.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "metrics.h"
+
+namespace karu::io {
+// the bucket holds at most this much time worth of bytes, such that a
+// background job that was idle doesn't get to burst for long.
+constexpr std::chrono::milliseconds kRateLimiterBurst{100};
+// the rate is tuned at most this often.
+constexpr std::chrono::milliseconds kRateLimiterTuneInterval{100};
+// background I/O waits at most this long for in-flight foreground reads.
+constexpr std::chrono::milliseconds kMaxPreemption{10};
+
+// RateLimiter is a token bucket for the disk bandwidth of background work.
+// Every background read or write asks for its bytes first and sleeps once the
+// bucket is empty. Large requests are let through right away and the debt is
+// paid by sleeping, such that the average stays at the rate.
+//
+// Foreground reads mark themselves with a ForegroundScope and background
+// requests wait for them, bounded by kMaxPreemption. With a target latency
+// the rate follows the mean Get latency of the registry: it is halved while
+// the mean is above the target, down to 1/64 of the maximum rate, and raised
+// by a sixteenth of the maximum rate while it's below.
+class RateLimiter {
+ public:
+  // target_latency of 0 keeps the rate fixed. metrics has to outlive the
+  // limiter.
+  RateLimiter(std::uint64_t bytes_per_second,
+              std::chrono::nanoseconds target_latency,
+              metrics::Registry *metrics);
+  RateLimiter &operator=(const RateLimiter &) = delete;
+  RateLimiter(const RateLimiter &) = delete;
+
+  // blocks until bytes may be read or written by background work. Returns
+  // false right away once cancel is notified, if there is one.
+  bool Request(std::uint64_t bytes,
+               const absl::Notification *cancel = nullptr) noexcept;
+  void BeginForeground() noexcept {
+    foreground_.fetch_add(1, std::memory_order_relaxed);
+  }
+  void EndForeground() noexcept {
+    foreground_.fetch_sub(1, std::memory_order_relaxed);
+  }
+  // the current rate in bytes per second.
+  [[nodiscard]] std::uint64_t Rate() const noexcept {
+    return rate_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  // needs mutex_.
+  void Refill(std::chrono::steady_clock::time_point now) noexcept;
+  // reads the Get latencies without holding mutex_, such that requests
+  // aren't held up by the registry.
+  void Tune() noexcept;
+
+  const std::uint64_t max_rate_;
+  const std::chrono::nanoseconds target_latency_;
+  metrics::Registry *metrics_;
+  std::atomic<std::uint64_t> rate_;
+  std::atomic<std::uint32_t> foreground_{0};
+
+  absl::Mutex mutex_;
+  double tokens_;
+  std::chrono::steady_clock::time_point last_refill_;
+  std::chrono::steady_clock::time_point last_tune_;
+  // the Get latencies at the last tuning, the mean is taken over the window
+  // since then.
+  std::uint64_t last_get_count_ = 0;
+  std::uint64_t last_get_sum_ = 0;
+};
+
+// marks a foreground read for the lifetime of the scope. Does nothing if the
+// limiter is nullptr.
+class ForegroundScope {
+ public:
+  explicit ForegroundScope(RateLimiter *limiter) : limiter_(limiter) {
+    if (limiter_ != nullptr) {
+      limiter_->BeginForeground();
+    }
+  }
+  ~ForegroundScope() {
+    if (limiter_ != nullptr) {
+      limiter_->EndForeground();
+    }
+  }
+  ForegroundScope &operator=(const ForegroundScope &) = delete;
+  ForegroundScope(const ForegroundScope &) = delete;
+
+ private:
+  RateLimiter *limiter_;
+};
+}  // namespace karu::io
+
+#endif
@@ -0,0 +1,125 @@
+#include "record_scanner.h"
+
+#include <absl/status/status.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "encoder.h"
+
+namespace karu::scanner {
+RecordScanner::RecordScanner(const io::FileReader &reader,
+                             std::uint64_t file_size, std::uint32_t buffer_size)
+    : reader_(reader),
+      file_size_(file_size),
+      capacity_(buffer_size),
+      buffer_(new std::uint8_t[buffer_size]) {}
+
+absl::StatusOr<bool> RecordScanner::Ensure(std::uint32_t n) noexcept {
+  if (offset_ >= buffer_offset_ && offset_ + n <= buffer_offset_ + length_) {
+    return true;
+  }
+
+  if (n > capacity_) {
+    return absl::InternalError("record does not fit into the scan buffer.");
+  }
+
+  // move the part of the record we already have to the front of the buffer
+  // and fill the rest of it with the following bytes of the file.
+  std::uint32_t keep = 0;
+  if (offset_ >= buffer_offset_ && offset_ < buffer_offset_ + length_) {
+    keep = static_cast<std::uint32_t>(buffer_offset_ + length_ - offset_);
+    std::memmove(buffer_.get(), &buffer_[offset_ - buffer_offset_], keep);
+  }
+  buffer_offset_ = offset_;
+  length_ = keep;
+
+  while (length_ < n && buffer_offset_ + length_ < file_size_) {
+    if (throttle_ &&
+        !throttle_(std::min<std::uint64_t>(
+            capacity_ - length_, file_size_ - buffer_offset_ - length_))) {
+      return absl::CancelledError("the scan was cancelled.");
+    }
+    auto status = reader_.ReadAt(buffer_offset_ + length_,
+                                 {&buffer_[length_], capacity_ - length_});
+    if (!status.ok()) {
+      return status.status();
+    }
+
+    if (*status == 0) {
+      break;
+    }
+    length_ += static_cast<std::uint32_t>(*status);
+  }
+
+  return length_ >= n;
+}
+
+absl::StatusOr<bool> RecordScanner::Next(Record &record) noexcept {
+  auto status = Ensure(encoder::kFullHeader);
+  if (!status.ok() || !*status) {
+    return status;
+  }
+
+  encoder::FullEncoding encoded(&buffer_[offset_ - buffer_offset_]);
+  std::uint16_t key_length = encoded.Header().KeyLength();
+  std::uint16_t value_length = encoded.Header().ValueLength();
+  if (offset_ + encoded.Size() > file_size_) {
+    return false;
+  }
+
+  // small values are read together with the key.
+  record.value_loaded_ = !encoded.Header().IsTombstoneValue() &&
+                         value_length <= inline_limit_;
+  status = Ensure(encoder::kFullHeader + key_length +
+                  (record.value_loaded_ ? value_length : 0));
+  if (!status.ok() || !*status) {
+    return status;
+  }
+
+  // Ensure may have moved the record to the front of the buffer.
+  encoder::FullEncoding entry(&buffer_[offset_ - buffer_offset_]);
+  record.key_ = entry.Key();
+  record.value_pos_ =
+      static_cast<std::uint32_t>(offset_ + entry.ValueOffset());
+  record.value_size_ = value_length;
+  record.tombstone_ = entry.Header().IsTombstoneValue();
+  record.value_ = record.value_loaded_ ? entry.Value() : absl::string_view();
+
+  offset_ = record.value_pos_ + value_length;
+  return true;
+}
+
+absl::StatusOr<bool> RecordScanner::NextFixed(
+    std::uint32_t size, const std::uint8_t *&record) noexcept {
+  auto status = Ensure(size);
+  if (!status.ok() || !*status) {
+    return status;
+  }
+
+  record = &buffer_[offset_ - buffer_offset_];
+  offset_ += size;
+  return true;
+}
+
+std::uint64_t EstimateRecords(const io::FileReader &reader,
+                              std::uint64_t file_size) noexcept {
+  const std::uint64_t sample =
+      std::min<std::uint64_t>(file_size, kEstimateSampleSize);
+  RecordScanner scanner(reader, sample, kEstimateSampleSize);
+  Record record{};
+  std::uint64_t count = 0;
+  while (true) {
+    auto next = scanner.Next(record);
+    if (!next.ok() || !*next) {
+      break;
+    }
+    ++count;
+  }
+
+  if (count == 0) {
+    return file_size > 0 ? 1 : 0;
+  }
+  return file_size * count / scanner.Offset();
+}
+}  // namespace karu::scanner
@@ -0,0 +1,82 @@
+#ifndef _KARU_RECORD_SCANNER_H
+#define _KARU_RECORD_SCANNER_H
+
+#include <absl/status/statusor.h>
+#include <absl/strings/string_view.h>
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#include "file_io.h"
+
+namespace karu::scanner {
+// EstimateRecords samples this many bytes at the start of a file.
+constexpr std::uint32_t kEstimateSampleSize = 64 * 1024;
+
+// the size of a single sequential read. Records are decoded in place from
+// this buffer, such that scanning a datafile costs one syscall per chunk
+// instead of two per record.
+constexpr std::uint32_t kScanBufferSize = 1 << 20;
+
+struct Record {
+  absl::string_view key_;  // only valid until the next call to Next.
+  std::uint32_t value_pos_;
+  std::uint16_t value_size_;
+  bool tombstone_;
+  // the value itself, only set if value_loaded_, see SetInlineLimit.
+  absl::string_view value_;
+  bool value_loaded_;
+};
+
+// RecordScanner walks the records of a datafile from start to end. Truncated
+// records at the tail of the file, e.g. from a crash in the middle of a write,
+// end the scan.
+class RecordScanner {
+ public:
+  RecordScanner(const io::FileReader &reader, std::uint64_t file_size,
+                std::uint32_t buffer_size = kScanBufferSize);
+  RecordScanner &operator=(const RecordScanner &) = delete;
+  RecordScanner(const RecordScanner &) = delete;
+
+  // decodes the next record into record. Returns false once there are no more
+  // complete records in the file.
+  absl::StatusOr<bool> Next(Record &record) noexcept;
+  // points record at the next size bytes, for datafiles of headerless
+  // records that are all size bytes long, see TypedDB. Returns false once
+  // fewer than size bytes are left.
+  absl::StatusOr<bool> NextFixed(std::uint32_t size,
+                                 const std::uint8_t *&record) noexcept;
+  // continues the scan at offset, which has to be the start of a record.
+  void Seek(std::uint64_t offset) noexcept { offset_ = offset; }
+  // values of at most limit bytes are returned with their record.
+  void SetInlineLimit(std::size_t limit) noexcept { inline_limit_ = limit; }
+  // throttle is called before every read of the file. Next returns
+  // Cancelled once it returns false.
+  void SetThrottle(io::Throttle throttle) noexcept {
+    throttle_ = std::move(throttle);
+  }
+  [[nodiscard]] std::uint64_t Offset() const noexcept { return offset_; }
+
+ private:
+  // makes sure that the n bytes starting at offset_ are in the buffer.
+  absl::StatusOr<bool> Ensure(std::uint32_t n) noexcept;
+
+  const io::FileReader &reader_;
+  const std::uint64_t file_size_;
+  const std::uint32_t capacity_;
+  std::unique_ptr<std::uint8_t[]> buffer_;
+  std::uint64_t buffer_offset_ = 0;  // file offset of buffer_[0]
+  std::uint32_t length_ = 0;         // number of valid bytes in buffer_
+  std::uint64_t offset_ = 0;         // file offset of the next record
+  std::size_t inline_limit_ = 0;
+  io::Throttle throttle_;
+};
+
+// extrapolates the number of records in a datafile of file_size bytes from
+// the ones in its first kEstimateSampleSize bytes.
+std::uint64_t EstimateRecords(const io::FileReader &reader,
+                              std::uint64_t file_size) noexcept;
+}  // namespace karu::scanner
+
+#endif
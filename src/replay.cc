@@ -0,0 +1,144 @@
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "capture.h"
+#include "karu.h"
+
+// karu_replay runs a trace recorded with DBConfig::capture_path_ against a
+// fresh database directory.
+namespace {
+constexpr const char *kOpNames[karu::capture::kOpCount] = {
+    "", "get", "get_miss", "insert", "delete"};
+
+struct Options {
+  std::string trace_path_;
+  std::string directory_ = "./karu_replay_db";
+  bool hint_files_ = true;
+  std::string json_path_;
+  karu::capture::ReplayOptions replay_;
+};
+
+void print_usage() {
+  std::cerr << "usage: karu_replay --trace=PATH [flags]\n"
+               "  --directory=PATH    database directory, wiped on start\n"
+               "  --speed=X           1 replays at the captured speed, 2\n"
+               "                      twice as fast, 0 as fast as possible\n"
+               "  --prefill=0|1       insert the keys that are read before\n"
+               "                      they are written\n"
+               "  --hint_files=0|1    write and read hint files\n"
+               "  --json=PATH         also write the results as json\n";
+}
+
+Options parse_options(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto eq = arg.find('=');
+    if (arg.rfind("--", 0) != 0 || eq == std::string::npos) {
+      print_usage();
+      std::exit(1);
+    }
+
+    std::string name = arg.substr(2, eq - 2);
+    std::string value = arg.substr(eq + 1);
+    if (name == "trace") {
+      options.trace_path_ = value;
+    } else if (name == "directory") {
+      options.directory_ = value;
+    } else if (name == "speed") {
+      options.replay_.speed_ = std::stod(value);
+    } else if (name == "prefill") {
+      options.replay_.prefill_ = value != "0";
+    } else if (name == "hint_files") {
+      options.hint_files_ = value != "0";
+    } else if (name == "json") {
+      options.json_path_ = value;
+    } else {
+      print_usage();
+      std::exit(1);
+    }
+  }
+
+  if (options.trace_path_.empty()) {
+    print_usage();
+    std::exit(1);
+  }
+  return options;
+}
+
+double to_us(std::uint64_t ns) { return static_cast<double>(ns) / 1000.0; }
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options options = parse_options(argc, argv);
+
+  std::filesystem::remove_all(options.directory_);
+  std::filesystem::create_directories(options.directory_);
+
+  karu::capture::ReplayStats stats;
+  karu::metrics::Stats db_stats;
+  {
+    karu::DB db(karu::DBConfig{
+        .hint_files_ = options.hint_files_,
+        .database_directory_ = options.directory_,
+    });
+    auto status = karu::capture::Replay(options.trace_path_, db,
+                                        options.replay_, stats);
+    if (!status.ok()) {
+      std::cerr << "karu_replay: " << status.message() << '\n';
+      return 1;
+    }
+    db_stats = db.GetStats();
+  }
+  std::filesystem::remove_all(options.directory_);
+
+  std::cout << stats.events_ << " events in " << stats.seconds_ << " s ("
+            << static_cast<double>(stats.events_) / stats.seconds_
+            << " ops/s), " << stats.prefilled_ << " keys prefilled, "
+            << stats.misses_ << " unexpected misses, " << stats.errors_
+            << " errors\n";
+  for (int op = 0; op < karu::capture::kOpCount; ++op) {
+    const auto &h = stats.latencies_[op];
+    if (h.Count() == 0) {
+      continue;
+    }
+    std::cout << "  " << kOpNames[op] << ": count=" << h.Count()
+              << " p50=" << to_us(h.Percentile(50))
+              << "us p99=" << to_us(h.Percentile(99))
+              << "us p999=" << to_us(h.Percentile(99.9))
+              << "us max=" << to_us(h.Max()) << "us\n";
+  }
+
+  if (!options.json_path_.empty()) {
+    std::ofstream out(options.json_path_);
+    out << "{\"events\": " << stats.events_
+        << ", \"seconds\": " << stats.seconds_
+        << ", \"speed\": " << options.replay_.speed_
+        << ", \"prefilled\": " << stats.prefilled_
+        << ", \"misses\": " << stats.misses_
+        << ", \"errors\": " << stats.errors_ << ", \"latency_us\": {";
+    bool first = true;
+    for (int op = 0; op < karu::capture::kOpCount; ++op) {
+      const auto &h = stats.latencies_[op];
+      if (h.Count() == 0) {
+        continue;
+      }
+      out << (first ? "" : ", ") << '"' << kOpNames[op]
+          << "\": {\"count\": " << h.Count()
+          << ", \"p50\": " << to_us(h.Percentile(50))
+          << ", \"p99\": " << to_us(h.Percentile(99))
+          << ", \"p999\": " << to_us(h.Percentile(99.9))
+          << ", \"max\": " << to_us(h.Max()) << '}';
+      first = false;
+    }
+    out << "}, \"db\": " << db_stats.ToJson() << "}\n";
+    if (!out) {
+      std::cerr << "karu_replay: could not write " << options.json_path_
+                << '\n';
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,202 @@
+#include "resp.h"
+
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+
+namespace karu::resp {
+// reads a line ending in \r\n starting at pos. Returns false if the line isn't
+// complete yet.
+static bool read_line(absl::string_view input, std::size_t &pos,
+                      absl::string_view &line) noexcept {
+  auto end = input.find("\r\n", pos);
+  if (end == absl::string_view::npos) {
+    return false;
+  }
+
+  line = input.substr(pos, end - pos);
+  pos = end + 2;
+  return true;
+}
+
+static ParseResult parse_inline(absl::string_view input,
+                                std::vector<absl::string_view> &args,
+                                std::size_t &consumed) noexcept {
+  auto end = input.find('\n');
+  if (end == absl::string_view::npos) {
+    return input.size() > kMaxBulkLength ? ParseResult::kError
+                                         : ParseResult::kIncomplete;
+  }
+
+  absl::string_view line = input.substr(0, end);
+  if (!line.empty() && line.back() == '\r') {
+    line.remove_suffix(1);
+  }
+  for (absl::string_view arg : absl::StrSplit(line, ' ', absl::SkipEmpty())) {
+    args.push_back(arg);
+  }
+  consumed = end + 1;
+  return ParseResult::kCommand;
+}
+
+ParseResult ParseCommand(absl::string_view input,
+                         std::vector<absl::string_view> &args,
+                         std::size_t &consumed) noexcept {
+  args.clear();
+  if (input.empty()) {
+    return ParseResult::kIncomplete;
+  }
+
+  if (input[0] != '*') {
+    return parse_inline(input, args, consumed);
+  }
+
+  std::size_t pos = 1;
+  absl::string_view line;
+  if (!read_line(input, pos, line)) {
+    return ParseResult::kIncomplete;
+  }
+
+  std::int64_t count = 0;
+  if (!absl::SimpleAtoi(line, &count) || count < 0 ||
+      static_cast<std::size_t>(count) > kMaxArguments) {
+    return ParseResult::kError;
+  }
+
+  for (std::int64_t i = 0; i < count; ++i) {
+    if (pos >= input.size()) {
+      return ParseResult::kIncomplete;
+    }
+    if (input[pos] != '$') {
+      return ParseResult::kError;
+    }
+
+    ++pos;
+    if (!read_line(input, pos, line)) {
+      return ParseResult::kIncomplete;
+    }
+
+    std::int64_t length = 0;
+    if (!absl::SimpleAtoi(line, &length) || length < 0 ||
+        static_cast<std::size_t>(length) > kMaxBulkLength) {
+      return ParseResult::kError;
+    }
+
+    if (input.size() < pos + length + 2) {
+      return ParseResult::kIncomplete;
+    }
+    if (input.substr(pos + length, 2) != "\r\n") {
+      return ParseResult::kError;
+    }
+
+    args.push_back(input.substr(pos, length));
+    pos += length + 2;
+  }
+
+  consumed = pos;
+  return ParseResult::kCommand;
+}
+
+// nested arrays deeper than this are rejected.
+constexpr int kMaxReplyDepth = 8;
+
+static ParseResult parse_reply(absl::string_view input, std::size_t &pos,
+                               Reply &reply, int depth) noexcept {
+  if (pos >= input.size()) {
+    return ParseResult::kIncomplete;
+  }
+  const char type = input[pos++];
+  absl::string_view line;
+  if (!read_line(input, pos, line)) {
+    return ParseResult::kIncomplete;
+  }
+
+  switch (type) {
+    case '+':
+      reply = {ReplyType::kSimpleString, line};
+      return ParseResult::kCommand;
+    case '-':
+      reply = {ReplyType::kError, line};
+      return ParseResult::kCommand;
+    case ':':
+      reply = {ReplyType::kInteger, line};
+      return ParseResult::kCommand;
+    case '$':
+    case '*':
+      break;
+    default:
+      return ParseResult::kError;
+  }
+
+  std::int64_t length = 0;
+  if (!absl::SimpleAtoi(line, &length) || length < -1) {
+    return ParseResult::kError;
+  }
+  if (length == -1) {
+    reply = {ReplyType::kNull, {}};
+    return ParseResult::kCommand;
+  }
+
+  if (type == '$') {
+    if (input.size() < pos + length + 2) {
+      return ParseResult::kIncomplete;
+    }
+    if (input.substr(pos + length, 2) != "\r\n") {
+      return ParseResult::kError;
+    }
+    reply = {ReplyType::kBulkString, input.substr(pos, length)};
+    pos += length + 2;
+    return ParseResult::kCommand;
+  }
+
+  if (depth >= kMaxReplyDepth) {
+    return ParseResult::kError;
+  }
+  const std::size_t start = pos;
+  Reply element{};
+  for (std::int64_t i = 0; i < length; ++i) {
+    if (auto result = parse_reply(input, pos, element, depth + 1);
+        result != ParseResult::kCommand) {
+      return result;
+    }
+  }
+  reply = {ReplyType::kArray, input.substr(start, pos - start)};
+  return ParseResult::kCommand;
+}
+
+ParseResult ParseReply(absl::string_view input, Reply &reply,
+                       std::size_t &consumed) noexcept {
+  std::size_t pos = 0;
+  auto result = parse_reply(input, pos, reply, 0);
+  if (result == ParseResult::kCommand) {
+    consumed = pos;
+  }
+  return result;
+}
+
+void AppendSimpleString(std::string &out, absl::string_view value) {
+  absl::StrAppend(&out, "+", value, "\r\n");
+}
+
+void AppendError(std::string &out, absl::string_view message) {
+  absl::StrAppend(&out, "-", message, "\r\n");
+}
+
+void AppendInteger(std::string &out, std::int64_t value) {
+  absl::StrAppend(&out, ":", value, "\r\n");
+}
+
+void AppendBulkHeader(std::string &out, std::size_t length) {
+  absl::StrAppend(&out, "$", length, "\r\n");
+}
+
+void AppendBulkString(std::string &out, absl::string_view value) {
+  absl::StrAppend(&out, "$", value.size(), "\r\n", value, "\r\n");
+}
+
+void AppendNull(std::string &out) { out.append("$-1\r\n"); }
+
+void AppendArrayHeader(std::string &out, std::size_t length) {
+  absl::StrAppend(&out, "*", length, "\r\n");
+}
+}  // namespace karu::resp
@@ -0,0 +1,62 @@
+#ifndef _KARU_RESP_H
+#define _KARU_RESP_H
+
+#include <absl/strings/string_view.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace karu::resp {
+// requests bigger than this are rejected, such that a client can't make the
+// server buffer an unbounded amount of memory.
+constexpr std::size_t kMaxBulkLength = 1 << 20;
+constexpr std::size_t kMaxArguments = 1 << 16;
+
+enum class ParseResult {
+  kCommand,     // a full command (or reply) was parsed
+  kIncomplete,  // more data is needed
+  kError,       // the input is not valid RESP
+};
+
+// ParseCommand parses a single command from the start of input. Commands are
+// either RESP arrays of bulk strings, which is what redis-cli and the client
+// libraries send, or inline commands separated by spaces. On success args
+// point into input and consumed is set to the length of the command.
+ParseResult ParseCommand(absl::string_view input,
+                         std::vector<absl::string_view> &args,
+                         std::size_t &consumed) noexcept;
+
+enum class ReplyType {
+  kSimpleString,
+  kError,
+  kInteger,
+  kBulkString,
+  kNull,
+  kArray,
+};
+
+// a reply sent by the server. value_ is the payload of strings, errors and
+// integers and the encoded elements of arrays.
+struct Reply {
+  ReplyType type_;
+  absl::string_view value_;
+};
+
+// ParseReply parses a single reply from the start of input, this is the
+// client side of ParseCommand.
+ParseResult ParseReply(absl::string_view input, Reply &reply,
+                       std::size_t &consumed) noexcept;
+
+// helpers for appending replies to an output buffer.
+void AppendSimpleString(std::string &out, absl::string_view value);
+void AppendError(std::string &out, absl::string_view message);
+void AppendInteger(std::string &out, std::int64_t value);
+void AppendBulkHeader(std::string &out, std::size_t length);
+void AppendBulkString(std::string &out, absl::string_view value);
+void AppendNull(std::string &out);
+void AppendArrayHeader(std::string &out, std::size_t length);
+}  // namespace karu::resp
+
+#endif
@@ -0,0 +1,1075 @@
+#include "server.h"
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory_resource>
+#include <optional>
+#include <thread>
+#include <utility>
+
+#include "../third_party/parallel_hashmap/phmap.h"
+#include "encoder.h"
+#include "hash.h"
+#include "resp.h"
+#include "spsc_queue.h"
+
+namespace karu::server {
+// epoll data of the listening socket and the eventfd, connections use ids
+// from kFirstConnectionId on. Ids are never reused, unlike file descriptors,
+// so replies from other shards can't end up on a newer connection.
+constexpr std::uint64_t kListenId = 0;
+constexpr std::uint64_t kWakeId = 1;
+constexpr std::uint64_t kFirstConnectionId = 2;
+// SCAN cursors store the shard in the top bits and the cursor of the shard's
+// DB::Scan in the rest.
+constexpr int kScanShardShift = 48;
+constexpr std::uint64_t kScanCursorMask = (std::uint64_t{1} << 48) - 1;
+
+// the memory a GET reads its value into. Small values go into a scratch
+// buffer and are copied into the output, large ones into a string that
+// becomes an output chunk of its own, so they aren't copied at all.
+class ValueResource : public std::pmr::memory_resource {
+ public:
+  std::string TakeLarge() noexcept { return std::move(large_); }
+
+ private:
+  void *do_allocate(std::size_t bytes, std::size_t) override {
+    if (bytes < kZeroCopyThreshold) {
+      return small_;
+    }
+    large_.resize(bytes);
+    return large_.data();
+  }
+  void do_deallocate(void *, std::size_t, std::size_t) override {}
+  bool do_is_equal(
+      const std::pmr::memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+
+  char small_[kZeroCopyThreshold];
+  std::string large_;
+};
+
+static absl::Status errno_status(absl::string_view what) noexcept {
+  return absl::InternalError(absl::StrCat(what, ": ", std::strerror(errno)));
+}
+
+std::size_t ShardOf(absl::string_view key, std::size_t shard_count) noexcept {
+  // the keydir uses the low bits of the same hash, so the shard is picked
+  // from the high bits such that every shard still sees well spread hashes.
+  std::uint64_t high = hash::HashKey(key) >> 32;
+  return static_cast<std::size_t>((high * shard_count) >> 32);
+}
+
+bool MatchGlob(absl::string_view pattern, absl::string_view str) noexcept {
+  // iterative matching with backtracking to the last star.
+  std::size_t p = 0, s = 0;
+  std::size_t star = absl::string_view::npos, star_s = 0;
+  while (s < str.size()) {
+    if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == str[s])) {
+      ++p;
+      ++s;
+    } else if (p < pattern.size() && pattern[p] == '*') {
+      star = p++;
+      star_s = s;
+    } else if (star != absl::string_view::npos) {
+      p = star + 1;
+      s = ++star_s;
+    } else {
+      return false;
+    }
+  }
+
+  while (p < pattern.size() && pattern[p] == '*') {
+    ++p;
+  }
+  return p == pattern.size();
+}
+
+// a piece of output. Replies that are computed by another shard reserve a
+// chunk with a non-zero slot_, and the output stops at that chunk until the
+// reply has arrived.
+struct Chunk {
+  std::string data_;
+  std::uint64_t slot_ = 0;
+};
+
+struct Connection {
+  std::uint64_t id_;
+  int fd_;
+  std::string input_;
+  // output_ holds the replies that have not been written yet and
+  // output_offset_ how much of the first chunk has already been written.
+  std::deque<Chunk> output_;
+  std::size_t output_offset_ = 0;
+  bool writable_ = false;  // if we are waiting for EPOLLOUT
+  bool closing_ = false;   // close once all of the output has been written
+};
+
+// a function that is run on the worker it is sent to.
+using Task = std::function<void(Worker &)>;
+
+// Partition groups the items of a multi key command by shard.
+struct Partition {
+  std::vector<std::size_t> shards_;              // shard of every part
+  std::vector<std::vector<std::size_t>> items_;  // items of every part
+  std::vector<std::size_t> part_of_;             // part of every item
+};
+
+template <typename ShardOfItem>
+static Partition make_partition(std::size_t item_count,
+                                std::size_t shard_count,
+                                ShardOfItem shard_of) {
+  Partition partition;
+  std::vector<std::size_t> part_of_shard(shard_count, SIZE_MAX);
+  partition.part_of_.resize(item_count);
+  for (std::size_t i = 0; i < item_count; ++i) {
+    std::size_t shard = shard_of(i);
+    if (part_of_shard[shard] == SIZE_MAX) {
+      part_of_shard[shard] = partition.shards_.size();
+      partition.shards_.push_back(shard);
+      partition.items_.emplace_back();
+    }
+    partition.part_of_[i] = part_of_shard[shard];
+    partition.items_[part_of_shard[shard]].push_back(i);
+  }
+  return partition;
+}
+
+// Worker is the event loop of a single shard.
+class Worker {
+ public:
+  Worker(Server &server, std::size_t index, DB &db) noexcept;
+  ~Worker();
+
+  absl::Status Listen(const std::string &address, std::uint16_t port) noexcept;
+  [[nodiscard]] std::uint16_t Port() const noexcept { return port_; }
+  absl::Status Run() noexcept;
+  // wakes up the event loop, can be called from any thread.
+  void Wake() noexcept;
+
+ private:
+  friend class Server;
+
+  template <typename Result>
+  struct ScatterState {
+    std::vector<Result> results_;
+    std::size_t remaining_;
+    std::function<void(std::vector<Result> &, std::string &)> finish_;
+    std::uint64_t connection_;
+    std::uint64_t slot_;
+  };
+
+  void Accept() noexcept;
+  void Close(Connection &conn) noexcept;
+  // returns false if the connection was closed.
+  bool HandleRead(Connection &conn) noexcept;
+  bool HandleWrite(Connection &conn) noexcept;
+  void HandleCommands(Connection &conn) noexcept;
+  void HandleCommand(Connection &conn,
+                     const std::vector<absl::string_view> &args) noexcept;
+  void FlushSets(Connection &conn) noexcept;
+
+  void HandleGet(Connection &conn, absl::string_view key) noexcept;
+  void HandleMultiGet(Connection &conn,
+                      const std::vector<absl::string_view> &args) noexcept;
+  void HandleDelete(Connection &conn,
+                    const std::vector<absl::string_view> &args) noexcept;
+  void HandleScan(Connection &conn,
+                  const std::vector<absl::string_view> &args) noexcept;
+  // looks up the keys in this worker's shard.
+  std::vector<std::optional<std::string>> Lookup(
+      const std::vector<std::string> &keys) noexcept;
+
+  // Scatter runs work for every part on the worker of its shard and calls
+  // finish on this worker with all of the results to produce the reply. The
+  // parts of this worker's own shard are run right away.
+  template <typename Result>
+  void Scatter(
+      Connection &conn, const std::vector<std::size_t> &shards,
+      std::function<Result(Worker &, std::size_t)> work,
+      std::function<void(std::vector<Result> &, std::string &)> finish);
+  void Send(std::size_t target, Task task) noexcept;
+  // pushes the queued tasks to the other workers and wakes them up. Returns
+  // true if some tasks didn't fit in the queues.
+  bool FlushOutbox() noexcept;
+  void DrainInbox() noexcept;
+  // sets the reply of a slot reserved by Scatter.
+  void Complete(std::uint64_t connection, std::uint64_t slot,
+                std::string reply) noexcept;
+
+  // returns the chunk small replies should be appended to.
+  std::string &Output(Connection &conn) noexcept;
+  void OutputValue(Connection &conn, std::string value) noexcept;
+  [[nodiscard]] std::size_t Shard(absl::string_view key) const noexcept {
+    return ShardOf(key, server_.workers_.size());
+  }
+
+  Server &server_;
+  std::size_t index_;
+  DB &db_;
+  std::uint16_t port_ = 0;
+  int listen_fd_ = -1;
+  int epoll_fd_ = -1;
+  int wake_fd_ = -1;
+
+  phmap::flat_hash_map<std::uint64_t, std::unique_ptr<Connection>>
+      connections_;
+  std::uint64_t next_connection_ = kFirstConnectionId;
+  std::uint64_t next_slot_ = 1;
+  // SETs waiting to be written. The views point into the input buffer of the
+  // connection that is being handled.
+  std::vector<std::pair<absl::string_view, absl::string_view>> pending_sets_;
+  std::string multiget_buffer_;
+
+  // inbox_[i] holds the tasks sent by worker i. Tasks that don't fit into
+  // the queue of another worker wait in outbox_ until they do.
+  std::vector<std::unique_ptr<SpscQueue<Task>>> inbox_;
+  std::vector<std::deque<Task>> outbox_;
+  std::vector<bool> wake_;
+};
+
+Worker::Worker(Server &server, std::size_t index, DB &db) noexcept
+    : server_(server), index_(index), db_(db) {}
+
+Worker::~Worker() {
+  for (auto &[id, conn] : connections_) {
+    ::close(conn->fd_);
+  }
+  for (int fd : {listen_fd_, epoll_fd_, wake_fd_}) {
+    if (fd != -1) {
+      ::close(fd);
+    }
+  }
+}
+
+absl::Status Worker::Listen(const std::string &address,
+                            std::uint16_t port) noexcept {
+  listen_fd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (listen_fd_ == -1) {
+    return errno_status("socket");
+  }
+
+  // every worker has its own listening socket on the same port, the kernel
+  // spreads the incoming connections between them.
+  int one = 1;
+  ::setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (::setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) ==
+      -1) {
+    return errno_status("SO_REUSEPORT");
+  }
+
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (::inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+    return absl::InvalidArgumentError("invalid listen address");
+  }
+
+  if (::bind(listen_fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) ==
+      -1) {
+    return errno_status("bind");
+  }
+  if (::listen(listen_fd_, SOMAXCONN) == -1) {
+    return errno_status("listen");
+  }
+
+  socklen_t len = sizeof(addr);
+  ::getsockname(listen_fd_, reinterpret_cast<sockaddr *>(&addr), &len);
+  port_ = ntohs(addr.sin_port);
+
+  epoll_fd_ = ::epoll_create1(0);
+  wake_fd_ = ::eventfd(0, EFD_NONBLOCK);
+  if (epoll_fd_ == -1 || wake_fd_ == -1) {
+    return errno_status("epoll");
+  }
+
+  for (auto [fd, id] : {std::pair{listen_fd_, kListenId},
+                        std::pair{wake_fd_, kWakeId}}) {
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = id;
+    if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) == -1) {
+      return errno_status("epoll_ctl");
+    }
+  }
+
+  return absl::OkStatus();
+}
+
+void Worker::Wake() noexcept {
+  std::uint64_t value = 1;
+  [[maybe_unused]] auto written = ::write(wake_fd_, &value, sizeof(value));
+}
+
+absl::Status Worker::Run() noexcept {
+  epoll_event events[kMaxEvents];
+  while (!server_.stopping_.load(std::memory_order_acquire)) {
+    // don't block while some tasks are still waiting for room in a queue.
+    int timeout = FlushOutbox() ? 0 : -1;
+    int count = ::epoll_wait(epoll_fd_, events, kMaxEvents, timeout);
+    if (count == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno_status("epoll_wait");
+    }
+
+    for (int i = 0; i < count; ++i) {
+      std::uint64_t id = events[i].data.u64;
+      if (id == kWakeId) {
+        // reset the eventfd before draining the queues, such that a task
+        // pushed after the drain wakes us up again.
+        std::uint64_t value;
+        [[maybe_unused]] auto n = ::read(wake_fd_, &value, sizeof(value));
+        continue;
+      }
+      if (id == kListenId) {
+        Accept();
+        continue;
+      }
+
+      auto it = connections_.find(id);
+      if (it == connections_.end()) {
+        continue;
+      }
+
+      Connection &conn = *it->second;
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        Close(conn);
+        continue;
+      }
+      if ((events[i].events & EPOLLIN) && !HandleRead(conn)) {
+        continue;
+      }
+      if (events[i].events & EPOLLOUT) {
+        HandleWrite(conn);
+      }
+    }
+
+    DrainInbox();
+  }
+
+  return absl::OkStatus();
+}
+
+void Worker::Accept() noexcept {
+  while (true) {
+    int fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK);
+    if (fd == -1) {
+      return;  // EAGAIN or the client already went away
+    }
+
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    auto conn = std::make_unique<Connection>();
+    conn->id_ = next_connection_++;
+    conn->fd_ = fd;
+
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = conn->id_;
+    if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) == -1) {
+      ::close(fd);
+      continue;
+    }
+    connections_[conn->id_] = std::move(conn);
+  }
+}
+
+void Worker::Close(Connection &conn) noexcept {
+  ::epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, conn.fd_, nullptr);
+  ::close(conn.fd_);
+  connections_.erase(conn.id_);
+}
+
+bool Worker::HandleRead(Connection &conn) noexcept {
+  while (true) {
+    std::size_t old_size = conn.input_.size();
+    conn.input_.resize(old_size + kReadSize);
+    ssize_t n = ::read(conn.fd_, conn.input_.data() + old_size, kReadSize);
+    conn.input_.resize(old_size + (n > 0 ? n : 0));
+    if (n == 0) {
+      Close(conn);
+      return false;
+    }
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      Close(conn);
+      return false;
+    }
+    if (static_cast<std::size_t>(n) < kReadSize) {
+      break;
+    }
+  }
+
+  HandleCommands(conn);
+  return HandleWrite(conn);
+}
+
+bool Worker::HandleWrite(Connection &conn) noexcept {
+  while (!conn.output_.empty() && conn.output_.front().slot_ == 0) {
+    ::iovec iov[IOV_MAX];
+    int iov_count = 0;
+    std::size_t offset = conn.output_offset_;
+    for (auto it = conn.output_.begin(); it != conn.output_.end() &&
+                                         it->slot_ == 0 && iov_count < IOV_MAX;
+         ++it) {
+      iov[iov_count].iov_base = it->data_.data() + offset;
+      iov[iov_count].iov_len = it->data_.size() - offset;
+      ++iov_count;
+      offset = 0;
+    }
+
+    ssize_t n = ::writev(conn.fd_, iov, iov_count);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      Close(conn);
+      return false;
+    }
+
+    auto written = static_cast<std::size_t>(n);
+    while (!conn.output_.empty() && conn.output_.front().slot_ == 0) {
+      std::size_t left =
+          conn.output_.front().data_.size() - conn.output_offset_;
+      if (written < left) {
+        conn.output_offset_ += written;
+        break;
+      }
+      written -= left;
+      conn.output_.pop_front();
+      conn.output_offset_ = 0;
+    }
+  }
+
+  if (conn.output_.empty() && conn.closing_) {
+    Close(conn);
+    return false;
+  }
+
+  // only ask for EPOLLOUT while there is output that could be written,
+  // otherwise the level triggered loop would keep waking up.
+  bool want_write =
+      !conn.output_.empty() && conn.output_.front().slot_ == 0;
+  if (want_write != conn.writable_) {
+    epoll_event event{};
+    event.events = EPOLLIN;
+    if (want_write) {
+      event.events |= EPOLLOUT;
+    }
+    event.data.u64 = conn.id_;
+    ::epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, conn.fd_, &event);
+    conn.writable_ = want_write;
+  }
+  return true;
+}
+
+void Worker::HandleCommands(Connection &conn) noexcept {
+  absl::string_view input = conn.input_;
+  std::size_t pos = 0;
+  std::vector<absl::string_view> args;
+  while (pos < input.size() && !conn.closing_) {
+    args.clear();
+    std::size_t consumed = 0;
+    auto result = resp::ParseCommand(input.substr(pos), args, consumed);
+    if (result == resp::ParseResult::kIncomplete) {
+      break;
+    }
+    if (result == resp::ParseResult::kError) {
+      FlushSets(conn);
+      resp::AppendError(Output(conn), "ERR Protocol error");
+      conn.closing_ = true;
+      break;
+    }
+
+    pos += consumed;
+    if (!args.empty()) {
+      HandleCommand(conn, args);
+    }
+  }
+
+  // the pending sets point into the input, so they are written before the
+  // input is discarded.
+  FlushSets(conn);
+  conn.input_.erase(0, pos);
+}
+
+void Worker::HandleCommand(
+    Connection &conn, const std::vector<absl::string_view> &args) noexcept {
+  std::string command = absl::AsciiStrToUpper(args[0]);
+  if (command == "SET") {
+    if (args.size() != 3) {
+      FlushSets(conn);
+      resp::AppendError(Output(conn),
+                        "ERR wrong number of arguments for 'set' command");
+    } else if (args[1].size() > kMaxKeySize ||
+               args[2].size() >= encoder::kTombstone) {
+      FlushSets(conn);
+      resp::AppendError(Output(conn), "ERR key or value is too large");
+    } else {
+      pending_sets_.emplace_back(args[1], args[2]);
+    }
+    return;
+  }
+
+  // every other command needs to see the result of the earlier sets.
+  FlushSets(conn);
+  if (command == "GET") {
+    if (args.size() != 2) {
+      resp::AppendError(Output(conn),
+                        "ERR wrong number of arguments for 'get' command");
+      return;
+    }
+    HandleGet(conn, args[1]);
+  } else if (command == "MGET") {
+    HandleMultiGet(conn, args);
+  } else if (command == "DEL") {
+    HandleDelete(conn, args);
+  } else if (command == "SCAN") {
+    HandleScan(conn, args);
+  } else if (command == "PING") {
+    if (args.size() > 1) {
+      resp::AppendBulkString(Output(conn), args[1]);
+    } else {
+      resp::AppendSimpleString(Output(conn), "PONG");
+    }
+  } else if (command == "INFO") {
+    // only the shard of the connection is reported.
+    resp::AppendBulkString(Output(conn), db_.GetStats().ToText());
+  } else if (command == "COMMAND") {
+    // redis-cli asks for the command docs when it connects.
+    resp::AppendArrayHeader(Output(conn), 0);
+  } else if (command == "QUIT") {
+    resp::AppendSimpleString(Output(conn), "OK");
+    conn.closing_ = true;
+  } else {
+    resp::AppendError(Output(conn),
+                      absl::StrCat("ERR unknown command '", args[0], "'"));
+  }
+}
+
+void Worker::FlushSets(Connection &conn) noexcept {
+  if (pending_sets_.empty()) {
+    return;
+  }
+
+  auto append_replies = [](std::string &out, std::size_t count,
+                           const absl::Status &status) {
+    for (std::size_t i = 0; i < count; ++i) {
+      if (status.ok()) {
+        resp::AppendSimpleString(out, "OK");
+      } else {
+        resp::AppendError(out, absl::StrCat("ERR ", status.message()));
+      }
+    }
+  };
+
+  auto partition = make_partition(
+      pending_sets_.size(), server_.workers_.size(),
+      [&](std::size_t i) { return Shard(pending_sets_[i].first); });
+  if (partition.shards_.size() == 1 && partition.shards_[0] == index_) {
+    auto status = db_.InsertBatch(pending_sets_);
+    append_replies(Output(conn), pending_sets_.size(), status);
+    pending_sets_.clear();
+    return;
+  }
+
+  // the other shards can't read from our input buffer.
+  struct Plan {
+    Partition partition_;
+    std::vector<std::pair<std::string, std::string>> pairs_;
+  };
+  auto plan = std::make_shared<Plan>();
+  plan->pairs_.reserve(pending_sets_.size());
+  for (const auto &[key, value] : pending_sets_) {
+    plan->pairs_.emplace_back(key, value);
+  }
+  plan->partition_ = std::move(partition);
+  pending_sets_.clear();
+
+  Scatter<absl::Status>(
+      conn, plan->partition_.shards_,
+      [plan](Worker &worker, std::size_t part) {
+        std::vector<std::pair<absl::string_view, absl::string_view>> batch;
+        for (std::size_t i : plan->partition_.items_[part]) {
+          batch.emplace_back(plan->pairs_[i].first, plan->pairs_[i].second);
+        }
+        return worker.db_.InsertBatch(batch);
+      },
+      [plan, append_replies](std::vector<absl::Status> &statuses,
+                             std::string &out) {
+        for (std::size_t part : plan->partition_.part_of_) {
+          append_replies(out, 1, statuses[part]);
+        }
+      });
+}
+
+void Worker::HandleGet(Connection &conn, absl::string_view key) noexcept {
+  auto append_value = [](std::string &out,
+                         const absl::StatusOr<std::string> &value) {
+    if (absl::IsNotFound(value.status())) {
+      resp::AppendNull(out);
+    } else if (!value.ok()) {
+      resp::AppendError(out, absl::StrCat("ERR ", value.status().message()));
+    } else {
+      resp::AppendBulkString(out, *value);
+    }
+  };
+
+  std::size_t shard = Shard(key);
+  if (shard != index_) {
+    Scatter<std::string>(
+        conn, {shard},
+        [key = std::string(key), append_value](Worker &worker, std::size_t) {
+          std::string out;
+          append_value(out, worker.db_.Get(key));
+          return out;
+        },
+        [](std::vector<std::string> &replies, std::string &out) {
+          out += replies[0];
+        });
+    return;
+  }
+
+  // the value is read straight into where it is sent from, see
+  // ValueResource.
+  ValueResource resource;
+  auto value = db_.Get(key, resource);
+  if (!value.ok()) {
+    append_value(Output(conn), value.status());
+  } else if (value->size() < kZeroCopyThreshold) {
+    resp::AppendBulkString(Output(conn), *value);
+  } else {
+    OutputValue(conn, resource.TakeLarge());
+  }
+}
+
+std::vector<std::optional<std::string>> Worker::Lookup(
+    const std::vector<std::string> &keys) noexcept {
+  std::vector<MultiGetResult> results(keys.size());
+  if (multiget_buffer_.empty()) {
+    multiget_buffer_.resize(kOutputChunkSize);
+  }
+
+  auto buffer = [&] {
+    return absl::Span<std::uint8_t>(
+        reinterpret_cast<std::uint8_t *>(multiget_buffer_.data()),
+        multiget_buffer_.size());
+  };
+  auto status = db_.MultiGet(keys, buffer(), absl::MakeSpan(results));
+  if (absl::IsResourceExhausted(status)) {
+    // the results contain the offsets the values would have had, so the last
+    // one tells us how big the buffer needs to be.
+    std::size_t required = 0;
+    for (const auto &result : results) {
+      required = std::max<std::size_t>(required,
+                                       result.offset_ + result.size_);
+    }
+    multiget_buffer_.resize(required);
+    status = db_.MultiGet(keys, buffer(), absl::MakeSpan(results));
+  }
+
+  std::vector<std::optional<std::string>> values(keys.size());
+  for (std::size_t i = 0; status.ok() && i < keys.size(); ++i) {
+    if (results[i].status_.ok()) {
+      values[i] = multiget_buffer_.substr(results[i].offset_, results[i].size_);
+    }
+  }
+  return values;
+}
+
+void Worker::HandleMultiGet(
+    Connection &conn, const std::vector<absl::string_view> &args) noexcept {
+  if (args.size() < 2) {
+    resp::AppendError(Output(conn),
+                      "ERR wrong number of arguments for 'mget' command");
+    return;
+  }
+
+  struct Plan {
+    Partition partition_;
+    std::vector<std::string> keys_;
+  };
+  auto plan = std::make_shared<Plan>();
+  for (std::size_t i = 1; i < args.size(); ++i) {
+    plan->keys_.emplace_back(args[i]);
+  }
+  plan->partition_ =
+      make_partition(plan->keys_.size(), server_.workers_.size(),
+                     [&](std::size_t i) { return Shard(plan->keys_[i]); });
+
+  using Values = std::vector<std::optional<std::string>>;
+  Scatter<Values>(
+      conn, plan->partition_.shards_,
+      [plan](Worker &worker, std::size_t part) {
+        std::vector<std::string> keys;
+        for (std::size_t i : plan->partition_.items_[part]) {
+          keys.push_back(plan->keys_[i]);
+        }
+        return worker.Lookup(keys);
+      },
+      [plan](std::vector<Values> &values, std::string &out) {
+        // the values of every part are in the order of its items.
+        std::vector<std::size_t> next(values.size(), 0);
+        resp::AppendArrayHeader(out, plan->keys_.size());
+        for (std::size_t part : plan->partition_.part_of_) {
+          const auto &value = values[part][next[part]++];
+          if (value.has_value()) {
+            resp::AppendBulkString(out, *value);
+          } else {
+            resp::AppendNull(out);
+          }
+        }
+      });
+}
+
+void Worker::HandleDelete(
+    Connection &conn, const std::vector<absl::string_view> &args) noexcept {
+  if (args.size() < 2) {
+    resp::AppendError(Output(conn),
+                      "ERR wrong number of arguments for 'del' command");
+    return;
+  }
+
+  struct Plan {
+    Partition partition_;
+    std::vector<std::string> keys_;
+  };
+  auto plan = std::make_shared<Plan>();
+  for (std::size_t i = 1; i < args.size(); ++i) {
+    plan->keys_.emplace_back(args[i]);
+  }
+  plan->partition_ =
+      make_partition(plan->keys_.size(), server_.workers_.size(),
+                     [&](std::size_t i) { return Shard(plan->keys_[i]); });
+
+  Scatter<std::int64_t>(
+      conn, plan->partition_.shards_,
+      [plan](Worker &worker, std::size_t part) {
+        std::int64_t deleted = 0;
+        for (std::size_t i : plan->partition_.items_[part]) {
+          if (worker.db_.Delete(plan->keys_[i]).ok()) {
+            ++deleted;
+          }
+        }
+        return deleted;
+      },
+      [](std::vector<std::int64_t> &counts, std::string &out) {
+        std::int64_t deleted = 0;
+        for (auto count : counts) {
+          deleted += count;
+        }
+        resp::AppendInteger(out, deleted);
+      });
+}
+
+void Worker::HandleScan(Connection &conn,
+                        const std::vector<absl::string_view> &args) noexcept {
+  const std::size_t shard_count = server_.workers_.size();
+  std::uint64_t cursor = 0;
+  if (args.size() < 2 || !absl::SimpleAtoi(args[1], &cursor) ||
+      (cursor >> kScanShardShift) >= shard_count) {
+    resp::AppendError(Output(conn), "ERR invalid cursor");
+    return;
+  }
+
+  std::string pattern;
+  std::size_t count = 10;
+  for (std::size_t i = 2; i < args.size(); i += 2) {
+    std::string option = absl::AsciiStrToUpper(args[i]);
+    if (i + 1 >= args.size()) {
+      resp::AppendError(Output(conn), "ERR syntax error");
+      return;
+    }
+    if (option == "MATCH") {
+      pattern = std::string(args[i + 1]);
+    } else if (option == "COUNT" && absl::SimpleAtoi(args[i + 1], &count) &&
+               count > 0) {
+      continue;
+    } else {
+      resp::AppendError(Output(conn), "ERR syntax error");
+      return;
+    }
+  }
+
+  // a cursor walks the shards one after another.
+  std::size_t shard = cursor >> kScanShardShift;
+  Scatter<std::string>(
+      conn, {shard},
+      [=](Worker &worker, std::size_t) {
+        std::vector<std::string> keys;
+        std::uint64_t next =
+            worker.db_.Scan(cursor & kScanCursorMask, count, keys);
+        if (next != 0) {
+          next |= std::uint64_t{shard} << kScanShardShift;
+        } else if (shard + 1 < shard_count) {
+          next = std::uint64_t{shard + 1} << kScanShardShift;
+        }
+
+        if (!pattern.empty()) {
+          keys.erase(std::remove_if(keys.begin(), keys.end(),
+                                    [&](const std::string &key) {
+                                      return !MatchGlob(pattern, key);
+                                    }),
+                     keys.end());
+        }
+
+        std::string out;
+        resp::AppendArrayHeader(out, 2);
+        resp::AppendBulkString(out, absl::StrCat(next));
+        resp::AppendArrayHeader(out, keys.size());
+        for (const auto &key : keys) {
+          resp::AppendBulkString(out, key);
+        }
+        return out;
+      },
+      [](std::vector<std::string> &replies, std::string &out) {
+        out += replies[0];
+      });
+}
+
+template <typename Result>
+void Worker::Scatter(
+    Connection &conn, const std::vector<std::size_t> &shards,
+    std::function<Result(Worker &, std::size_t)> work,
+    std::function<void(std::vector<Result> &, std::string &)> finish) {
+  auto state = std::make_shared<ScatterState<Result>>();
+  state->results_.resize(shards.size());
+  state->remaining_ = shards.size();
+  for (std::size_t part = 0; part < shards.size(); ++part) {
+    if (shards[part] == index_) {
+      state->results_[part] = work(*this, part);
+      --state->remaining_;
+    }
+  }
+
+  if (state->remaining_ == 0) {
+    finish(state->results_, Output(conn));
+    return;
+  }
+
+  // the reply is written once all of the other shards have answered. The
+  // state is only touched on this worker, the other shards just pass it
+  // back.
+  state->finish_ = std::move(finish);
+  state->connection_ = conn.id_;
+  state->slot_ = next_slot_++;
+  conn.output_.push_back(Chunk{.data_ = {}, .slot_ = state->slot_});
+
+  const std::size_t origin = index_;
+  for (std::size_t part = 0; part < shards.size(); ++part) {
+    if (shards[part] == index_) {
+      continue;
+    }
+
+    Send(shards[part], [work, part, origin, state](Worker &worker) {
+      Result result = work(worker, part);
+      worker.Send(origin, [part, state, result = std::move(result)](
+                              Worker &owner) mutable {
+        state->results_[part] = std::move(result);
+        if (--state->remaining_ == 0) {
+          std::string reply;
+          state->finish_(state->results_, reply);
+          owner.Complete(state->connection_, state->slot_, std::move(reply));
+        }
+      });
+    });
+  }
+}
+
+void Worker::Send(std::size_t target, Task task) noexcept {
+  auto &queue = *server_.workers_[target]->inbox_[index_];
+  if (outbox_[target].empty() && queue.TryPush(std::move(task))) {
+    wake_[target] = true;
+    return;
+  }
+  outbox_[target].push_back(std::move(task));
+}
+
+bool Worker::FlushOutbox() noexcept {
+  bool pending = false;
+  for (std::size_t target = 0; target < outbox_.size(); ++target) {
+    auto &outbox = outbox_[target];
+    auto &queue = *server_.workers_[target]->inbox_[index_];
+    while (!outbox.empty() && queue.TryPush(std::move(outbox.front()))) {
+      outbox.pop_front();
+      wake_[target] = true;
+    }
+    pending |= !outbox.empty();
+
+    // one wake up for all of the tasks sent to the worker in this iteration.
+    if (wake_[target]) {
+      server_.workers_[target]->Wake();
+      wake_[target] = false;
+    }
+  }
+  return pending;
+}
+
+void Worker::DrainInbox() noexcept {
+  Task task;
+  for (auto &queue : inbox_) {
+    while (queue != nullptr && queue->TryPop(task)) {
+      task(*this);
+    }
+  }
+}
+
+void Worker::Complete(std::uint64_t connection, std::uint64_t slot,
+                      std::string reply) noexcept {
+  auto it = connections_.find(connection);
+  if (it == connections_.end()) {
+    return;  // the client went away in the meantime
+  }
+
+  Connection &conn = *it->second;
+  for (auto &chunk : conn.output_) {
+    if (chunk.slot_ == slot) {
+      chunk.data_ = std::move(reply);
+      chunk.slot_ = 0;
+      break;
+    }
+  }
+  HandleWrite(conn);
+}
+
+std::string &Worker::Output(Connection &conn) noexcept {
+  if (conn.output_.empty() || conn.output_.back().slot_ != 0 ||
+      conn.output_.back().data_.size() >= kOutputChunkSize ||
+      conn.output_.back().data_.capacity() < kOutputChunkSize) {
+    conn.output_.emplace_back();
+    conn.output_.back().data_.reserve(kOutputChunkSize);
+  }
+  return conn.output_.back().data_;
+}
+
+void Worker::OutputValue(Connection &conn, std::string value) noexcept {
+  if (value.size() < kZeroCopyThreshold) {
+    resp::AppendBulkString(Output(conn), value);
+    return;
+  }
+
+  resp::AppendBulkHeader(Output(conn), value.size());
+  conn.output_.push_back(Chunk{.data_ = std::move(value)});
+  conn.output_.push_back(Chunk{.data_ = "\r\n"});
+}
+
+Server::Server(DB &db, ServerConfig config) noexcept
+    : Server(std::vector<DB *>{&db}, std::move(config)) {}
+
+Server::Server(const std::vector<DB *> &shards, ServerConfig config) noexcept
+    : config_(std::move(config)) {
+  for (std::size_t i = 0; i < shards.size(); ++i) {
+    workers_.push_back(std::make_unique<Worker>(*this, i, *shards[i]));
+  }
+
+  // a queue for every ordered pair of workers, a worker never sends to
+  // itself.
+  for (auto &worker : workers_) {
+    worker->inbox_.resize(shards.size());
+    worker->outbox_.resize(shards.size());
+    worker->wake_.resize(shards.size(), false);
+    for (std::size_t i = 0; i < shards.size(); ++i) {
+      if (i != worker->index_) {
+        worker->inbox_[i] = std::make_unique<SpscQueue<Task>>(kShardQueueSize);
+      }
+    }
+  }
+}
+
+Server::~Server() = default;
+
+absl::Status Server::Listen() noexcept {
+  std::uint16_t port = config_.port_;
+  for (auto &worker : workers_) {
+    // with port 0 the first worker picks the port the others share.
+    if (auto status = worker->Listen(config_.address_, port); !status.ok()) {
+      return status;
+    }
+    port = worker->Port();
+  }
+
+  port_ = port;
+  return absl::OkStatus();
+}
+
+static void pin_thread(pthread_t thread, std::size_t index) noexcept {
+  const unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(index % cpus, &set);
+  ::pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+absl::Status Server::Run() noexcept {
+  if (workers_.empty() || workers_[0]->epoll_fd_ == -1) {
+    return absl::FailedPreconditionError("Listen has not been called");
+  }
+
+  std::vector<absl::Status> statuses(workers_.size());
+  std::vector<std::thread> threads;
+  for (std::size_t i = 1; i < workers_.size(); ++i) {
+    threads.emplace_back([this, i, &statuses] {
+      statuses[i] = workers_[i]->Run();
+      // a failed loop takes the whole server down.
+      Stop();
+    });
+    if (config_.pin_threads_) {
+      pin_thread(threads.back().native_handle(), i);
+    }
+  }
+
+  if (config_.pin_threads_) {
+    pin_thread(::pthread_self(), 0);
+  }
+  statuses[0] = workers_[0]->Run();
+  Stop();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  for (const auto &status : statuses) {
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  return absl::OkStatus();
+}
+
+void Server::Stop() noexcept {
+  stopping_.store(true, std::memory_order_release);
+  for (auto &worker : workers_) {
+    worker->Wake();
+  }
+}
+}  // namespace karu::server
@@ -0,0 +1,85 @@
+#ifndef _KARU_SERVER_H
+#define _KARU_SERVER_H
+
+#include <absl/status/status.h>
+#include <absl/strings/string_view.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "karu.h"
+
+namespace karu::server {
+// replies are accumulated into chunks of this size before being written.
+// Values at least kZeroCopyThreshold bytes long get their own chunk such that
+// they are written from the string returned by the database without copying.
+constexpr std::size_t kOutputChunkSize = 16 * 1024;
+constexpr std::size_t kZeroCopyThreshold = 512;
+constexpr std::size_t kReadSize = 16 * 1024;
+constexpr std::size_t kMaxEvents = 128;
+// capacity of the queue between every pair of event loops.
+constexpr std::size_t kShardQueueSize = 4096;
+
+struct ServerConfig {
+  std::string address_ = "127.0.0.1";
+  std::uint16_t port_ = 6380;
+  // pin the event loop of shard i to cpu i.
+  bool pin_threads_ = false;
+};
+
+class Worker;
+
+// Server serves a DB over the Redis protocol (RESP), such that redis-cli,
+// redis-benchmark and memtier can be used against karu. All of the complete
+// commands in a read are handled before the replies are written, and
+// consecutive SETs are written to the database as one batch with a single
+// sync.
+//
+// The server runs one epoll event loop per DB shard. Every loop accepts
+// connections on its own SO_REUSEPORT socket and is the only thread that
+// touches its shard. A key belongs to the shard picked by its hash; commands
+// for keys of other shards are forwarded to the owning loop over lock-free
+// queues and the replies are sent back the same way.
+class Server {
+ public:
+  Server(DB &db, ServerConfig config) noexcept;
+  Server(const std::vector<DB *> &shards, ServerConfig config) noexcept;
+  ~Server();
+  Server &operator=(const Server &) = delete;
+  Server(const Server &) = delete;
+
+  // binds the listening sockets. When the configured port is 0 a free port is
+  // picked, which is returned by Port afterwards.
+  absl::Status Listen() noexcept;
+  // runs the event loops until Stop is called. The first loop runs on the
+  // calling thread.
+  absl::Status Run() noexcept;
+  // can be called from any thread.
+  void Stop() noexcept;
+  [[nodiscard]] std::uint16_t Port() const noexcept { return port_; }
+  [[nodiscard]] std::size_t ShardCount() const noexcept {
+    return workers_.size();
+  }
+
+ private:
+  friend class Worker;
+
+  ServerConfig config_;
+  std::uint16_t port_ = 0;
+  std::atomic<bool> stopping_ = false;
+  std::vector<std::unique_ptr<Worker>> workers_;
+};
+
+// ShardOf returns the shard a key belongs to.
+std::size_t ShardOf(absl::string_view key, std::size_t shard_count) noexcept;
+
+// MatchGlob matches the redis style patterns used by SCAN MATCH, where * is
+// any number of characters and ? is a single character.
+bool MatchGlob(absl::string_view pattern, absl::string_view str) noexcept;
+}  // namespace karu::server
+
+#endif
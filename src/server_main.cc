@@ -0,0 +1,116 @@
+#include <csignal>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "karu.h"
+#include "server.h"
+
+// karu_server serves a database over the Redis protocol:
+//   karu_server <directory> [--port=N] [--address=IP] [--shards=N]
+//               [--capture=PATH]
+// With more than one shard every shard is stored in <directory>/shard-<i> and
+// served by its own event loop pinned to a core. The shard of a key depends
+// on the shard count, so a directory has to be opened with the same count
+// every time.
+namespace {
+karu::server::Server *running_server = nullptr;
+
+void handle_signal(int) {
+  if (running_server != nullptr) {
+    running_server->Stop();
+  }
+}
+
+void print_usage() {
+  std::cerr << "usage: karu_server <directory> [flags]\n"
+               "  --port=N       port to listen on (default 6380)\n"
+               "  --address=IP   address to listen on (default 127.0.0.1)\n"
+               "  --shards=N     event loops and database shards, 0 for one\n"
+               "                 per core (default 1)\n"
+               "  --capture=PATH record a trace of the operations for\n"
+               "                 karu_replay, suffixed with .<shard> when\n"
+               "                 sharded\n";
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    print_usage();
+    return 1;
+  }
+
+  karu::server::ServerConfig config;
+  std::size_t shard_count = 1;
+  std::string capture_path;
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto eq = arg.find('=');
+    if (arg.rfind("--", 0) != 0 || eq == std::string::npos) {
+      print_usage();
+      return 1;
+    }
+
+    std::string name = arg.substr(2, eq - 2);
+    std::string value = arg.substr(eq + 1);
+    if (name == "port") {
+      config.port_ = static_cast<std::uint16_t>(std::stoul(value));
+    } else if (name == "address") {
+      config.address_ = value;
+    } else if (name == "shards") {
+      shard_count = std::stoul(value);
+    } else if (name == "capture") {
+      capture_path = value;
+    } else {
+      print_usage();
+      return 1;
+    }
+  }
+  if (shard_count == 0) {
+    shard_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  std::vector<std::unique_ptr<karu::DB>> dbs;
+  std::vector<karu::DB *> shards;
+  for (std::size_t i = 0; i < shard_count; ++i) {
+    std::string directory = argv[1];
+    std::string capture = capture_path;
+    if (shard_count > 1) {
+      directory += "/shard-" + std::to_string(i);
+      capture += capture.empty() ? "" : "." + std::to_string(i);
+    }
+    std::filesystem::create_directories(directory);
+
+    dbs.push_back(std::make_unique<karu::DB>(karu::DBConfig{
+        .hint_files_ = true,
+        .database_directory_ = directory,
+        .keydir_snapshot_ = true,
+        .capture_path_ = capture,
+    }));
+    shards.push_back(dbs.back().get());
+  }
+
+  config.pin_threads_ = shard_count > 1;
+  karu::server::Server server(shards, config);
+  if (auto status = server.Listen(); !status.ok()) {
+    std::cerr << "karu_server: " << status.message() << '\n';
+    return 1;
+  }
+
+  running_server = &server;
+  std::signal(SIGINT, handle_signal);
+  std::signal(SIGTERM, handle_signal);
+  std::signal(SIGPIPE, SIG_IGN);
+  std::cerr << "karu_server: listening on " << config.address_ << ':'
+            << server.Port() << " with " << shard_count << " shard(s)\n";
+
+  if (auto status = server.Run(); !status.ok()) {
+    std::cerr << "karu_server: " << status.message() << '\n';
+    return 1;
+  }
+  return 0;
+}
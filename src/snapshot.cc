@@ -0,0 +1,181 @@
+#include "snapshot.h"
+
+#include <absl/base/internal/endian.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+
+#include "encoder.h"
+
+namespace karu::snapshot {
+// every entry is stored as: key length (2), file id (8), position (4),
+// value size (2) followed by the key itself and the value if it is inlined,
+// which is flagged in the key length.
+constexpr std::uint32_t kEntryHeader = 2 + 8 + 4 + 2;
+
+absl::Status WriteSnapshot(const std::string &path,
+                           absl::Span<const file_id_t> datafiles,
+                           const keydir_t &index, const FileSlots &slots,
+                           absl::Mutex *mutex,
+                           const io::Throttle &throttle) noexcept {
+  const std::string tmp_path = path + ".tmp";
+  std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    return absl::InternalError("could not open snapshot file: " + tmp_path);
+  }
+
+  // the entry count is filled in at the end, the keydir may change in
+  // between two submaps.
+  std::uint8_t header[24];
+  absl::little_endian::Store32(&header[0], kSnapshotMagic);
+  absl::little_endian::Store32(&header[4], kSnapshotVersion);
+  absl::little_endian::Store64(&header[8], datafiles.size());
+  absl::little_endian::Store64(&header[16], 0);
+  file.write(reinterpret_cast<const char *>(header), sizeof(header));
+
+  for (const auto id : datafiles) {
+    std::uint8_t buffer[8];
+    absl::little_endian::Store64(buffer, id);
+    file.write(reinterpret_cast<const char *>(buffer), sizeof(buffer));
+  }
+
+  // a submap is encoded as a whole, such that no entry of it is missed when
+  // it is rehashed between two chunks.
+  std::uint64_t entry_count = 0;
+  std::string chunk;
+  for (std::size_t submap = 0; submap < index.subcnt(); ++submap) {
+    chunk.clear();
+    if (mutex != nullptr) {
+      mutex->ReaderLock();
+    }
+    index.with_submap(submap, [&](const auto &set) {
+      for (const auto &[key, entry] : set) {
+        std::uint8_t buffer[kEntryHeader];
+        absl::little_endian::Store16(
+            &buffer[0],
+            key.size() | (entry.Inline() ? encoder::kInlineValueFlag : 0));
+        absl::little_endian::Store64(&buffer[2], slots.FileOf(entry));
+        absl::little_endian::Store32(&buffer[10], entry.pos_);
+        absl::little_endian::Store16(&buffer[14], entry.value_size_);
+        chunk.append(reinterpret_cast<const char *>(buffer), sizeof(buffer));
+        chunk.append(key);
+        if (entry.Inline()) {
+          chunk.append(entry.inline_value_, entry.value_size_);
+        }
+      }
+      entry_count += set.size();
+    });
+    if (mutex != nullptr) {
+      mutex->ReaderUnlock();
+    }
+
+    for (std::size_t offset = 0; offset < chunk.size();
+         offset += kSnapshotChunkSize) {
+      const std::size_t size =
+          std::min(kSnapshotChunkSize, chunk.size() - offset);
+      if (throttle && !throttle(size)) {
+        file.close();
+        std::error_code ec;
+        std::filesystem::remove(tmp_path, ec);
+        return absl::CancelledError("writing the snapshot was cancelled.");
+      }
+      file.write(&chunk[offset], static_cast<std::streamsize>(size));
+    }
+  }
+
+  // the magic is repeated at the end so that a truncated snapshot is detected.
+  absl::little_endian::Store32(&header[0], kSnapshotMagic);
+  file.write(reinterpret_cast<const char *>(header), 4);
+  absl::little_endian::Store64(&header[16], entry_count);
+  file.seekp(16);
+  file.write(reinterpret_cast<const char *>(&header[16]), 8);
+  file.close();
+  if (file.fail()) {
+    return absl::InternalError("could not write snapshot file.");
+  }
+
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, path, ec);
+  if (ec) {
+    return absl::InternalError("could not rename snapshot file: " +
+                               ec.message());
+  }
+
+  return absl::OkStatus();
+}
+
+absl::Status ReadSnapshot(const std::string &path,
+                          std::vector<file_id_t> &datafiles, keydir_t &index,
+                          FileSlots &slots) noexcept {
+  std::ifstream file(path, std::ios::binary | std::ios::in);
+  if (!file) {
+    return absl::NotFoundError("could not open snapshot file: " + path);
+  }
+
+  std::uint8_t header[24];
+  if (!file.read(reinterpret_cast<char *>(header), sizeof(header))) {
+    return absl::DataLossError("snapshot header is truncated.");
+  }
+
+  if (absl::little_endian::Load32(&header[0]) != kSnapshotMagic ||
+      absl::little_endian::Load32(&header[4]) == 0 ||
+      absl::little_endian::Load32(&header[4]) > kSnapshotVersion) {
+    return absl::DataLossError("invalid snapshot header.");
+  }
+  const std::uint64_t datafile_count = absl::little_endian::Load64(&header[8]);
+  const std::uint64_t entry_count = absl::little_endian::Load64(&header[16]);
+
+  std::vector<file_id_t> ids(datafile_count);
+  for (auto &id : ids) {
+    std::uint8_t buffer[8];
+    if (!file.read(reinterpret_cast<char *>(buffer), sizeof(buffer))) {
+      return absl::DataLossError("snapshot datafile list is truncated.");
+    }
+    id = static_cast<file_id_t>(absl::little_endian::Load64(buffer));
+  }
+
+  keydir_t result;
+  result.reserve(entry_count);
+  std::string key;
+  for (std::uint64_t i = 0; i < entry_count; ++i) {
+    std::uint8_t buffer[kEntryHeader];
+    if (!file.read(reinterpret_cast<char *>(buffer), sizeof(buffer))) {
+      return absl::DataLossError("snapshot entry is truncated.");
+    }
+
+    const std::uint16_t key_length = absl::little_endian::Load16(&buffer[0]);
+    key.resize(key_length & ~encoder::kInlineValueFlag);
+    if (!file.read(key.data(), static_cast<std::streamsize>(key.size()))) {
+      return absl::DataLossError("snapshot entry is truncated.");
+    }
+
+    auto &entry = result[key];
+    entry = DatabaseEntry{
+        .file_id_ =
+            static_cast<file_id_t>(absl::little_endian::Load64(&buffer[2])),
+        .pos_ = absl::little_endian::Load32(&buffer[10]),
+        .value_size_ = absl::little_endian::Load16(&buffer[14]),
+    };
+    if ((key_length & encoder::kInlineValueFlag) != 0) {
+      char value[kMaxInlineValueSize];
+      if (entry.value_size_ > kMaxInlineValueSize ||
+          !file.read(value, entry.value_size_)) {
+        return absl::DataLossError("snapshot inline value is invalid.");
+      }
+      entry.MaybeInline({value, entry.value_size_}, kMaxInlineValueSize,
+                        slots.Acquire(entry.file_id_));
+    }
+  }
+
+  std::uint8_t trailer[4];
+  if (!file.read(reinterpret_cast<char *>(trailer), sizeof(trailer)) ||
+      absl::little_endian::Load32(trailer) != kSnapshotMagic) {
+    return absl::DataLossError("snapshot trailer is missing.");
+  }
+
+  datafiles = std::move(ids);
+  index = std::move(result);
+  return absl::OkStatus();
+}
+}  // namespace karu::snapshot
@@ -0,0 +1,49 @@
+#ifndef _KARU_SNAPSHOT_H
+#define _KARU_SNAPSHOT_H
+
+#include <absl/status/status.h>
+#include <absl/synchronization/mutex.h>
+#include <absl/types/span.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "file_io.h"
+#include "file_slots.h"
+#include "types.h"
+
+namespace karu::snapshot {
+constexpr std::uint32_t kSnapshotMagic = 0x4b44534e;  // "NSDK"
+// version 2 added inline values. Version 1 snapshots never set the flag, so
+// they are read the same way.
+constexpr std::uint32_t kSnapshotVersion = 2;
+
+// the snapshot is written in chunks of about this many bytes.
+constexpr std::size_t kSnapshotChunkSize = 1 << 20;
+
+// WriteSnapshot stores the whole keydir together with the ids of the datafiles
+// whose entries are fully contained in it. The snapshot is first written into
+// a temporary file which is then renamed over path, such that a crash never
+// leaves a half-written snapshot behind.
+//
+// The keydir is encoded one submap at a time while holding a reader lock on
+// mutex, if there is one, and the lock is released while the chunks are
+// written. throttle is called before every chunk and the snapshot is
+// abandoned once it returns false. Inline entries are stored with the id of
+// their datafile, which slots resolves.
+absl::Status WriteSnapshot(const std::string &path,
+                           absl::Span<const file_id_t> datafiles,
+                           const keydir_t &index, const FileSlots &slots,
+                           absl::Mutex *mutex = nullptr,
+                           const io::Throttle &throttle = nullptr) noexcept;
+
+// ReadSnapshot loads a snapshot written by WriteSnapshot into index and stores
+// the ids of the datafiles it covers into datafiles. The datafiles of inline
+// entries take a slot of slots.
+absl::Status ReadSnapshot(const std::string &path,
+                          std::vector<file_id_t> &datafiles, keydir_t &index,
+                          FileSlots &slots) noexcept;
+}  // namespace karu::snapshot
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef _KARU_SPSC_QUEUE_H
+#define _KARU_SPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <utility>
+
+namespace karu {
+constexpr std::size_t kCacheLineSize = 64;
+
+// SpscQueue is a bounded lock-free queue with a single producer and a single
+// consumer thread. The capacity is rounded up to a power of two.
+template <typename T>
+class SpscQueue {
+ public:
+  explicit SpscQueue(std::size_t capacity)
+      : mask_(RoundUp(capacity) - 1),
+        slots_(std::make_unique<std::optional<T>[]>(mask_ + 1)) {}
+  SpscQueue &operator=(const SpscQueue &) = delete;
+  SpscQueue(const SpscQueue &) = delete;
+
+  // returns false if the queue is full, value is left untouched then.
+  bool TryPush(T &&value) noexcept {
+    const std::size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ > mask_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ > mask_) {
+        return false;
+      }
+    }
+
+    slots_[tail & mask_].emplace(std::move(value));
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool TryPop(T &value) noexcept {
+    const std::size_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_) {
+        return false;
+      }
+    }
+
+    auto &slot = slots_[head & mask_];
+    value = std::move(*slot);
+    slot.reset();
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  [[nodiscard]] std::size_t Capacity() const noexcept { return mask_ + 1; }
+
+ private:
+  static std::size_t RoundUp(std::size_t n) noexcept {
+    std::size_t capacity = 1;
+    while (capacity < n) {
+      capacity <<= 1;
+    }
+    return capacity;
+  }
+
+  const std::size_t mask_;
+  std::unique_ptr<std::optional<T>[]> slots_;
+
+  // the producer and consumer indices are on their own cache lines, each next
+  // to the copy of the other index that only its owner reads.
+  alignas(kCacheLineSize) std::atomic<std::size_t> tail_{0};
+  std::size_t cached_head_ = 0;
+  alignas(kCacheLineSize) std::atomic<std::size_t> head_{0};
+  std::size_t cached_tail_ = 0;
+};
+}  // namespace karu
+
+#endif
@@ -10,20 +10,20 @@
 
 #include "encoder.h"
 #include "file_io.h"
+#include "gc.h"
+#include "hash.h"
 #include "hint.h"
+#include "record_scanner.h"
+#include "trace.h"
 #include "types.h"
 
 namespace karu::sstable {
 
-#define STRING_TO_SPAN(str)       \
-  absl::Span<const std::uint8_t>{ \
-      reinterpret_cast<const std::uint8_t *>((str).data()), (str).size()};
-
 SSTable::SSTable(const std::string& fname, std::int64_t id)
-    : id_(id),
+    : bloom_(bloom::BloomFilter(30000, 13)),
+      id_(id),
       reader_(nullptr),
-      write_(nullptr),
-      bloom_(bloom::BloomFilter(30000, 13)) {
+      write_(nullptr) {
   std::string hint_path = fname;
   fname_ = fname;
   for (size_t i = 0; i < 4; ++i) {
@@ -43,49 +43,57 @@ absl::Status SSTable::InitWriterAndReader() noexcept {
     return reader.status();
   }
   reader_ = std::move(reader.value());
+  reader_->SetMetrics(metrics_);
 
   auto writer = io::OpenFileWriter(fname_);
   if (!writer.ok()) {
     return writer.status();
   }
   write_ = std::move(writer.value());
+  write_->SetMetrics(metrics_);
 
   return absl::OkStatus();
 }
 
 absl::StatusOr<std::uint32_t> SSTable::Insert(
-    const std::string &key, const std::string &value) noexcept {
+    absl::string_view key, absl::string_view value) noexcept {
   if (write_ == nullptr) {
     return absl::InternalError("table writer is nullptr when trying to write");
   }
-
-  auto key_span = STRING_TO_SPAN(key);
-  auto value_span = STRING_TO_SPAN(value);
-
-  auto key_len = static_cast<std::uint16_t>(key_span.size());
-  auto value_len = static_cast<std::uint16_t>(value_span.size());
-  std::uint32_t buffer_size = encoder::kFullHeader + key_len + value_len;
-  std::unique_ptr<std::uint8_t[]> buffer(new std::uint8_t[buffer_size]);
-  absl::little_endian::Store16(&buffer.get()[0], key_len);
-  absl::little_endian::Store16(&buffer.get()[encoder::kKeyByteCount],
-                               value_len);
-
-  std::memcpy(&buffer[encoder::kFullHeader], key_span.data(), key_span.size());
-  std::memcpy(&buffer[encoder::kFullHeader + key_span.size()],
-              value_span.data(), value_len);
-
-  auto status = write_->Append({buffer.get(), buffer_size});
+  KARU_TRACE_SCOPE("SSTable::Insert");
+
+  KARU_TRACE_BEGIN(encode_span, "SSTable::Insert/encode");
+  // the record is encoded into the append buffer of the table, which keeps its
+  // capacity between inserts.
+  auto value_len = static_cast<std::uint16_t>(value.size());
+  const std::uint32_t buffer_size =
+      encoder::FullEncoding::EncodedSize(key.size(), value.size());
+  append_buffer_.resize(buffer_size);
+  auto record =
+      encoder::FullEncoding::Encode(append_buffer_.data(), key, value);
+  KARU_TRACE_END(encode_span);
+
+  KARU_TRACE_BEGIN(append_span, "SSTable::Insert/append");
+  auto status = write_->Append({append_buffer_.data(), buffer_size});
+  KARU_TRACE_END(append_span);
   if (!status.ok()) {
     return status.status();
   }
 
   // write changes to disk
-  write_->Sync();
+  {
+    KARU_TRACE_SCOPE("SSTable::Insert/sync");
+    metrics::ScopedLatency latency(metrics_, metrics::kFlushLatency);
+    write_->Sync();
+  }
 
   // after we have successfully written the value into the table, we can create
-  // the hint entry.
-  std::uint32_t pos = *status + encoder::kFullHeader + key_len;
-  if (auto status = hint_->WriteHint(key, value_len, pos); !status.ok()) {
+  // the hint entry. It is only buffered, recovery scans whatever the hint file
+  // doesn't cover yet.
+  std::uint32_t pos = *status + record.ValueOffset();
+  KARU_TRACE_SCOPE("SSTable::Insert/hint");
+  if (auto status = hint_->WriteHint(key, value_len, pos, value);
+      !status.ok()) {
     std::cerr << status.message() << '\n';
     return status;
   }
@@ -93,24 +101,134 @@ absl::StatusOr<std::uint32_t> SSTable::Insert(
   return pos;  // where the value starts in the file.
 }
 
+absl::StatusOr<std::vector<std::uint32_t>> SSTable::InsertBatch(
+    absl::Span<const std::pair<absl::string_view, absl::string_view>>
+        pairs) noexcept {
+  if (write_ == nullptr) {
+    return absl::InternalError("table writer is nullptr when trying to write");
+  }
+  KARU_TRACE_SCOPE("SSTable::InsertBatch");
+
+  std::uint32_t buffer_size = 0;
+  for (const auto &[key, value] : pairs) {
+    buffer_size += encoder::FullEncoding::EncodedSize(key.size(), value.size());
+  }
+
+  append_buffer_.resize(buffer_size);
+  std::vector<std::uint32_t> positions;
+  positions.reserve(pairs.size());
+  std::uint32_t offset = 0;
+  for (const auto &[key, value] : pairs) {
+    auto record =
+        encoder::FullEncoding::Encode(&append_buffer_[offset], key, value);
+    // relative until we know the file offset
+    positions.push_back(offset + record.ValueOffset());
+    offset += record.Size();
+  }
+
+  auto status = write_->Append({append_buffer_.data(), buffer_size});
+  if (!status.ok()) {
+    return status.status();
+  }
+
+  {
+    metrics::ScopedLatency latency(metrics_, metrics::kFlushLatency);
+    write_->Sync();
+  }
+
+  for (std::size_t i = 0; i < pairs.size(); ++i) {
+    positions[i] += *status;
+    auto value_len = static_cast<std::uint16_t>(pairs[i].second.size());
+    if (auto hint_status = hint_->WriteHint(pairs[i].first, value_len,
+                                            positions[i], pairs[i].second);
+        !hint_status.ok()) {
+      return hint_status;
+    }
+  }
+
+  return positions;
+}
+
+absl::Status SSTable::Delete(absl::string_view key) noexcept {
+  if (write_ == nullptr) {
+    return absl::InternalError("table writer is nullptr when trying to write");
+  }
+
+  const std::uint32_t buffer_size =
+      encoder::FullEncoding::EncodedSize(key.size(), 0);
+  append_buffer_.resize(buffer_size);
+  encoder::FullEncoding::EncodeTombstone(append_buffer_.data(), key);
+
+  auto status = write_->Append({append_buffer_.data(), buffer_size});
+  if (!status.ok()) {
+    return status.status();
+  }
+  write_->Sync();
+
+  return hint_->WriteHint(key, encoder::kTombstone, *status + buffer_size);
+}
+
 // This is exactly same as the Find function but with arguments such that we
 // don't need to construct a separate file struct.
 absl::StatusOr<std::string> SSTable::Find(std::uint16_t value_size,
                                           std::uint32_t pos) noexcept {
-  std::unique_ptr<std::uint8_t[]> value_buffer(new std::uint8_t[value_size]);
-  auto status = reader_->ReadAt(pos, {value_buffer.get(), value_size});
+  KARU_TRACE_SCOPE("SSTable::Find");
+  // the value is read straight into the result.
+  std::string result(value_size, '\0');
+  if (auto status = Read(
+          pos, {reinterpret_cast<std::uint8_t *>(result.data()), value_size});
+      !status.ok()) {
+    return status;
+  }
+
+  return result;
+}
+
+absl::Status SSTable::Read(std::uint32_t pos,
+                           absl::Span<std::uint8_t> dst) noexcept {
+  KARU_TRACE_SCOPE("SSTable::Read");
+  if (reader_ == nullptr) {
+    return absl::InternalError("reader is nullptr when reading.");
+  }
+
+  auto status = reader_->ReadAt(pos, dst);
   if (!status.ok()) {
     return status.status();
   }
 
-  if (*status != value_size) {
+  if (*status != dst.size()) {
     return absl::InternalError("read wrong amount of bytes from file.");
   }
+  return absl::OkStatus();
+}
 
-  std::string result = reinterpret_cast<char *>(value_buffer.get());
-  result.resize(value_size);
+absl::Status SSTable::FlushHints() noexcept {
+  if (hint_ == nullptr) {
+    return absl::OkStatus();
+  }
+  return hint_->Flush();
+}
 
-  return result;
+void SSTable::SetMetrics(metrics::Registry *metrics) noexcept {
+  metrics_ = metrics;
+  if (reader_ != nullptr) {
+    reader_->SetMetrics(metrics);
+  }
+  if (write_ != nullptr) {
+    write_->SetMetrics(metrics);
+  }
+  if (hint_ != nullptr) {
+    hint_->SetMetrics(metrics);
+  }
+}
+
+absl::StatusOr<std::uint64_t> SSTable::FindRange(
+    std::uint32_t pos, absl::Span<const ::iovec> dst) noexcept {
+  if (reader_ == nullptr) {
+    return absl::InternalError("reader is nullptr when reading.");
+  }
+
+  return reader_->ReadVAt(pos, dst);
 }
 
 absl::Status SSTable::InitOnlyReader() noexcept {
@@ -119,6 +237,7 @@ absl::Status SSTable::InitOnlyReader() noexcept {
     return reader.status();
   }
   reader_ = std::move(reader.value());
+  reader_->SetMetrics(metrics_);
 
   return absl::OkStatus();
 }
@@ -144,12 +263,19 @@ absl::StatusOr<std::string> SSTable::FindValueFromPos(
 }
 
 absl::StatusOr<std::string> SSTable::Find(const std::string &key) noexcept {
-  if (!bloom_.contains(key.c_str(), key.size())) {
+  KARU_TRACE_SCOPE("SSTable::Find");
+  if (!bloom_.contains(hash::HashKey(key))) {
+    if (metrics_ != nullptr) {
+      metrics_->Add(metrics::kBloomNegatives);
+    }
     return absl::NotFoundError("could not find key in bloom map.");
   }
 
   auto offset_it = offset_map_.find(key);
   if (offset_it == offset_map_.end()) {
+    if (metrics_ != nullptr) {
+      metrics_->Add(metrics::kBloomFalsePositives);
+    }
     return absl::NotFoundError("could not find offset for key");
   }
 
@@ -163,31 +289,22 @@ absl::Status SSTable::BuildFromBTree(
   }
 
   for (const auto &entry : btree) {
-    absl::Span<const std::uint8_t> key_span = STRING_TO_SPAN(entry.first);
-    absl::Span<const std::uint8_t> value_span = STRING_TO_SPAN(entry.second);
-
-    if (key_span.empty() || key_span.size() > 0xFF) {
+    if (entry.first.empty() || entry.first.size() > 0xFF) {
       return absl::InternalError("invalid key length");
     }
 
-    if (value_span.size() >= encoder::kTombstone) {
+    if (entry.second.size() >= encoder::kTombstone) {
       return absl::InternalError("invalid value length");
     }
 
-    auto key_len = static_cast<std::uint16_t>(key_span.size());
-    auto value_len = static_cast<std::uint16_t>(value_span.size());
-    std::uint32_t buffer_size = encoder::kFullHeader + key_len + value_len;
-    std::unique_ptr<std::uint8_t[]> buffer(new std::uint8_t[buffer_size]);
-    absl::little_endian::Store16(&buffer.get()[0], key_len);
-    absl::little_endian::Store16(&buffer.get()[encoder::kKeyByteCount],
-                                 value_len);
+    const std::uint32_t buffer_size =
+        encoder::FullEncoding::EncodedSize(entry.first.size(),
+                                           entry.second.size());
+    append_buffer_.resize(buffer_size);
+    auto record = encoder::FullEncoding::Encode(append_buffer_.data(),
+                                                entry.first, entry.second);
 
-    std::memcpy(&buffer[encoder::kFullHeader], key_span.data(),
-                key_span.size());
-    std::memcpy(&buffer[encoder::kFullHeader + key_span.size()],
-                value_span.data(), value_len);
-
-    auto status = write_->Append({buffer.get(), buffer_size});
+    auto status = write_->Append({append_buffer_.data(), buffer_size});
     if (!status.ok()) {
       return status.status();
     }
@@ -195,17 +312,18 @@ absl::Status SSTable::BuildFromBTree(
     bloom_.add(entry.first.c_str(), entry.first.size());
     auto offset = *status;
     offset_map_[entry.first] =
-        EntryPosition{.pos_ = offset + encoder::kFullHeader + key_len,
-                      .value_size_ = value_len};
+        EntryPosition{.pos_ = offset + record.ValueOffset(),
+                      .value_size_ = record.Header().ValueLength()};
   }
 
   write_->Sync();  // we don't need to sync after every turn
   return absl::OkStatus();
 }
 
-absl::Status SSTable::AddEntriesToIndex(
-    phmap::parallel_flat_hash_map<std::string, karu::DatabaseEntry>
-        &index) noexcept {
+absl::Status SSTable::AddEntriesToIndex(keydir_t &index, std::uint64_t start,
+                                        std::size_t inline_limit,
+                                        bool keep_tombstones,
+                                        const io::Throttle &throttle) noexcept {
   if (reader_ == nullptr) {
     return absl::InternalError("reader is nullptr when reading.");
   }
@@ -214,43 +332,52 @@ absl::Status SSTable::AddEntriesToIndex(
   if (::stat(fname_.c_str(), &fileStat) == -1) {
     return absl::InternalError("could not get filesize");
   }
-  auto file_size = static_cast<uint32_t>(fileStat.st_size);
 
-  std::uint32_t starting_offset = 0;
-  while (starting_offset <= file_size) {
-    std::unique_ptr<std::uint8_t[]> header_buffer(
-        new std::uint8_t[encoder::kFullHeader]);
-    auto status = reader_->ReadAt(starting_offset,
-                                  {header_buffer.get(), encoder::kFullHeader});
-    if (!status.ok()) break;
-    if (*status == 0) {
-      break;
+  // the records that garbage collection found dead may be holes by now.
+  auto dead = gc::ReadExtents(gc::DeadPath(fname_));
+  if (!dead.ok()) {
+    return dead.status();
+  }
+  std::size_t next_dead = 0;
+
+  scanner::RecordScanner scanner(*reader_, fileStat.st_size);
+  scanner.Seek(start);
+  scanner.SetInlineLimit(inline_limit);
+  scanner.SetThrottle(throttle);
+  scanner::Record record{};
+  while (true) {
+    for (; next_dead < dead->size() &&
+           (*dead)[next_dead].start_ <= scanner.Offset();
+         ++next_dead) {
+      if (scanner.Offset() < (*dead)[next_dead].end_) {
+        scanner.Seek((*dead)[next_dead].end_);
+      }
     }
 
-    std::uint16_t key_length =
-        absl::little_endian::Load16(&header_buffer.get()[0]);
-    std::uint16_t value_length = absl::little_endian::Load16(
-        &header_buffer.get()[encoder::kKeyByteCount]);
-
-    std::unique_ptr<std::uint8_t[]> key_buffer(new std::uint8_t[key_length]);
-    status = reader_->ReadAt(starting_offset + encoder::kFullHeader,
-                             {
-                                 key_buffer.get(),
-                                 key_length,
-                             });
+    auto status = scanner.Next(record);
     if (!status.ok()) {
+      return status.status();
+    }
+
+    if (!*status) {
       break;
     }
 
-    std::string result = reinterpret_cast<char *>(key_buffer.get());
-    result.resize(key_length);
-    starting_offset += encoder::kFullHeader + key_length;
-    index[result] = DatabaseEntry{
+    if (record.tombstone_ && !keep_tombstones) {
+      index.erase(record.key_);
+      continue;
+    }
+
+    auto &entry = index.try_emplace(record.key_).first->second;
+    entry = DatabaseEntry{
         .file_id_ = id_,
-        .pos_ = starting_offset,
-        .value_size_ = value_length,
+        .pos_ = record.value_pos_,
+        .value_size_ =
+            record.tombstone_ ? encoder::kTombstone : record.value_size_,
     };
-    starting_offset += value_length;
+    if (record.value_loaded_) {
+      entry.MaybeInline(record.value_, inline_limit, file_slot_);
+    }
   }
 
   return absl::OkStatus();
@@ -265,43 +392,29 @@ absl::Status SSTable::PopulateFromFile() noexcept {
   if (::stat(fname_.c_str(), &fileStat) == -1) {
     return absl::InternalError("could not get filesize");
   }
-  auto file_size = static_cast<uint32_t>(fileStat.st_size);
 
-  std::uint32_t starting_offset = 0;
-  while (starting_offset <= file_size) {
-    std::unique_ptr<std::uint8_t[]> header_buffer(
-        new std::uint8_t[encoder::kFullHeader]);
-    auto status = reader_->ReadAt(starting_offset,
-                                  {header_buffer.get(), encoder::kFullHeader});
-    if (!status.ok()) break;
-    if (*status == 0) {
-      break;
+  scanner::RecordScanner scanner(*reader_, fileStat.st_size);
+  scanner::Record record{};
+  while (true) {
+    auto status = scanner.Next(record);
+    if (!status.ok()) {
+      return status.status();
     }
 
-    std::uint16_t key_length =
-        absl::little_endian::Load16(&header_buffer.get()[0]);
-    std::uint16_t value_length = absl::little_endian::Load16(
-        &header_buffer.get()[encoder::kKeyByteCount]);
-
-    std::unique_ptr<std::uint8_t[]> key_buffer(new std::uint8_t[key_length]);
-    status = reader_->ReadAt(starting_offset + encoder::kFullHeader,
-                             {
-                                 key_buffer.get(),
-                                 key_length,
-                             });
-    if (!status.ok()) {
+    if (!*status) {
       break;
     }
 
-    std::string result = reinterpret_cast<char *>(key_buffer.get());
-    result.resize(key_length);
-    starting_offset += encoder::kFullHeader + key_length;
-    offset_map_[result] = EntryPosition{
-        .pos_ = starting_offset,
-        .value_size_ = value_length,
+    if (record.tombstone_) {
+      offset_map_.erase(std::string(record.key_));
+      continue;
+    }
+
+    offset_map_[std::string(record.key_)] = EntryPosition{
+        .pos_ = record.value_pos_,
+        .value_size_ = record.value_size_,
     };
-    starting_offset += value_length;
-    bloom_.add(result.c_str(), result.size());
+    bloom_.add(record.key_.data(), record.key_.size());
   }
 
   return absl::OkStatus();
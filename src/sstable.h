@@ -7,12 +7,14 @@
 #include <map>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "../third_party/parallel_hashmap/phmap.h"
 #include "absl/container/btree_map.h"
 #include "bloom.h"
 #include "file_io.h"
 #include "hint.h"
+#include "metrics.h"
 #include "types.h"
 
 namespace karu::sstable {
@@ -26,25 +28,41 @@ class SSTable {
  public:
   explicit SSTable(std::string  fname)
       : fname_(std::move(fname)),
+        bloom_(bloom::BloomFilter(30000, 13)),
         id_(0),
         reader_(nullptr),
-        write_(nullptr),
-        bloom_(bloom::BloomFilter(30000, 13)){};
+        write_(nullptr){};
   SSTable(const std::string& fname, std::int64_t id);
 
   SSTable& operator=(const SSTable&) = delete;
   SSTable(const SSTable&) = delete;
 
-  absl::StatusOr<std::uint32_t> Insert(const std::string& key,
-                                       const std::string& value) noexcept;
+  absl::StatusOr<std::uint32_t> Insert(absl::string_view key,
+                                       absl::string_view value) noexcept;
+  // writes all of the pairs with a single append and sync. Returns the value
+  // position of every pair.
+  absl::StatusOr<std::vector<std::uint32_t>> InsertBatch(
+      absl::Span<const std::pair<absl::string_view, absl::string_view>>
+          pairs) noexcept;
+  // writes a tombstone entry for the key.
+  absl::Status Delete(absl::string_view key) noexcept;
 
   absl::Status PopulateFromFile() noexcept;
   absl::Status InitWriterAndReader() noexcept;
   absl::Status InitOnlyReader() noexcept;
   absl::StatusOr<std::string> Get(absl::string_view key) noexcept;
+  // adds the records starting at offset start to the index. start is used to
+  // scan only the tail of the file that its hint file doesn't cover.
+  // Values of at most inline_limit bytes are inlined into the index if the
+  // table has a file slot. With keep_tombstones a deleted key stays in the
+  // index as a tombstone entry. throttle is called before every read of the
+  // datafile.
   absl::Status AddEntriesToIndex(
-      phmap::parallel_flat_hash_map<std::string, karu::DatabaseEntry>&
-          index) noexcept;
+      keydir_t& index, std::uint64_t start = 0, std::size_t inline_limit = 0,
+      bool keep_tombstones = false,
+      const io::Throttle& throttle = nullptr) noexcept;
+  // writes the buffered hints of the table into its hint file.
+  absl::Status FlushHints() noexcept;
 
   absl::Status BuildFromBTree(
       const absl::btree_map<std::string, std::string>& btree) noexcept;
@@ -54,21 +72,41 @@ class SSTable {
   std::map<std::string, EntryPosition> offset_map_;
   absl::StatusOr<std::string> Find(std::uint16_t value_size,
                                    std::uint32_t pos) noexcept;
-  [[nodiscard]] std::uint32_t Size() const noexcept { return size_; }
+  // reads dst.size() bytes starting at pos into dst.
+  absl::Status Read(std::uint32_t pos, absl::Span<std::uint8_t> dst) noexcept;
+  // reads the range starting at pos into the given buffers. This is used to
+  // coalesce reads of neighbouring values into a single syscall.
+  absl::StatusOr<std::uint64_t> FindRange(
+      std::uint32_t pos, absl::Span<const ::iovec> dst) noexcept;
+  // metrics is used for every file of the table. It needs to outlive the
+  // table.
+  void SetMetrics(metrics::Registry* metrics) noexcept;
+  // the number of bytes written into the table, 0 if it has no writer.
+  [[nodiscard]] std::uint32_t Size() const noexcept {
+    return write_ != nullptr ? write_->Size() : 0;
+  }
   [[nodiscard]] std::int64_t ID() const noexcept { return id_; }
+  // the slot of the table in the FileSlots of its database, kNoFileSlot if
+  // its values aren't inlined.
+  void SetFileSlot(std::uint16_t slot) noexcept { file_slot_ = slot; }
+  [[nodiscard]] std::uint16_t FileSlot() const noexcept { return file_slot_; }
 
  private:
   std::string fname_;
   absl::Mutex mutex_;
   bloom::BloomFilter bloom_;
   std::int64_t id_;
+  std::uint16_t file_slot_ = kNoFileSlot;
+  metrics::Registry* metrics_ = nullptr;
 
-  std::uint32_t size_ = 0;
   std::unique_ptr<hint::HintFile> hint_ = nullptr;
   std::unique_ptr<io::FileReader> reader_ = nullptr;
   // this is only used when creating the sstable. When loading files after
   // reopening database we just initialize the reader_ field.
   std::unique_ptr<io::FileWriter> write_ = nullptr;
+  // records are encoded into this buffer before they are appended. Writes are
+  // serialized by the database, so one buffer per table is enough.
+  std::vector<std::uint8_t> append_buffer_;
 };
 
 absl::StatusOr<std::unique_ptr<SSTable>> ParseSSTableFromFile(
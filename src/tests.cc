@@ -1,19 +1,41 @@
 #include <absl/container/btree_map.h>
+#include <absl/synchronization/notification.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <memory_resource>
 #include <random>
+#include <set>
+#include <sstream>
 #include <string>
 #include <thread>
 
 #include "bloom.h"
+#include "capture.h"
 #include "encoder.h"
+#include "executor.h"
+#include "hash.h"
+#include "histogram.h"
 #include "gtest/gtest.h"
 #include "karu.h"
+#include "record_scanner.h"
+#include "resp.h"
+#include "server.h"
+#include "spsc_queue.h"
 #include "sstable.h"
+#include "trace.h"
+#include "typed_db.h"
+#include "utils.h"
 
 using namespace karu;
 
@@ -83,8 +105,9 @@ TEST(SSTableTest, TestBuildFromBTree) {
         {"llonglonglonglonglonglonglonglonglonglonglongong", "verylong"},
         {"verylong", "llonglonglonglonglonglonglonglonglonglonglongong"}};
 
-    createTestFile("./test/table.data");
-    sstable::SSTable sstable("./test/table.data");
+    const std::string path = test_dir + "/table.data";
+    createTestFile(path);
+    sstable::SSTable sstable(path);
     auto status = sstable.InitWriterAndReader();
 
     status = sstable.BuildFromBTree(values);
@@ -108,9 +131,10 @@ TEST(SSTableTest, TestPopulateFromFile) {
         {"llonglonglonglonglonglonglonglonglonglonglongong", "verylong"},
         {"verylong", "llonglonglonglonglonglonglonglonglonglonglongong"}};
 
-    createTestFile("./test/table.data");
+    const std::string path = test_dir + "/table.data";
+    createTestFile(path);
     {
-      auto sstable = std::make_unique<sstable::SSTable>("./test/table.data");
+      auto sstable = std::make_unique<sstable::SSTable>(path);
       auto status = sstable->InitWriterAndReader();
       OK;
       status = sstable->BuildFromBTree(values);
@@ -118,7 +142,7 @@ TEST(SSTableTest, TestPopulateFromFile) {
     }
 
     {
-      auto sstable = std::make_unique<sstable::SSTable>("./test/table.data");
+      auto sstable = std::make_unique<sstable::SSTable>(path);
       auto status = sstable->InitOnlyReader();
       OK;
       status = sstable->PopulateFromFile();
@@ -192,6 +216,51 @@ TEST(KaruTest, MemtableFlush) {
   });
 }
 
+TEST(KaruTest, MultiGet) {
+  test_wrapper([](const std::string &test_dir) {
+    auto keys = generate_random_keys(200);
+    karu::DB db(test_dir);
+
+    // spread the keys over an immutable and the active datafile.
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+      if (i == keys.size() / 2) {
+        auto status = db.FlushMemoryTable();
+        OK;
+      }
+      auto status = db.Insert(keys[i], keys[i]);
+      OK;
+    }
+
+    std::vector<std::string> lookup(keys.rbegin(), keys.rend());
+    lookup.push_back("missing key");
+    lookup.push_back(keys[0]);  // duplicate keys should work too.
+
+    std::vector<std::uint8_t> buffer(lookup.size() * 10);
+    std::vector<karu::MultiGetResult> results(lookup.size());
+    auto status = db.MultiGet(lookup, absl::MakeSpan(buffer),
+                              absl::MakeSpan(results));
+    OK;
+
+    for (std::size_t i = 0; i < lookup.size(); ++i) {
+      if (lookup[i] == "missing key") {
+        EXPECT_TRUE(absl::IsNotFound(results[i].status_));
+        continue;
+      }
+
+      EXPECT_TRUE(results[i].status_.ok());
+      std::string value(
+          reinterpret_cast<const char *>(buffer.data() + results[i].offset_),
+          results[i].size_);
+      EXPECT_EQ(lookup[i], value);
+    }
+
+    std::vector<std::uint8_t> small_buffer(5);
+    status = db.MultiGet(lookup, absl::MakeSpan(small_buffer),
+                         absl::MakeSpan(results));
+    EXPECT_FALSE(status.ok());
+  });
+}
+
 TEST(EncoderTest, HintHeader) {
   std::unique_ptr<std::uint8_t[]> buffer(new std::uint8_t[8]);
   encoder::HintHeader hintheader(buffer.get());
@@ -224,6 +293,24 @@ TEST(EncoderTest, EntryHeader) {
   EXPECT_TRUE(entryheader.IsTombstoneValue());
 }
 
+TEST(EncoderTest, FullEncoding) {
+  const std::string key = "key";
+  const std::string value = "some value";
+  std::vector<std::uint8_t> buffer(
+      encoder::FullEncoding::EncodedSize(key.size(), value.size()));
+
+  auto record = encoder::FullEncoding::Encode(buffer.data(), key, value);
+  EXPECT_EQ(record.Size(), buffer.size());
+  EXPECT_EQ(record.Key(), key);
+  EXPECT_EQ(record.Value(), value);
+  EXPECT_EQ(record.ValueOffset(), encoder::kFullHeader + key.size());
+
+  auto tombstone = encoder::FullEncoding::EncodeTombstone(buffer.data(), key);
+  EXPECT_TRUE(tombstone.Header().IsTombstoneValue());
+  EXPECT_EQ(tombstone.Key(), key);
+  EXPECT_EQ(tombstone.Size(), encoder::kFullHeader + key.size());
+}
+
 TEST(BloomFilterTest, Main) {
   bloom::BloomFilter bloomfilter(60000, 13);
   auto keys = generate_random_keys();
@@ -333,3 +420,1546 @@ TEST(KaruTest, HintFileStartup) {
     }
   });
 }
+
+TEST(KaruTest, HintFileTail) {
+  test_wrapper([](const std::string &test_dir) {
+    auto keys = generate_random_keys(50, 8);
+    karu::DBConfig conf{
+        .hint_files_ = true,
+        .database_directory_ = test_dir,
+    };
+    {
+      karu::DB db(conf);
+      for (const auto &k : keys) {
+        auto status = db.Insert(k, k);
+        OK;
+      }
+      auto status = db.Delete(keys[0]);
+      OK;
+
+      // the hints are still buffered.
+      for (const auto &path : utils::files_with_extension(".hnt", test_dir)) {
+        EXPECT_EQ(std::filesystem::file_size(path), 0);
+      }
+    }
+
+    // cut the hint file in the middle of a hint as if we crashed before all of
+    // them were written. The rest has to be recovered from the datafile.
+    auto hint_files = utils::files_with_extension(".hnt", test_dir);
+    ASSERT_EQ(hint_files.size(), 1);
+    std::filesystem::resize_file(
+        hint_files[0], std::filesystem::file_size(hint_files[0]) / 2 + 3);
+
+    karu::DB db(conf);
+    EXPECT_TRUE(absl::IsNotFound(db.Get(keys[0]).status()));
+    for (std::size_t i = 1; i < keys.size(); ++i) {
+      auto status = db.Get(keys[i]);
+      OK;
+      EXPECT_EQ(*status, keys[i]);
+    }
+  });
+}
+
+TEST(RecordScannerTest, CrossesChunkBoundaries) {
+  test_wrapper([](const std::string &test_dir) {
+    auto pairs = generate_random_pairs(100, 13);
+    const std::string path = test_dir + "/scan.data";
+    std::vector<std::uint32_t> positions;
+    {
+      karu::sstable::SSTable sstable(path, 1);
+      auto status = sstable.InitWriterAndReader();
+      OK;
+      for (const auto &[key, value] : pairs) {
+        auto insert_status = sstable.Insert(key, value);
+        EXPECT_TRUE(insert_status.ok());
+        positions.push_back(*insert_status);
+      }
+    }
+
+    // add a truncated record to the end, which should be ignored.
+    {
+      std::ofstream file(path, std::ios::app | std::ios::binary);
+      file.write("\x05\x00", 2);
+    }
+
+    auto reader = io::OpenFileReader(path);
+    EXPECT_TRUE(reader.ok());
+
+    // the buffer is smaller than two records, so most of them are split.
+    karu::scanner::RecordScanner scanner(
+        **reader, std::filesystem::file_size(path), 32);
+    karu::scanner::Record record{};
+    std::size_t count = 0;
+    while (true) {
+      auto status = scanner.Next(record);
+      EXPECT_TRUE(status.ok());
+      if (!*status) {
+        break;
+      }
+
+      EXPECT_EQ(pairs[count].first, std::string(record.key_));
+      EXPECT_EQ(positions[count], record.value_pos_);
+      EXPECT_EQ(pairs[count].second.size(), record.value_size_);
+      ++count;
+    }
+    EXPECT_EQ(pairs.size(), count);
+  });
+}
+
+TEST(KaruTest, KeydirSnapshot) {
+  test_wrapper([](const std::string &test_dir) {
+    auto first = generate_random_keys(200);
+    auto second = generate_random_keys(200);
+    karu::DBConfig conf{
+        .hint_files_ = true,
+        .database_directory_ = test_dir,
+        .keydir_snapshot_ = true,
+    };
+    {
+      karu::DB db(conf);
+      for (const auto &k : first) {
+        auto status = db.Insert(k, k);
+        OK;
+      }
+    }
+    EXPECT_TRUE(std::filesystem::exists(test_dir + "/keydir.snap"));
+
+    // these are written into a datafile that isn't covered by the snapshot,
+    // so they need to be replayed on the next startup.
+    {
+      karu::DB db(karu::DBConfig{
+          .hint_files_ = true,
+          .database_directory_ = test_dir,
+      });
+      for (const auto &k : second) {
+        auto status = db.Insert(k, first[0]);
+        OK;
+      }
+    }
+
+    karu::DB db(conf);
+    for (const auto &k : first) {
+      auto status = db.Get(k);
+      OK;
+      EXPECT_EQ(*status, k);
+    }
+    for (const auto &k : second) {
+      auto status = db.Get(k);
+      OK;
+      EXPECT_EQ(*status, first[0]);
+    }
+  });
+}
+
+TEST(HashTest, Hash64) {
+  // every prefix of the string goes through a different branch of the hash.
+  const std::string data(200, 'a');
+  std::set<std::uint64_t> hashes;
+  for (std::size_t len = 0; len <= data.size(); ++len) {
+    auto h = karu::hash::Hash64(data.data(), len);
+    EXPECT_EQ(h, karu::hash::Hash64(data.data(), len));
+    hashes.insert(h);
+  }
+  EXPECT_EQ(hashes.size(), data.size() + 1);
+
+  EXPECT_NE(karu::hash::HashKey("hello"), karu::hash::HashKey("hellp"));
+  EXPECT_NE(karu::hash::Hash64("hello", 5, 1), karu::hash::HashKey("hello"));
+
+  // the keydir hash can be derived from HashKey without hashing again.
+  karu::keydir_t keydir;
+  for (const std::string &key : {std::string(), std::string("hello"),
+                                 std::string(100, 'k')}) {
+    EXPECT_EQ(karu::KeydirHash(karu::hash::HashKey(key)), keydir.hash(key));
+  }
+}
+
+TEST(HistogramTest, Percentiles) {
+  karu::metrics::Histogram histogram;
+  for (std::uint64_t i = 1; i <= 10000; ++i) {
+    histogram.Record(i);
+  }
+
+  EXPECT_EQ(histogram.Count(), 10000);
+  EXPECT_EQ(histogram.Min(), 1);
+  EXPECT_EQ(histogram.Max(), 10000);
+  EXPECT_NEAR(histogram.Percentile(50), 5000, 5000 * 0.02);
+  EXPECT_NEAR(histogram.Percentile(99), 9900, 9900 * 0.02);
+  EXPECT_EQ(histogram.Percentile(100), 10000);
+
+  karu::metrics::Histogram other;
+  other.Record(1000000);
+  histogram.Merge(other);
+  EXPECT_EQ(histogram.Count(), 10001);
+  EXPECT_EQ(histogram.Max(), 1000000);
+
+  // merging into an empty histogram keeps the minimum of the other one.
+  karu::metrics::Histogram empty;
+  empty.Merge(other);
+  EXPECT_EQ(empty.Min(), 1000000);
+  empty.Merge(karu::metrics::Histogram());
+  EXPECT_EQ(empty.Min(), 1000000);
+}
+
+TEST(KaruTest, Stats) {
+  test_wrapper([](const std::string &test_dir) {
+    auto keys = generate_random_keys(100);
+    karu::DB db(test_dir);
+    for (const auto &k : keys) {
+      auto status = db.Insert(k, k);
+      OK;
+    }
+    auto status = db.FlushMemoryTable();
+    OK;
+    for (const auto &k : keys) {
+      EXPECT_TRUE(db.Get(k).ok());
+    }
+
+    // metrics written from another thread are included as well.
+    std::thread([&] { EXPECT_TRUE(db.Get(keys[0]).ok()); }).join();
+
+    auto stats = db.GetStats();
+    EXPECT_EQ(stats.index_size_, keys.size());
+    EXPECT_EQ(stats.datafile_count_, 2);
+    EXPECT_EQ(stats.latencies_[metrics::kInsertLatency].count_, keys.size());
+    EXPECT_EQ(stats.latencies_[metrics::kGetLatency].count_, keys.size() + 1);
+    EXPECT_EQ(stats.latencies_[metrics::kRotationLatency].count_, 1);
+    EXPECT_EQ(stats.counters_[metrics::kReadSyscalls], keys.size() + 1);
+    EXPECT_EQ(stats.counters_[metrics::kBytesRead], (keys.size() + 1) * 10);
+    EXPECT_GT(stats.counters_[metrics::kBytesWritten], 0);
+
+    EXPECT_NE(stats.ToText().find("index_size 100"), std::string::npos);
+    EXPECT_NE(stats.ToJson().find("\"index_size\": 100"), std::string::npos);
+  });
+}
+
+TEST(TraceTest, ChromeTrace) {
+  karu::trace::Clear();
+  const std::uint64_t start = karu::trace::NowNanos();
+  for (std::size_t i = 0; i < karu::trace::kTraceBufferSize + 10; ++i) {
+    karu::trace::Record(i < 10 ? "old" : "new", start + i, 1);
+  }
+
+  std::ostringstream out;
+  karu::trace::WriteChromeTrace(out);
+  const std::string trace = out.str();
+
+  // the ring buffer only keeps the newest events.
+  EXPECT_EQ(trace.find("\"old\""), std::string::npos);
+  EXPECT_NE(trace.find("\"name\": \"new\", \"ph\": \"X\""), std::string::npos);
+  EXPECT_EQ(trace.rfind("{\"displayTimeUnit\"", 0), 0);
+}
+
+TEST(KaruTest, DeleteAndInsertBatch) {
+  for (bool hint_files : {false, true}) {
+    test_wrapper([hint_files](const std::string &test_dir) {
+      karu::DBConfig conf{
+          .hint_files_ = hint_files,
+          .database_directory_ = test_dir,
+      };
+      {
+        karu::DB db(conf);
+        std::vector<std::pair<absl::string_view, absl::string_view>> batch = {
+            {"a", "1"}, {"b", "2"}, {"c", "3"}, {"a", "4"}};
+        auto status = db.InsertBatch(batch);
+        OK;
+
+        EXPECT_EQ(*db.Get("a"), "4");
+        EXPECT_EQ(*db.Get("c"), "3");
+        status = db.Delete("b");
+        OK;
+        EXPECT_TRUE(absl::IsNotFound(db.Get("b").status()));
+        EXPECT_TRUE(absl::IsNotFound(db.Delete("b")));
+
+        status = db.FlushMemoryTable();
+        OK;
+        status = db.Delete("c");
+        OK;
+      }
+      {
+        // the tombstones need to survive a restart.
+        karu::DB db(conf);
+        EXPECT_EQ(*db.Get("a"), "4");
+        EXPECT_TRUE(absl::IsNotFound(db.Get("b").status()));
+        EXPECT_TRUE(absl::IsNotFound(db.Get("c").status()));
+
+        std::vector<std::string> keys;
+        EXPECT_EQ(db.Scan(0, 10, keys), 0);
+        EXPECT_EQ(keys, std::vector<std::string>{"a"});
+      }
+    });
+  }
+}
+
+TEST(KaruTest, ScanPages) {
+  test_wrapper([](const std::string &test_dir) {
+    karu::DB db(test_dir);
+    for (int i = 0; i < 5000; ++i) {
+      auto status = db.Insert("key-" + std::to_string(i), "value");
+      OK;
+    }
+    for (int i = 0; i < 5000; i += 10) {
+      auto status = db.Delete("key-" + std::to_string(i));
+      OK;
+    }
+
+    // every call resumes at its cursor, each live key is returned once.
+    std::vector<std::string> keys;
+    std::uint64_t cursor = 0;
+    std::size_t calls = 0;
+    do {
+      const std::size_t before = keys.size();
+      cursor = db.Scan(cursor, 7, keys);
+      EXPECT_LE(keys.size() - before, 7);
+      EXPECT_LT(cursor, std::uint64_t{1} << 48);
+      ++calls;
+    } while (cursor != 0);
+    EXPECT_EQ(keys.size(), 4500);
+    EXPECT_EQ(std::set<std::string>(keys.begin(), keys.end()).size(), 4500);
+    EXPECT_GE(calls, 4500 / 7);
+  });
+}
+
+TEST(KaruTest, StringViewKeys) {
+  test_wrapper([](const std::string &test_dir) {
+    karu::DB db(test_dir);
+
+    // keys that are only views into a larger buffer, e.g. a network read.
+    const std::string buffer = "key1key2value";
+    absl::string_view first = absl::string_view(buffer).substr(0, 4);
+    absl::string_view second = absl::string_view(buffer).substr(4, 4);
+    auto status = db.Insert(first, absl::string_view(buffer).substr(8));
+    OK;
+
+    std::string owned = "key2";
+    status = db.Insert(std::move(owned), "moved");
+    OK;
+
+    EXPECT_EQ(*db.Get(first), "value");
+    EXPECT_EQ(*db.Get(second), "moved");
+    EXPECT_EQ(*db.Get(std::string("key2")), "moved");
+
+    status = db.Delete(first);
+    OK;
+    EXPECT_TRUE(absl::IsNotFound(db.Get("key1").status()));
+  });
+}
+
+TEST(KaruTest, GetIntoBuffer) {
+  test_wrapper([](const std::string &test_dir) {
+    karu::DB db(test_dir);
+    auto status = db.Insert("key", "value");
+    OK;
+
+    std::uint8_t buffer[8];
+    auto size = db.Get("key", absl::MakeSpan(buffer));
+    ASSERT_TRUE(size.ok());
+    EXPECT_EQ(absl::string_view(reinterpret_cast<char *>(buffer), *size),
+              "value");
+    EXPECT_TRUE(absl::IsResourceExhausted(
+        db.Get("key", absl::MakeSpan(buffer, 4)).status()));
+    EXPECT_TRUE(
+        absl::IsNotFound(db.Get("missing", absl::MakeSpan(buffer)).status()));
+
+    // the values are allocated from the arena and stay valid with it.
+    std::pmr::monotonic_buffer_resource arena;
+    auto first = db.Get("key", arena);
+    status = db.Insert("key", "other");
+    OK;
+    auto second = db.Get("key", arena);
+    ASSERT_TRUE(first.ok() && second.ok());
+    EXPECT_EQ(*first, "value");
+    EXPECT_EQ(*second, "other");
+  });
+}
+
+TEST(TypedDBTest, FixedWidthRecords) {
+  struct Value {
+    char data_[16];
+  };
+  auto make_value = [](char c) {
+    Value value{};
+    std::memset(value.data_, c, sizeof(value.data_));
+    return value;
+  };
+
+  test_wrapper([&](const std::string &test_dir) {
+    using DB = karu::TypedDB<std::uint64_t, Value>;
+    static_assert(DB::kStride == 24);
+    {
+      auto db = DB::Open(test_dir);
+      ASSERT_TRUE(db.ok());
+      for (std::uint64_t key = 0; key < 100; ++key) {
+        auto status = (*db)->Insert(key, make_value('a'));
+        OK;
+      }
+      auto status = (*db)->FlushMemoryTable();
+      OK;
+
+      std::vector<std::pair<std::uint64_t, Value>> batch = {
+          {1, make_value('b')}, {1000, make_value('c')}};
+      status = (*db)->InsertBatch(batch);
+      OK;
+      EXPECT_EQ((*db)->Get(1)->data_[0], 'b');
+      EXPECT_TRUE(absl::IsNotFound((*db)->Get(101).status()));
+    }
+
+    // the keydir is rebuilt from the records, newest file last.
+    auto db = DB::Open(test_dir);
+    ASSERT_TRUE(db.ok());
+    EXPECT_EQ((*db)->Get(0)->data_[15], 'a');
+    EXPECT_EQ((*db)->Get(1)->data_[0], 'b');
+    EXPECT_EQ((*db)->Get(1000)->data_[0], 'c');
+    EXPECT_EQ((*db)->GetStats().index_size_, 101);
+
+    // the records have no header, other sizes can't read them.
+    EXPECT_TRUE(absl::IsFailedPrecondition(
+        karu::TypedDB<std::uint32_t, Value>::Open(test_dir).status()));
+  });
+}
+
+TEST(TypedDBTest, CollectGarbage) {
+  using Value = std::array<char, 16>;
+  auto make_value = [](char c) {
+    Value value{};
+    value.fill(c);
+    return value;
+  };
+
+  test_wrapper([&](const std::string &test_dir) {
+    using DB = karu::TypedDB<std::uint64_t, Value>;
+    auto insert = [&](DB &db, std::uint64_t from, std::uint64_t to, char c) {
+      for (std::uint64_t key = from; key < to; ++key) {
+        auto status = db.Insert(key, make_value(c));
+        OK;
+      }
+      auto status = db.FlushMemoryTable();
+      OK;
+    };
+
+    std::string active;
+    {
+      auto db = DB::Open(test_dir);
+      ASSERT_TRUE(db.ok());
+      // the first file gets holes, the second one dies completely and most
+      // of the third one is overwritten, so it is rewritten.
+      insert(**db, 0, 1000, 'a');
+      insert(**db, 2000, 2100, 'b');
+      insert(**db, 3000, 3100, 'c');
+      insert(**db, 0, 300, 'd');
+      insert(**db, 2000, 2100, 'e');
+      insert(**db, 3000, 3080, 'f');
+
+      const auto files = (*db)->GetStats().datafile_count_;
+      auto status = (*db)->CollectGarbage();
+      OK;
+      auto stats = (*db)->GetStats();
+      EXPECT_EQ(stats.counters_[metrics::kGcFilesRemoved], 2);
+      EXPECT_EQ(stats.counters_[metrics::kGcFilesRewritten], 1);
+      EXPECT_GT(stats.counters_[metrics::kGcBytesPunched], 0);
+      EXPECT_EQ(stats.datafile_count_, files - 2);
+      EXPECT_EQ((*db)->Get(3090)->at(0), 'c');
+
+      // a partial record at the end, as a crash during a write leaves it.
+      auto paths = karu::utils::datafiles(karu::sstable_file_suffix, test_dir);
+      active = paths.back().second;
+      std::ofstream(active, std::ios::binary | std::ios::app) << "trunc";
+    }
+
+    // recovery skips the holes and drops the partial record.
+    auto db = DB::Open(test_dir);
+    ASSERT_TRUE(db.ok());
+    EXPECT_EQ(std::filesystem::file_size(active) % DB::kStride, 0);
+    EXPECT_EQ((*db)->GetStats().index_size_, 1200);
+    EXPECT_EQ((*db)->Get(5)->at(0), 'd');
+    EXPECT_EQ((*db)->Get(500)->at(15), 'a');
+    EXPECT_EQ((*db)->Get(2050)->at(0), 'e');
+    EXPECT_EQ((*db)->Get(3050)->at(0), 'f');
+    EXPECT_EQ((*db)->Get(3090)->at(0), 'c');
+    auto status = (*db)->Insert(4000, make_value('g'));
+    OK;
+    EXPECT_EQ((*db)->Get(4000)->at(0), 'g');
+  });
+}
+
+TEST(KaruTest, InlineValues) {
+  // every way of rebuilding the keydir has to inline the small values again.
+  for (int mode = 0; mode < 3; ++mode) {
+    test_wrapper([mode](const std::string &test_dir) {
+      karu::DBConfig conf{
+          .hint_files_ = mode == 1,
+          .database_directory_ = test_dir,
+          .keydir_snapshot_ = mode == 2,
+          .inline_value_size_ = 4,
+      };
+      auto read_syscalls = [](karu::DB &db) {
+        return db.GetStats().counters_[metrics::kReadSyscalls];
+      };
+
+      {
+        karu::DB db(conf);
+        auto status = db.Insert("small", "1234");
+        OK;
+        status = db.Insert("large", "12345");
+        OK;
+        std::vector<std::pair<absl::string_view, absl::string_view>> batch = {
+            {"batch", "ab"}};
+        status = db.InsertBatch(batch);
+        OK;
+
+        const auto before = read_syscalls(db);
+        EXPECT_EQ(*db.Get("small"), "1234");
+        EXPECT_EQ(*db.Get("batch"), "ab");
+        EXPECT_EQ(read_syscalls(db), before);
+        EXPECT_EQ(*db.Get("large"), "12345");
+        EXPECT_EQ(read_syscalls(db), before + 1);
+
+        // the top bit of the key length marks inline values on disk.
+        const std::string too_large(40000, 'k');
+        EXPECT_TRUE(absl::IsInvalidArgument(db.Insert(too_large, "1")));
+        batch = {{"other", "1"}, {too_large, "1"}};
+        EXPECT_TRUE(absl::IsInvalidArgument(db.InsertBatch(batch)));
+        status = db.Insert(std::string(karu::kMaxKeySize, 'k'), "xyz");
+        OK;
+      }
+
+      karu::DB db(conf);
+      const auto before = read_syscalls(db);
+      EXPECT_EQ(*db.Get("small"), "1234");
+      EXPECT_EQ(*db.Get(std::string(karu::kMaxKeySize, 'k')), "xyz");
+      EXPECT_TRUE(absl::IsNotFound(db.Get(std::string(40000, 'k')).status()));
+      EXPECT_TRUE(absl::IsNotFound(db.Get("other").status()));
+
+      std::vector<std::string> keys = {"batch", "large", "small"};
+      std::vector<std::uint8_t> buffer(32);
+      std::vector<karu::MultiGetResult> results(keys.size());
+      auto status = db.MultiGet(keys, absl::MakeSpan(buffer),
+                                absl::MakeSpan(results));
+      OK;
+      EXPECT_EQ(std::string(reinterpret_cast<char *>(buffer.data()), 11),
+                "ab123451234");
+      EXPECT_EQ(read_syscalls(db), before + 1);
+    });
+  }
+}
+
+TEST(KaruTest, InlineValuesAndGarbageCollection) {
+  static_assert(sizeof(karu::DatabaseEntry) == 16);
+  test_wrapper([](const std::string &test_dir) {
+    karu::DBConfig conf{
+        .hint_files_ = false,
+        .database_directory_ = test_dir,
+        .inline_value_size_ = 8,
+    };
+    {
+      karu::DB db(conf);
+      auto status = db.Insert("flag", "1");
+      OK;
+      for (int i = 0; i < 100; ++i) {
+        status = db.Insert("key-" + std::to_string(i), std::string(1000, 'a'));
+        OK;
+      }
+      status = db.FlushMemoryTable();
+      OK;
+      for (int i = 0; i < 100; ++i) {
+        status = db.Insert("key-" + std::to_string(i), std::string(1000, 'b'));
+        OK;
+      }
+      status = db.FlushMemoryTable();
+      OK;
+
+      // the inline entry has no datafile id of its own, its record still has
+      // to count as live and move with the rewrite.
+      status = db.CollectGarbage();
+      OK;
+      EXPECT_EQ(db.GetStats().counters_[metrics::kGcFilesRewritten], 1);
+      EXPECT_EQ(*db.Get("flag"), "1");
+    }
+
+    karu::DB db(conf);
+    EXPECT_EQ(*db.Get("flag"), "1");
+    EXPECT_EQ(*db.Get("key-7"), std::string(1000, 'b'));
+  });
+}
+
+TEST(KaruTest, FrozenKeydir) {
+  test_wrapper([](const std::string &test_dir) {
+    karu::DBConfig conf{
+        .hint_files_ = true,
+        .database_directory_ = test_dir,
+    };
+    {
+      karu::DB db(conf);
+      for (int i = 0; i < 5000; ++i) {
+        auto status = db.Insert("key-" + std::to_string(i), std::to_string(i));
+        OK;
+        if (i == 2500) {
+          status = db.FlushMemoryTable();
+          OK;
+        }
+      }
+      auto status = db.Delete("key-7");
+      OK;
+      status = db.Freeze();
+      OK;
+    }
+
+    conf.read_only_ = true;
+    {
+      karu::DB db(conf);
+      EXPECT_EQ(db.GetStats().index_size_, 4999);
+      for (int i = 0; i < 5000; ++i) {
+        auto status = db.Get("key-" + std::to_string(i));
+        if (i == 7) {
+          EXPECT_TRUE(absl::IsNotFound(status.status()));
+          continue;
+        }
+        OK;
+        EXPECT_EQ(*status, std::to_string(i));
+      }
+      EXPECT_TRUE(absl::IsNotFound(db.Get("missing").status()));
+      EXPECT_TRUE(absl::IsFailedPrecondition(db.Insert("a", "b")));
+
+      std::vector<std::string> keys = {"key-1", "missing", "key-4999"};
+      std::vector<std::uint8_t> buffer(16);
+      std::vector<karu::MultiGetResult> results(keys.size());
+      auto status = db.MultiGet(keys, absl::MakeSpan(buffer),
+                                absl::MakeSpan(results));
+      OK;
+      EXPECT_TRUE(absl::IsNotFound(results[1].status_));
+      EXPECT_EQ(std::string(reinterpret_cast<char *>(buffer.data()), 5),
+                "14999");
+    }
+
+    auto frozen =
+        karu::frozen::FrozenKeydir::Open(test_dir + "/keydir.frozen");
+    ASSERT_TRUE(frozen.ok());
+    EXPECT_LT((*frozen)->BitsPerKey(), 5.0);
+
+    // writes after the freeze make the database load the regular keydir.
+    {
+      conf.read_only_ = false;
+      karu::DB db(conf);
+      auto status = db.Insert("key-1", "new");
+      OK;
+    }
+    conf.read_only_ = true;
+    karu::DB db(conf);
+    EXPECT_EQ(*db.Get("key-1"), "new");
+    EXPECT_TRUE(absl::IsNotFound(db.Get("key-7").status()));
+  });
+}
+
+TEST(KaruTest, MappedKeydir) {
+  test_wrapper([](const std::string &test_dir) {
+    karu::DBConfig conf{
+        .hint_files_ = true,
+        .database_directory_ = test_dir,
+        .mapped_keydir_ = true,
+    };
+    auto bytes_read = [](karu::DB &db) {
+      return db.GetStats().counters_[metrics::kBytesRead];
+    };
+    auto check = [](karu::DB &db) {
+      EXPECT_EQ(db.GetStats().index_size_, 2999);
+      EXPECT_EQ(*db.Get("key-1"), "new");
+      EXPECT_EQ(*db.Get("key-2999"), "2999");
+      EXPECT_TRUE(absl::IsNotFound(db.Get("key-7").status()));
+    };
+
+    {
+      // enough keys to grow the table a couple of times.
+      karu::DB db(conf);
+      for (int i = 0; i < 3000; ++i) {
+        auto status = db.Insert("key-" + std::to_string(i), std::to_string(i));
+        OK;
+      }
+      auto status = db.Insert("key-1", "new");
+      OK;
+      status = db.Delete("key-7");
+      OK;
+      check(db);
+
+      std::vector<std::string> keys;
+      std::uint64_t cursor = 0;
+      do {
+        cursor = db.Scan(cursor, 100, keys);
+      } while (cursor != 0);
+      EXPECT_EQ(keys.size(), 2999);
+
+      // a copy of an open keydir is dirty, like one left behind by a crash.
+      std::filesystem::copy(test_dir, test_dir + "-crash");
+    }
+
+    {
+      // a clean keydir is used as is, without reading the datafiles.
+      karu::DB db(conf);
+      EXPECT_EQ(bytes_read(db), 0);
+      check(db);
+    }
+
+    {
+      karu::DB db(karu::DBConfig{
+          .hint_files_ = true,
+          .database_directory_ = test_dir + "-crash",
+          .mapped_keydir_ = true,
+      });
+      EXPECT_GT(bytes_read(db), 0);
+      check(db);
+    }
+    std::filesystem::remove_all(test_dir + "-crash");
+
+    // writes without the mapped keydir make it rebuild on the next open.
+    {
+      karu::DB db(karu::DBConfig{
+          .hint_files_ = true,
+          .database_directory_ = test_dir,
+      });
+      auto status = db.Insert("key-2999", "other");
+      OK;
+    }
+    karu::DB db(conf);
+    EXPECT_EQ(*db.Get("key-2999"), "other");
+    EXPECT_EQ(*db.Get("key-1"), "new");
+  });
+}
+
+TEST(KaruTest, BackgroundLoad) {
+  test_wrapper([](const std::string &test_dir) {
+    karu::DBConfig conf{
+        .hint_files_ = true,
+        .database_directory_ = test_dir,
+    };
+    {
+      // newer files overwrite and delete keys of older ones.
+      karu::DB db(conf);
+      for (int i = 0; i < 1000; ++i) {
+        auto status = db.Insert("key-" + std::to_string(i), "old");
+        OK;
+      }
+      auto status = db.FlushMemoryTable();
+      OK;
+      for (int i = 0; i < 100; ++i) {
+        status = db.Insert("key-" + std::to_string(i), "new");
+        OK;
+        status = db.Delete("key-" + std::to_string(100 + i));
+        OK;
+      }
+    }
+
+    conf.background_load_ = true;
+    for (int round = 0; round < 2; ++round) {
+      karu::DB db(conf);
+      // whatever the background load got to, the answers are the same.
+      EXPECT_EQ(*db.Get("key-5"), "new");
+      EXPECT_TRUE(absl::IsNotFound(db.Get("key-105").status()));
+      EXPECT_EQ(*db.Get("key-500"), "old");
+      EXPECT_TRUE(absl::IsNotFound(db.Delete("key-106")));
+      const std::string deleted = "key-" + std::to_string(600 + round);
+      auto status = db.Delete(deleted);
+      OK;
+      status = db.Insert("key-502", "live");
+      OK;
+
+      db.WaitUntilReady();
+      EXPECT_TRUE(db.Ready());
+      const auto stats = db.GetStats();
+      EXPECT_EQ(stats.pending_files_, 0);
+      EXPECT_EQ(stats.index_size_, 899 - round);
+      EXPECT_TRUE(absl::IsNotFound(db.Get(deleted).status()));
+      EXPECT_EQ(*db.Get("key-502"), "live");
+      EXPECT_EQ(*db.Get("key-6"), "new");
+    }
+
+    // the first load wrote a filter for every datafile it read.
+    EXPECT_GE(karu::utils::files_with_extension(".blm", test_dir).size(), 2);
+  });
+}
+
+TEST(KaruTest, ThrottledBackgroundLoad) {
+  test_wrapper([](const std::string &test_dir) {
+    karu::DBConfig conf{
+        .hint_files_ = false,
+        .database_directory_ = test_dir,
+    };
+    {
+      karu::DB db(conf);
+      for (int i = 0; i < 3000; ++i) {
+        auto status = db.Insert("key-" + std::to_string(i),
+                                std::string(1000, 'v'));
+        OK;
+      }
+    }
+
+    // the load asks for every chunk it reads instead of the whole file at
+    // once, so it is paced over the file.
+    conf.background_load_ = true;
+    conf.background_io_rate_ = 32 << 20;
+    karu::DB db(conf);
+    db.WaitUntilReady();
+    const auto stats = db.GetStats();
+    EXPECT_EQ(stats.index_size_, 3000);
+    EXPECT_GE(stats.counters_[metrics::kIoThrottled], 3);
+  });
+}
+
+TEST(KaruTest, ShutdownDuringThrottledLoad) {
+  using namespace std::chrono_literals;
+  test_wrapper([](const std::string &test_dir) {
+    karu::DBConfig conf{
+        .hint_files_ = false,
+        .database_directory_ = test_dir,
+        .keydir_snapshot_ = true,
+    };
+    {
+      karu::DB db(conf);
+      for (int i = 0; i < 3000; ++i) {
+        auto status = db.Insert("key-" + std::to_string(i),
+                                std::string(1000, 'v'));
+        OK;
+      }
+    }
+    std::filesystem::remove(test_dir + "/" + karu::snapshot_file_name);
+
+    // at 64 KiB/s the first chunk alone takes seconds, closing the database
+    // cancels the wait.
+    conf.background_load_ = true;
+    conf.background_io_rate_ = 64 << 10;
+    auto throttled = std::make_unique<karu::DB>(conf);
+    std::this_thread::sleep_for(20ms);
+    EXPECT_FALSE(throttled->Ready());
+    const auto start = std::chrono::steady_clock::now();
+    throttled.reset();
+    EXPECT_LT(std::chrono::steady_clock::now() - start, 1s);
+
+    // the cancelled load didn't leave an incomplete snapshot behind.
+    EXPECT_FALSE(std::filesystem::exists(test_dir + "/" +
+                                         karu::snapshot_file_name));
+    conf.background_load_ = false;
+    conf.background_io_rate_ = 0;
+    karu::DB db(conf);
+    EXPECT_EQ(db.GetStats().index_size_, 3000);
+  });
+}
+
+TEST(KaruTest, EstimateEntries) {
+  test_wrapper([](const std::string &test_dir) {
+    {
+      karu::DB db(karu::DBConfig{
+          .hint_files_ = true,
+          .database_directory_ = test_dir,
+      });
+      for (int i = 0; i < 5000; ++i) {
+        auto status = db.Insert("key-" + std::to_string(i), "value");
+        OK;
+      }
+    }
+
+    auto datafiles = karu::utils::files_with_extension(".data", test_dir);
+    ASSERT_EQ(datafiles.size(), 1);
+    auto hints = karu::utils::files_with_extension(".hnt", test_dir);
+    ASSERT_EQ(hints.size(), 1);
+
+    // both are sampled from the first 64 KiB, the keys only differ a bit in
+    // size, so the estimates are close.
+    auto hinted = karu::hint::EstimateHintCount(hints[0]);
+    EXPECT_GT(hinted, 4500);
+    EXPECT_LT(hinted, 5500);
+
+    auto reader = karu::io::OpenFileReader(datafiles[0]);
+    ASSERT_TRUE(reader.ok());
+    auto scanned = karu::scanner::EstimateRecords(
+        **reader, std::filesystem::file_size(datafiles[0]));
+    EXPECT_GT(scanned, 4500);
+    EXPECT_LT(scanned, 5500);
+    EXPECT_EQ(karu::scanner::EstimateRecords(**reader, 0), 0);
+  });
+}
+
+TEST(KaruTest, CollectGarbage) {
+  test_wrapper([](const std::string &test_dir) {
+    karu::DBConfig conf{
+        .hint_files_ = true,
+        .database_directory_ = test_dir,
+        // the collection goes through the rate limiter.
+        .background_io_rate_ = 1 << 30,
+    };
+    auto value = [](char c, int i) {
+      return std::string(1000, c) + std::to_string(i);
+    };
+    {
+      karu::DB db(conf);
+      // a third of this file dies, so it gets holes.
+      for (int i = 0; i < 1000; ++i) {
+        auto status = db.Insert("key-" + std::to_string(i), value('a', i));
+        OK;
+      }
+      auto status = db.FlushMemoryTable();
+      OK;
+      for (int i = 0; i < 300; ++i) {
+        status = db.Insert("key-" + std::to_string(i), value('b', i));
+        OK;
+      }
+      for (int i = 900; i < 950; ++i) {
+        status = db.Delete("key-" + std::to_string(i));
+        OK;
+      }
+      status = db.FlushMemoryTable();
+      OK;
+
+      // this file dies completely and is removed.
+      for (int i = 0; i < 100; ++i) {
+        status = db.Insert("x-" + std::to_string(i), value('c', i));
+        OK;
+      }
+      status = db.FlushMemoryTable();
+      OK;
+      // and most of this one, so it is rewritten.
+      for (int i = 0; i < 100; ++i) {
+        status = db.Insert("y-" + std::to_string(i), value('e', i));
+        OK;
+      }
+      status = db.FlushMemoryTable();
+      OK;
+      for (int i = 0; i < 100; ++i) {
+        status = db.Insert("x-" + std::to_string(i), value('d', i));
+        OK;
+      }
+      for (int i = 0; i < 80; ++i) {
+        status = db.Insert("y-" + std::to_string(i), value('f', i));
+        OK;
+      }
+      status = db.FlushMemoryTable();
+      OK;
+
+      const auto files = db.GetStats().datafile_count_;
+      status = db.CollectGarbage();
+      OK;
+      auto stats = db.GetStats();
+      EXPECT_EQ(stats.counters_[metrics::kGcFilesRemoved], 2);
+      EXPECT_EQ(stats.counters_[metrics::kGcFilesRewritten], 1);
+      EXPECT_GT(stats.counters_[metrics::kGcBytesPunched], 0);
+      EXPECT_EQ(stats.datafile_count_, files - 2);
+      EXPECT_EQ(stats.index_size_, 1150);
+      EXPECT_EQ(stats.background_io_rate_, 1 << 30);
+      EXPECT_EQ(*db.Get("key-5"), value('b', 5));
+      EXPECT_EQ(*db.Get("key-500"), value('a', 500));
+      EXPECT_EQ(*db.Get("y-90"), value('e', 90));
+
+      // nothing died since, so the second run doesn't do anything.
+      status = db.CollectGarbage();
+      OK;
+      EXPECT_EQ(db.GetStats().counters_[metrics::kGcBytesPunched],
+                stats.counters_[metrics::kGcBytesPunched]);
+    }
+    EXPECT_FALSE(karu::utils::files_with_extension(".dead", test_dir).empty());
+
+    // recovery from the hints and from the datafiles skips the holes.
+    for (bool hints : {true, false}) {
+      conf.hint_files_ = hints;
+      karu::DB db(conf);
+      EXPECT_EQ(db.GetStats().index_size_, 1150);
+      EXPECT_EQ(*db.Get("key-5"), value('b', 5));
+      EXPECT_EQ(*db.Get("key-500"), value('a', 500));
+      EXPECT_TRUE(absl::IsNotFound(db.Get("key-920").status()));
+      EXPECT_EQ(*db.Get("x-7"), value('d', 7));
+      EXPECT_EQ(*db.Get("y-7"), value('f', 7));
+      EXPECT_EQ(*db.Get("y-90"), value('e', 90));
+    }
+  });
+}
+
+TEST(KaruTest, GetDuringCollectGarbage) {
+  test_wrapper([](const std::string &test_dir) {
+    karu::DB db(test_dir);
+    auto value = [](int i) {
+      return std::string(1000, 'v') + std::to_string(i);
+    };
+    std::vector<std::string> live;
+    for (int i = 80; i < 100; ++i) {
+      live.push_back("key-" + std::to_string(i));
+    }
+
+    // the reader keeps reading keys whose datafile is rewritten and removed
+    // under it.
+    std::atomic<bool> done{false};
+    std::thread reader([&] {
+      std::vector<std::uint8_t> buffer(live.size() * 1010);
+      std::vector<karu::MultiGetResult> results(live.size());
+      while (!done.load()) {
+        for (int i = 80; i < 100; ++i) {
+          auto got = db.Get("key-" + std::to_string(i));
+          if (!absl::IsNotFound(got.status())) {
+            ASSERT_TRUE(got.ok()) << got.status();
+            EXPECT_EQ(*got, value(i));
+          }
+        }
+        auto status = db.MultiGet(live, absl::MakeSpan(buffer),
+                                  absl::MakeSpan(results));
+        OK;
+        for (const auto &result : results) {
+          EXPECT_TRUE(result.status_.ok() ||
+                      absl::IsNotFound(result.status_))
+              << result.status_;
+        }
+      }
+    });
+
+    for (int round = 0; round < 20; ++round) {
+      for (int i = 0; i < 100; ++i) {
+        auto status = db.Insert("key-" + std::to_string(i), value(i));
+        OK;
+      }
+      auto status = db.FlushMemoryTable();
+      OK;
+      for (int i = 0; i < 80; ++i) {
+        status = db.Insert("key-" + std::to_string(i), value(i));
+        OK;
+      }
+      status = db.FlushMemoryTable();
+      OK;
+      status = db.CollectGarbage();
+      OK;
+    }
+    done.store(true);
+    reader.join();
+    EXPECT_GT(db.GetStats().counters_[metrics::kGcFilesRewritten], 0);
+  });
+}
+
+TEST(KaruTest, GetMissingDatafile) {
+  test_wrapper([](const std::string &test_dir) {
+    karu::DBConfig conf{
+        .hint_files_ = true,
+        .database_directory_ = test_dir,
+    };
+    {
+      karu::DB db(conf);
+      auto status = db.Insert("key", "value");
+      OK;
+    }
+    // the hints are loaded but the datafile they point into is gone, which
+    // must not be mistaken for a datafile that garbage collection removed.
+    for (const auto &path :
+         karu::utils::files_with_extension(".data", test_dir)) {
+      std::filesystem::remove(path);
+    }
+    karu::DB db(conf);
+    std::vector<std::uint8_t> buffer(16);
+    EXPECT_TRUE(absl::IsInternal(db.Get("key").status()));
+    EXPECT_TRUE(
+        absl::IsInternal(db.Get("key", absl::MakeSpan(buffer)).status()));
+  });
+}
+
+TEST(AccessTest, SketchAndAnchors) {
+  karu::access::AccessTracker tracker(1024);
+  const std::uint64_t hot = karu::hash::HashKey("hot");
+  const std::uint64_t cold = karu::hash::HashKey("cold");
+  for (int i = 0; i < 100; ++i) {
+    tracker.RecordGet(hot);
+  }
+  tracker.RecordGet(cold);
+  // the sketch never underestimates and is exact without collisions.
+  EXPECT_GE(tracker.Estimate(hot), 100 * karu::access::kSampleInterval);
+  EXPECT_LT(tracker.Estimate(cold), 10 * karu::access::kSampleInterval);
+
+  const std::uint64_t batch[] = {karu::hash::HashKey("a"),
+                                 karu::hash::HashKey("b"),
+                                 karu::hash::HashKey("c")};
+  tracker.RecordBatch(batch);
+  EXPECT_EQ(tracker.Anchor(batch[0]), tracker.Anchor(batch[1]));
+  EXPECT_EQ(tracker.Anchor(batch[1]), tracker.Anchor(batch[2]));
+  EXPECT_EQ(tracker.Anchor(hot), hot);
+}
+
+TEST(KaruTest, HotKeys) {
+  test_wrapper([](const std::string &test_dir) {
+    karu::DBConfig conf{
+        .hint_files_ = true,
+        .database_directory_ = test_dir,
+        .track_access_ = true,
+        .hot_key_reads_ = 256,
+    };
+    {
+      karu::DB db(conf);
+      for (int file = 0; file < 2; ++file) {
+        for (int i = 0; i < 200; ++i) {
+          auto status = db.Insert(
+              "key-" + std::to_string(file * 200 + i), std::string(100, 'v'));
+          OK;
+        }
+        auto status = db.FlushMemoryTable();
+        OK;
+      }
+
+      // sampling is per thread, so this reads every key well above the
+      // threshold.
+      for (int round = 0; round < 1000; ++round) {
+        for (int i = 0; i < 400; i += 50) {
+          auto value = db.Get("key-" + std::to_string(i));
+          ASSERT_TRUE(value.ok());
+        }
+      }
+      const std::vector<std::string> keys = {"key-10", "key-210"};
+      std::vector<std::uint8_t> buffer(200);
+      std::vector<karu::MultiGetResult> results(keys.size());
+      for (int round = 0; round < 1000; ++round) {
+        auto status =
+            db.MultiGet(keys, absl::MakeSpan(buffer), absl::MakeSpan(results));
+        OK;
+      }
+
+      const auto files = db.GetStats().datafile_count_;
+      auto status = db.CollectGarbage();
+      OK;
+      auto stats = db.GetStats();
+      EXPECT_EQ(stats.counters_[metrics::kGcHotKeysMoved], 10);
+      // the hot datafile was added, the old records became holes.
+      EXPECT_EQ(stats.datafile_count_, files + 1);
+
+      // the keys of the MultiGet are next to each other now, so they are
+      // read with a single syscall.
+      const auto reads = stats.counters_[metrics::kReadSyscalls];
+      status =
+          db.MultiGet(keys, absl::MakeSpan(buffer), absl::MakeSpan(results));
+      OK;
+      EXPECT_EQ(db.GetStats().counters_[metrics::kReadSyscalls], reads + 1);
+
+      // they are hot already, so the next run leaves them alone.
+      status = db.CollectGarbage();
+      OK;
+      EXPECT_EQ(db.GetStats().counters_[metrics::kGcHotKeysMoved], 10);
+    }
+
+    karu::DB db(conf);
+    EXPECT_EQ(db.GetStats().index_size_, 400);
+    for (int i = 0; i < 400; i += 10) {
+      EXPECT_EQ(*db.Get("key-" + std::to_string(i)), std::string(100, 'v'));
+    }
+  });
+}
+
+TEST(MetricsTest, AlternatingRegistries) {
+  // a thread that alternates between DBs keeps their metrics apart, also
+  // after one of them was destroyed and another one took its place.
+  karu::metrics::Registry first;
+  for (int round = 0; round < 2; ++round) {
+    karu::metrics::Registry second;
+    for (int i = 0; i < 100; ++i) {
+      first.Add(metrics::kBytesRead);
+      second.Add(metrics::kBytesRead, 2);
+    }
+    EXPECT_EQ(second.Collect().counters_[metrics::kBytesRead], 200);
+  }
+  EXPECT_EQ(first.Collect().counters_[metrics::kBytesRead], 200);
+}
+
+TEST(RateLimiterTest, ThrottleAndTune) {
+  using namespace std::chrono_literals;
+  karu::metrics::Registry registry;
+  karu::io::RateLimiter limiter(10 << 20, 1us, &registry);
+
+  // 1 MiB at 10 MiB/s takes about 100ms.
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < 5; ++i) {
+    limiter.Request(200 << 10);
+  }
+  EXPECT_GE(std::chrono::steady_clock::now() - start, 80ms);
+  auto stats = registry.Collect();
+  EXPECT_GT(stats.counters_[metrics::kIoThrottled], 0);
+  EXPECT_GT(stats.counters_[metrics::kIoThrottledNanos], 0);
+
+  // background requests wait for foreground reads, but not forever.
+  {
+    karu::io::ForegroundScope foreground(&limiter);
+    limiter.Request(0);
+  }
+  EXPECT_EQ(registry.Collect().counters_[metrics::kIoPreempted], 1);
+
+  // slow Gets lower the rate, it recovers once they are fast again.
+  registry.Record(metrics::kGetLatency, 1000000);
+  std::this_thread::sleep_for(110ms);
+  limiter.Request(0);
+  EXPECT_EQ(limiter.Rate(), 5 << 20);
+  std::this_thread::sleep_for(110ms);
+  limiter.Request(0);
+  EXPECT_GT(limiter.Rate(), 5 << 20);
+  stats = registry.Collect();
+  EXPECT_EQ(stats.counters_[metrics::kIoRateDecreases], 1);
+  EXPECT_EQ(stats.counters_[metrics::kIoRateIncreases], 1);
+}
+
+TEST(ExecutorTest, SchedulingAndShutdown) {
+  using namespace std::chrono_literals;
+  {
+    // a single thread starts the queued jobs by priority.
+    karu::Executor executor(1);
+    absl::Notification release;
+    absl::Mutex mutex;
+    std::vector<int> order;
+    executor.Submit("gate", karu::Priority::kHigh,
+                    [&] { release.WaitForNotification(); });
+    executor.Submit("low", karu::Priority::kLow, [&] {
+      absl::MutexLock lock(&mutex);
+      order.push_back(2);
+    });
+    executor.Submit("normal", karu::Priority::kNormal, [&] {
+      absl::MutexLock lock(&mutex);
+      order.push_back(1);
+    });
+    executor.Submit("high", karu::Priority::kHigh, [&] {
+      absl::MutexLock lock(&mutex);
+      order.push_back(0);
+    });
+    absl::Notification done;
+    executor.SubmitAfter("delayed", karu::Priority::kLow,
+                         absl::Milliseconds(20), [&] { done.Notify(); });
+    release.Notify();
+    EXPECT_TRUE(done.WaitForNotificationWithTimeout(absl::Seconds(5)));
+    absl::MutexLock lock(&mutex);
+    EXPECT_EQ(order, (std::vector<int>{0, 1, 2}));
+  }
+
+  {
+    // the jobs a job submits are stolen by the other threads.
+    karu::Executor executor(4);
+    absl::Mutex mutex;
+    std::set<std::thread::id> threads;
+    std::atomic<int> finished{0};
+    executor.Submit("parent", karu::Priority::kNormal, [&] {
+      for (int i = 0; i < 8; ++i) {
+        executor.Submit("child", karu::Priority::kNormal, [&] {
+          {
+            absl::MutexLock lock(&mutex);
+            threads.insert(std::this_thread::get_id());
+          }
+          std::this_thread::sleep_for(20ms);
+          finished.fetch_add(1);
+        });
+      }
+    });
+    for (int i = 0; i < 500 && finished.load() < 8; ++i) {
+      std::this_thread::sleep_for(10ms);
+    }
+    EXPECT_EQ(finished.load(), 8);
+    {
+      absl::MutexLock lock(&mutex);
+      EXPECT_GT(threads.size(), 1);
+    }
+
+    // the accounting only covers finished jobs, wait for the last one.
+    for (int i = 0; i < 500; ++i) {
+      auto jobs = executor.Accounting();
+      if (jobs.size() == 2 && jobs[0].runs_ == 8) {
+        break;
+      }
+      std::this_thread::sleep_for(10ms);
+    }
+    auto jobs = executor.Accounting();
+    ASSERT_EQ(jobs.size(), 2);
+    EXPECT_EQ(jobs[0].name_, "child");
+    EXPECT_EQ(jobs[0].runs_, 8);
+    EXPECT_GE(jobs[0].wall_ns_, 8 * 20000000ull);
+    EXPECT_EQ(jobs[1].name_, "parent");
+    EXPECT_EQ(jobs[1].runs_, 1);
+  }
+
+  {
+    // Shutdown drops the jobs that haven't started.
+    karu::Executor executor(1);
+    absl::Notification started;
+    std::atomic<bool> ran{false};
+    executor.Submit("running", karu::Priority::kHigh, [&] {
+      started.Notify();
+      std::this_thread::sleep_for(20ms);
+    });
+    executor.Submit("queued", karu::Priority::kHigh, [&] { ran = true; });
+    executor.SubmitAfter("delayed", karu::Priority::kHigh, absl::Hours(1),
+                         [&] { ran = true; });
+    started.WaitForNotification();
+    executor.Shutdown();
+    EXPECT_TRUE(executor.Cancelled());
+    EXPECT_FALSE(ran.load());
+    executor.Submit("late", karu::Priority::kHigh, [&] { ran = true; });
+    EXPECT_FALSE(ran.load());
+    EXPECT_EQ(executor.Accounting().size(), 1);
+  }
+}
+
+TEST(RespTest, ParseCommand) {
+  std::vector<absl::string_view> args;
+  std::size_t consumed = 0;
+  std::string input = "*2\r\n$3\r\nGET\r\n$3\r\nfoo\r\nPING\r\n";
+  EXPECT_EQ(resp::ParseCommand(input, args, consumed),
+            resp::ParseResult::kCommand);
+  EXPECT_EQ(args, (std::vector<absl::string_view>{"GET", "foo"}));
+
+  args.clear();
+  absl::string_view rest = absl::string_view(input).substr(consumed);
+  EXPECT_EQ(resp::ParseCommand(rest, args, consumed),
+            resp::ParseResult::kCommand);
+  EXPECT_EQ(args, (std::vector<absl::string_view>{"PING"}));
+  EXPECT_EQ(consumed, rest.size());
+
+  args.clear();
+  EXPECT_EQ(resp::ParseCommand("*2\r\n$3\r\nGET\r\n$3\r\nfo", args,
+                               consumed),
+            resp::ParseResult::kIncomplete);
+  args.clear();
+  EXPECT_EQ(resp::ParseCommand("*1\r\n$x\r\n", args, consumed),
+            resp::ParseResult::kError);
+
+  resp::Reply reply{};
+  const std::string replies = "*2\r\n$1\r\na\r\n$-1\r\n:3\r\n-ERR x\r\n";
+  EXPECT_EQ(resp::ParseReply(replies, reply, consumed),
+            resp::ParseResult::kCommand);
+  EXPECT_EQ(reply.type_, resp::ReplyType::kArray);
+  EXPECT_EQ(reply.value_, "$1\r\na\r\n$-1\r\n");
+  rest = absl::string_view(replies).substr(consumed);
+  EXPECT_EQ(resp::ParseReply(rest, reply, consumed),
+            resp::ParseResult::kCommand);
+  EXPECT_EQ(reply.type_, resp::ReplyType::kInteger);
+  EXPECT_EQ(reply.value_, "3");
+  EXPECT_EQ(resp::ParseReply(rest.substr(consumed), reply, consumed),
+            resp::ParseResult::kCommand);
+  EXPECT_EQ(reply.type_, resp::ReplyType::kError);
+  EXPECT_EQ(resp::ParseReply("$5\r\nab", reply, consumed),
+            resp::ParseResult::kIncomplete);
+
+  EXPECT_TRUE(server::MatchGlob("user:*", "user:10"));
+  EXPECT_TRUE(server::MatchGlob("u?er*1?", "user:10"));
+  EXPECT_FALSE(server::MatchGlob("user:?", "user:10"));
+}
+
+int connect_to(std::uint16_t port) {
+  int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  ::inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+  if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// sends the request and reads until the server closes the connection.
+std::string roundtrip(std::uint16_t port, const std::string &request) {
+  int fd = connect_to(port);
+  if (fd == -1) {
+    return "";
+  }
+  std::size_t sent = 0;
+  while (sent < request.size()) {
+    ssize_t n = ::write(fd, request.data() + sent, request.size() - sent);
+    if (n <= 0) {
+      break;
+    }
+    sent += n;
+  }
+
+  std::string reply;
+  char buf[4096];
+  ssize_t n;
+  while ((n = ::read(fd, buf, sizeof(buf))) > 0) {
+    reply.append(buf, n);
+  }
+  ::close(fd);
+  return reply;
+}
+
+TEST(ServerTest, Pipelining) {
+  test_wrapper([](const std::string &test_dir) {
+    karu::DB db(test_dir);
+    server::Server srv(db, {.address_ = "127.0.0.1", .port_ = 0});
+    auto status = srv.Listen();
+    OK;
+    std::thread loop([&] { EXPECT_TRUE(srv.Run().ok()); });
+
+    const std::string big(2000, 'v');
+    const std::string request =
+        "*3\r\n$3\r\nSET\r\n$1\r\na\r\n$1\r\n1\r\n"
+        "SET b " + big + "\r\n"
+        "GET a\r\nGET b\r\nGET missing\r\n"
+        "MGET a missing\r\nDEL a missing\r\nSCAN 0 MATCH a*\r\n"
+        "QUIT\r\n";
+    std::string reply = roundtrip(srv.Port(), request);
+    const std::string expected =
+        "+OK\r\n+OK\r\n$1\r\n1\r\n$2000\r\n" + big +
+        "\r\n$-1\r\n*2\r\n$1\r\n1\r\n$-1\r\n:1\r\n"
+        "*2\r\n$1\r\n0\r\n*0\r\n+OK\r\n";
+    EXPECT_EQ(reply, expected);
+
+    srv.Stop();
+    loop.join();
+  });
+}
+
+TEST(SpscQueueTest, ProducerConsumer) {
+  SpscQueue<std::uint64_t> queue(100);
+  EXPECT_EQ(queue.Capacity(), 128);
+
+  constexpr std::uint64_t kCount = 100000;
+  std::thread producer([&] {
+    for (std::uint64_t i = 0; i < kCount; ++i) {
+      std::uint64_t value = i;
+      while (!queue.TryPush(std::move(value))) {
+        std::this_thread::yield();
+      }
+    }
+  });
+
+  std::uint64_t expected = 0, value = 0;
+  while (expected < kCount) {
+    if (queue.TryPop(value)) {
+      ASSERT_EQ(value, expected++);
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  producer.join();
+  EXPECT_FALSE(queue.TryPop(value));
+}
+
+TEST(ServerTest, Shards) {
+  test_wrapper([](const std::string &test_dir) {
+    constexpr std::size_t kShards = 4;
+    std::vector<std::unique_ptr<karu::DB>> dbs;
+    std::vector<karu::DB *> shards;
+    for (std::size_t i = 0; i < kShards; ++i) {
+      std::string dir = test_dir + "/shard-" + std::to_string(i);
+      createTestDirectory(dir);
+      dbs.push_back(std::make_unique<karu::DB>(dir));
+      shards.push_back(dbs.back().get());
+    }
+
+    server::Server srv(shards, {.address_ = "127.0.0.1", .port_ = 0});
+    auto status = srv.Listen();
+    OK;
+    EXPECT_EQ(srv.ShardCount(), kShards);
+    std::thread loop([&] { EXPECT_TRUE(srv.Run().ok()); });
+
+    // connections land on any of the loops, every one of them has to route
+    // the keys to the right shard.
+    constexpr int kKeys = 64;
+    for (int conn = 0; conn < 4; ++conn) {
+      std::string request, expected;
+      for (int i = conn; i < kKeys; i += 4) {
+        request += "SET key" + std::to_string(i) + " v" + std::to_string(i) +
+                   "\r\n";
+        expected += "+OK\r\n";
+      }
+      request += "QUIT\r\n";
+      expected += "+OK\r\n";
+      EXPECT_EQ(roundtrip(srv.Port(), request), expected);
+    }
+
+    std::set<std::size_t> used;
+    for (int i = 0; i < kKeys; ++i) {
+      std::string key = "key" + std::to_string(i);
+      std::size_t shard = server::ShardOf(key, kShards);
+      used.insert(shard);
+      EXPECT_EQ(*dbs[shard]->Get(key), "v" + std::to_string(i));
+    }
+    EXPECT_EQ(used.size(), kShards);
+
+    std::string request = "MGET", expected = "*" + std::to_string(kKeys + 1) +
+                                               "\r\n";
+    for (int i = 0; i < kKeys; ++i) {
+      request += " key" + std::to_string(i);
+      std::string value = "v" + std::to_string(i);
+      expected += "$" + std::to_string(value.size()) + "\r\n" + value + "\r\n";
+    }
+    request += " missing\r\nGET key7\r\nDEL key1 key2 key3 missing\r\n"
+               "QUIT\r\n";
+    expected += "$-1\r\n$2\r\nv7\r\n:3\r\n+OK\r\n";
+    EXPECT_EQ(roundtrip(srv.Port(), request), expected);
+
+    // SCAN walks every shard.
+    std::set<std::string> scanned;
+    std::string cursor = "0";
+    do {
+      std::string reply =
+          roundtrip(srv.Port(), "SCAN " + cursor + " COUNT 7\r\nQUIT\r\n");
+      std::istringstream lines(reply);
+      std::string line;
+      std::getline(lines, line);  // *2
+      std::getline(lines, line);  // cursor length
+      std::getline(lines, cursor);
+      cursor.pop_back();
+      std::getline(lines, line);  // key count
+      while (std::getline(lines, line) && line != "+OK\r") {
+        std::getline(lines, line);
+        line.pop_back();
+        scanned.insert(line);
+      }
+    } while (cursor != "0");
+    EXPECT_EQ(scanned.size(), kKeys - 3);
+    EXPECT_EQ(scanned.count("key1"), 0);
+
+    srv.Stop();
+    loop.join();
+  });
+}
+
+TEST(CaptureTest, RecordAndReplay) {
+  test_wrapper([](const std::string &test_dir) {
+    const std::string trace = test_dir + "/trace.kcap";
+    const std::string db_dir = test_dir + "/db";
+    createTestDirectory(db_dir);
+    {
+      karu::DB db(karu::DBConfig{
+          .hint_files_ = false,
+          .database_directory_ = db_dir,
+          .capture_path_ = trace,
+      });
+      auto status = db.Insert("a", "12345");
+      OK;
+      EXPECT_TRUE(db.Get("a").ok());
+      EXPECT_FALSE(db.Get("b").ok());
+      status = db.Delete("a");
+      OK;
+    }
+
+    auto reader = capture::Reader::Open(trace);
+    ASSERT_TRUE(reader.ok());
+    std::vector<std::pair<capture::Op, std::string>> ops;
+    capture::Event event;
+    std::uint64_t last = 0;
+    while (*(*reader)->Next(event)) {
+      ops.emplace_back(event.op_, event.key_);
+      EXPECT_GE(event.timestamp_, last);
+      last = event.timestamp_;
+    }
+    std::vector<std::pair<capture::Op, std::string>> expected = {
+        {capture::Op::kInsert, "a"},
+        {capture::Op::kGet, "a"},
+        {capture::Op::kGetMiss, "b"},
+        {capture::Op::kDelete, "a"},
+    };
+    EXPECT_EQ(ops, expected);
+
+    // a trace that starts with a read needs the prefill to hit.
+    const std::string read_trace = test_dir + "/read.kcap";
+    {
+      auto writer = capture::Writer::Open(read_trace, true);
+      ASSERT_TRUE(writer.ok());
+      (*writer)->Record(capture::Op::kGet, "x", 10);
+      (*writer)->Record(capture::Op::kInsert, "x", 3);
+      (*writer)->Record(capture::Op::kGet, "x", 3);
+    }
+
+    const std::string replay_dir = test_dir + "/replay";
+    createTestDirectory(replay_dir);
+    karu::DB db(replay_dir);
+    capture::ReplayStats stats;
+    auto status = capture::Replay(read_trace, db,
+                                  {.speed_ = 0, .prefill_ = true}, stats);
+    OK;
+    EXPECT_EQ(stats.events_, 3);
+    EXPECT_EQ(stats.prefilled_, 1);
+    EXPECT_EQ(stats.misses_, 0);
+    EXPECT_EQ(stats.errors_, 0);
+  });
+}
@@ -0,0 +1,123 @@
+#include "trace.h"
+
+#include <absl/synchronization/mutex.h>
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <vector>
+
+namespace karu::trace {
+namespace {
+absl::Mutex buffers_mutex;
+// the buffers are kept alive after their thread exits, such that the events
+// can still be dumped.
+std::vector<std::shared_ptr<ThreadBuffer>> &buffers() {
+  static auto *buffers = new std::vector<std::shared_ptr<ThreadBuffer>>();
+  return *buffers;
+}
+
+ThreadBuffer &local_buffer() noexcept {
+  thread_local std::shared_ptr<ThreadBuffer> buffer = [] {
+    auto buffer = std::make_shared<ThreadBuffer>();
+    absl::MutexLock guard(&buffers_mutex);
+    buffer->tid_ = static_cast<std::uint32_t>(buffers().size() + 1);
+    buffers().push_back(buffer);
+    return buffer;
+  }();
+  return *buffer;
+}
+}  // namespace
+
+std::uint64_t NowNanos() noexcept {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void Record(const char *name, std::uint64_t start,
+            std::uint64_t duration) noexcept {
+  auto &buffer = local_buffer();
+  const std::uint64_t head = buffer.head_.load(std::memory_order_relaxed);
+  auto &event = buffer.events_[head % kTraceBufferSize];
+  event.name_.store(name, std::memory_order_relaxed);
+  event.start_.store(start, std::memory_order_relaxed);
+  event.duration_.store(duration, std::memory_order_relaxed);
+  buffer.head_.store(head + 1, std::memory_order_release);
+}
+
+void WriteChromeTrace(std::ostream &out) noexcept {
+  std::vector<std::shared_ptr<ThreadBuffer>> snapshot;
+  {
+    absl::MutexLock guard(&buffers_mutex);
+    snapshot = buffers();
+  }
+
+  out << std::fixed << std::setprecision(3);
+  out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+  bool first = true;
+  for (const auto &buffer : snapshot) {
+    const std::uint64_t head = buffer->head_.load(std::memory_order_acquire);
+    const std::uint64_t begin =
+        head > kTraceBufferSize ? head - kTraceBufferSize : 0;
+
+    struct Copy {
+      const char *name_;
+      std::uint64_t start_;
+      std::uint64_t duration_;
+    };
+    std::vector<Copy> events;
+    events.reserve(head - begin);
+    for (std::uint64_t i = begin; i < head; ++i) {
+      const auto &event = buffer->events_[i % kTraceBufferSize];
+      events.push_back({event.name_.load(std::memory_order_relaxed),
+                        event.start_.load(std::memory_order_relaxed),
+                        event.duration_.load(std::memory_order_relaxed)});
+    }
+
+    // the writer might have overwritten the oldest events while we copied.
+    const std::uint64_t new_head =
+        buffer->head_.load(std::memory_order_acquire);
+    const std::uint64_t valid_from =
+        new_head > kTraceBufferSize ? new_head - kTraceBufferSize : 0;
+
+    for (std::uint64_t i = begin; i < head; ++i) {
+      const auto &event = events[i - begin];
+      if (i < valid_from || event.name_ == nullptr) {
+        continue;
+      }
+
+      out << (first ? "" : ",") << "\n{\"name\": \"" << event.name_
+          << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->tid_
+          << ", \"ts\": " << static_cast<double>(event.start_) / 1000.0
+          << ", \"dur\": " << static_cast<double>(event.duration_) / 1000.0
+          << '}';
+      first = false;
+    }
+  }
+  out << "\n]}\n";
+}
+
+absl::Status DumpChromeTrace(const std::string &path) noexcept {
+  std::ofstream out(path, std::ios::trunc);
+  if (!out) {
+    return absl::InternalError("could not open trace file: " + path);
+  }
+
+  WriteChromeTrace(out);
+  if (!out) {
+    return absl::InternalError("could not write trace file: " + path);
+  }
+  return absl::OkStatus();
+}
+
+void Clear() noexcept {
+  absl::MutexLock guard(&buffers_mutex);
+  for (auto &buffer : buffers()) {
+    for (auto &event : buffer->events_) {
+      event.name_.store(nullptr, std::memory_order_relaxed);
+    }
+  }
+}
+}  // namespace karu::trace
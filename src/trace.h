@@ -0,0 +1,100 @@
+#ifndef _KARU_TRACE_H
+#define _KARU_TRACE_H
+
+#include <absl/status/status.h>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#if defined(KARU_TRACING) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define KARU_USDT_PROBES 1
+#endif
+#endif
+
+namespace karu::trace {
+// number of events kept per thread. Older events are overwritten.
+constexpr std::size_t kTraceBufferSize = 1 << 14;
+
+struct Event {
+  std::atomic<const char *> name_{nullptr};
+  std::atomic<std::uint64_t> start_{0};
+  std::atomic<std::uint64_t> duration_{0};
+};
+
+// ThreadBuffer is a single producer ring buffer. Only the owning thread writes
+// into it, while the dump may read it concurrently and drops the events that
+// were overwritten while it was reading.
+struct ThreadBuffer {
+  std::uint32_t tid_ = 0;
+  std::atomic<std::uint64_t> head_{0};
+  std::array<Event, kTraceBufferSize> events_;
+};
+
+struct Span {
+  const char *name_;
+  std::uint64_t start_;
+};
+
+std::uint64_t NowNanos() noexcept;
+// records a finished event into the ring buffer of the calling thread.
+void Record(const char *name, std::uint64_t start,
+            std::uint64_t duration) noexcept;
+
+inline Span Begin(const char *name) noexcept {
+#ifdef KARU_USDT_PROBES
+  DTRACE_PROBE1(karu, stage_begin, name);
+#endif
+  return {.name_ = name, .start_ = NowNanos()};
+}
+
+inline void End(const Span &span) noexcept {
+  const std::uint64_t duration = NowNanos() - span.start_;
+#ifdef KARU_USDT_PROBES
+  DTRACE_PROBE2(karu, stage_end, span.name_, duration);
+#endif
+  Record(span.name_, span.start_, duration);
+}
+
+// traces the time from construction until the end of the scope.
+class Scope {
+ public:
+  explicit Scope(const char *name) noexcept : span_(Begin(name)) {}
+  ~Scope() { End(span_); }
+  Scope &operator=(const Scope &) = delete;
+  Scope(const Scope &) = delete;
+
+ private:
+  Span span_;
+};
+
+// writes the events of every thread in the Chrome trace event format, which
+// can be opened in chrome://tracing or Perfetto.
+void WriteChromeTrace(std::ostream &out) noexcept;
+absl::Status DumpChromeTrace(const std::string &path) noexcept;
+// drops all of the recorded events.
+void Clear() noexcept;
+}  // namespace karu::trace
+
+// The trace points compile to nothing unless KARU_TRACING is defined, which is
+// done by configuring with -DKARU_TRACING=ON.
+#define KARU_TRACE_CONCAT_INNER(a, b) a##b
+#define KARU_TRACE_CONCAT(a, b) KARU_TRACE_CONCAT_INNER(a, b)
+
+#ifdef KARU_TRACING
+#define KARU_TRACE_SCOPE(name) \
+  ::karu::trace::Scope KARU_TRACE_CONCAT(karu_trace_scope_, __LINE__)(name)
+#define KARU_TRACE_BEGIN(span, name) \
+  const ::karu::trace::Span span = ::karu::trace::Begin(name)
+#define KARU_TRACE_END(span) ::karu::trace::End(span)
+#else
+#define KARU_TRACE_SCOPE(name)
+#define KARU_TRACE_BEGIN(span, name)
+#define KARU_TRACE_END(span)
+#endif
+
+#endif
@@ -0,0 +1,587 @@
+#ifndef _KARU_TYPED_DB_H
+#define _KARU_TYPED_DB_H
+
+#include <absl/base/internal/endian.h>
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/synchronization/mutex.h>
+#include <absl/types/span.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "../third_party/parallel_hashmap/phmap.h"
+#include "file_io.h"
+#include "gc.h"
+#include "hash.h"
+#include "karu.h"
+#include "metrics.h"
+#include "record_scanner.h"
+#include "types.h"
+#include "utils.h"
+
+namespace karu {
+constexpr const char *typed_layout_file_name = "typed.layout";
+
+namespace typed {
+// Codec selects the encoding of a fixed size type at compile time. Integers
+// are stored little endian such that the files are portable, everything else
+// is copied as is.
+template <typename T>
+struct Codec {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "TypedDB only stores trivially copyable types");
+
+  static void Encode(std::uint8_t *dst, const T &value) noexcept {
+    if constexpr (std::is_integral_v<T> && sizeof(T) == 8) {
+      absl::little_endian::Store64(dst, static_cast<std::uint64_t>(value));
+    } else if constexpr (std::is_integral_v<T> && sizeof(T) == 4) {
+      absl::little_endian::Store32(dst, static_cast<std::uint32_t>(value));
+    } else if constexpr (std::is_integral_v<T> && sizeof(T) == 2) {
+      absl::little_endian::Store16(dst, static_cast<std::uint16_t>(value));
+    } else {
+      std::memcpy(dst, &value, sizeof(T));
+    }
+  }
+
+  static T Decode(const std::uint8_t *src) noexcept {
+    if constexpr (std::is_integral_v<T> && sizeof(T) == 8) {
+      return static_cast<T>(absl::little_endian::Load64(src));
+    } else if constexpr (std::is_integral_v<T> && sizeof(T) == 4) {
+      return static_cast<T>(absl::little_endian::Load32(src));
+    } else if constexpr (std::is_integral_v<T> && sizeof(T) == 2) {
+      return static_cast<T>(absl::little_endian::Load16(src));
+    } else {
+      T value;
+      std::memcpy(&value, src, sizeof(T));
+      return value;
+    }
+  }
+};
+
+// integer keys use the integer hash of phmap, other keys are hashed as bytes,
+// which is why they can't have padding.
+template <typename T>
+struct KeyHash {
+  std::size_t operator()(const T &key) const noexcept {
+    if constexpr (std::is_integral_v<T>) {
+      return phmap::Hash<T>{}(key);
+    } else {
+      return hash::Hash64(&key, sizeof(T));
+    }
+  }
+};
+
+template <typename T>
+struct KeyEqual {
+  bool operator()(const T &a, const T &b) const noexcept {
+    if constexpr (std::is_integral_v<T>) {
+      return a == b;
+    } else {
+      return std::memcmp(&a, &b, sizeof(T)) == 0;
+    }
+  }
+};
+
+// the location of a value is the slot of its record, the byte offset follows
+// from the stride.
+struct Entry {
+  file_id_t file_id_;
+  std::uint32_t slot_;
+};
+}  // namespace typed
+
+// TypedDB is a DB for fixed size keys and values, e.g. uint64_t keys with
+// 16 byte values. A record is just the key followed by the value, without
+// the length header, so the n-th record of a datafile starts at n * kStride.
+// The keydir maps the keys themselves instead of strings. The datafiles are
+// named, ordered, scanned and garbage collected like the ones of DB, and the
+// directory remembers the key and value sizes it was created with.
+template <typename Key, typename Value>
+class TypedDB {
+  static_assert(std::has_unique_object_representations_v<Key>,
+                "keys are hashed and compared as bytes, so they can't have "
+                "padding");
+
+ public:
+  using KeyCodec = typed::Codec<Key>;
+  using ValueCodec = typed::Codec<Value>;
+  static constexpr std::uint32_t kStride = sizeof(Key) + sizeof(Value);
+
+  static absl::StatusOr<std::unique_ptr<TypedDB>> Open(
+      const std::string &directory,
+      double gc_rewrite_threshold = DBConfig{}.gc_rewrite_threshold_) noexcept;
+  TypedDB &operator=(const TypedDB &) = delete;
+  TypedDB(const TypedDB &) = delete;
+
+  absl::Status Insert(const Key &key, const Value &value) noexcept;
+  // inserts all of the pairs with a single write and sync. If the same key is
+  // in the batch multiple times the last one wins.
+  absl::Status InsertBatch(
+      absl::Span<const std::pair<Key, Value>> pairs) noexcept;
+  absl::StatusOr<Value> Get(const Key &key) noexcept;
+  absl::Status FlushMemoryTable() noexcept;
+  // see DB::CollectGarbage, a record is dead once its key has a newer one.
+  absl::Status CollectGarbage() noexcept;
+  metrics::Stats GetStats() noexcept;
+
+ private:
+  TypedDB(std::string directory, double gc_rewrite_threshold) noexcept
+      : directory_(std::move(directory)),
+        gc_rewrite_threshold_(gc_rewrite_threshold) {}
+  absl::Status CheckLayout() noexcept;
+  absl::Status Recover() noexcept;
+  // opens a new active datafile. The caller needs to hold table_mutex_ or be
+  // Open.
+  absl::Status OpenActive() noexcept;
+  absl::Status Append(absl::Span<const std::uint8_t> records,
+                      std::uint32_t &first_slot) noexcept;
+  // extents are the live records of the datafile, sorted by offset.
+  absl::Status RewriteDatafile(file_id_t id,
+                               absl::Span<const gc::Extent> extents) noexcept;
+  absl::Status RemoveDatafile(file_id_t id) noexcept;
+  std::string DatafilePath(file_id_t id) const noexcept {
+    return directory_ + "/" + std::to_string(id) + sstable_file_suffix;
+  }
+
+  std::string directory_;
+  const double gc_rewrite_threshold_;
+  metrics::Registry metrics_;
+
+  phmap::flat_hash_map<Key, typed::Entry, typed::KeyHash<Key>,
+                       typed::KeyEqual<Key>>
+      index_;
+  // the readers of every datafile including the active one.
+  phmap::flat_hash_map<file_id_t, std::unique_ptr<io::FileReader>> readers_;
+  std::unique_ptr<io::FileWriter> writer_;
+  file_id_t active_id_ = 0;
+
+  absl::Mutex table_mutex_;
+  absl::Mutex index_mutex_;
+  // only one CollectGarbage runs at a time.
+  absl::Mutex gc_mutex_;
+};
+
+template <typename Key, typename Value>
+absl::StatusOr<std::unique_ptr<TypedDB<Key, Value>>>
+TypedDB<Key, Value>::Open(const std::string &directory,
+                          double gc_rewrite_threshold) noexcept {
+  std::unique_ptr<TypedDB> db(new TypedDB(directory, gc_rewrite_threshold));
+  if (auto status = db->CheckLayout(); !status.ok()) {
+    return status;
+  }
+  if (auto status = db->Recover(); !status.ok()) {
+    return status;
+  }
+  if (auto status = db->OpenActive(); !status.ok()) {
+    return status;
+  }
+  return db;
+}
+
+template <typename Key, typename Value>
+absl::Status TypedDB<Key, Value>::CheckLayout() noexcept {
+  // the records have no header, so reading them with other sizes would
+  // silently return garbage.
+  const std::string path = directory_ + "/" + typed_layout_file_name;
+  const std::string layout =
+      std::to_string(sizeof(Key)) + " " + std::to_string(sizeof(Value));
+  if (std::ifstream in(path); in) {
+    std::string existing;
+    std::getline(in, existing);
+    if (existing != layout) {
+      return absl::FailedPreconditionError(
+          "directory was created with key and value sizes " + existing +
+          ", not " + layout);
+    }
+    return absl::OkStatus();
+  }
+
+  std::ofstream out(path, std::ios::trunc);
+  out << layout << '\n';
+  if (!out) {
+    return absl::InternalError("could not write layout file: " + path);
+  }
+  return absl::OkStatus();
+}
+
+template <typename Key, typename Value>
+absl::Status TypedDB<Key, Value>::Recover() noexcept {
+  // oldest first, such that newer records replace older ones.
+  for (const auto &[id, path] : utils::datafiles(sstable_file_suffix,
+                                                 directory_)) {
+    std::error_code ec;
+    std::uint64_t size = std::filesystem::file_size(path, ec);
+    if (ec) {
+      return absl::InternalError("could not get the size of " + path);
+    }
+
+    // a crash in the middle of a write leaves part of a record behind. It
+    // was never acknowledged, so it is cut off instead of being read as the
+    // start of one.
+    if (const std::uint64_t partial = size % kStride; partial != 0) {
+      std::cerr << "dropping a truncated record of " << partial
+                << " bytes at the end of " << path << '\n';
+      size -= partial;
+      std::filesystem::resize_file(path, size, ec);
+      if (ec) {
+        return absl::InternalError("could not truncate " + path + ": " +
+                                   ec.message());
+      }
+    }
+
+    auto reader = io::OpenFileReader(path);
+    if (!reader.ok()) {
+      return reader.status();
+    }
+    (*reader)->SetMetrics(&metrics_);
+
+    // the records that garbage collection found dead may be holes by now,
+    // which would read back as records of a zero key.
+    auto dead = gc::ReadExtents(gc::DeadPath(path));
+    if (!dead.ok()) {
+      return dead.status();
+    }
+    std::size_t next_dead = 0;
+
+    scanner::RecordScanner scanner(**reader, size);
+    const std::uint8_t *record = nullptr;
+    while (true) {
+      for (; next_dead < dead->size() &&
+             (*dead)[next_dead].start_ <= scanner.Offset();
+           ++next_dead) {
+        if (scanner.Offset() < (*dead)[next_dead].end_) {
+          scanner.Seek((*dead)[next_dead].end_);
+        }
+      }
+
+      const std::uint64_t offset = scanner.Offset();
+      auto next = scanner.NextFixed(kStride, record);
+      if (!next.ok()) {
+        return next.status();
+      }
+      if (!*next) {
+        break;
+      }
+      index_[KeyCodec::Decode(record)] = typed::Entry{
+          .file_id_ = id,
+          .slot_ = static_cast<std::uint32_t>(offset / kStride),
+      };
+    }
+    readers_[id] = *std::move(reader);
+  }
+
+  return absl::OkStatus();
+}
+
+template <typename Key, typename Value>
+absl::Status TypedDB<Key, Value>::OpenActive() noexcept {
+  file_id_t newest = 0;
+  for (const auto &[existing, reader] : readers_) {
+    newest = std::max(newest, existing);
+  }
+
+  const file_id_t id = utils::next_file_id(newest);
+  const std::string path = DatafilePath(id);
+  // the reader creates the file, which the writer needs to exist.
+  auto reader = io::OpenFileReader(path);
+  if (!reader.ok()) {
+    return reader.status();
+  }
+  auto writer = io::OpenFileWriter(path);
+  if (!writer.ok()) {
+    return writer.status();
+  }
+
+  (*reader)->SetMetrics(&metrics_);
+  (*writer)->SetMetrics(&metrics_);
+  readers_[id] = *std::move(reader);
+  writer_ = *std::move(writer);
+  active_id_ = id;
+  return absl::OkStatus();
+}
+
+template <typename Key, typename Value>
+absl::Status TypedDB<Key, Value>::Append(
+    absl::Span<const std::uint8_t> records,
+    std::uint32_t &first_slot) noexcept {
+  auto offset = writer_->Append(records);
+  if (!offset.ok()) {
+    return offset.status();
+  }
+
+  {
+    metrics::ScopedLatency latency(&metrics_, metrics::kFlushLatency);
+    writer_->Sync();
+  }
+  first_slot = *offset / kStride;
+  return absl::OkStatus();
+}
+
+template <typename Key, typename Value>
+absl::Status TypedDB<Key, Value>::Insert(const Key &key,
+                                         const Value &value) noexcept {
+  metrics::ScopedLatency latency(&metrics_, metrics::kInsertLatency);
+  std::uint8_t record[kStride];
+  KeyCodec::Encode(record, key);
+  ValueCodec::Encode(&record[sizeof(Key)], value);
+
+  absl::WriterMutexLock table_lock(&table_mutex_);
+  std::uint32_t slot = 0;
+  if (auto status = Append({record, kStride}, slot); !status.ok()) {
+    return status;
+  }
+
+  absl::WriterMutexLock index_lock(&index_mutex_);
+  index_[key] = typed::Entry{.file_id_ = active_id_, .slot_ = slot};
+  return absl::OkStatus();
+}
+
+template <typename Key, typename Value>
+absl::Status TypedDB<Key, Value>::InsertBatch(
+    absl::Span<const std::pair<Key, Value>> pairs) noexcept {
+  if (pairs.empty()) {
+    return absl::OkStatus();
+  }
+  metrics::ScopedLatency latency(&metrics_, metrics::kInsertLatency);
+
+  std::vector<std::uint8_t> records(pairs.size() * kStride);
+  for (std::size_t i = 0; i < pairs.size(); ++i) {
+    KeyCodec::Encode(&records[i * kStride], pairs[i].first);
+    ValueCodec::Encode(&records[i * kStride + sizeof(Key)], pairs[i].second);
+  }
+
+  absl::WriterMutexLock table_lock(&table_mutex_);
+  std::uint32_t slot = 0;
+  if (auto status = Append(records, slot); !status.ok()) {
+    return status;
+  }
+
+  absl::WriterMutexLock index_lock(&index_mutex_);
+  for (std::size_t i = 0; i < pairs.size(); ++i) {
+    index_[pairs[i].first] = typed::Entry{
+        .file_id_ = active_id_,
+        .slot_ = static_cast<std::uint32_t>(slot + i),
+    };
+  }
+  return absl::OkStatus();
+}
+
+template <typename Key, typename Value>
+absl::StatusOr<Value> TypedDB<Key, Value>::Get(const Key &key) noexcept {
+  metrics::ScopedLatency latency(&metrics_, metrics::kGetLatency);
+  // the table lock is taken first, such that CollectGarbage can't remove the
+  // datafile between the lookup and the read.
+  absl::ReaderMutexLock lock(&table_mutex_);
+  typed::Entry entry{};
+  {
+    absl::ReaderMutexLock index_lock(&index_mutex_);
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+      return absl::NotFoundError("could not find key in index");
+    }
+    entry = it->second;
+  }
+
+  auto it = readers_.find(entry.file_id_);
+  if (it == readers_.end()) {
+    return absl::InternalError("invalid file id.");
+  }
+
+  std::uint8_t buffer[sizeof(Value)];
+  const std::uint64_t offset =
+      static_cast<std::uint64_t>(entry.slot_) * kStride + sizeof(Key);
+  auto read = it->second->ReadAt(offset, absl::MakeSpan(buffer));
+  if (!read.ok()) {
+    return read.status();
+  }
+  if (*read != sizeof(Value)) {
+    return absl::InternalError("read wrong amount of bytes from file.");
+  }
+  return ValueCodec::Decode(buffer);
+}
+
+template <typename Key, typename Value>
+absl::Status TypedDB<Key, Value>::FlushMemoryTable() noexcept {
+  metrics::ScopedLatency latency(&metrics_, metrics::kRotationLatency);
+  absl::WriterMutexLock guard(&table_mutex_);
+  return OpenActive();
+}
+
+template <typename Key, typename Value>
+absl::Status TypedDB<Key, Value>::CollectGarbage() noexcept {
+  absl::MutexLock gc_guard(&gc_mutex_);
+
+  // the live records of every immutable datafile, see DB::CollectGarbage.
+  std::map<file_id_t, std::vector<gc::Extent>> live;
+  {
+    absl::ReaderMutexLock table_guard(&table_mutex_);
+    for (const auto &[id, _] : readers_) {
+      if (id != active_id_) {
+        live[id];
+      }
+    }
+
+    absl::ReaderMutexLock index_guard(&index_mutex_);
+    for (const auto &[key, entry] : index_) {
+      if (auto it = live.find(entry.file_id_); it != live.end()) {
+        const std::uint32_t start = entry.slot_ * kStride;
+        it->second.push_back({.start_ = start, .end_ = start + kStride});
+      }
+    }
+  }
+
+  for (auto &[id, extents] : live) {
+    std::uint64_t punched = 0;
+    auto action = gc::CollectDatafile(DatafilePath(id), extents,
+                                      gc_rewrite_threshold_, punched);
+    if (!action.ok()) {
+      return action.status();
+    }
+    if (punched > 0) {
+      metrics_.Add(metrics::kGcBytesPunched, punched);
+    }
+    if (*action == gc::Action::kKeep) {
+      continue;
+    }
+
+    if (*action == gc::Action::kRewrite) {
+      if (auto status = RewriteDatafile(id, extents); !status.ok()) {
+        return status;
+      }
+    }
+    if (auto status = RemoveDatafile(id); !status.ok()) {
+      return status;
+    }
+  }
+
+  return absl::OkStatus();
+}
+
+template <typename Key, typename Value>
+absl::Status TypedDB<Key, Value>::RewriteDatafile(
+    file_id_t id, absl::Span<const gc::Extent> extents) noexcept {
+  const io::FileReader *reader = nullptr;
+  {
+    // only CollectGarbage removes readers, so the reader stays valid after
+    // the lock is released.
+    absl::ReaderMutexLock guard(&table_mutex_);
+    auto it = readers_.find(id);
+    if (it == readers_.end()) {
+      return absl::InternalError("invalid file id.");
+    }
+    reader = it->second.get();
+  }
+
+  // the records are read without holding a lock and moved in chunks, such
+  // that reads and writes go on in between.
+  constexpr std::size_t kChunk = scanner::kScanBufferSize / kStride;
+  scanner::RecordScanner scanner(*reader, extents.back().end_);
+  std::vector<std::uint8_t> records;
+  std::vector<std::uint8_t> moved;
+  std::vector<Key> keys;
+  for (std::size_t next = 0; next < extents.size();) {
+    const std::size_t last = std::min(extents.size(), next + kChunk);
+    records.resize((last - next) * kStride);
+    for (std::size_t i = next; i < last; ++i) {
+      const std::uint8_t *record = nullptr;
+      scanner.Seek(extents[i].start_);
+      auto read = scanner.NextFixed(kStride, record);
+      if (!read.ok()) {
+        return read.status();
+      }
+      if (!*read) {
+        return absl::DataLossError("datafile is truncated: " +
+                                   DatafilePath(id));
+      }
+      std::memcpy(&records[(i - next) * kStride], record, kStride);
+    }
+
+    // a record that was overwritten since the extents were collected must
+    // not be moved, as it would replace the newer value on recovery. Holding
+    // the table lock keeps the index from changing until the moved records
+    // are indexed.
+    absl::WriterMutexLock table_guard(&table_mutex_);
+    moved.clear();
+    keys.clear();
+    {
+      absl::ReaderMutexLock index_guard(&index_mutex_);
+      for (std::size_t i = next; i < last; ++i) {
+        const std::uint8_t *record = &records[(i - next) * kStride];
+        const Key key = KeyCodec::Decode(record);
+        auto it = index_.find(key);
+        if (it != index_.end() && it->second.file_id_ == id &&
+            it->second.slot_ == extents[i].start_ / kStride) {
+          moved.insert(moved.end(), record, record + kStride);
+          keys.push_back(key);
+        }
+      }
+    }
+    next = last;
+    if (keys.empty()) {
+      continue;
+    }
+
+    std::uint32_t slot = 0;
+    if (auto status = Append(moved, slot); !status.ok()) {
+      return status;
+    }
+    absl::WriterMutexLock index_guard(&index_mutex_);
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+      index_[keys[i]] = typed::Entry{
+          .file_id_ = active_id_,
+          .slot_ = static_cast<std::uint32_t>(slot + i),
+      };
+    }
+  }
+
+  metrics_.Add(metrics::kGcFilesRewritten);
+  return absl::OkStatus();
+}
+
+template <typename Key, typename Value>
+absl::Status TypedDB<Key, Value>::RemoveDatafile(file_id_t id) noexcept {
+  {
+    absl::WriterMutexLock guard(&table_mutex_);
+    readers_.erase(id);
+  }
+
+  const std::string path = DatafilePath(id);
+  for (const auto &file : {path, gc::DeadPath(path)}) {
+    std::error_code ec;
+    std::filesystem::remove(file, ec);
+    if (ec) {
+      return absl::InternalError("could not remove " + file + ": " +
+                                 ec.message());
+    }
+  }
+
+  metrics_.Add(metrics::kGcFilesRemoved);
+  return absl::OkStatus();
+}
+
+template <typename Key, typename Value>
+metrics::Stats TypedDB<Key, Value>::GetStats() noexcept {
+  metrics::Stats stats = metrics_.Collect();
+  {
+    absl::ReaderMutexLock lock(&index_mutex_);
+    stats.index_size_ = index_.size();
+  }
+
+  absl::ReaderMutexLock lock(&table_mutex_);
+  stats.datafile_count_ = readers_.size();
+  return stats;
+}
+}  // namespace karu
+
+#endif
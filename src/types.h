@@ -1,16 +1,89 @@
 #ifndef _KARU_TYPES_H
 #define _KARU_TYPES_H
 
+#include <absl/strings/string_view.h>
+
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "../third_party/parallel_hashmap/phmap.h"
+#include "hash.h"
 
 namespace karu {
 using file_id_t = std::int64_t;
 
+// values of at most this many bytes can be kept in the keydir, see
+// DBConfig::inline_value_size_.
+constexpr std::size_t kMaxInlineValueSize = 8;
+// the top bit of DatabaseEntry::inline_slot_ tags an inline entry, the bits
+// below it are the slot of its datafile, see FileSlots.
+constexpr std::uint16_t kInlineTag = 0x8000;
+// MaybeInline doesn't inline values of datafiles without a slot.
+constexpr std::uint16_t kNoFileSlot = 0x7FFF;
+
 struct DatabaseEntry {
-  file_id_t file_id_;
+  // an inline entry keeps its value in place of the datafile id, such that
+  // Get can return it without touching the datafile. pos_ stays valid and the
+  // datafile id is found through the slot in inline_slot_, snapshots and
+  // garbage collection still refer to the record.
+  union {
+    file_id_t file_id_;
+    char inline_value_[kMaxInlineValueSize];
+  };
   std::uint32_t pos_;
   std::uint16_t value_size_;
+  std::uint16_t inline_slot_ = 0;
+
+  [[nodiscard]] bool Inline() const noexcept {
+    return (inline_slot_ & kInlineTag) != 0;
+  }
+  [[nodiscard]] std::uint16_t FileSlot() const noexcept {
+    return inline_slot_ & ~kInlineTag;
+  }
+  [[nodiscard]] absl::string_view InlineValue() const noexcept {
+    return {inline_value_, value_size_};
+  }
+  // tombstones are only kept in the keydir while it is loaded newest file
+  // first, such that older files don't bring the key back.
+  [[nodiscard]] bool Tombstone() const noexcept {
+    return value_size_ == 0xFFFF;
+  }
+  // keeps value in place of the datafile id if it is at most limit bytes.
+  // slot is the slot of the datafile the entry points into.
+  void MaybeInline(absl::string_view value, std::size_t limit,
+                   std::uint16_t slot) noexcept {
+    if (limit == 0 || slot == kNoFileSlot ||
+        value.size() > std::min(limit, kMaxInlineValueSize)) {
+      return;
+    }
+    std::memcpy(inline_value_, value.data(), value.size());
+    inline_slot_ = kInlineTag | slot;
+  }
 };
+// the keydir holds one entry per key, inlining must not make them bigger.
+static_assert(sizeof(DatabaseEntry) == 16);
+
+// the keydir is split into 2^kKeydirSubmapBits submaps that grow on their
+// own. A resize only rehashes a single submap, so the insert that triggers it
+// stalls for 1/256 of the keydir instead of 1/16 with phmap's default.
+constexpr std::size_t kKeydirSubmapBits = 8;
+
+// the in-memory index which maps every key to the location of its latest
+// value.
+using keydir_t = phmap::parallel_flat_hash_map<
+    std::string, DatabaseEntry, hash::KeyHash, hash::KeyEqual,
+    phmap::priv::Allocator<phmap::priv::Pair<const std::string, DatabaseEntry>>,
+    kKeydirSubmapBits>;
+
+// the hash keydir_t uses for a key whose hash::HashKey is key_hash. phmap
+// mixes the result of its hasher, see HashElement, so a caller that needs
+// both hashes only has to hash the key once.
+inline std::size_t KeydirHash(std::uint64_t key_hash) noexcept {
+  return phmap::phmap_mix<sizeof(std::size_t)>()(
+      static_cast<std::size_t>(key_hash));
+}
 };  // namespace karu
 
 #endif
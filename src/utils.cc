@@ -1,5 +1,6 @@
 #include "utils.h"
 
+#include <algorithm>
 #include <cctype>
 #include <filesystem>
 
@@ -25,12 +26,9 @@ absl::StatusOr<file_id_t> parse_file_id(std::string_view path) noexcept {
   file_id_t last = 0;
   file_id_t id = 0;
 
-  // TODO: not so scuffed in the future plese
   for (char i : path) {
     if (std::isdigit(i)) {
-      id += i - '0';  // add the number and a zero the rhs of the number.
-      id *= 10;
-
+      id = id * 10 + (i - '0');  // shift the number left and add the digit.
       last = id;
     } else {
       id = 0;
@@ -45,4 +43,25 @@ file_id_t generate_file_id() noexcept {
              std::chrono::system_clock::now().time_since_epoch())
       .count();
 }
+
+std::vector<std::pair<file_id_t, std::string>> datafiles(
+    std::string_view ext, std::string_view directory) noexcept {
+  std::vector<std::pair<file_id_t, std::string>> files;
+  for (auto &path : files_with_extension(ext, directory)) {
+    auto id = parse_file_id(path);
+    if (!id.ok()) {
+      continue;
+    }
+    files.emplace_back(*id, std::move(path));
+  }
+
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+file_id_t next_file_id(file_id_t newest) noexcept {
+  // ids are timestamps in milliseconds, two rotations in the same millisecond
+  // must still get increasing ids.
+  return std::max(generate_file_id(), newest + 1);
+}
 }  // namespace karu
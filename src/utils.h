@@ -5,6 +5,7 @@
 
 #include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 #include "karu.h"
@@ -15,6 +16,13 @@ std::vector<std::string> files_with_extension(
 
 absl::StatusOr<file_id_t> parse_file_id(std::string_view path) noexcept;
 file_id_t generate_file_id() noexcept;
+
+// the ids and paths of the files with extension ext in directory, oldest
+// first, which is the order recovery replays them in.
+std::vector<std::pair<file_id_t, std::string>> datafiles(
+    std::string_view ext, std::string_view directory) noexcept;
+// the id of a new datafile, given the newest existing one.
+file_id_t next_file_id(file_id_t newest) noexcept;
 }  // namespace karu
 
 #endif
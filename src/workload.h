@@ -0,0 +1,79 @@
+#ifndef _KARU_WORKLOAD_H
+#define _KARU_WORKLOAD_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// key generation shared by karu_bench and karu_loadgen.
+namespace karu::workload {
+constexpr double kZipfianConstant = 0.99;
+
+// scramble spreads the popular zipfian ranks over the whole key space, such
+// that the hot keys aren't the first ones inserted.
+inline std::uint64_t scramble(std::uint64_t value) {
+  std::uint64_t hash = 0xCBF29CE484222325ull;
+  for (int i = 0; i < 8; ++i) {
+    hash ^= value & 0xFF;
+    hash *= 1099511628211ull;
+    value >>= 8;
+  }
+  return hash;
+}
+
+// ZipfianGenerator is the generator from "Quickly Generating Billion-Record
+// Synthetic Databases" by Gray et al. which is also used by YCSB. The constants
+// are computed once and the generator is shared between the threads.
+class ZipfianGenerator {
+ public:
+  explicit ZipfianGenerator(std::uint64_t items) : items_(items) {
+    zeta_n_ = zeta(items);
+    const double zeta_2 = zeta(2);
+    alpha_ = 1.0 / (1.0 - kZipfianConstant);
+    eta_ = (1 - std::pow(2.0 / static_cast<double>(items),
+                         1 - kZipfianConstant)) /
+           (1 - zeta_2 / zeta_n_);
+  }
+
+  // returns a rank in [0, items) where small ranks are the most popular.
+  std::uint64_t Next(double u) const {
+    const double uz = u * zeta_n_;
+    if (uz < 1.0) {
+      return 0;
+    }
+    if (uz < 1.0 + std::pow(0.5, kZipfianConstant)) {
+      return 1;
+    }
+    auto rank = static_cast<std::uint64_t>(
+        static_cast<double>(items_) * std::pow(eta_ * u - eta_ + 1, alpha_));
+    return std::min(rank, items_ - 1);
+  }
+
+ private:
+  static double zeta(std::uint64_t n) {
+    double sum = 0;
+    for (std::uint64_t i = 0; i < n; ++i) {
+      sum += 1.0 / std::pow(static_cast<double>(i + 1), kZipfianConstant);
+    }
+    return sum;
+  }
+
+  std::uint64_t items_;
+  double zeta_n_;
+  double alpha_;
+  double eta_;
+};
+
+inline std::string build_key(std::uint64_t id, std::size_t key_size) {
+  std::string number = std::to_string(id);
+  std::string key = "user";
+  if (key.size() + number.size() < key_size) {
+    key.append(key_size - key.size() - number.size(), '0');
+  }
+  return key + number;
+}
+}  // namespace karu::workload
+
+#endif
@@ -1181,6 +1181,21 @@ public:
     bool empty() const { return !size(); }
     size_t size() const { return size_; }
     size_t capacity() const { return capacity_; }
+
+    // karu patch, see patches/0001-resumable-iteration.patch - the slot
+    // index of an element and the first element at or after a slot index,
+    // such that an iteration can be resumed later.
+    // -----------------------------------------------------------------
+    size_t slot_index(const_iterator it) const {
+        return static_cast<size_t>(it.inner_.ctrl_ - ctrl_);
+    }
+    const_iterator iterator_from(size_t i) const {
+        if (i != 0 && i >= capacity_)
+            return end();
+        auto it = const_cast<raw_hash_set*>(this)->iterator_at(i);
+        it.skip_empty_or_deleted();
+        return it;
+    }
     size_t max_size() const { return (std::numeric_limits<size_t>::max)(); }
 
     PHMAP_ATTRIBUTE_REINITIALIZES void clear() {
@@ -2761,6 +2776,16 @@ public:
         inner.set_.clear();
     }
 
+    // karu patch, see patches/0001-resumable-iteration.patch - calls f with
+    // the embedded set of a submap while holding a shared lock on it
+    // ----------------------------------------------------------------------
+    template <class F>
+    void with_submap(std::size_t submap_index, F&& f) const {
+        const Inner& inner = sets_[submap_index];
+        typename Lockable::SharedLock m(const_cast<Inner&>(inner));
+        f(inner.set_);
+    }
+
     // This overload kicks in when the argument is an rvalue of insertable and
     // decomposable type other than init_type.
     //
@@ -3196,6 +3221,16 @@ public:
         set.prefetch_hash(hashval);
     }
 
+    // karu patch, see patches/0002-prefetch-hash.patch - prefetch with a hash
+    // that was computed before, like find(key, hashval)
+    // ----------------------------------------------------------------------
+    void prefetch_hash(size_t hashval) const {
+        const Inner& inner = sets_[subidx(hashval)];
+        const auto&  set   = inner.set_;
+        typename Lockable::SharedLock m(const_cast<Inner&>(inner));
+        set.prefetch_hash(hashval);
+    }
+
     // The API of find() has two extensions.
     //
     // 1. The hash can be passed by the user. It must be equal to the hash of the